@@ -1,4 +1,27 @@
 (() => {
+    // C-alpha coordinates embedded by msa2lddtreport as base64 delta-int16 ("ca16", Coordinate16 layout:
+    // per axis an int32 start and int16 deltas in thousandths of an Angstrom) are expanded to the plain "ca" string
+    var decodeFoldMasonData = function(data) {
+        (data && data.entries || []).forEach(function(entry) {
+            if (typeof entry.ca16 !== "string") return;
+            var bin = atob(entry.ca16), bytes = new Uint8Array(bin.length);
+            for (var i = 0; i < bin.length; i++) bytes[i] = bin.charCodeAt(i);
+            var view = new DataView(bytes.buffer), len = Math.max(bytes.length / 6 - 1, 0), coords = new Array(3 * len);
+            for (var axis = 0, offset = 0; axis < 3 && len > 0; axis++) {
+                var value = view.getInt32(offset, true);
+                offset += 4;
+                coords[axis] = (value / 1e3).toFixed(3);
+                for (var j = 1; j < len; j++) {
+                    value += view.getInt16(offset, true);
+                    offset += 2;
+                    coords[3 * j + axis] = (value / 1e3).toFixed(3);
+                }
+            }
+            entry.ca = coords.join(",");
+            delete entry.ca16;
+        });
+        return data;
+    };
     var e, n = {
         5106: (e, n, t) => {
             "use strict";
@@ -2020,7 +2043,7 @@
                         if ("complete" == document.readyState) {
                             var n = document.getElementById("data");
                             if (!n) return null;
-                            var t = JSON.parse(n.textContent);
+                            var t = decodeFoldMasonData(JSON.parse(n.textContent));
                             e.fetchData(t);
                         }
                     };
@@ -4806,7 +4829,7 @@
                         if ("complete" == document.readyState) {
                             var n = document.getElementById("data");
                             if (!n) return null;
-                            var t = JSON.parse(n.textContent);
+                            var t = decodeFoldMasonData(JSON.parse(n.textContent));
                             e.handleUploadData(t);
                         }
                     };
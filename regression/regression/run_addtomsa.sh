@@ -0,0 +1,5 @@
+#!/bin/sh -ex
+# place the two structures missing from a three-row MSA
+awk '/^>/ {keep = ($1 == ">d1q1fa_" || $1 == ">d1urva_" || $1 == ">d1naza_")} keep' "${DATADIR}/msa.fasta" > "${RESULTS}/part.fa"
+"$FOLDMASON" addtomsa --threads 1 "${RESULTS}/structures" "${RESULTS}/part.fa" "${RESULTS}/msa" > "${RESULTS}/addtomsa.log"
+test "$(grep -c '^>' "${RESULTS}/msa_aa.fa")" -eq 5
@@ -0,0 +1,11 @@
+#!/bin/sh -ex
+# data/clusters.tsv names representative and member, the clustering DB needs their keys
+awk 'NR == FNR { key[$2] = $1; next } { print key[$1] "\t" key[$2] }' \
+    "${RESULTS}/structures.lookup" "${DATADIR}/clusters.tsv" > "${RESULTS}/clu.tsv"
+"$FOLDMASON" tsv2db "${RESULTS}/clu.tsv" "${RESULTS}/clu" --output-dbtype 6
+# leave the last pair out of the alignment DB, so it is scored as a missing pair
+sed '$d' "${RESULTS}/clu.tsv" > "${RESULTS}/aligned.tsv"
+"$FOLDMASON" tsv2db "${RESULTS}/aligned.tsv" "${RESULTS}/aligned" --output-dbtype 6
+"$FOLDMASON" structurealign --threads 1 -a 1 "${RESULTS}/structures" "${RESULTS}/structures" "${RESULTS}/aligned" "${RESULTS}/aln"
+"$FOLDMASON" structuremsacluster --threads 1 "${RESULTS}/structures" "${RESULTS}/clu" "${RESULTS}/aln" "${RESULTS}/msa" > "${RESULTS}/structuremsa.log"
+grep -q "Read 1 cluster alignments (1 with backtrace), scoring 1 missing pairs" "${RESULTS}/structuremsa.log"
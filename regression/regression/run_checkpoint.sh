@@ -0,0 +1,15 @@
+#!/bin/sh -ex
+# An unwritable output interrupts the run after the alignment, so its checkpoint is kept
+mkdir -p "${RESULTS}/msa_aa.fa"
+if "$FOLDMASON" structuremsa --threads 1 --checkpoint-rounds 1 "${RESULTS}/structures" "${RESULTS}/msa" > "${RESULTS}/interrupted.log" 2>&1; then
+    exit 1
+fi
+rmdir "${RESULTS}/msa_aa.fa"
+# cut the journal inside a record, resuming must drop it and continue from the record before
+SIZE="$(wc -c < "${RESULTS}/msa.ckpt")"
+head -c "$((SIZE * 7 / 10))" "${RESULTS}/msa.ckpt" > "${RESULTS}/partial.ckpt"
+mv -f "${RESULTS}/partial.ckpt" "${RESULTS}/msa.ckpt"
+"$FOLDMASON" structuremsa --threads 1 --checkpoint-rounds 1 --resume 1 "${RESULTS}/structures" "${RESULTS}/msa" > "${RESULTS}/structuremsa.log"
+grep -q "Resuming from checkpoint .* after [1-9][0-9]* of" "${RESULTS}/structuremsa.log"
+cmp "${RESULTS}/msa_aa.fa" "${DATADIR}/msa.fasta"
+[ ! -f "${RESULTS}/msa.ckpt" ]
@@ -0,0 +1,11 @@
+#!/bin/sh -ex
+# move the second half of d1b0ba_ by 100 A, its x deltas then overflow int16
+mkdir -p "${RESULTS}/in"
+find "$DATADIR" -type f -name "d*" -exec cp {} "${RESULTS}/in" \;
+awk '/^ATOM/ && substr($0, 23, 4) + 0 > 50 { $0 = substr($0, 1, 30) sprintf("%8.3f", substr($0, 31, 8) + 100) substr($0, 39) } 1' \
+    "${DATADIR}/d1b0ba_" > "${RESULTS}/in/d1b0ba_"
+"$FOLDMASON" createdb --threads 1 "${RESULTS}/in" "${RESULTS}/shifted"
+"$FOLDMASON" msa2lddtreport --threads 1 --report-compact-ca 1 "${RESULTS}/shifted" "${DATADIR}/msa.fasta" "${RESULTS}/report.html" > "${RESULTS}/report.log"
+test "$(grep -o '"ca16": "' "${RESULTS}/report.html" | wc -l)" -eq 4
+test "$(grep -o '"ca": "' "${RESULTS}/report.html" | wc -l)" -eq 1
+cp "${DATADIR}/msa.fasta" "${RESULTS}/msa_aa.fa"
@@ -0,0 +1,8 @@
+#!/bin/sh -ex
+"$FOLDMASON" structuremsa --threads 1 --write-fmsa 1 "${RESULTS}/structures" "${RESULTS}/msa" > "${RESULTS}/structuremsa.log"
+# a truncated file must be rejected instead of read out of bounds
+head -c "$(($(wc -c < "${RESULTS}/msa.fmsa") - 4))" "${RESULTS}/msa.fmsa" > "${RESULTS}/truncated.fmsa"
+if "$FOLDMASON" msa2lddt --threads 1 "${RESULTS}/structures" "${RESULTS}/truncated.fmsa" > "${RESULTS}/truncated.log" 2>&1; then
+    exit 1
+fi
+grep -q "is truncated or corrupt" "${RESULTS}/truncated.log"
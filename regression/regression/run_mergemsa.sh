@@ -0,0 +1,7 @@
+#!/bin/sh -ex
+# three inputs, so the second merge reuses the profile of the group left over from the first
+awk '/^>/ {keep = ($1 == ">d1q1fa_" || $1 == ">d1urva_" || $1 == ">d1naza_")} keep' "${DATADIR}/msa.fasta" > "${RESULTS}/part1.fa"
+awk '/^>/ {keep = ($1 == ">d1b0ba_")} keep' "${DATADIR}/msa.fasta" > "${RESULTS}/part2.fa"
+awk '/^>/ {keep = ($1 == ">d2w72b_")} keep' "${DATADIR}/msa.fasta" > "${RESULTS}/part3.fa"
+"$FOLDMASON" mergemsa --threads 1 "${RESULTS}/structures" "${RESULTS}/part1.fa" "${RESULTS}/part2.fa" "${RESULTS}/part3.fa" "${RESULTS}/msa" > "${RESULTS}/mergemsa.log"
+test "$(grep -c '^>' "${RESULTS}/msa_aa.fa")" -eq 5
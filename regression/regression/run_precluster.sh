@@ -0,0 +1,3 @@
+#!/bin/sh -ex
+"$FOLDMASON" structuremsa --threads 1 --precluster 1 --precluster-min-score 0.2 "${RESULTS}/structures" "${RESULTS}/msa" > "${RESULTS}/structuremsa.log"
+grep -q "Pre-clustered 5 structures into 1 clusters" "${RESULTS}/structuremsa.log"
@@ -0,0 +1,2 @@
+#!/bin/sh -ex
+"$FOLDMASON" structuremsa --threads 1 --recompute-scores 1 "${RESULTS}/structures" "${RESULTS}/msa" > "${RESULTS}/structuremsa.log"
@@ -0,0 +1,2 @@
+#!/bin/sh -ex
+"$FOLDMASON" structuremsa --threads 1 --regressive 1 --regressive-clade-size 2 "${RESULTS}/structures" "${RESULTS}/msa" > "${RESULTS}/structuremsa.log"
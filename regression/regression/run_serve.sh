@@ -0,0 +1,10 @@
+#!/bin/sh -ex
+FILES="$(find "$DATADIR" -type f -name 'd*' | awk '{ printf "%s\"%s\"", (NR > 1 ? "," : ""), $0 }')"
+mkdir -p "${RESULTS}/tmp"
+# a structure that cannot be parsed must be answered with an error without ending the server,
+# later requests still use the matrices and report JS set up by the server
+printf '{"id":"bad","structures":{"x.pdb":"garbage"}}\n{"id":"all","files":[%s]}\n{"id":"html","files":[%s],"report":1}\n' "$FILES" "$FILES" \
+    | "$FOLDMASON" serve --threads 1 "${RESULTS}/tmp" > "${RESULTS}/serve.out" 2> "${RESULTS}/serve.log"
+test "$(grep -c '"id":"bad","status":"error"' "${RESULTS}/serve.out")" -eq 1
+grep -q '"id":"html","status":"ok".*"report":"<!DOCTYPE html>' "${RESULTS}/serve.out"
+grep '"id":"all"' "${RESULTS}/serve.out" | sed -e 's/.*"aa":"\([^"]*\)".*/\1/' -e 's/\\n/\n/g' > "${RESULTS}/msa_aa.fa"
@@ -0,0 +1,12 @@
+#!/bin/sh -ex
+awk 'NR == FNR { key[$2] = $1; next } { print key[$1] "\t" key[$2] }' \
+    "${RESULTS}/structures.lookup" "${DATADIR}/clusters.tsv" > "${RESULTS}/clu.tsv"
+"$FOLDMASON" tsv2db "${RESULTS}/clu.tsv" "${RESULTS}/clu" --output-dbtype 6
+"$FOLDMASON" structuremsabatch --threads 1 "${RESULTS}/structures" "${RESULTS}/clu" "${RESULTS}/batch" > "${RESULTS}/structuremsabatch.log"
+[ "$(wc -l < "${RESULTS}/batch.index")" -eq 3 ]
+# the MSA of the d1q1fa_ cluster is scored, entries end with a null byte
+KEY="$(awk '$2 == "d1q1fa_" { print $1 }' "${RESULTS}/structures.lookup")"
+awk -v key="$KEY" '$1 == key { print $2, $3 - 1 }' "${RESULTS}/batch.index" | while read -r OFFSET LENGTH; do
+    dd if="${RESULTS}/batch" of="${RESULTS}/msa_aa.fa" bs=1 skip="$OFFSET" count="$LENGTH"
+done
+[ "$(grep -c '^>' "${RESULTS}/msa_aa.fa")" -eq 2 ]
@@ -44,7 +44,13 @@ run_test() {
   export RESULTS="${SCRATCH}/${NAME}"
   mkdir -p "${RESULTS}"
   START="$(date +%s)"
-  "${SCRIPTS}/${FILE}" "$@"
+  if [ -n "${LDDT_TARGET}" ]; then
+    "$FOLDMASON" createdb --threads 1 $(find "$DATADIR" -type f -name "d*") "${RESULTS}/structures" > "${RESULTS}/createdb.log" \
+      && "${SCRIPTS}/${FILE}" "$@" \
+      && score_lddt
+  else
+    "${SCRIPTS}/${FILE}" "$@"
+  fi
   STATUS="$?"
   END="$(date +%s)"
   if [ "${STATUS}" = "0" ]; then
@@ -55,12 +61,43 @@ run_test() {
   eval "${NAME}_TIME"="$((END-START))"
 }
 
+# Score ${RESULTS}/${LDDT_MSA} against ${RESULTS}/structures, passing if its LDDT is ${LDDT_OP} ${LDDT_TARGET}
+score_lddt() {
+  "$FOLDMASON" msa2lddt --threads 1 "${RESULTS}/structures" "${RESULTS}/${LDDT_MSA}" > "${RESULTS}/msa2lddt.log" || return 1
+  awk -v target="$LDDT_TARGET" -v op="$LDDT_OP" \
+    '/Average MSA LDDT/ {print ((op == ">=") ? ($4 >= target) : ($4 == target)) ? "GOOD" : "BAD"; print "Expected: ", op, target; print "Actual: ", $4; }' \
+    "${RESULTS}/msa2lddt.log" > "${RESULTS}.report"
+}
+
+# Like run_test, but the script gets the test structures in ${RESULTS}/structures and
+# leaves its MSA in ${RESULTS}/msa_aa.fa (or the fifth parameter), which must score ${LDDT_OP} ${LDDT_TARGET}
+run_lddt_test() {
+  LDDT_OP="$3"
+  LDDT_TARGET="$4"
+  LDDT_MSA="${5:-msa_aa.fa}"
+  run_test "$1" "$2"
+  LDDT_OP=""
+  LDDT_TARGET=""
+}
+
 # continue on if one test fail
+LDDT_TARGET=""
 set +e
 # export EVALUATE="${BASE}/bench.awk"
 run_test run_easymsa "run_easymsa.sh"
 run_test run_structuremsa "run_structuremsa.sh"
 run_test run_msa2lddt "run_msa2lddt.sh"
+run_lddt_test run_regressive "run_regressive.sh" ">=" 0.700
+run_lddt_test run_recomputescores "run_recomputescores.sh" ">=" 0.693
+run_lddt_test run_precluster "run_precluster.sh" ">=" 0.690
+run_lddt_test run_alndb "run_alndb.sh" ">=" 0.690
+run_lddt_test run_structuremsabatch "run_structuremsabatch.sh" ">=" 0.710
+run_lddt_test run_checkpoint "run_checkpoint.sh" "==" 0.698404
+run_lddt_test run_fmsa "run_fmsa.sh" "==" 0.698404 msa.fmsa
+run_lddt_test run_addtomsa "run_addtomsa.sh" ">=" 0.688
+run_lddt_test run_mergemsa "run_mergemsa.sh" ">=" 0.645
+run_lddt_test run_serve "run_serve.sh" "==" 0.698404
+run_lddt_test run_compactca "run_compactca.sh" "==" 0.698404
 # run_test run_refinemsa "run_refinemsa.sh"
 set -e
 printf "\n"
@@ -11,6 +11,7 @@ extern int structurecluster(int argc, const char** argv, const Command &command)
 extern int easystructuresearch(int argc, const char** argv, const Command &command);
 extern int easystructurecluster(int argc, const char** argv, const Command &command);
 extern int easymsa(int argc, const char** argv, const Command &command);
+extern int serve(int argc, const char** argv, const Command &command);
 extern int tmalign(int argc, const char** argv, const Command &command);
 extern int aln2tmscore(int argc, const char** argv, const Command &command);
 extern int structurealign(int argc, const char** argv, const Command &command);
@@ -22,10 +23,13 @@ extern int structureeasyrbh(int argc, const char** argv, const Command &command)
 extern int structureungappedalign(int argc, const char** argv, const Command &command);
 extern int structuremsa(int argc, const char** argv, const Command &command);
 extern int structuremsacluster(int argc, const char** argv, const Command &command);
+extern int structuremsabatch(int argc, const char** argv, const Command &command);
 extern int msa2lddt(int argc, const char** argv, const Command &command);
 extern int msa2lddtreport(int argc, const char** argv, const Command &command);
 extern int msa2lddtjson(int argc, const char** argv, const Command &command);
 extern int refinemsa(int argc, const char** argv, const Command &command);
+extern int addtomsa(int argc, const char** argv, const Command &command);
+extern int mergemsa(int argc, const char** argv, const Command &command);
 extern int convert2pdb(int argc, const char** argv, const Command &command);
 extern int compressca(int argc, const char** argv, const Command &command);
 extern int scorecomplex(int argc, const char **argv, const Command& command);
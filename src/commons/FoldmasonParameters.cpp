@@ -11,16 +11,28 @@ FoldmasonParameters::FoldmasonParameters() :
         PARAM_SCORE_BIAS_AA(PARAM_SCORE_BIAS_AA_ID, "--score-bias-aa", "AA alignment score bias", "", typeid(float), (void *) &scoreBiasAa, "^([0-9]*\\.[0-9]*)$"),
         PARAM_SCORE_BIAS_3DI(PARAM_SCORE_BIAS_3DI_ID, "--score-bias-3di", "3Di alignment score bias", "", typeid(float), (void *) &scoreBias3di, "^([0-9]*\\.[0-9]*)$"),
         PARAM_GUIDE_TREE(PARAM_GUIDE_TREE_ID, "--guide-tree", "Input Newick guide tree", "Guide tree in Newick format", typeid(std::string), (void *) &guideTree, ".*\\.nw"),
-        PARAM_RECOMPUTE_SCORES(PARAM_RECOMPUTE_SCORES_ID, "--recompute-scores", "Recompute scores", "Recompute all-vs-all alignment scores every iteration", typeid(bool), (void *) &recomputeScores, ""),
-        PARAM_REGRESSIVE(PARAM_REGRESSIVE_ID, "--regressive", "Regressive alignment", "Align sequences root-to-leaf", typeid(bool), (void *) &regressive, ""),
-        PARAM_PRECLUSTER(PARAM_PRECLUSTER_ID, "--precluster", "Pre-cluster structures", "Pre-cluster structures before constructing MSA", typeid(bool), (void *) &precluster, ""),
+        PARAM_RECOMPUTE_SCORES(PARAM_RECOMPUTE_SCORES_ID, "--recompute-scores", "Recompute scores", "Choose the merge order dynamically, rescoring merged profiles against the remaining structures after every round", typeid(bool), (void *) &recomputeScores, ""),
+        PARAM_REGRESSIVE(PARAM_REGRESSIVE_ID, "--regressive", "Regressive alignment", "Align sequences root-to-leaf: align one seed per guide tree clade, align each clade with its seed independently and join clades through their seeds", typeid(bool), (void *) &regressive, ""),
+        PARAM_PRECLUSTER(PARAM_PRECLUSTER_ID, "--precluster", "Pre-cluster structures", "Pre-cluster structures by shared 3Di k-mers before constructing MSA and only score cluster representatives all-vs-all", typeid(bool), (void *) &precluster, ""),
+        PARAM_PRECLUSTER_MIN_SCORE(PARAM_PRECLUSTER_MIN_SCORE_ID, "--precluster-min-score", "Pre-cluster score ratio", "Minimum ungapped score of a pre-cluster member against its representative, relative to the larger self score of the two [0.0,1.0]", typeid(float), (void *) &preclusterMinScore, "^(0(\\.[0-9]+)?|1(\\.0+)?)$"),
         PARAM_REFINE_ITERS(PARAM_REFINE_ITERS_ID, "--refine-iters", "Total refinement iterations", "Number of alignment refinement iterations", typeid(int), (void *) &refineIters, "[0-9]{1}[0-9]*$"),
         PARAM_BITFACTOR_AA(PARAM_BITFACTOR_AA_ID, "--bitfactor-aa", "AA matrix bit factor", "AA matrix bit factor", typeid(float), (void *) &bitFactorAa, "^([0-9]*\\.[0-9]*)$"),
         PARAM_BITFACTOR_3DI(PARAM_BITFACTOR_3DI_ID, "--bitfactor-3di", "3Di matrix bit factor", "3Di matrix bit factor", typeid(float), (void *) &bitFactor3Di, "^([0-9]*\\.[0-9]*)$"),
         PARAM_PAIR_THRESHOLD(PARAM_PAIR_THRESHOLD_ID, "--pair-threshold", "LDDT pair threshold", "% of pair subalignments with LDDT information [0.0,1.0]",typeid(float), (void *) &pairThreshold, "^0(\\.[0-9]+)?|1(\\.0+)?$"),
         PARAM_REPORT_COMMAND(PARAM_REPORT_COMMAND_ID, "--report-command", "", "", typeid(std::string), (void *) &reportCommand, ""),
         PARAM_REPORT_PATHS(PARAM_REPORT_PATHS_ID, "--report-paths", "", "", typeid(bool), (void *) &reportPaths, ""),
-        PARAM_REFINE_SEED(PARAM_REFINE_SEED_ID, "--refine-seed", "Random number generator seed", "Random number generator seed", typeid(int), (void *) &refinementSeed, "^([-]?[0-9]*)$")
+        PARAM_REPORT_COMPACT_CA(PARAM_REPORT_COMPACT_CA_ID, "--report-compact-ca", "Compact report coordinates", "Embed C-alpha coordinates in HTML reports as base64 delta-int16 instead of text. Needs the ca16 decoder of the bundled viewer (JSON output always uses text)", typeid(bool), (void *) &reportCompactCa, ""),
+        PARAM_REFINE_SEED(PARAM_REFINE_SEED_ID, "--refine-seed", "Random number generator seed", "Random number generator seed", typeid(int), (void *) &refinementSeed, "^([-]?[0-9]*)$"),
+        PARAM_LDDT_PRECISION(PARAM_LDDT_PRECISION_ID, "--lddt-precision", "Sampled LDDT precision", "Estimate LDDT from sampled pairs until the 95% CI half-width is below this value (0.0: exact all-vs-all LDDT)", typeid(float), (void *) &lddtPrecision, "^[0-9]*(\\.[0-9]+)?$"),
+        PARAM_LDDT_MAX_PAIRS(PARAM_LDDT_MAX_PAIRS_ID, "--lddt-max-pairs", "Sampled LDDT max pairs", "Maximum number of pairs to score when estimating LDDT from samples", typeid(int), (void *) &lddtMaxPairs, "^[1-9]{1}[0-9]*$"),
+        PARAM_REFINE_CANDIDATES(PARAM_REFINE_CANDIDATES_ID, "--refine-candidates", "Refinement candidates per iteration", "Number of partitions aligned in parallel per refinement iteration; the best improving one is kept. The result depends on this value, so it defaults to 1 instead of --threads to keep MSAs identical across thread counts. Set it to the thread count to use all threads during refinement", typeid(int), (void *) &refineCandidates, "^[1-9]{1}[0-9]*$"),
+        PARAM_REFINE_MODE(PARAM_REFINE_MODE_ID, "--refine-mode", "Refinement bipartitions", "Bipartitions to re-align during refinement 0: random, 1: guide tree edges (reuses cached subtree profiles)", typeid(int), (void *) &refineMode, "^[0-1]{1}$"),
+        PARAM_SIMD(PARAM_SIMD_ID, "--simd", "SIMD kernels", "Instruction set for the dispatched alignment kernels 0: auto-detect, 1: SSE2, 2: AVX2, 3: AVX-512BW", typeid(int), (void *) &simdLevel, "^[0-3]{1}$"),
+        PARAM_COLLAPSE_SEQ_ID(PARAM_COLLAPSE_SEQ_ID_ID, "--collapse-seq-id", "Collapse duplicates seq. id", "Align one representative per group of near-identical structures and copy its gapping to the others; members must match at least this fraction of the longer representative's positions in AA and 3Di without gaps (0.0: off, 1.0: exact duplicates)", typeid(float), (void *) &collapseSeqId, "^(0(\\.[0-9]+)?|1(\\.0+)?)$"),
+        PARAM_REGRESSIVE_CLADE_SIZE(PARAM_REGRESSIVE_CLADE_SIZE_ID, "--regressive-clade-size", "Regressive clade size", "Maximum number of structures per clade aligned independently with --regressive", typeid(int), (void *) &regressiveCladeSize, "^[1-9]{1}[0-9]*$"),
+        PARAM_CHECKPOINT_ROUNDS(PARAM_CHECKPOINT_ROUNDS_ID, "--checkpoint-rounds", "Checkpoint interval", "Write a checkpoint of the progressive alignment to <alignmentFile>.ckpt every N merge rounds (0: off)", typeid(int), (void *) &checkpointRounds, "^[0-9]{1}[0-9]*$"),
+        PARAM_RESUME(PARAM_RESUME_ID, "--resume", "Resume from checkpoint", "Continue the progressive alignment from <alignmentFile>.ckpt if it exists", typeid(bool), (void *) &resume, ""),
+        PARAM_WRITE_FMSA(PARAM_WRITE_FMSA_ID, "--write-fmsa", "Write binary MSA", "Also write the alignment as <alignmentFile>.fmsa, a compact binary MSA that other commands load faster than FASTA", typeid(bool), (void *) &writeFmsa, "")
 {
     // structuremsa
     structuremsa.push_back(&PARAM_WG);
@@ -41,6 +53,9 @@ FoldmasonParameters::FoldmasonParameters() :
     structuremsa.push_back(&PARAM_GUIDE_TREE);
     structuremsa.push_back(&PARAM_RECOMPUTE_SCORES);
     structuremsa.push_back(&PARAM_REGRESSIVE);
+    structuremsa.push_back(&PARAM_REGRESSIVE_CLADE_SIZE);
+    structuremsa.push_back(&PARAM_PRECLUSTER);
+    structuremsa.push_back(&PARAM_PRECLUSTER_MIN_SCORE);
     structuremsa.push_back(&PARAM_SUB_MAT);
     structuremsa.push_back(&PARAM_THREADS);
     structuremsa.push_back(&PARAM_MAX_SEQ_LEN);
@@ -51,6 +66,16 @@ FoldmasonParameters::FoldmasonParameters() :
     structuremsa.push_back(&PARAM_NO_COMP_BIAS_CORR);
     structuremsa.push_back(&PARAM_V);
     structuremsa.push_back(&PARAM_REFINE_SEED);
+    structuremsa.push_back(&PARAM_REFINE_CANDIDATES);
+    structuremsa.push_back(&PARAM_REFINE_MODE);
+    structuremsa.push_back(&PARAM_LDDT_PRECISION);
+    structuremsa.push_back(&PARAM_LDDT_MAX_PAIRS);
+    structuremsa.push_back(&PARAM_SIMD);
+    structuremsa.push_back(&PARAM_COLLAPSE_SEQ_ID);
+    structuremsa.push_back(&PARAM_CHECKPOINT_ROUNDS);
+    structuremsa.push_back(&PARAM_RESUME);
+    structuremsa.push_back(&PARAM_WRITE_FMSA);
+    structuremsa.push_back(&PARAM_COMPRESSED);
 
     structuremsacluster = combineList(structuremsacluster, structuremsa);
 
@@ -61,6 +86,9 @@ FoldmasonParameters::FoldmasonParameters() :
     msa2lddt.push_back(&PARAM_V);
     msa2lddt.push_back(&PARAM_REPORT_COMMAND);
     msa2lddt.push_back(&PARAM_REPORT_PATHS);
+    msa2lddt.push_back(&PARAM_REPORT_COMPACT_CA);
+    msa2lddt.push_back(&PARAM_LDDT_PRECISION);
+    msa2lddt.push_back(&PARAM_LDDT_MAX_PAIRS);
 
     // refinemsa
     refinemsa = combineList(refinemsa, structuremsa);
@@ -71,7 +99,7 @@ FoldmasonParameters::FoldmasonParameters() :
     easymsaworkflow = combineList(easymsaworkflow, structurecreatedb);
     easymsaworkflow = combineList(easymsaworkflow, structuremsa);
     easymsaworkflow = combineList(easymsaworkflow, msa2lddt);
-    easymsaworkflow.push_back(&PARAM_PRECLUSTER);
+    easymsaworkflow.push_back(&PARAM_REMOVE_TMP_FILES);
     easymsaworkflow.push_back(&PARAM_REPORT_MODE);
 
     pcaAa = 1.1;
@@ -84,15 +112,27 @@ FoldmasonParameters::FoldmasonParameters() :
     guideTree = "";
     reportCommand = "";
     reportPaths = true;
+    reportCompactCa = false;
     recomputeScores = false;
     regressive = false;
     precluster = false;
+    preclusterMinScore = 0.5;
     refineIters = 0;
     bitFactorAa = 1.1;
     bitFactor3Di = 2.1;
     pairThreshold = 0.0;
     wg = true;
     refinementSeed = -1;
+    lddtPrecision = 0.0;
+    lddtMaxPairs = 1000000;
+    refineCandidates = 1;
+    refineMode = REFINE_MODE_RANDOM;
+    simdLevel = 0;
+    collapseSeqId = 0.0;
+    regressiveCladeSize = 1000;
+    checkpointRounds = 0;
+    resume = false;
+    writeFmsa = false;
 
     citations.emplace(CITATION_FOLDMASON, " << TODO >> ");
 }
\ No newline at end of file
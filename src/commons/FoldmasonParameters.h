@@ -25,6 +25,9 @@ public:
         return static_cast<FoldmasonParameters&>(FoldmasonParameters::getInstance());
     }
 
+    static const int REFINE_MODE_RANDOM = 0;
+    static const int REFINE_MODE_GUIDE_TREE = 1;
+
     std::vector<MMseqsParameter *> structuremsa;
     std::vector<MMseqsParameter *> structuremsacluster;
     std::vector<MMseqsParameter *> msa2lddt;
@@ -41,13 +44,25 @@ public:
     PARAMETER(PARAM_RECOMPUTE_SCORES)
     PARAMETER(PARAM_REGRESSIVE)
     PARAMETER(PARAM_PRECLUSTER)
+    PARAMETER(PARAM_PRECLUSTER_MIN_SCORE)
     PARAMETER(PARAM_REFINE_ITERS)
     PARAMETER(PARAM_BITFACTOR_AA)
     PARAMETER(PARAM_BITFACTOR_3DI)
     PARAMETER(PARAM_PAIR_THRESHOLD)
     PARAMETER(PARAM_REPORT_COMMAND)
     PARAMETER(PARAM_REPORT_PATHS)
+    PARAMETER(PARAM_REPORT_COMPACT_CA)
     PARAMETER(PARAM_REFINE_SEED)
+    PARAMETER(PARAM_LDDT_PRECISION)
+    PARAMETER(PARAM_LDDT_MAX_PAIRS)
+    PARAMETER(PARAM_REFINE_CANDIDATES)
+    PARAMETER(PARAM_REFINE_MODE)
+    PARAMETER(PARAM_SIMD)
+    PARAMETER(PARAM_COLLAPSE_SEQ_ID)
+    PARAMETER(PARAM_REGRESSIVE_CLADE_SIZE)
+    PARAMETER(PARAM_CHECKPOINT_ROUNDS)
+    PARAMETER(PARAM_RESUME)
+    PARAMETER(PARAM_WRITE_FMSA)
 
     MultiParam<PseudoCounts> pcaAa;
     MultiParam<PseudoCounts> pcbAa;
@@ -59,12 +74,24 @@ public:
     bool recomputeScores;
     bool regressive;
     bool precluster;
+    float preclusterMinScore;
     int refineIters;
     float bitFactorAa;
     float bitFactor3Di;
     std::string reportCommand;
     bool reportPaths;
+    bool reportCompactCa;
     float pairThreshold;
     int refinementSeed;
+    float lddtPrecision;
+    int lddtMaxPairs;
+    int refineCandidates;
+    int refineMode;
+    int simdLevel;
+    float collapseSeqId;
+    int regressiveCladeSize;
+    int checkpointRounds;
+    bool resume;
+    bool writeFmsa;
 };
 #endif
@@ -21,6 +21,55 @@ void SubMSA::concat(const std::vector<size_t> &other) {
     members.insert(members.end(), other.begin(), other.end());
 }
 
+CigarUndoLog::CigarUndoLog() {}
+CigarUndoLog::CigarUndoLog(size_t n) : saved(n, false), original_aa(n), original_ss(n) {}
+
+void CigarUndoLog::save(size_t row, std::vector<std::vector<Instruction> > &cigars_aa, std::vector<std::vector<Instruction> > &cigars_ss) {
+    if (saved[row]) {
+        return;
+    }
+    saved[row] = true;
+    rows.push_back(row);
+    original_aa[row].assign(cigars_aa[row].begin(), cigars_aa[row].end());
+    original_ss[row].assign(cigars_ss[row].begin(), cigars_ss[row].end());
+}
+
+void CigarUndoLog::replace(
+    size_t row,
+    std::vector<std::vector<Instruction> > &cigars_aa,
+    std::vector<std::vector<Instruction> > &cigars_ss,
+    std::vector<Instruction> &new_aa,
+    std::vector<Instruction> &new_ss
+) {
+    cigars_aa[row].swap(new_aa);
+    cigars_ss[row].swap(new_ss);
+    if (saved[row] == false) {
+        saved[row] = true;
+        rows.push_back(row);
+        original_aa[row].swap(new_aa);
+        original_ss[row].swap(new_ss);
+    }
+}
+
+void CigarUndoLog::rollback(std::vector<std::vector<Instruction> > &cigars_aa, std::vector<std::vector<Instruction> > &cigars_ss) {
+    for (size_t row : rows) {
+        cigars_aa[row].swap(original_aa[row]);
+        cigars_ss[row].swap(original_ss[row]);
+    }
+    clear();
+}
+
+void CigarUndoLog::clear() {
+    for (size_t row : rows) {
+        saved[row] = false;
+    }
+    rows.clear();
+}
+
+const std::vector<size_t>& CigarUndoLog::modifiedRows() const {
+    return rows;
+}
+
 MSAContainer::MSAContainer() {}
 MSAContainer::MSAContainer(size_t n) : dbKeys(n), dbIdToSubMSAVec(n, n), cigars_aa(n), cigars_ss(n) {}
 
@@ -61,6 +61,34 @@ struct SubMSA {
     void concat(const std::vector<size_t> &other);
 };
 
+/**
+ * @brief Original CIGAR rows replaced during an in-place edit of an MSA, for rolling it back
+ *
+ * Rows are saved at most once per edit: the first replacement moves the original row into
+ * the log, later replacements of the same row simply drop the intermediate version.
+ */
+class CigarUndoLog {
+    private:
+        std::vector<size_t> rows;
+        std::vector<bool> saved;
+        std::vector<std::vector<Instruction> > original_aa;
+        std::vector<std::vector<Instruction> > original_ss;
+
+    public:
+        CigarUndoLog();
+        CigarUndoLog(size_t n);
+
+        // Copy a row before it is modified in place
+        void save(size_t row, std::vector<std::vector<Instruction> > &cigars_aa, std::vector<std::vector<Instruction> > &cigars_ss);
+        // Swap a new row in; new_aa/new_ss are left holding unspecified content
+        void replace(size_t row, std::vector<std::vector<Instruction> > &cigars_aa, std::vector<std::vector<Instruction> > &cigars_ss,
+                     std::vector<Instruction> &new_aa, std::vector<Instruction> &new_ss);
+        // Restore all saved rows and clear the log
+        void rollback(std::vector<std::vector<Instruction> > &cigars_aa, std::vector<std::vector<Instruction> > &cigars_ss);
+        // Keep the edit and clear the log
+        void clear();
+        const std::vector<size_t>& modifiedRows() const;
+};
 
 class MSAContainer {
     private:
@@ -0,0 +1,256 @@
+#include "MSACheckpoint.h"
+#include "Debug.h"
+#include "FileUtil.h"
+
+#include <cstdio>
+#include <numeric>
+#include <utility>
+#include <unistd.h>
+
+static const char CHECKPOINT_MAGIC[8] = { 'F', 'M', 'C', 'K', 'P', 'T', '0', '2' };
+// Closes every record, a record without it was cut short
+static const uint64_t RECORD_END = 0x444E45434552434DULL;
+
+template <typename T>
+static bool writeValue(FILE *file, const T &value) {
+    return fwrite(&value, sizeof(T), 1, file) == 1;
+}
+
+template <typename T>
+static bool writeVector(FILE *file, const std::vector<T> &values) {
+    uint64_t size = values.size();
+    return writeValue(file, size) && (size == 0 || fwrite(values.data(), sizeof(T), size, file) == size);
+}
+
+static bool writeString(FILE *file, const std::string &value) {
+    uint64_t size = value.size();
+    return writeValue(file, size) && (size == 0 || fwrite(value.data(), 1, size, file) == size);
+}
+
+template <typename T>
+static bool readValue(FILE *file, T &value) {
+    return fread(&value, sizeof(T), 1, file) == 1;
+}
+
+template <typename T>
+static bool readVector(FILE *file, std::vector<T> &values) {
+    uint64_t size;
+    if (readValue(file, size) == false) {
+        return false;
+    }
+    values.resize(size);
+    return size == 0 || fread(values.data(), sizeof(T), size, file) == size;
+}
+
+static bool readString(FILE *file, std::string &value) {
+    uint64_t size;
+    if (readValue(file, size) == false) {
+        return false;
+    }
+    value.resize(size);
+    return size == 0 || fread(&value[0], 1, size, file) == size;
+}
+
+MSACheckpoint::MSACheckpoint(const std::string &path) : path(path), savedRound(0), fileLength(0) {}
+
+MSACheckpoint::~MSACheckpoint() {
+    wait();
+}
+
+void MSACheckpoint::wait() {
+    if (writer.joinable()) {
+        writer.join();
+    }
+}
+
+void MSACheckpoint::save(const MSAContainer &msa, const std::vector<AlnSimple> &hits, const std::vector<size_t> &merges, size_t round) {
+    // only one write in flight; a slow disk delays the next record, never the current one
+    wait();
+    if (round <= savedRound && fileLength > 0) {
+        return;
+    }
+    std::shared_ptr<Record> record(new Record());
+    record->header = (fileLength == 0);
+    if (record->header) {
+        record->dbKeys = msa.dbKeys;
+        record->hits = hits;
+        record->merges = merges;
+    }
+    record->round = round;
+
+    // Every merge of these rounds ends up in the sub-MSA that now holds its query
+    size_t begin = std::accumulate(merges.begin(), merges.begin() + savedRound, (size_t) 0);
+    size_t end = std::accumulate(merges.begin() + savedRound, merges.begin() + round, begin);
+    std::vector<bool> changed(msa.size(), false);
+    for (size_t i = begin; i < end; i++) {
+        size_t index = msa.dbIdToSubMSAVec[hits[i].queryId];
+        if (index >= msa.size() || changed[index]) {
+            continue;
+        }
+        changed[index] = true;
+        const SubMSA &sub = *(msa.begin() + index);
+        record->subMSAs.push_back(sub);
+        for (size_t member : sub.members) {
+            record->rows.push_back(member);
+            record->cigars_aa.push_back(msa.cigars_aa[member]);
+            record->cigars_ss.push_back(msa.cigars_ss[member]);
+        }
+    }
+
+    std::string target = path;
+    long length = fileLength;
+    writer = std::thread([this, record, target, length]() {
+        long written = MSACheckpoint::write(target, length, *record);
+        if (written < 0) {
+            // the next record covers these rounds again
+            Debug(Debug::WARNING) << "Could not write checkpoint " << target << "\n";
+        } else {
+            savedRound = record->round;
+            fileLength = written;
+        }
+    });
+}
+
+long MSACheckpoint::write(const std::string &path, long fileLength, const Record &record) {
+    // The first record is written with the linkage and renamed into place, later records
+    // are appended over whatever a failed previous append left behind
+    std::string tmpPath = path + ".tmp";
+    FILE *file = record.header ? fopen(tmpPath.c_str(), "wb") : fopen(path.c_str(), "r+b");
+    if (file == NULL) {
+        return -1;
+    }
+    bool ok = true;
+    if (record.header) {
+        ok = fwrite(CHECKPOINT_MAGIC, 1, sizeof(CHECKPOINT_MAGIC), file) == sizeof(CHECKPOINT_MAGIC)
+            && writeVector(file, record.dbKeys)
+            && writeVector(file, record.hits)
+            && writeVector(file, record.merges);
+    } else {
+        ok = fseek(file, fileLength, SEEK_SET) == 0;
+    }
+    ok = ok && writeValue(file, (uint64_t) record.round);
+    ok = ok && writeValue(file, (uint64_t) record.rows.size());
+    for (size_t i = 0; ok && i < record.rows.size(); i++) {
+        ok = writeValue(file, (uint64_t) record.rows[i])
+            && writeVector(file, record.cigars_aa[i])
+            && writeVector(file, record.cigars_ss[i]);
+    }
+    ok = ok && writeValue(file, (uint64_t) record.subMSAs.size());
+    for (size_t i = 0; ok && i < record.subMSAs.size(); i++) {
+        const SubMSA &sub = record.subMSAs[i];
+        ok = writeValue(file, (uint64_t) sub.id)
+            && writeVector(file, sub.members)
+            && writeString(file, sub.mask)
+            && writeString(file, sub.profile_aa)
+            && writeString(file, sub.profile_ss);
+    }
+    ok = ok && writeValue(file, RECORD_END);
+    long length = ok ? ftell(file) : -1;
+    ok = ok && length > 0 && (record.header || ftruncate(fileno(file), length) == 0);
+    ok = (fclose(file) == 0) && ok;
+    if (record.header) {
+        if (ok == false) {
+            FileUtil::remove(tmpPath.c_str());
+            return -1;
+        }
+        ok = std::rename(tmpPath.c_str(), path.c_str()) == 0;
+    }
+    return ok ? length : -1;
+}
+
+bool MSACheckpoint::load(MSAContainer &msa, std::vector<AlnSimple> &hits, std::vector<size_t> &merges, size_t &round) {
+    wait();
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == NULL) {
+        return false;
+    }
+    size_t n = msa.cigars_aa.size();
+    char magic[sizeof(CHECKPOINT_MAGIC)];
+    std::vector<size_t> dbKeys;
+    bool ok = fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+        && std::equal(magic, magic + sizeof(magic), CHECKPOINT_MAGIC);
+    ok = ok && readVector(file, dbKeys) && dbKeys == msa.dbKeys;
+    ok = ok && readVector(file, hits);
+    ok = ok && readVector(file, merges);
+
+    // Replay complete records; a newer sub-MSA replaces all sub-MSAs it absorbed
+    std::vector<SubMSA> subMSAs;
+    std::vector<bool> alive;
+    std::vector<size_t> rowToSubMSA(n, SIZE_MAX);
+    size_t completed = 0;
+    long length = ok ? ftell(file) : -1;
+    while (ok) {
+        Record record;
+        uint64_t value = 0;
+        bool complete = readValue(file, value) && value > completed && value <= merges.size();
+        record.round = value;
+        uint64_t rowCnt = 0;
+        complete = complete && readValue(file, rowCnt) && rowCnt <= n;
+        record.rows.resize(complete ? rowCnt : 0);
+        record.cigars_aa.resize(record.rows.size());
+        record.cigars_ss.resize(record.rows.size());
+        for (size_t i = 0; complete && i < record.rows.size(); i++) {
+            complete = readValue(file, value) && value < n
+                && readVector(file, record.cigars_aa[i])
+                && readVector(file, record.cigars_ss[i]);
+            record.rows[i] = value;
+        }
+        uint64_t subMSACnt = 0;
+        complete = complete && readValue(file, subMSACnt) && subMSACnt <= n;
+        record.subMSAs.resize(complete ? subMSACnt : 0);
+        for (size_t i = 0; complete && i < record.subMSAs.size(); i++) {
+            SubMSA &sub = record.subMSAs[i];
+            complete = readValue(file, value)
+                && readVector(file, sub.members)
+                && readString(file, sub.mask)
+                && readString(file, sub.profile_aa)
+                && readString(file, sub.profile_ss);
+            sub.id = value;
+            for (size_t j = 0; complete && j < sub.members.size(); j++) {
+                complete = sub.members[j] < n;
+            }
+        }
+        complete = complete && readValue(file, value) && value == RECORD_END;
+        if (complete == false) {
+            break;
+        }
+        for (size_t i = 0; i < record.rows.size(); i++) {
+            msa.cigars_aa[record.rows[i]].swap(record.cigars_aa[i]);
+            msa.cigars_ss[record.rows[i]].swap(record.cigars_ss[i]);
+        }
+        for (size_t i = 0; i < record.subMSAs.size(); i++) {
+            for (size_t member : record.subMSAs[i].members) {
+                if (rowToSubMSA[member] != SIZE_MAX) {
+                    alive[rowToSubMSA[member]] = false;
+                }
+                rowToSubMSA[member] = subMSAs.size();
+            }
+            subMSAs.push_back(record.subMSAs[i]);
+            alive.push_back(true);
+        }
+        completed = record.round;
+        length = ftell(file);
+    }
+    fclose(file);
+    if (ok == false || completed == 0) {
+        hits.clear();
+        merges.clear();
+        return false;
+    }
+
+    MSAContainer restored;
+    restored.dbKeys = msa.dbKeys;
+    restored.dbIdToSubMSAVec.assign(n, n);
+    restored.cigars_aa.swap(msa.cigars_aa);
+    restored.cigars_ss.swap(msa.cigars_ss);
+    for (size_t i = 0; i < subMSAs.size(); i++) {
+        if (alive[i]) {
+            restored.add(subMSAs[i]);
+        }
+    }
+    msa = std::move(restored);
+    round = completed;
+    savedRound = completed;
+    fileLength = length;
+    return true;
+}
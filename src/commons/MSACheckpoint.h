@@ -0,0 +1,58 @@
+#ifndef MSA_CHECKPOINT_H
+#define MSA_CHECKPOINT_H
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MSA.h"
+#include "newick.h"
+
+/**
+ * @brief Binary journal of a progressive alignment, extended after completed merge rounds
+ *
+ * The file starts with the linkage (hits/merges) and is followed by one record per saved
+ * round holding only the CIGAR rows and sub-MSAs merged since the previous record.
+ * Records are copied by the caller's thread and appended by a background thread; a
+ * record cut short by a crash is ignored on load, so the journal always restores the
+ * last fully written round.
+ */
+class MSACheckpoint {
+    public:
+        MSACheckpoint(const std::string &path);
+        ~MSACheckpoint();
+
+        // Copy the rows and sub-MSAs merged since the last save and append them in the background
+        void save(const MSAContainer &msa, const std::vector<AlnSimple> &hits, const std::vector<size_t> &merges, size_t round);
+        // Block until the pending write, if any, is finished
+        void wait();
+
+        // Replay the journal into msa, which must have been created for the same database.
+        // Later saves continue the journal after the restored round.
+        // Returns false if the file is missing, truncated or written for a different database.
+        bool load(MSAContainer &msa, std::vector<AlnSimple> &hits, std::vector<size_t> &merges, size_t &round);
+
+    private:
+        struct Record {
+            bool header;
+            std::vector<size_t> dbKeys;
+            std::vector<AlnSimple> hits;
+            std::vector<size_t> merges;
+            size_t round;
+            std::vector<size_t> rows;
+            std::vector<std::vector<Instruction> > cigars_aa;
+            std::vector<std::vector<Instruction> > cigars_ss;
+            std::vector<SubMSA> subMSAs;
+        };
+
+        std::string path;
+        std::thread writer;
+        // Rounds covered by the journal and its length in bytes, only touched after wait()
+        size_t savedRound;
+        long fileLength;
+
+        static long write(const std::string &path, long fileLength, const Record &record);
+};
+
+#endif
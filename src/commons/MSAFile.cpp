@@ -0,0 +1,198 @@
+#include "MSAFile.h"
+#include "Debug.h"
+#include "FileUtil.h"
+#include "Util.h"
+
+#include <climits>
+#include <cstring>
+
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
+static const char MSA_FILE_MAGIC[8] = { 'F', 'M', 'M', 'S', 'A', 0, 0, 1 };
+static const size_t MSA_FILE_HEADER_SIZE = sizeof(MSA_FILE_MAGIC) + 4 * sizeof(uint64_t);
+
+bool MSAFile::isMSAFile(const std::string &fileName) {
+    FILE *file = fopen(fileName.c_str(), "rb");
+    if (file == NULL) {
+        return false;
+    }
+    char magic[sizeof(MSA_FILE_MAGIC)];
+    bool isBinary = fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+        && memcmp(magic, MSA_FILE_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return isBinary;
+}
+
+void MSAFile::write(
+    const std::string &fileName,
+    const std::vector<std::string> &headers,
+    const std::vector<size_t> &keys,
+    const std::vector<std::vector<Instruction> > &cigars,
+    const std::vector<size_t> &rows
+) {
+    std::vector<Row> index(rows.size());
+    std::vector<uint32_t> runs;
+    std::string headerBlob;
+    uint64_t alnLength = 0;
+    for (size_t i = 0; i < rows.size(); i++) {
+        const std::vector<Instruction> &cigar = cigars[rows[i]];
+        Row &row = index[i];
+        row.key = static_cast<uint32_t>(keys[rows[i]]);
+        row.headerOffset = headerBlob.size();
+        row.headerLength = headers[rows[i]].size();
+        row.runOffset = runs.size();
+        headerBlob.append(headers[rows[i]]);
+
+        // even runs are gaps, odd runs are residues
+        uint64_t columns = 0;
+        uint32_t run = 0;
+        bool inGap = true;
+        runs.push_back(0);
+        for (const Instruction &ins : cigar) {
+            if (ins.isSeq() == inGap) {
+                runs.back() = run;
+                runs.push_back(0);
+                run = 0;
+                inGap = !inGap;
+            }
+            run += ins.isSeq() ? 1 : ins.bits.count;
+        }
+        runs.back() = run;
+        row.runCount = static_cast<uint32_t>(runs.size() - row.runOffset);
+        for (size_t j = row.runOffset; j < runs.size(); j++) {
+            columns += runs[j];
+        }
+        alnLength = std::max(alnLength, columns);
+    }
+    // keep the run array 4-byte aligned in the mapped file
+    headerBlob.append((4 - headerBlob.size() % 4) % 4, '\0');
+
+    FILE *file = fopen(fileName.c_str(), "wb");
+    if (file == NULL) {
+        Debug(Debug::ERROR) << "Could not open " << fileName << " for writing\n";
+        EXIT(EXIT_FAILURE);
+    }
+    uint64_t counts[4] = { rows.size(), alnLength, headerBlob.size(), runs.size() };
+    bool ok = fwrite(MSA_FILE_MAGIC, 1, sizeof(MSA_FILE_MAGIC), file) == sizeof(MSA_FILE_MAGIC)
+        && fwrite(counts, sizeof(uint64_t), 4, file) == 4
+        && fwrite(index.data(), sizeof(Row), index.size(), file) == index.size()
+        && fwrite(headerBlob.data(), 1, headerBlob.size(), file) == headerBlob.size()
+        && fwrite(runs.data(), sizeof(uint32_t), runs.size(), file) == runs.size();
+    if (fclose(file) != 0 || ok == false) {
+        Debug(Debug::ERROR) << "Could not write " << fileName << "\n";
+        EXIT(EXIT_FAILURE);
+    }
+}
+
+void MSAFile::read(
+    const std::string &fileName,
+    DBReader<unsigned int> *seqDbrAA,
+    DBReader<unsigned int> *seqDbr3Di,
+    std::vector<std::string> &headers,
+    std::vector<size_t> &indices,
+    std::vector<std::vector<Instruction> > &cigars_aa,
+    std::vector<std::vector<Instruction> > &cigars_ss,
+    int &alnLength,
+    int threads
+) {
+    FILE *file = FileUtil::openFileOrDie(fileName.c_str(), "rb", true);
+    size_t dataSize = 0;
+    char *data = static_cast<char *>(FileUtil::mmapFile(file, &dataSize));
+    if (dataSize < MSA_FILE_HEADER_SIZE || memcmp(data, MSA_FILE_MAGIC, sizeof(MSA_FILE_MAGIC)) != 0) {
+        Debug(Debug::ERROR) << fileName << " is not a binary MSA file\n";
+        EXIT(EXIT_FAILURE);
+    }
+    uint64_t counts[4];
+    memcpy(counts, data + sizeof(MSA_FILE_MAGIC), sizeof(counts));
+    const uint64_t rowCount = counts[0];
+    const uint64_t headerBytes = counts[2];
+    const uint64_t runCount = counts[3];
+    // bound each count by the remaining bytes first, so the size sum cannot overflow
+    const uint64_t available = dataSize - MSA_FILE_HEADER_SIZE;
+    if (rowCount > available / sizeof(Row)
+        || headerBytes > available - rowCount * sizeof(Row)
+        || runCount > (available - rowCount * sizeof(Row) - headerBytes) / sizeof(uint32_t)
+        || MSA_FILE_HEADER_SIZE + rowCount * sizeof(Row) + headerBytes + runCount * sizeof(uint32_t) != dataSize
+        || counts[1] > static_cast<uint64_t>(INT_MAX)) {
+        Debug(Debug::ERROR) << "Binary MSA file " << fileName << " is truncated or corrupt\n";
+        EXIT(EXIT_FAILURE);
+    }
+    const Row *index = reinterpret_cast<const Row *>(data + MSA_FILE_HEADER_SIZE);
+    const char *headerBlob = reinterpret_cast<const char *>(index + rowCount);
+    const uint32_t *runs = reinterpret_cast<const uint32_t *>(headerBlob + headerBytes);
+    for (size_t i = 0; i < rowCount; i++) {
+        const Row &row = index[i];
+        if (row.headerOffset > headerBytes || row.headerLength > headerBytes - row.headerOffset
+            || row.runOffset > runCount || row.runCount > runCount - row.runOffset) {
+            Debug(Debug::ERROR) << "Binary MSA file " << fileName << " is corrupt, row " << i << " points outside the file\n";
+            EXIT(EXIT_FAILURE);
+        }
+    }
+
+    // appends like parseFasta, so several files can be read into the same vectors
+    const size_t offset = cigars_aa.size();
+    headers.resize(offset + rowCount);
+    indices.resize(offset + rowCount);
+    cigars_aa.resize(offset + rowCount);
+    cigars_ss.resize(offset + rowCount);
+    if (alnLength == 0) {
+        alnLength = static_cast<int>(counts[1]);
+    }
+
+    bool mismatch = false;
+#pragma omp parallel for schedule(dynamic, 64) num_threads(threads)
+    for (size_t i = 0; i < rowCount; i++) {
+        unsigned int thread_idx = 0;
+#ifdef OPENMP
+        thread_idx = static_cast<unsigned int>(omp_get_thread_num());
+#endif
+        const Row &row = index[i];
+        headers[offset + i].assign(headerBlob + row.headerOffset, row.headerLength);
+        indices[offset + i] = row.key;
+        size_t seqIdAA = seqDbrAA->getId(row.key);
+        size_t seqId3Di = seqDbr3Di->getId(row.key);
+        if (seqIdAA == UINT_MAX || seqId3Di == UINT_MAX) {
+#pragma omp atomic write
+            mismatch = true;
+            continue;
+        }
+        const char *aa = seqDbrAA->getData(seqIdAA, thread_idx);
+        const char *ss = seqDbr3Di->getData(seqId3Di, thread_idx);
+        size_t length = seqDbrAA->getSeqLen(seqIdAA);
+
+        std::vector<Instruction> &cigarAa = cigars_aa[offset + i];
+        std::vector<Instruction> &cigarSs = cigars_ss[offset + i];
+        size_t residue = 0;
+        for (uint32_t r = 0; r < row.runCount; r++) {
+            uint32_t run = runs[row.runOffset + r];
+            if (r % 2 == 0) {
+                // gap runs are split like contract() does
+                while (run > 0) {
+                    int count = std::min(run, static_cast<uint32_t>(127));
+                    cigarAa.emplace_back(count);
+                    cigarSs.emplace_back(count);
+                    run -= count;
+                }
+            } else if (residue + run <= length) {
+                for (uint32_t j = 0; j < run; j++, residue++) {
+                    cigarAa.emplace_back(aa[residue]);
+                    cigarSs.emplace_back(ss[residue]);
+                }
+            } else {
+                residue += run;
+            }
+        }
+        if (residue != length) {
+#pragma omp atomic write
+            mismatch = true;
+        }
+    }
+    FileUtil::munmapData(data, dataSize);
+    fclose(file);
+    if (mismatch) {
+        Debug(Debug::ERROR) << "Binary MSA file " << fileName << " does not match the structure database\n";
+        EXIT(EXIT_FAILURE);
+    }
+}
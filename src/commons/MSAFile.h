@@ -0,0 +1,64 @@
+#ifndef MSA_FILE_H
+#define MSA_FILE_H
+
+#include <string>
+#include <vector>
+
+#include "DBReader.h"
+#include "MSA.h"
+
+/**
+ * @brief Binary MSA file, read by memory mapping
+ *
+ * Rows are stored as DB keys with gap-run skeletons; residues are filled in from the
+ * AA/3Di databases on load, so the file is a fraction of the size of the FASTA export.
+ *
+ * Layout (native byte order):
+ *   char     magic[8]
+ *   uint64   rowCount, alnLength, headerBytes, runCount
+ *   Row      rows[rowCount]
+ *   char     headers[headerBytes]
+ *   uint32   runs[runCount]   per row: gap, match, gap, match, ... starting with a (possibly empty) gap run
+ */
+class MSAFile {
+    public:
+        struct Row {
+            uint32_t key;
+            uint32_t runCount;
+            uint64_t headerOffset;
+            uint64_t headerLength;
+            uint64_t runOffset;
+        };
+
+        // True if fileName starts with the binary MSA magic
+        static bool isMSAFile(const std::string &fileName);
+
+        /**
+         * @brief Write rows of an MSA in the given order
+         * @param keys DB key of every row, indexed like cigars
+         * @param headers FASTA header of every row, indexed like cigars
+         */
+        static void write(
+            const std::string &fileName,
+            const std::vector<std::string> &headers,
+            const std::vector<size_t> &keys,
+            const std::vector<std::vector<Instruction> > &cigars,
+            const std::vector<size_t> &rows
+        );
+
+        // Load rows in file order with the same output as parseFasta; rows are expanded to
+        // full CIGARs, the compact runs only save disk space and parsing
+        static void read(
+            const std::string &fileName,
+            DBReader<unsigned int> *seqDbrAA,
+            DBReader<unsigned int> *seqDbr3Di,
+            std::vector<std::string> &headers,
+            std::vector<size_t> &indices,
+            std::vector<std::vector<Instruction> > &cigars_aa,
+            std::vector<std::vector<Instruction> > &cigars_ss,
+            int &alnLength,
+            int threads
+        );
+};
+
+#endif
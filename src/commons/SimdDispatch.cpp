@@ -0,0 +1,210 @@
+#include "SimdDispatch.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_DISPATCH_X86
+#endif
+
+namespace SimdDispatch {
+
+static std::atomic<int> selectedLevel(-1);
+
+UngappedProfile::UngappedProfile(size_t maxSequenceLength, int alphabetSize) : queryLength(0) {
+    aa = new int16_t[alphabetSize * maxSequenceLength];
+    ss = new int16_t[alphabetSize * maxSequenceLength];
+    rows = new int16_t[2 * (maxSequenceLength + 1)];
+}
+
+UngappedProfile::~UngappedProfile() {
+    delete[] aa;
+    delete[] ss;
+    delete[] rows;
+}
+
+#ifdef SIMD_DISPATCH_X86
+// mirrors the saturating int16 arithmetic of the vector kernels
+static inline int addSaturated(int a, int b) {
+    return std::min(std::max(a + b, (int) INT16_MIN), (int) INT16_MAX);
+}
+
+// Each row keeps S(i-1,j-1) at index i, so rows[0] stays zero and the
+// diagonal predecessor of query position i is a plain (unaligned) load at i.
+static inline int ungappedTail(const int16_t *prev, int16_t *curr, const int16_t *qa, const int16_t *q3,
+                               int start, int queryLength, int max) {
+    for (int i = start; i < queryLength; i++) {
+        int S = addSaturated(addSaturated(prev[i], qa[i]), q3[i]);
+        S = std::max(S, 0);
+        curr[i + 1] = (int16_t) S;
+        max = std::max(max, S);
+    }
+    return max;
+}
+
+__attribute__((target("sse2")))
+int ungappedSSE2(const int16_t *aaProfile, const int16_t *ssProfile, int queryLength,
+                 const unsigned char *dbAA, const unsigned char *db3Di, int dbLength, int16_t *rows) {
+    const int lanes = 8;
+    const int vecEnd = queryLength - (queryLength % lanes);
+    int16_t *prev = rows;
+    int16_t *curr = rows + queryLength + 1;
+    memset(rows, 0, 2 * (queryLength + 1) * sizeof(int16_t));
+    const __m128i zero = _mm_setzero_si128();
+    __m128i vMax = zero;
+    int max = 0;
+    for (int j = 0; j < dbLength; j++) {
+        const int16_t *qa = aaProfile + dbAA[j] * queryLength;
+        const int16_t *q3 = ssProfile + db3Di[j] * queryLength;
+        for (int i = 0; i < vecEnd; i += lanes) {
+            __m128i S = _mm_loadu_si128((const __m128i *) (prev + i));
+            S = _mm_adds_epi16(S, _mm_loadu_si128((const __m128i *) (qa + i)));
+            S = _mm_adds_epi16(S, _mm_loadu_si128((const __m128i *) (q3 + i)));
+            S = _mm_max_epi16(S, zero);
+            _mm_storeu_si128((__m128i *) (curr + i + 1), S);
+            vMax = _mm_max_epi16(vMax, S);
+        }
+        max = ungappedTail(prev, curr, qa, q3, vecEnd, queryLength, max);
+        std::swap(prev, curr);
+    }
+    int16_t lane[8];
+    _mm_storeu_si128((__m128i *) lane, vMax);
+    for (int i = 0; i < lanes; i++) {
+        max = std::max(max, (int) lane[i]);
+    }
+    return max;
+}
+
+__attribute__((target("avx2")))
+int ungappedAVX2(const int16_t *aaProfile, const int16_t *ssProfile, int queryLength,
+                 const unsigned char *dbAA, const unsigned char *db3Di, int dbLength, int16_t *rows) {
+    const int lanes = 16;
+    const int vecEnd = queryLength - (queryLength % lanes);
+    int16_t *prev = rows;
+    int16_t *curr = rows + queryLength + 1;
+    memset(rows, 0, 2 * (queryLength + 1) * sizeof(int16_t));
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i vMax = zero;
+    int max = 0;
+    for (int j = 0; j < dbLength; j++) {
+        const int16_t *qa = aaProfile + dbAA[j] * queryLength;
+        const int16_t *q3 = ssProfile + db3Di[j] * queryLength;
+        for (int i = 0; i < vecEnd; i += lanes) {
+            __m256i S = _mm256_loadu_si256((const __m256i *) (prev + i));
+            S = _mm256_adds_epi16(S, _mm256_loadu_si256((const __m256i *) (qa + i)));
+            S = _mm256_adds_epi16(S, _mm256_loadu_si256((const __m256i *) (q3 + i)));
+            S = _mm256_max_epi16(S, zero);
+            _mm256_storeu_si256((__m256i *) (curr + i + 1), S);
+            vMax = _mm256_max_epi16(vMax, S);
+        }
+        max = ungappedTail(prev, curr, qa, q3, vecEnd, queryLength, max);
+        std::swap(prev, curr);
+    }
+    int16_t lane[16];
+    _mm256_storeu_si256((__m256i *) lane, vMax);
+    for (int i = 0; i < lanes; i++) {
+        max = std::max(max, (int) lane[i]);
+    }
+    return max;
+}
+
+// Masked loads and stores cover the last partial vector, so this variant needs no scalar tail
+__attribute__((target("avx512f,avx512bw")))
+int ungappedAVX512BW(const int16_t *aaProfile, const int16_t *ssProfile, int queryLength,
+                     const unsigned char *dbAA, const unsigned char *db3Di, int dbLength, int16_t *rows) {
+    const int lanes = 32;
+    const int tail = queryLength % lanes;
+    const int vecEnd = queryLength - tail;
+    const __mmask32 tailMask = (__mmask32) ((1ULL << tail) - 1);
+    int16_t *prev = rows;
+    int16_t *curr = rows + queryLength + 1;
+    memset(rows, 0, 2 * (queryLength + 1) * sizeof(int16_t));
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i vMax = zero;
+    for (int j = 0; j < dbLength; j++) {
+        const int16_t *qa = aaProfile + dbAA[j] * queryLength;
+        const int16_t *q3 = ssProfile + db3Di[j] * queryLength;
+        for (int i = 0; i < vecEnd; i += lanes) {
+            __m512i S = _mm512_loadu_si512((const void *) (prev + i));
+            S = _mm512_adds_epi16(S, _mm512_loadu_si512((const void *) (qa + i)));
+            S = _mm512_adds_epi16(S, _mm512_loadu_si512((const void *) (q3 + i)));
+            S = _mm512_max_epi16(S, zero);
+            _mm512_storeu_si512((void *) (curr + i + 1), S);
+            vMax = _mm512_max_epi16(vMax, S);
+        }
+        if (tail) {
+            // masked-off lanes load as zero and are never stored
+            __m512i S = _mm512_maskz_loadu_epi16(tailMask, prev + vecEnd);
+            S = _mm512_adds_epi16(S, _mm512_maskz_loadu_epi16(tailMask, qa + vecEnd));
+            S = _mm512_adds_epi16(S, _mm512_maskz_loadu_epi16(tailMask, q3 + vecEnd));
+            S = _mm512_max_epi16(S, zero);
+            _mm512_mask_storeu_epi16(curr + vecEnd + 1, tailMask, S);
+            vMax = _mm512_max_epi16(vMax, S);
+        }
+        std::swap(prev, curr);
+    }
+    int16_t lane[32];
+    _mm512_storeu_si512((void *) lane, vMax);
+    int max = 0;
+    for (int i = 0; i < lanes; i++) {
+        max = std::max(max, (int) lane[i]);
+    }
+    return max;
+}
+#endif
+
+int detect() {
+#ifdef SIMD_DISPATCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        return LEVEL_AVX512BW;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return LEVEL_AVX2;
+    }
+    return LEVEL_SSE2;
+#else
+    return LEVEL_AUTO;
+#endif
+}
+
+int select(int requested) {
+    int supported = detect();
+    int level = (requested == LEVEL_AUTO || requested > supported) ? supported : requested;
+    selectedLevel.store(level);
+    return level;
+}
+
+int current() {
+    int level = selectedLevel.load(std::memory_order_relaxed);
+    if (level < 0) {
+        // lazy fallback for callers that never selected; every racing thread detects the same level
+        int expected = -1;
+        selectedLevel.compare_exchange_strong(expected, detect());
+        level = selectedLevel.load();
+    }
+    return level;
+}
+
+const char *name(int level) {
+    switch (level) {
+        case LEVEL_SSE2: return "SSE2";
+        case LEVEL_AVX2: return "AVX2";
+        case LEVEL_AVX512BW: return "AVX-512BW";
+        default:   return "native";
+    }
+}
+
+UngappedKernel ungapped() {
+    switch (current()) {
+#ifdef SIMD_DISPATCH_X86
+        case LEVEL_AVX512BW: return ungappedAVX512BW;
+        case LEVEL_AVX2: return ungappedAVX2;
+        case LEVEL_SSE2: return ungappedSSE2;
+#endif
+        default:   return NULL;
+    }
+}
+
+}
@@ -0,0 +1,72 @@
+#ifndef SIMD_DISPATCH_H
+#define SIMD_DISPATCH_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Runtime selection of instruction set specific kernels.
+// The rest of the binary is compiled against the single width chosen by simd.h,
+// kernels listed here are compiled for each level and picked from cpuid at startup.
+namespace SimdDispatch {
+    const int LEVEL_AUTO = 0;
+    const int LEVEL_SSE2 = 1;
+    const int LEVEL_AVX2 = 2;
+    const int LEVEL_AVX512BW = 3;
+
+    /**
+     * @brief Ungapped local alignment score of a query profile against one target.
+     * Profiles are linear int16 rows of length queryLength, one row per alphabet letter.
+     * rows must hold 2 * (queryLength + 1) scratch values.
+     */
+    typedef int (*UngappedKernel)(const int16_t *aaProfile, const int16_t *ssProfile, int queryLength,
+                                  const unsigned char *dbAA, const unsigned char *db3Di, int dbLength,
+                                  int16_t *rows);
+
+    /**
+     * @brief Linear int16 query profile and scratch rows for the ungapped kernels.
+     * Owned by the caller next to its StructureSmithWaterman and filled by
+     * StructureSmithWaterman::createUngappedProfile after each ssw_init.
+     */
+    class UngappedProfile {
+    public:
+        UngappedProfile(size_t maxSequenceLength, int alphabetSize);
+        ~UngappedProfile();
+
+        int16_t *aa;
+        int16_t *ss;
+        int16_t *rows;
+        int queryLength;
+
+    private:
+        UngappedProfile(const UngappedProfile &);
+        UngappedProfile &operator=(const UngappedProfile &);
+    };
+
+    /** @brief Highest level supported by the running CPU (LEVEL_AUTO on non-x86 targets) */
+    int detect();
+
+    /**
+     * @brief Select kernels for the requested level (LEVEL_AUTO or above the CPU level falls back to detect()).
+     * Call once at startup, before any parallel region uses the kernels.
+     */
+    int select(int requested);
+
+    /** @brief Currently selected level, selecting LEVEL_AUTO on first use */
+    int current();
+
+    const char *name(int level);
+
+    /** @brief Ungapped kernel of the selected level, NULL if the build width of simd.h should be used */
+    UngappedKernel ungapped();
+
+#if defined(__x86_64__) || defined(__i386__)
+    int ungappedSSE2(const int16_t *aaProfile, const int16_t *ssProfile, int queryLength,
+                     const unsigned char *dbAA, const unsigned char *db3Di, int dbLength, int16_t *rows);
+    int ungappedAVX2(const int16_t *aaProfile, const int16_t *ssProfile, int queryLength,
+                     const unsigned char *dbAA, const unsigned char *db3Di, int dbLength, int16_t *rows);
+    int ungappedAVX512BW(const int16_t *aaProfile, const int16_t *ssProfile, int queryLength,
+                         const unsigned char *dbAA, const unsigned char *db3Di, int dbLength, int16_t *rows);
+#endif
+}
+
+#endif
@@ -33,6 +33,7 @@ SOFTWARE.
 #include "StripedSmithWaterman.h"
 #include "../strucclustutils/EvalueNeuralNet.h"
 #include "block_aligner.h"
+#include "SimdDispatch.h"
 #include <iostream>
 
 StructureSmithWaterman::StructureSmithWaterman(size_t maxSequenceLength, int aaSize,
@@ -1977,7 +1978,38 @@ inline F simd_hmax(const F * in, unsigned int n) {
 //    return prev_sMat_vec[T]; /// 4;
 //}
 
-int StructureSmithWaterman::ungapped_alignment(const unsigned char *db_sequence, const unsigned char *db_3di_sequence, int32_t db_length) {
+// Same scores as the striped word profile (bias 0), laid out row by row so that any vector width can use it
+void StructureSmithWaterman::createUngappedProfile(SimdDispatch::UngappedProfile &ungapped) {
+    const int32_t query_length = profile->query_length;
+    const int32_t aaSize = profile->alphabetSize;
+    ungapped.queryLength = query_length;
+    if (SimdDispatch::ungapped() == NULL) {
+        return;
+    }
+    for (int32_t nt = 0; nt < aaSize; nt++) {
+        int16_t *aa = ungapped.aa + nt * query_length;
+        int16_t *ss = ungapped.ss + nt * query_length;
+        if (profile->isProfile) {
+            for (int32_t j = 0; j < query_length; j++) {
+                aa[j] = profile->alignment_aa_profile[nt * query_length + j];
+                ss[j] = profile->alignment_3di_profile[nt * query_length + j];
+            }
+        } else {
+            for (int32_t j = 0; j < query_length; j++) {
+                aa[j] = profile->mat_aa[nt * aaSize + profile->query_aa_sequence[j]] + profile->composition_bias_aa[j];
+                ss[j] = profile->mat_3di[nt * aaSize + profile->query_3di_sequence[j]] + profile->composition_bias_ss[j];
+            }
+        }
+    }
+}
+
+int StructureSmithWaterman::ungapped_alignment(const unsigned char *db_sequence, const unsigned char *db_3di_sequence, int32_t db_length,
+                                               SimdDispatch::UngappedProfile *ungapped) {
+    SimdDispatch::UngappedKernel kernel = SimdDispatch::ungapped();
+    if (kernel != NULL && ungapped != NULL) {
+        return kernel(ungapped->aa, ungapped->ss, ungapped->queryLength,
+                      db_sequence, db_3di_sequence, db_length, ungapped->rows);
+    }
 #define SWAP(tmp, arg1, arg2) tmp = arg1; arg1 = arg2; arg2 = tmp;
 
     int i; // position in query bands (0,..,W-1)
@@ -48,6 +48,7 @@
 
 #include "Sequence.h"
 #include "Matcher.h"
+#include "SimdDispatch.h"
 #include "EvalueComputation.h"
 #include "../strucclustutils/EvalueNeuralNet.h"
 #include "block_aligner.h"
@@ -140,7 +141,12 @@ public:
             const int covMode, const float covThr,
             const int32_t maskLen);
     
-    int ungapped_alignment(const unsigned char *db_sequence, const unsigned char *db_3di_sequence, int32_t db_length);
+    // ungapped is filled by createUngappedProfile for the current query; NULL uses the striped simd.h kernel
+    int ungapped_alignment(const unsigned char *db_sequence, const unsigned char *db_3di_sequence, int32_t db_length,
+                           SimdDispatch::UngappedProfile *ungapped = NULL);
+
+    // Fill a caller owned linear profile of the current query for the runtime dispatched ungapped kernels
+    void createUngappedProfile(SimdDispatch::UngappedProfile &ungapped);
 
     s_align alignStartPosBacktraceBlock (
             const unsigned char *db_aa_sequence,
@@ -250,10 +256,6 @@ public:
         int8_t* alignment_aa_profile;
         int8_t* alignment_3di_profile;
         bool isProfile;
-        int8_t* mat_rev; // needed for queryProfile
-        int32_t query_length;
-        int32_t alphabetSize;
-        uint8_t bias;
         // Memory layout of if mat + queryProfile is qL * AA
         //    Query length
         // A  -1  -3  -2  -1  -4  -2  -2  -3  -1  -3  -2  -2   7  -1  -2  -1  -1  -2  -5  -3
@@ -266,6 +268,10 @@ public:
         // C  -1  -4   2   5  -3  -2   0  -3   1  -3  -2   0  -1   2   0   0  -1  -3  -4  -2
         // ...
         // Y -1  -3  -2  -1  -4  -2  -2  -3  -1  -3  -2  -2   7  -1  -2  -1  -1  -2  -5  -3
+        int8_t* mat_rev; // needed for queryProfile
+        int32_t query_length;
+        int32_t alphabetSize;
+        uint8_t bias;
         short ** profile_aa_word_linear;
         short ** profile_3di_word_linear;
     };
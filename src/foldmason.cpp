@@ -28,12 +28,20 @@ std::vector<struct Command> foldmasonCommands = {
         {"easy-msa",          easymsa,           &foldmasonPar.easymsaworkflow,   COMMAND_EASY,
                 "Sensitive homology search and build MSAs",
                 "# Align a set of PDB files and create a MSA\n"
-                "foldseek easy-msa example/d1asha_ result.m8 tmp\n",
+                "foldseek easy-msa example/d1asha_ result.m8 tmp\n"
+                "# The structure database written to tmp is removed afterwards, keep it with --remove-tmp-files 0\n",
                 "Cameron Gilchrist <gamcil@snu.ac.kr> & Martin Steinegger <martin.steinegger@snu.ac.kr>",
                 "<i:PDB|mmCIF[.gz]> ... <i:PDB|mmCIF[.gz]>|<i:stdin> <o:alignmentFile> <tmpDir>",
                 CITATION_FOLDMASON, {{"PDB|mmCIF[.gz]|stdin", DbType::ACCESS_MODE_INPUT, DbType::NEED_DATA | DbType::VARIADIC, &DbValidator::flatfileStdinAndGeneric },
                                            {"alignmentFile", DbType::ACCESS_MODE_OUTPUT, DbType::NEED_DATA, &DbValidator::flatfile },
                                            {"tmpDir", DbType::ACCESS_MODE_OUTPUT, DbType::NEED_DATA, &DbValidator::directory }}},
+        {"serve",             serve,             &foldmasonPar.easymsaworkflow,   COMMAND_EASY,
+                "Align structures sent as JSON lines on stdin and answer with JSON lines on stdout",
+                "# Keep matrices and report assets loaded between requests\n"
+                "echo '{\"id\":\"1\",\"files\":[\"example/d1asha_\",\"example/d1cg5a_\"],\"report\":2}' | foldmason serve tmp\n",
+                "Cameron Gilchrist <gamcil@snu.ac.kr> & Martin Steinegger <martin.steinegger@snu.ac.kr>",
+                "<tmpDir>",
+                CITATION_FOLDMASON, {{"tmpDir", DbType::ACCESS_MODE_OUTPUT, DbType::NEED_DATA, &DbValidator::directory }}},
         {"structuremsa",      structuremsa,      &foldmasonPar.structuremsa,      COMMAND_ALIGNMENT,
                 "Compute guide tree based on Foldseek scores",
                 NULL,
@@ -45,10 +53,19 @@ std::vector<struct Command> foldmasonCommands = {
                 "Compute guide tree based on Foldseek scores",
                 NULL,
                 "Cameron Gilchrist <gamcil@snu.ac.kr> & Martin Steinegger <martin.steinegger@snu.ac.kr>",
-                "<i:queryDB> <i:clusterDB> <o:alignmentFile>",
+                "<i:queryDB> <i:clusterDB> [<i:alignmentDB>] <o:alignmentFile>",
                 CITATION_FOLDMASON, {{"queryDB", DbType::ACCESS_MODE_INPUT, DbType::NEED_DATA, &DbValidator::sequenceDb },
                                            {"clustDB", DbType::ACCESS_MODE_INPUT, DbType::NEED_DATA | DbType::VARIADIC, NULL },
                                            {"alignmentFile", DbType::ACCESS_MODE_OUTPUT, DbType::NEED_DATA, &DbValidator::flatfile }}},
+        {"structuremsabatch",      structuremsabatch,      &foldmasonPar.structuremsa,      COMMAND_ALIGNMENT,
+                "Compute one MSA per cluster of a clustering DB",
+                "# Align the members of every cluster of clusterDB, keyed by representative\n"
+                "foldmason structuremsabatch queryDB clusterDB msaDB\n",
+                "Cameron Gilchrist <gamcil@snu.ac.kr> & Martin Steinegger <martin.steinegger@snu.ac.kr>",
+                "<i:queryDB> <i:clusterDB> <o:msaDB>",
+                CITATION_FOLDMASON, {{"queryDB", DbType::ACCESS_MODE_INPUT, DbType::NEED_DATA, &DbValidator::sequenceDb },
+                                    {"clusterDB", DbType::ACCESS_MODE_INPUT, DbType::NEED_DATA, &DbValidator::clusterDb },
+                                    {"msaDB", DbType::ACCESS_MODE_OUTPUT, DbType::NEED_DATA, &DbValidator::msaDb }}},
         {"msa2lddt",      msa2lddt,      &foldmasonPar.msa2lddt,      COMMAND_ALIGNMENT,
                 "Calculate LDDT of a MSA",
                 NULL,
@@ -80,6 +97,24 @@ std::vector<struct Command> foldmasonCommands = {
                 CITATION_FOLDMASON, {{"queryDB", DbType::ACCESS_MODE_INPUT, DbType::NEED_DATA, &DbValidator::sequenceDb },
                                     {"msaFileIn", DbType::ACCESS_MODE_INPUT, DbType::NEED_DATA, &DbValidator::flatfileAndStdin },
                                     {"msaFileOut", DbType::ACCESS_MODE_OUTPUT, DbType::NEED_DATA, &DbValidator::flatfile },}},
+        {"addtomsa",      addtomsa,      &foldmasonPar.structuremsa,      COMMAND_ALIGNMENT,
+                "Add new structures to an existing MSA without realigning it",
+                "# Align structures of queryDB missing from msa_aa.fa to its frozen profile\n"
+                "foldmason addtomsa queryDB msa_aa.fa updated\n",
+                "Cameron Gilchrist <gamcil@snu.ac.kr> & Martin Steinegger <martin.steinegger@snu.ac.kr>",
+                "<i:queryDB> <i:msaFile> <o:alignmentFile>",
+                CITATION_FOLDMASON, {{"queryDB", DbType::ACCESS_MODE_INPUT, DbType::NEED_DATA, &DbValidator::sequenceDb },
+                                    {"msaFile", DbType::ACCESS_MODE_INPUT, DbType::NEED_DATA, &DbValidator::flatfileAndStdin },
+                                    {"alignmentFile", DbType::ACCESS_MODE_OUTPUT, DbType::NEED_DATA, &DbValidator::flatfile },}},
+        {"mergemsa",      mergemsa,      &foldmasonPar.structuremsa,      COMMAND_ALIGNMENT,
+                "Merge MSAs of disjoint sets of structures profile-to-profile",
+                "# Join MSAs built separately for each clade of myDb\n"
+                "foldmason mergemsa myDb clade1_aa.fa clade2_aa.fa clade3_aa.fa merged\n",
+                "Cameron Gilchrist <gamcil@snu.ac.kr> & Martin Steinegger <martin.steinegger@snu.ac.kr>",
+                "<i:queryDB> <i:msaFile1> ... <i:msaFileN> <o:alignmentFile>",
+                CITATION_FOLDMASON, {{"queryDB", DbType::ACCESS_MODE_INPUT, DbType::NEED_DATA, &DbValidator::sequenceDb },
+                                    {"msaFile", DbType::ACCESS_MODE_INPUT, DbType::NEED_DATA | DbType::VARIADIC, &DbValidator::flatfile },
+                                    {"alignmentFile", DbType::ACCESS_MODE_OUTPUT, DbType::NEED_DATA, &DbValidator::flatfile },}},
         {"convertalis",          structureconvertalis,    &foldmasonPar.convertalignments,    COMMAND_FORMAT_CONVERSION,
                 "Convert alignment DB to BLAST-tab, SAM or custom format",
                 "# Create output in BLAST M8 format (12 columns):\n"
@@ -0,0 +1,336 @@
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <algorithm>
+#include <vector>
+#include "DBReader.h"
+#include "Debug.h"
+#include "FileUtil.h"
+#include "IndexReader.h"
+#include "Matcher.h"
+#include "Sequence.h"
+#include "structuremsa.h"
+#include "msa2lddt.h"
+#include "MSAFile.h"
+#include "FoldmasonParameters.h"
+#include "refinemsa.h"
+#include "Util.h"
+
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
+/**
+ * @brief Where an added structure sits relative to the columns of the frozen MSA
+ *
+ * Residues aligned to an existing column are kept in columns_aa/columns_ss (gap if none).
+ * Residues falling between existing columns are kept in order in inserted_aa/inserted_ss,
+ * with insertSlot giving the existing column they precede (alnLength for the C-terminal end).
+ */
+struct FrozenPlacement {
+    std::string columns_aa;
+    std::string columns_ss;
+    std::string inserted_aa;
+    std::string inserted_ss;
+    std::vector<size_t> insertSlot;
+};
+
+/**
+ * @brief Place one structure against the frozen profile from its profile-sequence alignment
+ *
+ * The existing MSA is stood in for by a single all-match row spanning its columns, so
+ * updateCIGARs yields the columns the structure adds without touching the real rows.
+ */
+void placeAgainstProfile(
+    Matcher::result_t &res,
+    std::vector<size_t> &map1,
+    int alnLength,
+    const char *seqAa,
+    const char *seqSs,
+    size_t length,
+    FrozenPlacement &placement
+) {
+    std::vector<size_t> map2(length);
+    std::iota(map2.begin(), map2.end(), 0);
+    std::vector<Instruction> qBt;
+    std::vector<Instruction> tBt;
+    getMergeInstructions(res, map1, map2, qBt, tBt);
+
+    std::vector<std::vector<Instruction> > cigars_aa(2);
+    std::vector<std::vector<Instruction> > cigars_ss(2);
+    cigars_aa[0].assign(alnLength, Instruction('X'));
+    cigars_ss[0].assign(alnLength, Instruction('X'));
+    cigars_aa[1].reserve(length);
+    cigars_ss[1].reserve(length);
+    for (size_t i = 0; i < length; i++) {
+        cigars_aa[1].emplace_back(seqAa[i]);
+        cigars_ss[1].emplace_back(seqSs[i]);
+    }
+    std::vector<size_t> qMembers = { 0 };
+    std::vector<size_t> tMembers = { 1 };
+    updateCIGARs(res, map1, map2, cigars_aa, cigars_ss, qMembers, tMembers, qBt, tBt);
+
+    std::string ruler = expand(cigars_aa[0]);
+    std::string rowAa = expand(cigars_aa[1]);
+    std::string rowSs = expand(cigars_ss[1]);
+    placement.columns_aa.reserve(alnLength);
+    placement.columns_ss.reserve(alnLength);
+    size_t column = 0;
+    for (size_t i = 0; i < ruler.length(); i++) {
+        if (ruler[i] != '-') {
+            placement.columns_aa.push_back(rowAa[i]);
+            placement.columns_ss.push_back(rowSs[i]);
+            column++;
+        } else if (rowAa[i] != '-') {
+            placement.inserted_aa.push_back(rowAa[i]);
+            placement.inserted_ss.push_back(rowSs[i]);
+            placement.insertSlot.push_back(column);
+        }
+    }
+}
+
+/**
+ * @brief Add structures from queryDB that are missing from an existing MSA
+ *
+ * Profiles of the existing MSA are computed once and kept frozen; every new structure is
+ * aligned to them independently and in parallel, so the cost is linear in the number of
+ * added structures. Existing rows keep their alignment. Residues that new structures place
+ * between existing columns are collected into shared insertion columns in a final pass,
+ * left-justified and not aligned to each other.
+ */
+int addtomsa(int argc, const char **argv, const Command& command) {
+    FoldmasonParameters &par = FoldmasonParameters::getFoldmasonInstance();
+    const bool touch = (par.preloadMode != Parameters::PRELOAD_MODE_MMAP);
+    par.parseParameters(argc, argv, command, true, 0, MMseqsParameter::COMMAND_ALIGN);
+
+    DBReader<unsigned int> seqDbrAA(par.db1.c_str(), par.db1Index.c_str(), par.threads, DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA|DBReader<unsigned int>::USE_LOOKUP_REV);
+    seqDbrAA.open(DBReader<unsigned int>::NOSORT);
+    DBReader<unsigned int> seqDbr3Di((par.db1+"_ss").c_str(), (par.db1+"_ss.index").c_str(), par.threads, DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA);
+    seqDbr3Di.open(DBReader<unsigned int>::NOSORT);
+
+    IndexReader qdbrH(par.db1, par.threads, IndexReader::HEADERS, touch ? IndexReader::PRELOAD_INDEX : 0);
+
+    // Read in FASTA alignment
+    std::vector<std::vector<Instruction> > cigars_aa;
+    std::vector<std::vector<Instruction> > cigars_ss;
+    std::vector<size_t> indices;
+    std::vector<std::string> headers;
+    int alnLength = 0;
+
+    readMSA(par.db2, &seqDbrAA, &seqDbr3Di, headers, indices, cigars_aa, cigars_ss, alnLength, par.threads);
+    std::cout << "Parsed MSA\n";
+
+    if (cigars_aa.empty()) {
+        Debug(Debug::ERROR) << "No sequences found in " << par.db2 << "\n";
+        EXIT(EXIT_FAILURE);
+    }
+    alnLength = cigarLength(cigars_aa[0], true);
+    size_t existingCnt = cigars_aa.size();
+
+    // Structures of the database not yet in the MSA
+    std::vector<bool> inMSA(seqDbrAA.getSize(), false);
+    for (size_t key : indices) {
+        size_t id = seqDbrAA.getId(key);
+        if (id != UINT_MAX) {
+            inMSA[id] = true;
+        }
+    }
+    std::vector<size_t> newIds;
+    for (size_t i = 0; i < seqDbrAA.getSize(); i++) {
+        if (!inMSA[i]) {
+            newIds.push_back(i);
+        }
+    }
+    Debug(Debug::INFO) << "Adding " << newIds.size() << " structures to MSA of " << existingCnt << " sequences\n";
+
+    AlignmentMatrices matrices(par);
+    SubstitutionMatrix &subMat_3di = matrices.subMat_3di;
+    SubstitutionMatrix &subMat_aa = matrices.subMat_aa;
+    int8_t *tinySubMatAA = matrices.tinySubMatAA;
+    int8_t *tinySubMat3Di = matrices.tinySubMat3Di;
+
+    int maxSeqLength = std::max(static_cast<int>(par.maxSeqLen), alnLength);
+    std::vector<FrozenPlacement> placements(newIds.size());
+    if (!newIds.empty()) {
+        // Profiles of the existing MSA, built once
+        std::vector<size_t> group(existingCnt);
+        std::iota(group.begin(), group.end(), 0);
+        std::string mask = computeProfileMask(group, cigars_aa, subMat_aa, par.matchRatio);
+        std::vector<size_t> map1;
+        maskToMapping(mask, map1);
+        std::string profile_aa;
+        std::string profile_ss;
+        {
+            MsaFilter filter_aa(maxSeqLength + 1, existingCnt + 1, &subMat_aa, par.gapOpen.values.aminoacid(), par.gapExtend.values.aminoacid());
+            MsaFilter filter_3di(maxSeqLength + 1, existingCnt + 1, &subMat_3di, par.gapOpen.values.aminoacid(), par.gapExtend.values.aminoacid());
+            PSSMCalculator calculator_aa(&subMat_aa, maxSeqLength + 1, existingCnt + 1, par.pcmode, par.pcaAa, par.pcbAa
+#ifdef GAP_POS_SCORING
+            , par.gapOpen.values.aminoacid(), par.gapPseudoCount
+#endif
+            );
+            PSSMCalculator calculator_3di(&subMat_3di, maxSeqLength + 1, existingCnt + 1, par.pcmode, par.pca3di, par.pcb3di
+#ifdef GAP_POS_SCORING
+            , par.gapOpen.values.aminoacid(), par.gapPseudoCount
+#endif
+            );
+            profile_aa = msa2profile(
+                group, cigars_aa, mask, calculator_aa, filter_aa, subMat_aa,
+                par.filterMsa, par.compBiasCorrection, par.qid, par.filterMaxSeqId,
+                par.Ndiff, par.covMSAThr, par.qsc, par.filterMinEnable, par.wg
+            );
+            profile_ss = msa2profile(
+                group, cigars_ss, mask, calculator_3di, filter_3di, subMat_3di,
+                par.filterMsa, par.compBiasCorrection, par.qid, par.filterMaxSeqId,
+                par.Ndiff, par.covMSAThr, par.qsc, par.filterMinEnable, par.wg
+            );
+        }
+        std::cout << "Built profile of " << map1.size() << " match columns\n";
+
+        EncodedSequences encoded(seqDbrAA, seqDbr3Di, subMat_aa, subMat_3di);
+
+#pragma omp parallel num_threads(std::min(par.threads, static_cast<int>(newIds.size())))
+{
+        unsigned int thread_idx = 0;
+#ifdef OPENMP
+        thread_idx = static_cast<unsigned int>(omp_get_thread_num());
+#endif
+        StructureSmithWaterman structureSmithWaterman(maxSeqLength, subMat_3di.alphabetSize, par.compBiasCorrection, par.compBiasCorrectionScale, &subMat_aa, &subMat_3di);
+        Sequence profileAa(maxSeqLength, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_aa,  0, false, par.compBiasCorrection);
+        Sequence profileSs(maxSeqLength, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_3di, 0, false, par.compBiasCorrection);
+        Sequence targetAa(maxSeqLength, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) &subMat_aa,  0, false, par.compBiasCorrection);
+        Sequence targetSs(maxSeqLength, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) &subMat_3di, 0, false, par.compBiasCorrection);
+        profileAa.mapSequence(0, 0, profile_aa.c_str(), profile_aa.length() / Sequence::PROFILE_READIN_SIZE);
+        profileSs.mapSequence(0, 0, profile_ss.c_str(), profile_ss.length() / Sequence::PROFILE_READIN_SIZE);
+        structureSmithWaterman.ssw_init(&profileAa, &profileSs, tinySubMatAA, tinySubMat3Di, &subMat_aa);
+
+#pragma omp for schedule(dynamic, 1)
+        for (size_t i = 0; i < newIds.size(); i++) {
+            size_t id = newIds[i];
+            unsigned int key = seqDbrAA.getDbKey(id);
+            size_t id3Di = seqDbr3Di.getId(key);
+            targetAa.mapSequence(id, key, encoded.aaData(id));
+            targetSs.mapSequence(id, key, encoded.ssData(id));
+            Matcher::result_t res = pairwiseAlignment(
+                structureSmithWaterman,
+                profileAa.L,
+                &profileAa, &profileSs,
+                &targetAa, &targetSs,
+                par.gapOpen.values.aminoacid(), par.gapExtend.values.aminoacid(),
+                &subMat_aa, &subMat_3di,
+                par.compBiasCorrection
+            );
+            placeAgainstProfile(
+                res, map1, alnLength,
+                seqDbrAA.getData(id, thread_idx), seqDbr3Di.getData(id3Di, thread_idx), seqDbrAA.getSeqLen(id),
+                placements[i]
+            );
+        }
+}
+    }
+
+    // Every insertion slot is as wide as the longest insertion any new structure makes there
+    std::vector<size_t> slotWidth(alnLength + 1, 0);
+    for (FrozenPlacement &placement : placements) {
+        size_t start = 0;
+        while (start < placement.insertSlot.size()) {
+            size_t end = start;
+            while (end < placement.insertSlot.size() && placement.insertSlot[end] == placement.insertSlot[start]) {
+                end++;
+            }
+            slotWidth[placement.insertSlot[start]] = std::max(slotWidth[placement.insertSlot[start]], end - start);
+            start = end;
+        }
+    }
+    size_t insertedCols = std::accumulate(slotWidth.begin(), slotWidth.end(), (size_t) 0);
+    if (!newIds.empty()) {
+        std::cout << "Added " << insertedCols << " insertion columns\n";
+    }
+
+    // Widen the existing rows, then lay out the new rows in the same columns
+    if (insertedCols > 0) {
+#pragma omp parallel for schedule(static) num_threads(par.threads)
+        for (size_t i = 0; i < existingCnt; i++) {
+            std::string oldAa = expand(cigars_aa[i]);
+            std::string oldSs = expand(cigars_ss[i]);
+            std::string rowAa;
+            std::string rowSs;
+            rowAa.reserve(alnLength + insertedCols);
+            rowSs.reserve(alnLength + insertedCols);
+            for (int c = 0; c <= alnLength; c++) {
+                rowAa.append(slotWidth[c], '-');
+                rowSs.append(slotWidth[c], '-');
+                if (c < alnLength) {
+                    rowAa.push_back(oldAa[c]);
+                    rowSs.push_back(oldSs[c]);
+                }
+            }
+            cigars_aa[i] = contract(rowAa);
+            cigars_ss[i] = contract(rowSs);
+        }
+    }
+    cigars_aa.resize(existingCnt + newIds.size());
+    cigars_ss.resize(existingCnt + newIds.size());
+#pragma omp parallel for schedule(static) num_threads(par.threads)
+    for (size_t i = 0; i < newIds.size(); i++) {
+        FrozenPlacement &placement = placements[i];
+        std::string rowAa;
+        std::string rowSs;
+        rowAa.reserve(alnLength + insertedCols);
+        rowSs.reserve(alnLength + insertedCols);
+        size_t next = 0;
+        for (int c = 0; c <= alnLength; c++) {
+            size_t inserted = 0;
+            while (next < placement.insertSlot.size() && placement.insertSlot[next] == (size_t) c) {
+                rowAa.push_back(placement.inserted_aa[next]);
+                rowSs.push_back(placement.inserted_ss[next]);
+                next++;
+                inserted++;
+            }
+            rowAa.append(slotWidth[c] - inserted, '-');
+            rowSs.append(slotWidth[c] - inserted, '-');
+            if (c < alnLength) {
+                rowAa.push_back(placement.columns_aa[c]);
+                rowSs.push_back(placement.columns_ss[c]);
+            }
+        }
+        cigars_aa[existingCnt + i] = contract(rowAa);
+        cigars_ss[existingCnt + i] = contract(rowSs);
+    }
+    for (size_t id : newIds) {
+        unsigned int key = seqDbrAA.getDbKey(id);
+        size_t headerId = qdbrH.sequenceReader->getId(key);
+        headers.push_back(Util::parseFastaHeader(qdbrH.sequenceReader->getData(headerId, 0)));
+        indices.push_back(key);
+    }
+
+    // Refinement is scored by LDDT, so C-alpha coordinates are only read when it runs
+    if (par.refineIters > 0 && !newIds.empty()) {
+        if (FileUtil::fileExists((par.db1 + "_ca.dbtype").c_str()) == false) {
+            Debug(Debug::WARNING) << "Did not find " << FileUtil::baseName(par.db1) << " C-alpha database, skipping refinement\n";
+        } else {
+            DBReader<unsigned int> seqDbrCA((par.db1+"_ca").c_str(), (par.db1+"_ca.index").c_str(), par.threads, DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA);
+            seqDbrCA.open(DBReader<unsigned int>::NOSORT);
+            std::vector<std::vector<size_t> > treeGroups;
+            refineMany(
+                tinySubMatAA, tinySubMat3Di, &seqDbrCA, cigars_aa, cigars_ss,
+                subMat_aa, subMat_3di, par, maxSeqLength, indices, treeGroups
+            );
+            seqDbrCA.close();
+        }
+    }
+
+    // Write final MSA to file
+    std::vector<size_t> rows(cigars_aa.size());
+    std::iota(rows.begin(), rows.end(), 0);
+    writeMSAFasta(par.filenames[par.filenames.size()-1] + "_aa.fa", headers, cigars_aa, rows, par.threads, par.compressed);
+    writeMSAFasta(par.filenames[par.filenames.size()-1] + "_3di.fa", headers, cigars_ss, rows, par.threads, par.compressed);
+    if (par.writeFmsa) {
+        MSAFile::write(par.filenames[par.filenames.size()-1] + ".fmsa", headers, indices, cigars_aa, rows);
+    }
+
+    // Cleanup
+    seqDbrAA.close();
+    seqDbr3Di.close();
+
+    return EXIT_SUCCESS;
+}
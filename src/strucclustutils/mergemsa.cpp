@@ -0,0 +1,344 @@
+#include <iostream>
+#include <numeric>
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+#include "DBReader.h"
+#include "Debug.h"
+#include "FileUtil.h"
+#include "Matcher.h"
+#include "Sequence.h"
+#include "structuremsa.h"
+#include "msa2lddt.h"
+#include "MSAFile.h"
+#include "FoldmasonParameters.h"
+#include "refinemsa.h"
+
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
+// Profile of one row group, an empty mask marks it as not built yet
+struct GroupProfile {
+    std::string mask;
+    std::string profile_aa;
+    std::string profile_ss;
+};
+
+/**
+ * @brief Per thread objects for building and aligning profiles of MSA row groups
+ */
+struct MergeWorker {
+    MergeWorker(
+        FoldmasonParameters &par,
+        SubstitutionMatrix &subMat_aa,
+        SubstitutionMatrix &subMat_3di,
+        int maxSeqLength,
+        int sequenceCnt
+    ) : structureSmithWaterman(maxSeqLength, subMat_3di.alphabetSize, par.compBiasCorrection, par.compBiasCorrectionScale, &subMat_aa, &subMat_3di),
+        filter_aa(maxSeqLength + 1, sequenceCnt + 1, &subMat_aa, par.gapOpen.values.aminoacid(), par.gapExtend.values.aminoacid()),
+        filter_3di(maxSeqLength + 1, sequenceCnt + 1, &subMat_3di, par.gapOpen.values.aminoacid(), par.gapExtend.values.aminoacid()),
+        calculator_aa(&subMat_aa, maxSeqLength + 1, sequenceCnt + 1, par.pcmode, par.pcaAa, par.pcbAa
+#ifdef GAP_POS_SCORING
+            , par.gapOpen.values.aminoacid(), par.gapPseudoCount
+#endif
+        ),
+        calculator_3di(&subMat_3di, maxSeqLength + 1, sequenceCnt + 1, par.pcmode, par.pca3di, par.pcb3di
+#ifdef GAP_POS_SCORING
+            , par.gapOpen.values.aminoacid(), par.gapPseudoCount
+#endif
+        ),
+        query_aa(maxSeqLength, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_aa,  0, false, par.compBiasCorrection),
+        query_ss(maxSeqLength, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_3di, 0, false, par.compBiasCorrection),
+        target_aa(maxSeqLength, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_aa,  0, false, par.compBiasCorrection),
+        target_ss(maxSeqLength, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_3di, 0, false, par.compBiasCorrection)
+    {}
+
+    StructureSmithWaterman structureSmithWaterman;
+    MsaFilter filter_aa;
+    MsaFilter filter_3di;
+    PSSMCalculator calculator_aa;
+    PSSMCalculator calculator_3di;
+    Sequence query_aa;
+    Sequence query_ss;
+    Sequence target_aa;
+    Sequence target_ss;
+};
+
+void buildGroupProfile(
+    MergeWorker &worker,
+    std::vector<size_t> &group,
+    std::vector<std::vector<Instruction> > &cigars_aa,
+    std::vector<std::vector<Instruction> > &cigars_ss,
+    SubstitutionMatrix &subMat_aa,
+    SubstitutionMatrix &subMat_3di,
+    FoldmasonParameters &par,
+    GroupProfile &profile
+) {
+    profile.mask = computeProfileMask(group, cigars_aa, subMat_aa, par.matchRatio);
+    profile.profile_aa = msa2profile(
+        group, cigars_aa, profile.mask, worker.calculator_aa, worker.filter_aa, subMat_aa,
+        par.filterMsa, par.compBiasCorrection, par.qid, par.filterMaxSeqId,
+        par.Ndiff, par.covMSAThr, par.qsc, par.filterMinEnable, par.wg
+    );
+    profile.profile_ss = msa2profile(
+        group, cigars_ss, profile.mask, worker.calculator_3di, worker.filter_3di, subMat_3di,
+        par.filterMsa, par.compBiasCorrection, par.qid, par.filterMaxSeqId,
+        par.Ndiff, par.covMSAThr, par.qsc, par.filterMinEnable, par.wg
+    );
+}
+
+/**
+ * @brief Align two group profiles, using the most informative one as query
+ *
+ * @param swapped set if profile2 was used as query
+ */
+Matcher::result_t alignGroupProfiles(
+    MergeWorker &worker,
+    GroupProfile &profile1,
+    GroupProfile &profile2,
+    int8_t *tinySubMatAA,
+    int8_t *tinySubMat3Di,
+    SubstitutionMatrix &subMat_aa,
+    SubstitutionMatrix &subMat_3di,
+    FoldmasonParameters &par,
+    bool &swapped
+) {
+    Sequence *seqQueryAa = &worker.query_aa;
+    Sequence *seqQuerySs = &worker.query_ss;
+    Sequence *seqTargetAa = &worker.target_aa;
+    Sequence *seqTargetSs = &worker.target_ss;
+    seqQueryAa->mapSequence(0, 0, profile1.profile_aa.c_str(), profile1.profile_aa.length() / Sequence::PROFILE_READIN_SIZE);
+    seqQuerySs->mapSequence(0, 0, profile1.profile_ss.c_str(), profile1.profile_ss.length() / Sequence::PROFILE_READIN_SIZE);
+    seqTargetAa->mapSequence(1, 1, profile2.profile_aa.c_str(), profile2.profile_aa.length() / Sequence::PROFILE_READIN_SIZE);
+    seqTargetSs->mapSequence(1, 1, profile2.profile_ss.c_str(), profile2.profile_ss.length() / Sequence::PROFILE_READIN_SIZE);
+
+    float q_neff_sum = 0.0;
+    float t_neff_sum = 0.0;
+    for (int i = 0; i < seqQuerySs->L; i++) {
+        q_neff_sum += seqQuerySs->neffM[i];
+    }
+    for (int i = 0; i < seqTargetSs->L; i++) {
+        t_neff_sum += seqTargetSs->neffM[i];
+    }
+    swapped = (q_neff_sum <= t_neff_sum);
+    if (swapped) {
+        std::swap(seqQueryAa, seqTargetAa);
+        std::swap(seqQuerySs, seqTargetSs);
+    }
+    worker.structureSmithWaterman.ssw_init(seqQueryAa, seqQuerySs, tinySubMatAA, tinySubMat3Di, &subMat_aa);
+    return pairwiseAlignment(
+        worker.structureSmithWaterman,
+        seqQueryAa->L,
+        seqQueryAa, seqQuerySs,
+        seqTargetAa, seqTargetSs,
+        par.gapOpen.values.aminoacid(), par.gapExtend.values.aminoacid(),
+        &subMat_aa, &subMat_3di,
+        par.compBiasCorrection
+    );
+}
+
+/**
+ * @brief Merge two or more MSAs over the same structure database
+ *
+ * Every input MSA is treated as one profile. All pairs of input profiles are aligned to
+ * score them, and the MSAs are then merged profile-to-profile along the maximum spanning
+ * tree of those scores. Merges of disjoint MSAs within one round of the tree run in parallel.
+ * Rows of each input MSA stay aligned to each other.
+ */
+int mergemsa(int argc, const char **argv, const Command& command) {
+    FoldmasonParameters &par = FoldmasonParameters::getFoldmasonInstance();
+    par.parseParameters(argc, argv, command, true, 0, MMseqsParameter::COMMAND_ALIGN);
+
+    DBReader<unsigned int> seqDbrAA(par.db1.c_str(), par.db1Index.c_str(), par.threads, DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA|DBReader<unsigned int>::USE_LOOKUP_REV);
+    seqDbrAA.open(DBReader<unsigned int>::NOSORT);
+    DBReader<unsigned int> seqDbr3Di((par.db1+"_ss").c_str(), (par.db1+"_ss.index").c_str(), par.threads, DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA);
+    seqDbr3Di.open(DBReader<unsigned int>::NOSORT);
+
+    // Read in FASTA alignments, remembering the rows of each
+    std::vector<std::vector<Instruction> > cigars_aa;
+    std::vector<std::vector<Instruction> > cigars_ss;
+    std::vector<size_t> indices;
+    std::vector<std::string> headers;
+    std::vector<std::vector<size_t> > groups;
+    int totalLength = 0;
+    for (size_t i = 1; i < par.filenames.size() - 1; i++) {
+        int alnLength = 0;
+        size_t start = cigars_aa.size();
+        readMSA(par.filenames[i], &seqDbrAA, &seqDbr3Di, headers, indices, cigars_aa, cigars_ss, alnLength, par.threads);
+        if (cigars_aa.size() == start) {
+            Debug(Debug::ERROR) << "No sequences found in " << par.filenames[i] << "\n";
+            EXIT(EXIT_FAILURE);
+        }
+        groups.emplace_back(cigars_aa.size() - start);
+        std::iota(groups.back().begin(), groups.back().end(), start);
+        totalLength += cigarLength(cigars_aa[start], true);
+        std::cout << "Parsed " << groups.back().size() << " sequences from " << par.filenames[i] << "\n";
+    }
+    if (groups.size() < 2) {
+        Debug(Debug::ERROR) << "Expected at least two MSAs to merge\n";
+        EXIT(EXIT_FAILURE);
+    }
+    std::unordered_map<size_t, size_t> keyToGroup;
+    for (size_t i = 0; i < groups.size(); i++) {
+        for (size_t row : groups[i]) {
+            std::pair<std::unordered_map<size_t, size_t>::iterator, bool> entry = keyToGroup.emplace(indices[row], i);
+            if (!entry.second) {
+                Debug(Debug::ERROR) << "Sequence " << headers[row] << " is in both " << par.filenames[entry.first->second + 1]
+                                    << " and " << par.filenames[i + 1] << "\n";
+                EXIT(EXIT_FAILURE);
+            }
+        }
+    }
+    size_t sequenceCnt = cigars_aa.size();
+    size_t msaCnt = groups.size();
+
+    AlignmentMatrices matrices(par);
+    SubstitutionMatrix &subMat_3di = matrices.subMat_3di;
+    SubstitutionMatrix &subMat_aa = matrices.subMat_aa;
+    int8_t *tinySubMatAA = matrices.tinySubMatAA;
+    int8_t *tinySubMat3Di = matrices.tinySubMat3Di;
+
+    // Merged MSAs are at most as long as all inputs side by side
+    int maxSeqLength = std::max(static_cast<int>(par.maxSeqLen), totalLength);
+    int maxThreads = std::min(par.threads, static_cast<int>(msaCnt * (msaCnt - 1) / 2));
+    std::vector<MergeWorker*> workers(maxThreads);
+    for (int i = 0; i < maxThreads; i++) {
+        workers[i] = new MergeWorker(par, subMat_aa, subMat_3di, maxSeqLength, sequenceCnt);
+    }
+
+    // Score all pairs of input MSAs by aligning their profiles. The profiles are kept for
+    // the merges and only rebuilt for groups whose rows changed in an earlier round.
+    std::vector<GroupProfile> profiles(msaCnt);
+    std::vector<AlnSimple> hits;
+    hits.reserve(msaCnt * (msaCnt - 1) / 2);
+    for (size_t i = 0; i < msaCnt; i++) {
+        for (size_t j = i + 1; j < msaCnt; j++) {
+            AlnSimple hit;
+            hit.queryId = i;
+            hit.targetId = j;
+            hit.score = 0;
+            hits.push_back(hit);
+        }
+    }
+#pragma omp parallel num_threads(maxThreads)
+{
+    unsigned int thread_idx = 0;
+#ifdef OPENMP
+    thread_idx = static_cast<unsigned int>(omp_get_thread_num());
+#endif
+    MergeWorker &worker = *workers[thread_idx];
+#pragma omp for schedule(dynamic, 1)
+    for (size_t i = 0; i < msaCnt; i++) {
+        buildGroupProfile(worker, groups[i], cigars_aa, cigars_ss, subMat_aa, subMat_3di, par, profiles[i]);
+    }
+#pragma omp for schedule(dynamic, 1)
+    for (size_t i = 0; i < hits.size(); i++) {
+        bool swapped;
+        Matcher::result_t res = alignGroupProfiles(
+            worker, profiles[hits[i].queryId], profiles[hits[i].targetId],
+            tinySubMatAA, tinySubMat3Di, subMat_aa, subMat_3di, par, swapped
+        );
+        hits[i].score = res.score;
+    }
+}
+    sortHitsByScore(hits);
+    hits = mst(hits, msaCnt);
+    std::vector<size_t> merges;
+    hits = reorderLinkage(hits, merges, msaCnt);
+
+    // Merge along the tree; each round only touches disjoint groups
+    std::vector<int> parent(msaCnt);
+    std::iota(parent.begin(), parent.end(), 0);
+    size_t index = 0;
+    for (size_t round = 0; round < merges.size(); round++) {
+        std::vector<std::pair<size_t, size_t> > pairs(merges[round]);
+        for (size_t i = 0; i < merges[round]; i++) {
+            pairs[i].first = findRoot(hits[index + i].queryId, parent);
+            pairs[i].second = findRoot(hits[index + i].targetId, parent);
+            std::cout << "Merging " << par.filenames[hits[index + i].queryId + 1] << " and "
+                      << par.filenames[hits[index + i].targetId + 1] << " (score " << hits[index + i].score << ")\n";
+        }
+#pragma omp parallel num_threads(std::min(maxThreads, static_cast<int>(merges[round])))
+{
+        unsigned int thread_idx = 0;
+#ifdef OPENMP
+        thread_idx = static_cast<unsigned int>(omp_get_thread_num());
+#endif
+        MergeWorker &worker = *workers[thread_idx];
+#pragma omp for schedule(dynamic, 1)
+        for (size_t i = 0; i < pairs.size(); i++) {
+            std::vector<size_t> &group1 = groups[pairs[i].first];
+            std::vector<size_t> &group2 = groups[pairs[i].second];
+            GroupProfile &profile1 = profiles[pairs[i].first];
+            GroupProfile &profile2 = profiles[pairs[i].second];
+            if (profile1.mask.empty()) {
+                buildGroupProfile(worker, group1, cigars_aa, cigars_ss, subMat_aa, subMat_3di, par, profile1);
+            }
+            if (profile2.mask.empty()) {
+                buildGroupProfile(worker, group2, cigars_aa, cigars_ss, subMat_aa, subMat_3di, par, profile2);
+            }
+            bool swapped;
+            Matcher::result_t res = alignGroupProfiles(
+                worker, profile1, profile2, tinySubMatAA, tinySubMat3Di, subMat_aa, subMat_3di, par, swapped
+            );
+            std::vector<size_t> map1;
+            std::vector<size_t> map2;
+            maskToMapping(swapped ? profile2.mask : profile1.mask, map1);
+            maskToMapping(swapped ? profile1.mask : profile2.mask, map2);
+            std::vector<Instruction> qBt;
+            std::vector<Instruction> tBt;
+            getMergeInstructions(res, map1, map2, qBt, tBt);
+            updateCIGARs(
+                res, map1, map2, cigars_aa, cigars_ss,
+                swapped ? group2 : group1, swapped ? group1 : group2, qBt, tBt
+            );
+        }
+}
+        for (size_t i = 0; i < pairs.size(); i++) {
+            std::vector<size_t> &group1 = groups[pairs[i].first];
+            std::vector<size_t> &group2 = groups[pairs[i].second];
+            group2.insert(group2.end(), group1.begin(), group1.end());
+            std::sort(group2.begin(), group2.end());
+            group1.clear();
+            profiles[pairs[i].first] = GroupProfile();
+            profiles[pairs[i].second] = GroupProfile();
+            parent[pairs[i].first] = pairs[i].second;
+        }
+        index += merges[round];
+    }
+    for (int i = 0; i < maxThreads; i++) {
+        delete workers[i];
+    }
+
+    // Refinement is scored by LDDT, so C-alpha coordinates are only read when it runs
+    if (par.refineIters > 0) {
+        if (FileUtil::fileExists((par.db1 + "_ca.dbtype").c_str()) == false) {
+            Debug(Debug::WARNING) << "Did not find " << FileUtil::baseName(par.db1) << " C-alpha database, skipping refinement\n";
+        } else {
+            DBReader<unsigned int> seqDbrCA((par.db1+"_ca").c_str(), (par.db1+"_ca.index").c_str(), par.threads, DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA);
+            seqDbrCA.open(DBReader<unsigned int>::NOSORT);
+            std::vector<std::vector<size_t> > treeGroups;
+            refineMany(
+                tinySubMatAA, tinySubMat3Di, &seqDbrCA, cigars_aa, cigars_ss,
+                subMat_aa, subMat_3di, par, maxSeqLength, indices, treeGroups
+            );
+            seqDbrCA.close();
+        }
+    }
+
+    // Write final MSA to file
+    std::vector<size_t> rows(sequenceCnt);
+    std::iota(rows.begin(), rows.end(), 0);
+    writeMSAFasta(par.filenames[par.filenames.size()-1] + "_aa.fa", headers, cigars_aa, rows, par.threads, par.compressed);
+    writeMSAFasta(par.filenames[par.filenames.size()-1] + "_3di.fa", headers, cigars_ss, rows, par.threads, par.compressed);
+    if (par.writeFmsa) {
+        MSAFile::write(par.filenames[par.filenames.size()-1] + ".fmsa", headers, indices, cigars_aa, rows);
+    }
+
+    // Cleanup
+    seqDbrAA.close();
+    seqDbr3Di.close();
+
+    return EXIT_SUCCESS;
+}
@@ -1,5 +1,6 @@
 #include "DBReader.h"
 #include "DBWriter.h"
+#include "MSAFile.h"
 #include "IndexReader.h"
 #include "FoldmasonParameters.h"
 #include "Matcher.h"
@@ -8,6 +9,15 @@
 #include "Util.h"
 #include <fstream>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <unordered_map>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #define ZSTD_STATIC_LINKING_ONLY
 
@@ -23,6 +33,7 @@
 #include "Coordinate16.h"
 #include "MSA.h"
 #include "structuremsa.h"
+#include "msa2lddt.h"
 
 #ifdef OPENMP
 #include <omp.h>
@@ -39,23 +50,122 @@
     initializer(omp_priv(omp_orig))
 
 
-// Return the CA coordinates of a given db index as a string
-std::string getXYZstring(size_t index, int length, DBReader<unsigned int> *db) {
-    Coordinate16 coords;
-    char *cadata = db->getData(index, 0);
+/**
+ * @brief Append value with a fixed number of decimals, as printf("%.*f") would
+ *
+ * Avoids the per-value stream setup of std::stringstream when writing millions of coordinates.
+ */
+void appendFixed(std::string &out, double value, int decimals) {
+    static const double scale[] = { 1.0, 10.0, 100.0, 1000.0, 10000.0, 100000.0, 1000000.0 };
+    uint64_t rounded = static_cast<uint64_t>(std::fabs(value) * scale[decimals] + 0.5);
+    uint64_t denominator = static_cast<uint64_t>(scale[decimals]);
+    char buffer[32];
+    char *pos = buffer + sizeof(buffer);
+    uint64_t fraction = rounded % denominator;
+    for (int i = 0; i < decimals; i++) {
+        *--pos = static_cast<char>('0' + fraction % 10);
+        fraction /= 10;
+    }
+    if (decimals > 0) {
+        *--pos = '.';
+    }
+    uint64_t integer = rounded / denominator;
+    do {
+        *--pos = static_cast<char>('0' + integer % 10);
+        integer /= 10;
+    } while (integer > 0);
+    if (std::signbit(value)) {
+        *--pos = '-';
+    }
+    out.append(pos, buffer + sizeof(buffer) - pos);
+}
+
+static const char BASE64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+void appendBase64(std::string &out, const unsigned char *data, size_t length) {
+    size_t i = 0;
+    for (; i + 2 < length; i += 3) {
+        uint32_t triple = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        out.push_back(BASE64_ALPHABET[(triple >> 18) & 63]);
+        out.push_back(BASE64_ALPHABET[(triple >> 12) & 63]);
+        out.push_back(BASE64_ALPHABET[(triple >> 6) & 63]);
+        out.push_back(BASE64_ALPHABET[triple & 63]);
+    }
+    if (i < length) {
+        uint32_t triple = data[i] << 16;
+        if (i + 1 < length) {
+            triple |= data[i + 1] << 8;
+        }
+        out.push_back(BASE64_ALPHABET[(triple >> 18) & 63]);
+        out.push_back(BASE64_ALPHABET[(triple >> 12) & 63]);
+        out.push_back((i + 1 < length) ? BASE64_ALPHABET[(triple >> 6) & 63] : '=');
+        out.push_back('=');
+    }
+}
+
+/**
+ * @brief Encode one axis in the Coordinate16 layout, rounded to thousandths of an Angstrom
+ *
+ * @return false if the start does not fit in int32 or a delta does not fit in int16
+ */
+static bool encodeDiff16(const float *data, int length, int16_t *out) {
+    long long last = 0;
+    for (int i = 0; i < length; i++) {
+        if (std::isfinite(data[i]) == false || std::fabs(data[i]) > 2.0e6f) {
+            return false;
+        }
+        long long curr = std::llround(static_cast<double>(data[i]) * 1000.0);
+        if (i == 0) {
+            int32_t start = static_cast<int32_t>(curr);
+            memcpy(out, &start, sizeof(int32_t));
+        } else {
+            long long diff = curr - last;
+            if (diff < INT16_MIN || diff > INT16_MAX) {
+                return false;
+            }
+            out[i + 1] = static_cast<int16_t>(diff);
+        }
+        last = curr;
+    }
+    return true;
+}
+
+/**
+ * @brief Append the CA coordinates of a given db index as a JSON field
+ *
+ * Plain: "ca": "x,y,z,x,y,z,..." with three decimals.
+ * Compact: "ca16": base64 of the Coordinate16 layout (per axis an int32 start followed by int16
+ * deltas, in thousandths of an Angstrom), decoded by the report viewer. Chains whose deltas
+ * overflow int16 fall back to the plain field.
+ */
+void appendXYZ(std::string &out, size_t index, int length, DBReader<unsigned int> *db, Coordinate16 &coords, bool compact, int thread_idx) {
+    char *cadata = db->getData(index, thread_idx);
     size_t caLength = db->getEntryLen(index);
     float *caData = coords.read(cadata, length, caLength);
-    std::string xyz;
-    std::stringstream xyzz;
+    if (compact && length > 0) {
+        std::vector<int16_t> diffs(3 * (length + 1));
+        bool fits = true;
+        for (int axis = 0; axis < 3 && fits; axis++) {
+            fits = encodeDiff16(caData + axis * length, length, diffs.data() + axis * (length + 1));
+        }
+        if (fits) {
+            out.append(",\"ca16\": \"");
+            appendBase64(out, reinterpret_cast<const unsigned char *>(diffs.data()), diffs.size() * sizeof(int16_t));
+            out.append("\"");
+            return;
+        }
+    }
+    out.append(",\"ca\": \"");
     for (int i = 0; i < length; i++) {
-        xyzz << std::fixed << std::setprecision(3)
-            << caData[i] << ','
-            << caData[length + i] << ','
-            << caData[length * 2 + i];
+        appendFixed(out, caData[i], 3);
+        out.push_back(',');
+        appendFixed(out, caData[length + i], 3);
+        out.push_back(',');
+        appendFixed(out, caData[length * 2 + i], 3);
         if (i != length - 1)
-            xyzz << ',';
+            out.push_back(',');
     }
-    return xyzz.str();
+    out.append("\"");
 }
 
 Matcher::result_t makeMockAlignment(
@@ -193,6 +303,46 @@ double calculate_lddt_pair(
     return sum / alnLength;
 }
 
+double normalisedPairLDDT(LDDTCalculator &lddtcalculator, float *targetCaData, unsigned int tLen, Matcher::result_t &result) {
+    // full alignment length, not just aligned region
+    size_t alnLength = result.alnLength + result.qStartPos + result.dbStartPos + (result.qLen - result.qEndPos) + (result.dbLen - result.dbEndPos);
+    LDDTCalculator::LDDTScoreResult lddtres = lddtcalculator.computeLDDTScore(
+        tLen,
+        result.qStartPos,
+        result.dbStartPos,
+        result.backtrace,
+        targetCaData,
+        &targetCaData[tLen],
+        &targetCaData[tLen * 2]
+    );
+    double sum = 0.0;
+    for (int i = 0; i < lddtres.scoreLength; i++) {
+        sum += lddtres.perCaLddtScore[i];
+    }
+    return sum / alnLength;
+}
+
+/**
+ * @brief LDDT of two alignments of the same structure pair, building the query neighbour list once
+ *
+ * Scores are normalised like calculate_lddt_pair. The calculator must fit both structures.
+ */
+void calculate_lddt_pair(
+    LDDTCalculator &lddtcalculator,
+    float *queryCaData,
+    unsigned int qLen,
+    float *targetCaData,
+    unsigned int tLen,
+    Matcher::result_t &result1,
+    Matcher::result_t &result2,
+    double &lddt1,
+    double &lddt2
+) {
+    lddtcalculator.initQuery(qLen, queryCaData, &queryCaData[qLen], &queryCaData[qLen * 2]);
+    lddt1 = normalisedPairLDDT(lddtcalculator, targetCaData, tLen, result1);
+    lddt2 = normalisedPairLDDT(lddtcalculator, targetCaData, tLen, result2);
+}
+
 double calculate_lddt_pair(
     std::vector<Instruction> &q_cigar,
     std::vector<Instruction> &t_cigar,
@@ -240,6 +390,132 @@ double calculate_lddt_pair(
     return lddtres.avgLddtScore;
 }
 
+/**
+ * @brief Score a single MSA row pair, keeping per-residue LDDT in the calculator
+ *
+ * Query coordinates must already be loaded into the calculator via initQuery.
+ * On return, match_to_msa holds the MSA column of each aligned residue pair.
+ *
+ * @return per-residue LDDT of the aligned pairs, empty if the two rows share no aligned columns
+ */
+LDDTCalculator::LDDTScoreResult scorePairLDDT(
+    LDDTCalculator &lddtcalculator,
+    const std::vector<Instruction> &i_cigar,
+    const std::vector<Instruction> &j_cigar,
+    size_t j_length,
+    float *targetCaData,
+    int alnLength,
+    std::vector<int> &match_to_msa
+) {
+    match_to_msa.clear();
+
+    // Generate a CIGAR string from qId-tId sub-alignment, ignoring -- columns
+    // e.g. --X-XX-X---XX-
+    //      Y---YYYY---YYY
+    //          MMDM   MM
+    Matcher::result_t result = makeMockAlignment(i_cigar, j_cigar, match_to_msa, alnLength);
+
+    // If no alignment between the two sequences, skip
+    if (result.backtrace.length() == 0)
+        return LDDTCalculator::LDDTScoreResult();
+
+    // Remove D/I from backtrace after last M
+    result.backtrace.shrink_to_fit();
+    size_t k;
+    for (k = result.backtrace.length() - 1; result.backtrace[k] != 'M'; k--);
+    result.backtrace.erase(k + 1);
+
+    return lddtcalculator.computeLDDTScore(
+        j_length,
+        result.qStartPos,
+        result.dbStartPos,
+        result.backtrace,
+        targetCaData,
+        &targetCaData[j_length],
+        &targetCaData[j_length * 2]
+    );
+}
+
+/**
+ * @brief Score a single MSA row pair and add its per-residue LDDT to the MSA columns
+ *
+ * Query coordinates must already be loaded into the calculator via initQuery.
+ *
+ * @return false if the two rows share no aligned columns
+ */
+bool accumulatePairLDDT(
+    LDDTCalculator &lddtcalculator,
+    const std::vector<Instruction> &i_cigar,
+    const std::vector<Instruction> &j_cigar,
+    size_t j_length,
+    float *targetCaData,
+    int alnLength,
+    std::vector<int> &match_to_msa,
+    float *perColumnScore,
+    int *perColumnCount,
+    double &avgLddtScore
+) {
+    LDDTCalculator::LDDTScoreResult lddtres = scorePairLDDT(lddtcalculator, i_cigar, j_cigar, j_length, targetCaData, alnLength, match_to_msa);
+    if (lddtres.scoreLength == 0)
+        return false;
+
+    if (std::isnan(lddtres.avgLddtScore)) {
+        Debug(Debug::WARNING) << "Found NaN LDDT for a row pair\n";
+    }
+
+    for (int k = 0; k < lddtres.scoreLength; k++) {
+        if (lddtres.perCaLddtScore[k] == 0.0)
+            continue;
+        int idx = match_to_msa[k];
+        perColumnCount[idx] += 1;
+        perColumnScore[idx] += lddtres.perCaLddtScore[k];
+    }
+    avgLddtScore = lddtres.avgLddtScore;
+    return true;
+}
+
+/**
+ * @brief Turn per-column LDDT sums into means and average them over the considered columns
+ *
+ * Columns with fewer residues than pairThreshold * numRows are zeroed and not considered.
+ */
+float averageColumnScores(
+    std::vector<float> &perColumnScore,
+    std::vector<int> &perColumnCount,
+    const std::vector<int> &colCounts,
+    size_t numRows,
+    float pairThreshold,
+    int &numCols
+) {
+    float scaledSum = 0.0;
+    numCols = 0;
+    for (size_t i = 0; i < perColumnCount.size(); i++) {
+        // float pairSupport = perColumnCount[i] / static_cast<float>(numPairs);
+        float residuesInColumn = colCounts[i];
+
+        // TODO maybe change to bool flag to just count/not count single-residue columns in entire MSA score
+        if ((residuesInColumn / numRows) < pairThreshold) {
+            perColumnScore[i] = 0.0;
+            perColumnCount[i] = 0;
+            continue;
+        }
+        if (perColumnCount[i] > 0) {
+            perColumnScore[i] /= perColumnCount[i];  // get mean LDDT for this column
+            // perColumnScore[i] *= pairSupport;  // scale by % of pairs with LDDT >0
+        } else {
+            perColumnScore[i] = 0.0;
+        }
+        // scaledSum += perColumnScore[i];
+        // if (perColumnCount[i] / static_cast<float>(numPairs) >= pairThreshold) {
+        scaledSum += perColumnScore[i];
+        numCols++;
+        // }
+    }
+    // float lddtScore = sum / static_cast<double>(numPairs);
+    // float lddtScore = (scaledSum / perColumnCount.size());  // get mean over all columns
+    return (numCols > 0) ? scaledSum / static_cast<float>(numCols) : 0.0;
+}
+
 std::tuple<std::vector<float>, std::vector<int>, float, int> calculate_lddt(
     std::vector<std::vector<Instruction> > &cigars,
     std::vector<size_t> &subset,
@@ -259,7 +535,6 @@ std::tuple<std::vector<float>, std::vector<int>, float, int> calculate_lddt(
     std::vector<int>   perColumnCount(alnLength, 0);
 
     float sum = 0.0;
-    int numPairs = cigars.size() * (cigars.size() - 1) / 2;
     
     // Sort subset vector by indices so we can initQuery in outer loop
     // AND ensure it is only ever done in one direction
@@ -272,7 +547,6 @@ std::tuple<std::vector<float>, std::vector<int>, float, int> calculate_lddt(
     thread_idx = static_cast<unsigned int>(omp_get_thread_num());
 #endif
     LDDTCalculator *lddtcalculator = new LDDTCalculator(alnLength, alnLength);
-    std::vector<Matcher::result_t> results(numPairs);
     Coordinate16 qcoords;
     Coordinate16 tcoords;
 
@@ -287,8 +561,6 @@ std::tuple<std::vector<float>, std::vector<int>, float, int> calculate_lddt(
         size_t qCaLength = seqDbrCA->getEntryLen(i_id);
         float *queryCaData = qcoords.read(qcadata, i_length, qCaLength);
 
-        Matcher::result_t result;
-
         lddtcalculator->initQuery(
             i_length,
             queryCaData,
@@ -312,80 +584,597 @@ std::tuple<std::vector<float>, std::vector<int>, float, int> calculate_lddt(
 
             // assert(expand(i_cigar).length() == expand(j_cigar).length());
 
-            // Generate a CIGAR string from qId-tId sub-alignment, ignoring -- columns
-            // e.g. --X-XX-X---XX-
-            //      Y---YYYY---YYY
-            //          MMDM   MM
-            result = makeMockAlignment(i_cigar, j_cigar, match_to_msa, alnLength);
+            double avgLddtScore = 0.0;
+            if (accumulatePairLDDT(*lddtcalculator, i_cigar, j_cigar, j_length, targetCaData, alnLength,
+                                   match_to_msa, perColumnScore.data(), perColumnCount.data(), avgLddtScore)) {
+                sum += avgLddtScore;
+            }
+        }
+    }
+    delete lddtcalculator;
+}
 
-            // If no alignment between the two sequences, skip
-            if (result.backtrace.length() == 0)
+    std::vector<int> colCounts = countColumns(cigars, subset, alnLength);
+    int numCols = 0;
+    float lddtScore = averageColumnScores(perColumnScore, perColumnCount, colCounts, subset.size(), pairThreshold, numCols);
+    return std::make_tuple(perColumnScore, perColumnCount, lddtScore, numCols);
+}
+
+/**
+ * @brief Estimate MSA LDDT from a stratified sample of row pairs
+ *
+ * Pairs are drawn in rounds. Each round gives every row one random partner (row strata)
+ * and adds one pair per column that has not reached minimum pair support yet (column strata).
+ * Rounds are then bootstrapped to get 95% confidence intervals for the MSA LDDT and every
+ * column score. Sampling stops once the MSA LDDT interval half-width drops below
+ * targetPrecision, or maxPairs pairs have been scored.
+ *
+ * Falls back to the exact calculation if the MSA has too few pairs to benefit from sampling.
+ */
+struct SampledPair {
+    size_t i;
+    size_t j;
+    int column;  // -1: scored in all columns, otherwise only in this column
+};
+
+LDDTEstimate calculate_lddt_sampled(
+    std::vector<std::vector<Instruction> > &cigars,
+    std::vector<size_t> &subset,
+    std::vector<size_t> &keys,
+    DBReader<unsigned int> * seqDbrCA,
+    float pairThreshold,
+    float targetPrecision,
+    size_t maxPairs,
+    unsigned int seed
+) {
+    const int minRounds = 4;
+    const int minColumnSupport = 20;
+    const int maxHoldersPerColumn = 32;
+    const int bootstrapReplicates = 200;
+
+    LDDTEstimate estimate;
+    size_t numRows = subset.size();
+    int alnLength = cigarLength(cigars[subset[0]], true);
+    size_t totalPairs = numRows * (numRows - 1) / 2;
+
+    if (numRows < 2 || totalPairs <= numRows * minRounds) {
+        std::tie(estimate.perColumnScore, estimate.perColumnCount, estimate.lddtScore, estimate.numCols)
+            = calculate_lddt(cigars, subset, keys, seqDbrCA, pairThreshold);
+        estimate.perColumnLow = estimate.perColumnScore;
+        estimate.perColumnHigh = estimate.perColumnScore;
+        estimate.lddtLow = estimate.lddtScore;
+        estimate.lddtHigh = estimate.lddtScore;
+        estimate.numPairs = totalPairs;
+        estimate.exact = true;
+        return estimate;
+    }
+    
+    std::vector<int> colCounts = countColumns(cigars, subset, alnLength);
+    std::vector<size_t> lengths(numRows);
+    for (size_t i = 0; i < numRows; i++) {
+        lengths[i] = cigarLength(cigars[subset[i]], false);
+    }
+    
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<size_t> rowDist(0, numRows - 1);
+
+    // Per-round column sums, kept for bootstrapping
+    std::vector<std::vector<float> > roundScores;
+    std::vector<std::vector<int> > roundCounts;
+    std::vector<float> totalScore(alnLength, 0.0);
+    std::vector<int> totalCount(alnLength, 0);
+    std::vector<int> support(alnLength, 0);
+    std::vector<SampledPair> pairs;
+    std::vector<std::vector<size_t> > holders(alnLength);
+    std::vector<int> holdersSeen(alnLength);
+    std::vector<float> bootstrapLDDT(bootstrapReplicates);
+    std::vector<float> bootstrapColumns;
+    size_t pairsScored = 0;
+    int nextCheck = minRounds;
+
+    while (true) {
+        pairs.clear();
+
+        // Row strata: one random partner per row
+        for (size_t i = 0; i < numRows; i++) {
+            size_t j = rowDist(rng);
+            while (j == i) {
+                j = rowDist(rng);
+            }
+            pairs.push_back({ i, j, -1 });
+        }
+
+        // Column strata: extra pairs for under-supported columns, drawn from rows with a residue there
+        std::vector<bool> needy(alnLength, false);
+        bool anyNeedy = false;
+        for (int c = 0; c < alnLength; c++) {
+            if (colCounts[c] >= 2 && (colCounts[c] / static_cast<float>(numRows)) >= pairThreshold && support[c] < minColumnSupport) {
+                needy[c] = true;
+                anyNeedy = true;
+            }
+            holders[c].clear();
+            holdersSeen[c] = 0;
+        }
+        if (anyNeedy) {
+            for (size_t i = 0; i < numRows; i++) {
+                int col = 0;
+                for (const Instruction &ins : cigars[subset[i]]) {
+                    if (!ins.isSeq()) {
+                        col += ins.bits.count;
+                        continue;
+                    }
+                    if (needy[col]) {
+                        // reservoir sample of rows with a residue in this column
+                        holdersSeen[col]++;
+                        if (static_cast<int>(holders[col].size()) < maxHoldersPerColumn) {
+                            holders[col].push_back(i);
+                        } else {
+                            std::uniform_int_distribution<int> slot(0, holdersSeen[col] - 1);
+                            int s = slot(rng);
+                            if (s < maxHoldersPerColumn) {
+                                holders[col][s] = i;
+                            }
+                        }
+                    }
+                    col++;
+                }
+            }
+            for (int c = 0; c < alnLength; c++) {
+                if (holders[c].size() < 2) {
+                    continue;
+                }
+                std::uniform_int_distribution<size_t> holderDist(0, holders[c].size() - 1);
+                size_t a = holderDist(rng);
+                size_t b = holderDist(rng);
+                while (b == a) {
+                    b = holderDist(rng);
+                }
+                // only scored in column c, other columns would be biased towards rows sharing c
+                pairs.push_back({ holders[c][a], holders[c][b], c });
+            }
+        }
+
+        // Orient pairs as in the exact calculation (lower key is the query) and group by query
+        for (SampledPair &pair : pairs) {
+            if (keys[subset[pair.j]] < keys[subset[pair.i]]) {
+                std::swap(pair.i, pair.j);
+            }
+        }
+        std::sort(pairs.begin(), pairs.end(), [](const SampledPair &a, const SampledPair &b) {
+            return (a.i != b.i) ? a.i < b.i : a.j < b.j;
+        });
+
+        std::vector<float> perColumnScore(alnLength, 0.0);
+        std::vector<int>   perColumnCount(alnLength, 0);
+
+#pragma omp parallel reduction(vsum:perColumnScore,perColumnCount)
+{
+        unsigned int thread_idx = 0;
+#ifdef OPENMP
+        thread_idx = static_cast<unsigned int>(omp_get_thread_num());
+#endif
+        LDDTCalculator lddtcalculator(alnLength, alnLength);
+        Coordinate16 qcoords;
+        Coordinate16 tcoords;
+        std::vector<int> match_to_msa;
+        match_to_msa.reserve(alnLength);
+        std::vector<float> pairScore(alnLength, 0.0);
+        std::vector<int> pairCount(alnLength, 0);
+        size_t currentQuery = SIZE_MAX;
+
+#pragma omp for schedule(dynamic, 16)
+        for (size_t p = 0; p < pairs.size(); p++) {
+            size_t i = pairs[p].i;
+            size_t j = pairs[p].j;
+            if (i != currentQuery) {
+                size_t i_id = seqDbrCA->getId(keys[subset[i]]);
+                float *queryCaData = qcoords.read(seqDbrCA->getData(i_id, thread_idx), lengths[i], seqDbrCA->getEntryLen(i_id));
+                lddtcalculator.initQuery(lengths[i], queryCaData, &queryCaData[lengths[i]], &queryCaData[lengths[i] * 2]);
+                currentQuery = i;
+            }
+            size_t j_id = seqDbrCA->getId(keys[subset[j]]);
+            float *targetCaData = tcoords.read(seqDbrCA->getData(j_id, thread_idx), lengths[j], seqDbrCA->getEntryLen(j_id));
+            double avgLddtScore = 0.0;
+            if (pairs[p].column == -1) {
+                accumulatePairLDDT(lddtcalculator, cigars[subset[i]], cigars[subset[j]], lengths[j], targetCaData, alnLength,
+                                   match_to_msa, perColumnScore.data(), perColumnCount.data(), avgLddtScore);
                 continue;
+            }
+            int c = pairs[p].column;
+            if (accumulatePairLDDT(lddtcalculator, cigars[subset[i]], cigars[subset[j]], lengths[j], targetCaData, alnLength,
+                                   match_to_msa, pairScore.data(), pairCount.data(), avgLddtScore)) {
+                perColumnScore[c] += pairScore[c];
+                perColumnCount[c] += pairCount[c];
+                for (int idx : match_to_msa) {
+                    pairScore[idx] = 0.0;
+                    pairCount[idx] = 0;
+                }
+            }
+        }
+}
+        for (int c = 0; c < alnLength; c++) {
+            support[c] += perColumnCount[c];
+            totalScore[c] += perColumnScore[c];
+            totalCount[c] += perColumnCount[c];
+        }
+        roundScores.push_back(perColumnScore);
+        roundCounts.push_back(perColumnCount);
+        pairsScored += pairs.size();
 
-            // Remove D/I from backtrace after last M
-            result.backtrace.shrink_to_fit();
-            size_t k;
-            for (k = result.backtrace.length() - 1; result.backtrace[k] != 'M'; k--);
-            result.backtrace.erase(k + 1);
-
-            LDDTCalculator::LDDTScoreResult lddtres = lddtcalculator->computeLDDTScore(
-                j_length,
-                result.qStartPos,
-                result.dbStartPos,
-                result.backtrace,
-                targetCaData,
-                &targetCaData[j_length],
-                &targetCaData[j_length * 2]
-            );
-            
-            if (std::isnan(lddtres.avgLddtScore)) {
-                std::cout << "Found nan\n";
+        // Bootstrapping costs O(replicates * rounds * columns), so the interval is only
+        // checked after the number of rounds grew by half since the last check
+        int rounds = roundScores.size();
+        bool exhausted = pairsScored >= maxPairs || pairsScored >= totalPairs;
+        if (rounds < nextCheck && exhausted == false) {
+            continue;
+        }
+        nextCheck = std::max(rounds + 1, rounds * 3 / 2);
+
+        // Bootstrap over rounds
+        bootstrapColumns.assign(static_cast<size_t>(bootstrapReplicates) * alnLength, 0.0);
+        std::uniform_int_distribution<int> roundDist(0, rounds - 1);
+        for (int b = 0; b < bootstrapReplicates; b++) {
+            std::vector<float> scores(alnLength, 0.0);
+            std::vector<int> counts(alnLength, 0);
+            for (int r = 0; r < rounds; r++) {
+                int pick = roundDist(rng);
+                for (int c = 0; c < alnLength; c++) {
+                    scores[c] += roundScores[pick][c];
+                    counts[c] += roundCounts[pick][c];
+                }
             }
-            
+            // Sparse columns can miss out on a replicate entirely, use the pooled mean instead of 0
+            for (int c = 0; c < alnLength; c++) {
+                if (counts[c] == 0 && totalCount[c] > 0) {
+                    scores[c] = totalScore[c] / totalCount[c];
+                    counts[c] = 1;
+                }
+            }
+            int numCols = 0;
+            bootstrapLDDT[b] = averageColumnScores(scores, counts, colCounts, numRows, pairThreshold, numCols);
+            std::copy(scores.begin(), scores.end(), bootstrapColumns.begin() + static_cast<size_t>(b) * alnLength);
+        }
+        std::sort(bootstrapLDDT.begin(), bootstrapLDDT.end());
+        estimate.lddtLow  = bootstrapLDDT[static_cast<int>(0.025 * (bootstrapReplicates - 1))];
+        estimate.lddtHigh = bootstrapLDDT[static_cast<int>(0.975 * (bootstrapReplicates - 1))];
+        if ((estimate.lddtHigh - estimate.lddtLow) / 2.0 <= targetPrecision || exhausted) {
+            break;
+        }
+    }
+
+    // Point estimates from all sampled pairs
+    estimate.perColumnScore = totalScore;
+    estimate.perColumnCount = totalCount;
+    estimate.lddtScore = averageColumnScores(estimate.perColumnScore, estimate.perColumnCount, colCounts, numRows, pairThreshold, estimate.numCols);
+
+    // Per-column percentile intervals
+    estimate.perColumnLow.resize(alnLength);
+    estimate.perColumnHigh.resize(alnLength);
+    std::vector<float> column(bootstrapReplicates);
+    for (int c = 0; c < alnLength; c++) {
+        for (int b = 0; b < bootstrapReplicates; b++) {
+            column[b] = bootstrapColumns[static_cast<size_t>(b) * alnLength + c];
+        }
+        std::sort(column.begin(), column.end());
+        estimate.perColumnLow[c]  = column[static_cast<int>(0.025 * (bootstrapReplicates - 1))];
+        estimate.perColumnHigh[c] = column[static_cast<int>(0.975 * (bootstrapReplicates - 1))];
+    }
+    estimate.numPairs = pairsScored;
+    estimate.exact = false;
+    return estimate;
+}
+
+LDDTEstimate estimateLDDT(
+    std::vector<std::vector<Instruction> > &cigars,
+    std::vector<size_t> &subset,
+    std::vector<size_t> &keys,
+    DBReader<unsigned int> * seqDbrCA,
+    float pairThreshold,
+    float targetPrecision,
+    size_t maxPairs,
+    unsigned int seed
+) {
+    // Without a row pair there is nothing to score
+    if (subset.size() < 2) {
+        int alnLength = cigars.empty() ? 0 : cigarLength(cigars[0], true);
+        LDDTEstimate estimate;
+        estimate.perColumnScore.assign(alnLength, 0.0);
+        estimate.perColumnLow.assign(alnLength, 0.0);
+        estimate.perColumnHigh.assign(alnLength, 0.0);
+        estimate.perColumnCount.assign(alnLength, 0);
+        estimate.lddtScore = 0.0;
+        estimate.lddtLow = 0.0;
+        estimate.lddtHigh = 0.0;
+        estimate.numCols = 0;
+        estimate.numPairs = 0;
+        estimate.exact = true;
+        return estimate;
+    }
+    if (targetPrecision > 0.0) {
+        return calculate_lddt_sampled(cigars, subset, keys, seqDbrCA, pairThreshold, targetPrecision, maxPairs, seed);
+    }
+    LDDTEstimate estimate;
+    std::tie(estimate.perColumnScore, estimate.perColumnCount, estimate.lddtScore, estimate.numCols)
+        = calculate_lddt(cigars, subset, keys, seqDbrCA, pairThreshold);
+    estimate.perColumnLow = estimate.perColumnScore;
+    estimate.perColumnHigh = estimate.perColumnScore;
+    estimate.lddtLow = estimate.lddtScore;
+    estimate.lddtHigh = estimate.lddtScore;
+    estimate.numPairs = subset.size() * (subset.size() - 1) / 2;
+    estimate.exact = true;
+    return estimate;
+}
+
+LDDTPairCache::LDDTPairCache(std::vector<size_t> &keys, DBReader<unsigned int> *seqDbrCA, float pairThreshold)
+    : keys(keys), seqDbrCA(seqDbrCA), pairThreshold(pairThreshold), numRows(0) {}
+
+size_t LDDTPairCache::pairIndex(size_t a, size_t b) const {
+    if (a > b) {
+        std::swap(a, b);
+    }
+    return a * (2 * numRows - a - 1) / 2 + (b - a - 1);
+}
+
+void LDDTPairCache::scorePairs(
+    std::vector<std::vector<Instruction> > &cigars,
+    std::vector<std::pair<size_t, size_t> > &pairs,
+    std::vector<std::vector<LDDTPairCache::Contribution> > &out
+) {
+    int alnLength = cigarLength(cigars[0], true);
+
+    // Orient each pair like calculate_lddt (lower key is query), then group by query
+    // so coordinates are only loaded once per query
+    for (std::pair<size_t, size_t> &pair : pairs) {
+        if (keys[pair.first] > keys[pair.second]) {
+            std::swap(pair.first, pair.second);
+        }
+    }
+    std::vector<size_t> order(pairs.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return pairs[a].first < pairs[b].first;
+    });
+    std::vector<size_t> runStart;
+    for (size_t i = 0; i < order.size(); i++) {
+        if (i == 0 || pairs[order[i]].first != pairs[order[i - 1]].first) {
+            runStart.push_back(i);
+        }
+    }
+    runStart.push_back(order.size());
+    out.resize(pairs.size());
+
+#pragma omp parallel
+{
+    unsigned int thread_idx = 0;
+#ifdef OPENMP
+    thread_idx = static_cast<unsigned int>(omp_get_thread_num());
+#endif
+    LDDTCalculator *lddtcalculator = new LDDTCalculator(alnLength, alnLength);
+    Coordinate16 qcoords;
+    Coordinate16 tcoords;
+    std::vector<int> match_to_msa;
+    match_to_msa.reserve(alnLength);
+    std::vector<unsigned int> columnToResidue(alnLength);
+
+#pragma omp for schedule(dynamic, 1)
+    for (size_t run = 0; run < runStart.size() - 1; run++) {
+        size_t q_idx = pairs[order[runStart[run]]].first;
+        const std::vector<Instruction> &q_cigar = cigars[q_idx];
+        size_t q_length = cigarLength(q_cigar, false);
+        size_t q_id = seqDbrCA->getId(keys[q_idx]);
+        char *qcadata = seqDbrCA->getData(q_id, thread_idx);
+        float *queryCaData = qcoords.read(qcadata, q_length, seqDbrCA->getEntryLen(q_id));
+        lddtcalculator->initQuery(q_length, queryCaData, &queryCaData[q_length], &queryCaData[q_length * 2]);
+
+        int column = 0;
+        unsigned int residue = 0;
+        for (const Instruction &ins : q_cigar) {
+            if (ins.isSeq()) {
+                columnToResidue[column++] = residue++;
+            } else {
+                column += ins.bits.count;
+            }
+        }
+
+        for (size_t i = runStart[run]; i < runStart[run + 1]; i++) {
+            size_t t_idx = pairs[order[i]].second;
+            const std::vector<Instruction> &t_cigar = cigars[t_idx];
+            size_t t_length = cigarLength(t_cigar, false);
+            size_t t_id = seqDbrCA->getId(keys[t_idx]);
+            char *tcadata = seqDbrCA->getData(t_id, thread_idx);
+            float *targetCaData = tcoords.read(tcadata, t_length, seqDbrCA->getEntryLen(t_id));
+
+            std::vector<Contribution> &contributions = out[order[i]];
+            contributions.clear();
+            LDDTCalculator::LDDTScoreResult lddtres = scorePairLDDT(
+                *lddtcalculator, q_cigar, t_cigar, t_length, targetCaData, alnLength, match_to_msa
+            );
             for (int k = 0; k < lddtres.scoreLength; k++) {
                 if (lddtres.perCaLddtScore[k] == 0.0)
                     continue;
-                int idx = match_to_msa[k];
-                perColumnCount[idx] += 1;
-                perColumnScore[idx] += lddtres.perCaLddtScore[k];
+                Contribution contribution;
+                contribution.residue = columnToResidue[match_to_msa[k]];
+                contribution.score = lddtres.perCaLddtScore[k];
+                contributions.push_back(contribution);
             }
-            sum += lddtres.avgLddtScore;
-            
-            match_to_msa.clear();
+            contributions.shrink_to_fit();
         }
     }
     delete lddtcalculator;
 }
+}
 
-    std::vector<int> colCounts = countColumns(cigars, subset, alnLength);
-    float scaledSum = 0.0;
+static void mapResidues(const std::vector<Instruction> &cigar, std::vector<int> &columns) {
+    columns.clear();
+    int column = 0;
+    for (const Instruction &ins : cigar) {
+        if (ins.isSeq()) {
+            columns.push_back(column++);
+        } else {
+            column += ins.bits.count;
+        }
+    }
+}
+
+bool LDDTPairCache::init(std::vector<std::vector<Instruction> > &cigars, size_t maxBytes) {
+    numRows = cigars.size();
+    size_t numPairs = numRows * (numRows - 1) / 2;
+
+    // Worst case every aligned residue of the shorter row has a nonzero score
+    size_t residues = 0;
+    for (std::vector<Instruction> &cigar : cigars) {
+        residues += cigarLength(cigar, false);
+    }
+    size_t meanLength = (numRows > 0) ? residues / numRows : 0;
+    size_t estimate = numPairs * (meanLength * sizeof(Contribution) + sizeof(std::vector<Contribution>));
+    if (numRows < 2 || estimate > maxBytes) {
+        return false;
+    }
+
+    std::vector<std::pair<size_t, size_t> > pairs;
+    pairs.reserve(numPairs);
+    for (size_t a = 0; a < numRows; a++) {
+        for (size_t b = a + 1; b < numRows; b++) {
+            pairs.emplace_back(a, b);
+        }
+    }
+    scorePairs(cigars, pairs, pairContributions);
+
+    int alnLength = cigarLength(cigars[0], true);
+    residueToColumn.resize(numRows);
+    residueScore.resize(numRows);
+    residuePairs.resize(numRows);
+    for (size_t row = 0; row < numRows; row++) {
+        mapResidues(cigars[row], residueToColumn[row]);
+        residueScore[row].assign(residueToColumn[row].size(), 0.0);
+        residuePairs[row].assign(residueToColumn[row].size(), 0);
+    }
+    for (size_t a = 0; a < numRows; a++) {
+        for (size_t b = a + 1; b < numRows; b++) {
+            size_t query = queryRow(a, b);
+            for (const Contribution &contribution : pairContributions[pairIndex(a, b)]) {
+                residueScore[query][contribution.residue] += contribution.score;
+                residuePairs[query][contribution.residue]++;
+            }
+        }
+    }
+    columnScore.assign(alnLength, 0.0);
+    columnPairs.assign(alnLength, 0);
+    columnResidues.assign(alnLength, 0);
+    for (size_t row = 0; row < numRows; row++) {
+        for (size_t residue = 0; residue < residueToColumn[row].size(); residue++) {
+            int column = residueToColumn[row][residue];
+            columnScore[column] += residueScore[row][residue];
+            columnPairs[column] += residuePairs[row][residue];
+            columnResidues[column]++;
+        }
+    }
+    return true;
+}
+
+float LDDTPairCache::average(const std::vector<double> &score, const std::vector<int> &pairs, const std::vector<int> &residues) {
+    std::vector<float> perColumnScore(score.begin(), score.end());
+    std::vector<int> perColumnCount(pairs);
     int numCols = 0;
-    for (size_t i = 0; i < perColumnCount.size(); i++) {
-        // float pairSupport = perColumnCount[i] / static_cast<float>(numPairs);
-        float residuesInColumn = colCounts[i];
+    return averageColumnScores(perColumnScore, perColumnCount, residues, numRows, pairThreshold, numCols);
+}
 
-        // TODO maybe change to bool flag to just count/not count single-residue columns in entire MSA score
-        if ((residuesInColumn / subset.size()) < pairThreshold) {
-            perColumnScore[i] = 0.0;
-            perColumnCount[i] = 0;
-            continue;
+float LDDTPairCache::score() {
+    return average(columnScore, columnPairs, columnResidues);
+}
+
+float LDDTPairCache::scoreCandidate(std::vector<std::vector<Instruction> > &cigars, const std::vector<size_t> &rows, Candidate &candidate) {
+    std::vector<std::pair<size_t, size_t> > pairs;
+    pairs.reserve(candidate.group1.size() * candidate.group2.size());
+    for (size_t a : candidate.group1) {
+        for (size_t b : candidate.group2) {
+            pairs.emplace_back(a, b);
         }
-        if (perColumnCount[i] > 0) {
-            perColumnScore[i] /= perColumnCount[i];  // get mean LDDT for this column
-            // perColumnScore[i] *= pairSupport;  // scale by % of pairs with LDDT >0
-        } else {
-            perColumnScore[i] = 0.0;
+    }
+    scorePairs(cigars, pairs, candidate.contributions);
+
+    // Start from the current column sums and move the rewritten rows to their new columns
+    int alnLength = cigarLength(cigars[0], true);
+    size_t length = std::max(static_cast<size_t>(alnLength), columnScore.size());
+    candidate.columnScore.assign(columnScore.begin(), columnScore.end());
+    candidate.columnPairs.assign(columnPairs.begin(), columnPairs.end());
+    candidate.columnResidues.assign(columnResidues.begin(), columnResidues.end());
+    candidate.columnScore.resize(length, 0.0);
+    candidate.columnPairs.resize(length, 0);
+    candidate.columnResidues.resize(length, 0);
+    candidate.rows = rows;
+    candidate.residueToColumn.resize(rows.size());
+    std::vector<const std::vector<int> *> columns(numRows);
+    for (size_t row = 0; row < numRows; row++) {
+        columns[row] = &residueToColumn[row];
+    }
+    for (size_t i = 0; i < rows.size(); i++) {
+        size_t row = rows[i];
+        const std::vector<int> &oldColumns = residueToColumn[row];
+        for (size_t residue = 0; residue < oldColumns.size(); residue++) {
+            candidate.columnScore[oldColumns[residue]] -= residueScore[row][residue];
+            candidate.columnPairs[oldColumns[residue]] -= residuePairs[row][residue];
+            candidate.columnResidues[oldColumns[residue]]--;
         }
-        // scaledSum += perColumnScore[i];
-        // if (perColumnCount[i] / static_cast<float>(numPairs) >= pairThreshold) {
-        scaledSum += perColumnScore[i];
-        numCols++;
-        // }
+        std::vector<int> &newColumns = candidate.residueToColumn[i];
+        mapResidues(cigars[row], newColumns);
+        for (size_t residue = 0; residue < newColumns.size(); residue++) {
+            candidate.columnScore[newColumns[residue]] += residueScore[row][residue];
+            candidate.columnPairs[newColumns[residue]] += residuePairs[row][residue];
+            candidate.columnResidues[newColumns[residue]]++;
+        }
+        columns[row] = &newColumns;
     }
-    // float lddtScore = sum / static_cast<double>(numPairs);
-    // float lddtScore = (scaledSum / perColumnCount.size());  // get mean over all columns
-    float lddtScore = (numCols > 0) ? scaledSum / static_cast<float>(numCols) : 0.0;
-    return std::make_tuple(perColumnScore, perColumnCount, lddtScore, numCols);
+
+    // Replace the cross-group contributions, on the query row's columns in the candidate MSA
+    size_t index = 0;
+    for (size_t a : candidate.group1) {
+        for (size_t b : candidate.group2) {
+            const std::vector<int> &queryColumns = *columns[queryRow(a, b)];
+            for (const Contribution &contribution : pairContributions[pairIndex(a, b)]) {
+                candidate.columnScore[queryColumns[contribution.residue]] -= contribution.score;
+                candidate.columnPairs[queryColumns[contribution.residue]]--;
+            }
+            for (const Contribution &contribution : candidate.contributions[index]) {
+                candidate.columnScore[queryColumns[contribution.residue]] += contribution.score;
+                candidate.columnPairs[queryColumns[contribution.residue]]++;
+            }
+            index++;
+        }
+    }
+    candidate.columnScore.resize(alnLength);
+    candidate.columnPairs.resize(alnLength);
+    candidate.columnResidues.resize(alnLength);
+    return average(candidate.columnScore, candidate.columnPairs, candidate.columnResidues);
+}
+
+void LDDTPairCache::accept(Candidate &candidate) {
+    size_t index = 0;
+    for (size_t a : candidate.group1) {
+        for (size_t b : candidate.group2) {
+            size_t query = queryRow(a, b);
+            std::vector<Contribution> &contributions = pairContributions[pairIndex(a, b)];
+            for (const Contribution &contribution : contributions) {
+                residueScore[query][contribution.residue] -= contribution.score;
+                residuePairs[query][contribution.residue]--;
+            }
+            for (const Contribution &contribution : candidate.contributions[index]) {
+                residueScore[query][contribution.residue] += contribution.score;
+                residuePairs[query][contribution.residue]++;
+            }
+            std::swap(contributions, candidate.contributions[index]);
+            index++;
+        }
+    }
+    for (size_t i = 0; i < candidate.rows.size(); i++) {
+        residueToColumn[candidate.rows[i]].swap(candidate.residueToColumn[i]);
+    }
+    columnScore.swap(candidate.columnScore);
+    columnPairs.swap(candidate.columnPairs);
+    columnResidues.swap(candidate.columnResidues);
+    candidate.contributions.clear();
 }
 
 void fillCigars(
@@ -445,6 +1234,219 @@ void parseFasta(
     }
 }
 
+/**
+ * @brief Read a FASTA file into memory, decompressing gzip or zstd input
+ *
+ * Plain files are memory mapped; mapped is set to the mapping size so the caller can unmap it.
+ */
+static const char* loadFastaData(const std::string &fileName, std::string &buffer, size_t &size, size_t &mapped) {
+    mapped = 0;
+    FILE *file = FileUtil::openFileOrDie(fileName.c_str(), "rb", true);
+    unsigned char magic[4] = { 0, 0, 0, 0 };
+    size_t magicLength = fread(magic, 1, sizeof(magic), file);
+    bool isGzip = magicLength >= 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+    bool isZstd = magicLength == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd;
+    if (isZstd) {
+        rewind(file);
+        ZSTD_DStream *stream = ZSTD_createDStream();
+        ZSTD_initDStream(stream);
+        std::vector<char> in(ZSTD_DStreamInSize());
+        std::vector<char> out(ZSTD_DStreamOutSize());
+        size_t read;
+        while ((read = fread(in.data(), 1, in.size(), file)) > 0) {
+            ZSTD_inBuffer input = { in.data(), read, 0 };
+            while (input.pos < input.size) {
+                ZSTD_outBuffer output = { out.data(), out.size(), 0 };
+                size_t ret = ZSTD_decompressStream(stream, &output, &input);
+                if (ZSTD_isError(ret)) {
+                    Debug(Debug::ERROR) << "Could not decompress " << fileName << ": " << ZSTD_getErrorName(ret) << "\n";
+                    EXIT(EXIT_FAILURE);
+                }
+                buffer.append(out.data(), output.pos);
+            }
+        }
+        ZSTD_freeDStream(stream);
+        fclose(file);
+    } else if (isGzip) {
+        fclose(file);
+#ifdef HAVE_ZLIB
+        gzFile gz = gzopen(fileName.c_str(), "r");
+        if (gz == NULL) {
+            Debug(Debug::ERROR) << "Could not open " << fileName << " for reading\n";
+            EXIT(EXIT_FAILURE);
+        }
+        std::vector<char> out(1024 * 1024);
+        int read;
+        while ((read = gzread(gz, out.data(), out.size())) > 0) {
+            buffer.append(out.data(), read);
+        }
+        gzclose(gz);
+        if (read < 0) {
+            Debug(Debug::ERROR) << "Could not decompress " << fileName << "\n";
+            EXIT(EXIT_FAILURE);
+        }
+#else
+        Debug(Debug::ERROR) << "FoldMason was not compiled with zlib support. Can not read compressed input!\n";
+        EXIT(EXIT_FAILURE);
+#endif
+    } else if (magicLength > 0) {
+        const char *data = static_cast<const char *>(FileUtil::mmapFile(file, &mapped));
+        fclose(file);
+        size = mapped;
+        return data;
+    } else {
+        fclose(file);
+    }
+    size = buffer.size();
+    return buffer.data();
+}
+
+/**
+ * @brief Parallel FASTA MSA reader with the same output as parseFasta
+ *
+ * Record starts are found by scanning equal slices of the file in parallel, names are resolved
+ * through a hash of the database lookup and rows are built directly from the gap layout of each
+ * record, taking residues from the databases.
+ */
+void parseFastaFile(
+    const std::string &fileName,
+    DBReader<unsigned int> * seqDbrAA,
+    DBReader<unsigned int> * seqDbr3Di,
+    std::vector<std::string> &headers,
+    std::vector<size_t>      &indices,
+    std::vector<std::vector<Instruction> > &cigars_aa,
+    std::vector<std::vector<Instruction> > &cigars_ss,
+    int &alnLength,
+    int threads
+) {
+    std::string buffer;
+    size_t size = 0;
+    size_t mapped = 0;
+    const char *data = loadFastaData(fileName, buffer, size, mapped);
+
+    std::vector<std::vector<size_t> > sliceStarts(threads);
+#pragma omp parallel for schedule(static, 1) num_threads(threads)
+    for (int t = 0; t < threads; t++) {
+        size_t end = size * (t + 1) / threads;
+        for (size_t pos = size * t / threads; pos < end; pos++) {
+            if (data[pos] == '>' && (pos == 0 || data[pos - 1] == '\n')) {
+                sliceStarts[t].push_back(pos);
+            }
+        }
+    }
+    std::vector<size_t> starts;
+    for (int t = 0; t < threads; t++) {
+        starts.insert(starts.end(), sliceStarts[t].begin(), sliceStarts[t].end());
+    }
+    starts.push_back(size);
+
+    std::unordered_map<std::string, unsigned int> keyByName;
+    DBReader<unsigned int>::LookupEntry *lookup = seqDbrAA->getLookup();
+    keyByName.reserve(seqDbrAA->getLookupSize());
+    for (size_t i = 0; i < seqDbrAA->getLookupSize(); i++) {
+        keyByName.emplace(lookup[i].entryName, lookup[i].id);
+    }
+
+    const size_t rowCount = starts.size() - 1;
+    const size_t offset = cigars_aa.size();
+    headers.resize(offset + rowCount);
+    indices.resize(offset + rowCount);
+    cigars_aa.resize(offset + rowCount);
+    cigars_ss.resize(offset + rowCount);
+    std::vector<int> rowLengths(rowCount, 0);
+    bool invalid = false;
+
+#pragma omp parallel for schedule(dynamic, 64) num_threads(threads)
+    for (size_t i = 0; i < rowCount; i++) {
+        unsigned int thread_idx = 0;
+#ifdef OPENMP
+        thread_idx = static_cast<unsigned int>(omp_get_thread_num());
+#endif
+        const char *pos = data + starts[i] + 1;
+        const char *end = data + starts[i + 1];
+        const char *nameEnd = pos;
+        while (nameEnd < end && isspace(*nameEnd) == false) {
+            nameEnd++;
+        }
+        headers[offset + i].assign(pos, nameEnd - pos);
+        std::unordered_map<std::string, unsigned int>::const_iterator it = keyByName.find(headers[offset + i]);
+        size_t seqIdAA = (it == keyByName.end()) ? UINT_MAX : seqDbrAA->getId(it->second);
+        size_t seqId3Di = (it == keyByName.end()) ? UINT_MAX : seqDbr3Di->getId(it->second);
+        if (seqIdAA == UINT_MAX || seqId3Di == UINT_MAX) {
+#pragma omp critical
+            {
+                Debug(Debug::ERROR) << "Could not find " << headers[offset + i] << " in the structure database\n";
+                invalid = true;
+            }
+            continue;
+        }
+        indices[offset + i] = it->second;
+        const char *aa = seqDbrAA->getData(seqIdAA, thread_idx);
+        const char *ss = seqDbr3Di->getData(seqId3Di, thread_idx);
+        int length = seqDbrAA->getSeqLen(seqIdAA);
+
+        pos = static_cast<const char *>(memchr(nameEnd, '\n', end - nameEnd));
+        pos = (pos == NULL) ? end : pos;
+        std::vector<Instruction> &cigarAa = cigars_aa[offset + i];
+        std::vector<Instruction> &cigarSs = cigars_ss[offset + i];
+        int residue = 0;
+        int columns = 0;
+        for (; pos < end; pos++) {
+            if (isspace(*pos)) {
+                continue;
+            }
+            columns++;
+            if (*pos != '-') {
+                if (residue >= length) {
+#pragma omp critical
+                    {
+                        Debug(Debug::ERROR) << headers[offset + i] << " has more residues than its structure in the database\n";
+                        invalid = true;
+                    }
+                    break;
+                }
+                cigarAa.emplace_back(aa[residue]);
+                cigarSs.emplace_back(ss[residue]);
+                residue++;
+            } else if (cigarAa.empty() || cigarAa.back().isSeq() || cigarAa.back().isFull()) {
+                cigarAa.emplace_back(static_cast<int>(1));
+                cigarSs.emplace_back(static_cast<int>(1));
+            } else {
+                cigarAa.back().bits.count++;
+                cigarSs.back().bits.count++;
+            }
+        }
+        rowLengths[i] = columns;
+    }
+    if (mapped > 0) {
+        FileUtil::munmapData(const_cast<char *>(data), mapped);
+    }
+    if (invalid) {
+        EXIT(EXIT_FAILURE);
+    }
+    if (alnLength == 0 && rowCount > 0) {
+        alnLength = rowLengths[0];
+    }
+}
+
+void readMSA(
+    const std::string &fileName,
+    DBReader<unsigned int> * seqDbrAA,
+    DBReader<unsigned int> * seqDbr3Di,
+    std::vector<std::string> &headers,
+    std::vector<size_t>      &indices,
+    std::vector<std::vector<Instruction> > &cigars_aa,
+    std::vector<std::vector<Instruction> > &cigars_ss,
+    int &alnLength,
+    int threads
+) {
+    if (MSAFile::isMSAFile(fileName)) {
+        MSAFile::read(fileName, seqDbrAA, seqDbr3Di, headers, indices, cigars_aa, cigars_ss, alnLength, threads);
+        return;
+    }
+    parseFastaFile(fileName, seqDbrAA, seqDbr3Di, headers, indices, cigars_aa, cigars_ss, alnLength, threads);
+}
+
 float getLDDTScore(
     DBReader<unsigned int> &seqDbrAA,
     DBReader<unsigned int> &seqDbr3Di,
@@ -470,43 +1472,37 @@ float getLDDTScore(
     return lddtScore;
 }
 
-int msa2lddt(int argc, const char **argv, const Command& command, int makeReport) {
-    FoldmasonParameters &par = FoldmasonParameters::getFoldmasonInstance();
-
-    const bool touch = (par.preloadMode != Parameters::PRELOAD_MODE_MMAP);
-    par.parseParameters(argc, argv, command, true, 0, MMseqsParameter::COMMAND_ALIGN);
-    DBReader<unsigned int> seqDbrAA(par.db1.c_str(), par.db1Index.c_str(), par.threads, DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA|DBReader<unsigned int>::USE_LOOKUP_REV);
-    seqDbrAA.open(DBReader<unsigned int>::NOSORT);
-    DBReader<unsigned int> seqDbr3Di((par.db1+"_ss").c_str(), (par.db1+"_ss.index").c_str(), par.threads, DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA);
-    seqDbr3Di.open(DBReader<unsigned int>::NOSORT);
+static std::string decompressVendorJS() {
+    std::string vendorJS(ZSTD_findDecompressedSize(vendor_foldmason_js_zst, vendor_foldmason_js_zst_len), '\0');
+    size_t realSize = ZSTD_decompress(&vendorJS[0], vendorJS.size(), vendor_foldmason_js_zst, vendor_foldmason_js_zst_len);
+    vendorJS.resize(realSize);
+    return vendorJS;
+}
 
-    // Check for CA database
-    DBReader<unsigned int> *seqDbrCA = NULL;
-    bool caExist = FileUtil::fileExists((par.db1 + "_ca.dbtype").c_str());
-    if (caExist == false) {
-        Debug(Debug::INFO) << "Did not find " << FileUtil::baseName(par.db1) << " C-alpha database, not calculating LDDT\n";
-    } else {
-        seqDbrCA = new DBReader<unsigned int>(
-            (par.db1 + "_ca").c_str(),
-            (par.db1 + "_ca.index").c_str(),
-            par.threads,
-            DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA
-        );
-        seqDbrCA->open(DBReader<unsigned int>::NOSORT);
-    }
+const std::string &reportVendorJS() {
+    static const std::string vendorJS = decompressVendorJS();
+    return vendorJS;
+}
 
-    IndexReader headerDB(par.db1, par.threads, IndexReader::HEADERS, touch ? IndexReader::PRELOAD_INDEX : 0);
-    
-    // Read in MSA, mapping headers to database indices
-    KSeqWrapper* kseq = KSeqFactory(par.db2.c_str());
-    int alnLength = 0;
-    std::vector<std::string> headers;
-    std::vector<size_t> indices;
-    std::vector<std::vector<Instruction> > cigars_aa;
-    std::vector<std::vector<Instruction> > cigars_ss;
-    parseFasta(kseq, &seqDbrAA, &seqDbr3Di, headers, indices, cigars_aa, cigars_ss, alnLength);
-    delete kseq;
-    
+/**
+ * @brief Compute the LDDT of an MSA and write its HTML (makeReport 1) or JSON (makeReport 2) report
+ *
+ * Shared by msa2lddt and the in-process easy-msa path, which passes the alignment it just built.
+ * LDDT and CA coordinates are skipped if seqDbrCA is NULL.
+ */
+void msa2lddtReport(
+    FoldmasonParameters &par,
+    int makeReport,
+    const std::string &reportFile,
+    const std::string &msaFile,
+    const std::string &tree,
+    std::vector<std::string> &headers,
+    std::vector<size_t> &indices,
+    std::vector<std::vector<Instruction> > &cigars_aa,
+    std::vector<std::vector<Instruction> > &cigars_ss,
+    int alnLength,
+    DBReader<unsigned int> *seqDbrCA
+) {
     // Calculate LDDT
     std::vector<float> perColumnScore;
     std::vector<int>   perColumnCount;
@@ -516,22 +1512,39 @@ int msa2lddt(int argc, const char **argv, const Command& command, int makeReport
     std::vector<size_t> subset(headers.size());
     std::iota(subset.begin(), subset.end(), 0);
     
-    if (caExist) {
-        std::tie(perColumnScore, perColumnCount, lddtScore, numCols) = calculate_lddt(cigars_aa, subset, indices, seqDbrCA, par.pairThreshold);
+    LDDTEstimate estimate;
+    if (seqDbrCA != NULL) {
+        estimate = estimateLDDT(cigars_aa, subset, indices, seqDbrCA, par.pairThreshold, par.lddtPrecision, par.lddtMaxPairs, 0);
+        perColumnScore = estimate.perColumnScore;
+        perColumnCount = estimate.perColumnCount;
+        lddtScore = estimate.lddtScore;
+        numCols = estimate.numCols;
         std::string scores;
         for (float score : perColumnScore) {
             if (scores.length() > 0) scores += ",";
             scores += std::to_string(score);
         }
         Debug(Debug::INFO) << "Average MSA LDDT: " << lddtScore << '\n';
+        if (estimate.exact == false) {
+            Debug(Debug::INFO) << "MSA LDDT 95% CI: " << estimate.lddtLow << " - " << estimate.lddtHigh
+                               << " (" << estimate.numPairs << " sampled pairs)\n";
+        }
         Debug(Debug::INFO) << "Columns considered: " << numCols << "/" << alnLength << '\n';
         Debug(Debug::INFO) << "Column scores: " << scores << '\n';
+        if (estimate.exact == false) {
+            std::string intervals;
+            for (int i = 0; i < alnLength; i++) {
+                if (intervals.length() > 0) intervals += ",";
+                intervals += std::to_string(estimate.perColumnLow[i]) + "-" + std::to_string(estimate.perColumnHigh[i]);
+            }
+            Debug(Debug::INFO) << "Column score 95% CIs: " << intervals << '\n';
+        }
     }
     
     // Write clustal format MSA HTML
     if (makeReport) {
         Debug(Debug::INFO) << "Generating report\n";
-        DBWriter resultWriter(par.db3.c_str(), (par.db3 + ".index").c_str(), static_cast<unsigned int>(par.threads), par.compressed, Parameters::DBTYPE_OMIT_FILE);
+        DBWriter resultWriter(reportFile.c_str(), (reportFile + ".index").c_str(), static_cast<unsigned int>(par.threads), par.compressed, Parameters::DBTYPE_OMIT_FILE);
         resultWriter.open();
 
 /* 
@@ -543,9 +1556,7 @@ int msa2lddt(int argc, const char **argv, const Command& command, int makeReport
 */
         
         if (makeReport == 1) {
-            size_t dstSize = ZSTD_findDecompressedSize(vendor_foldmason_js_zst, vendor_foldmason_js_zst_len);
-            char* dst = (char*)malloc(sizeof(char) * dstSize);
-            size_t realSize = ZSTD_decompress(dst, dstSize, vendor_foldmason_js_zst, vendor_foldmason_js_zst_len);
+            const std::string &vendorJS = reportVendorJS();
             
             std::string mainJS(const_cast<char *>(reinterpret_cast<const char *>(main_foldmason_js)), main_foldmason_js_len);
             std::string htmlTemplate(
@@ -567,7 +1578,7 @@ R"html(<!DOCTYPE html>
 
             // vendor.js
             resultWriter.writeData(scriptStart.c_str(), scriptStart.size(), 0, 0, false, false);
-            resultWriter.writeData(dst, realSize, 0, 0, false, false);
+            resultWriter.writeData(vendorJS.c_str(), vendorJS.size(), 0, 0, false, false);
             resultWriter.writeData(scriptEnd.c_str(), scriptEnd.size(), 0, 0, false, false);
             
             // main.js
@@ -578,56 +1589,71 @@ R"html(<!DOCTYPE html>
             // Data <div>
             const char* dataStart = "<div id=\"data\" style=\"display: none;\">\n{\"entries\": [";
             resultWriter.writeData(dataStart, strlen(dataStart), 0, 0, false, false);
-
-            free(dst);
         } else if (makeReport == 2) {
             const char* dataStart = "{\"entries\": [";
             resultWriter.writeData(dataStart, strlen(dataStart), 0, 0, false, false);
         }
         
-        // tree: string (optional, from --guide-tree)
+        // tree: string (optional)
         // entries: [ { name, aa, ss, ca }, ... ]
         // scores: [ float ]
         // statistics: { db, msaFile, msaLDDT }
 
-        for (size_t i = 0; i < cigars_aa.size(); i++) {
-            std::string seq_aa = expand(cigars_aa[i]);
-            std::string seq_ss = expand(cigars_ss[i]);
-            std::string entry;
-            entry.append("{\"name\":\"");
-            entry.append(headers[i]);
-            entry.append("\",\"aa\": \"");
-            entry.append(seq_aa);
-            entry.append("\",\"ss\": \"");
-            entry.append(seq_ss);
-            entry.append("\"");
-            if (caExist) {
-                size_t length = std::count_if(seq_aa.begin(), seq_aa.end(), [](char c) { return (c != '-'); });
-                std::string seq_ca = getXYZstring(indices[i], length, seqDbrCA);
-                entry.append(",\"ca\": \"");
-                entry.append(seq_ca);
+        // Entries are rendered in parallel in chunks of rows and written in row order
+        const bool compactCa = (makeReport == 1 && par.reportCompactCa);
+        const size_t rowsPerChunk = 64;
+        const size_t chunkCnt = (cigars_aa.size() + rowsPerChunk - 1) / rowsPerChunk;
+#pragma omp parallel num_threads(par.threads)
+{
+        unsigned int thread_idx = 0;
+#ifdef OPENMP
+        thread_idx = static_cast<unsigned int>(omp_get_thread_num());
+#endif
+        Coordinate16 coords;
+        std::string entry;
+
+#pragma omp for ordered schedule(dynamic, 1)
+        for (size_t chunk = 0; chunk < chunkCnt; chunk++) {
+            entry.clear();
+            size_t chunkEnd = std::min(cigars_aa.size(), (chunk + 1) * rowsPerChunk);
+            for (size_t i = chunk * rowsPerChunk; i < chunkEnd; i++) {
+                entry.append("{\"name\":\"");
+                entry.append(headers[i]);
+                entry.append("\",\"aa\": \"");
+                appendExpanded(entry, cigars_aa[i]);
+                entry.append("\",\"ss\": \"");
+                appendExpanded(entry, cigars_ss[i]);
                 entry.append("\"");
+                if (seqDbrCA != NULL) {
+                    size_t length = cigarLength(cigars_aa[i], false);
+                    appendXYZ(entry, indices[i], length, seqDbrCA, coords, compactCa, thread_idx);
+                }
+                entry.append("}");
+                if (i != cigars_aa.size() - 1) {
+                    entry.append(",");
+                } else {
+                    entry.append("]");
+                }
             }
-            entry.append("}");
-            if (i != cigars_aa.size() - 1) {
-                entry.append(",");
-            } else {
-                entry.append("]");
-            }
+#pragma omp ordered
             resultWriter.writeData(entry.c_str(), entry.length(), 0, 0, false, false);
         }
+}
 
         // Per-column scores, as [score, score, ...]
         std::string middle = "";
 
-        if (caExist) {
+        if (seqDbrCA != NULL) {
             middle.append(",\"scores\": [");
             for (int i = 0; i < alnLength; i++) {
-                std::string entry = (perColumnCount[i] == 0) ? "-1" : std::to_string(perColumnScore[i]);
+                if (perColumnCount[i] == 0) {
+                    middle.append("-1");
+                } else {
+                    appendFixed(middle, perColumnScore[i], 6);
+                }
                 if (i != alnLength - 1) {
-                    entry.append(",");
+                    middle.append(",");
                 }
-                middle.append(entry);
             }
             middle.append("]");
         }
@@ -635,15 +1661,7 @@ R"html(<!DOCTYPE html>
 
         std::string end = "";
 
-        if (par.guideTree != "") {
-            std::string tree;
-            std::string line;
-            std::ifstream newick(par.guideTree);
-            if (newick.is_open()) {
-                while (std::getline(newick, line))
-                    tree += line;
-                newick.close();
-            }
+        if (tree != "") {
             end.append(",\"tree\": \"");
             end.append(tree);            
             end.append("\"");
@@ -655,16 +1673,23 @@ R"html(<!DOCTYPE html>
             end.append("\"db\":\"");
             end.append(par.db1);
             end.append("\",\"msaFile\":\"");
-            end.append(par.db2);
+            end.append(msaFile);
             end.append("\"");
             hasPrev = true;
         }
-        if (caExist) {
+        if (seqDbrCA != NULL) {
             if (hasPrev) {
                 end.append(",");
             }
             end.append("\"msaLDDT\":");
             end.append(std::to_string(lddtScore));
+            if (estimate.exact == false) {
+                end.append(",\"msaLDDTCI\":[");
+                end.append(std::to_string(estimate.lddtLow));
+                end.append(",");
+                end.append(std::to_string(estimate.lddtHigh));
+                end.append("]");
+            }
             hasPrev = true;
         }
         if (par.reportCommand != "") {
@@ -684,13 +1709,61 @@ R"html(<!DOCTYPE html>
         resultWriter.writeData(end.c_str(), end.length(), 0, 0, false, false);
         resultWriter.writeEnd(0, 0, false, 0);
         resultWriter.close(true);
-        FileUtil::remove((par.db3 + ".index").c_str());
+        FileUtil::remove((reportFile + ".index").c_str());
     }
     
     if (par.reportCommand != "") {
         std::cout << "Report command: " << par.reportCommand << '\n';
     }
+}
+
+int msa2lddt(int argc, const char **argv, const Command& command, int makeReport) {
+    FoldmasonParameters &par = FoldmasonParameters::getFoldmasonInstance();
+
+    const bool touch = (par.preloadMode != Parameters::PRELOAD_MODE_MMAP);
+    par.parseParameters(argc, argv, command, true, 0, MMseqsParameter::COMMAND_ALIGN);
+    DBReader<unsigned int> seqDbrAA(par.db1.c_str(), par.db1Index.c_str(), par.threads, DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA|DBReader<unsigned int>::USE_LOOKUP_REV);
+    seqDbrAA.open(DBReader<unsigned int>::NOSORT);
+    DBReader<unsigned int> seqDbr3Di((par.db1+"_ss").c_str(), (par.db1+"_ss.index").c_str(), par.threads, DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA);
+    seqDbr3Di.open(DBReader<unsigned int>::NOSORT);
+
+    // Check for CA database
+    DBReader<unsigned int> *seqDbrCA = NULL;
+    bool caExist = FileUtil::fileExists((par.db1 + "_ca.dbtype").c_str());
+    if (caExist == false) {
+        Debug(Debug::INFO) << "Did not find " << FileUtil::baseName(par.db1) << " C-alpha database, not calculating LDDT\n";
+    } else {
+        seqDbrCA = new DBReader<unsigned int>(
+            (par.db1 + "_ca").c_str(),
+            (par.db1 + "_ca.index").c_str(),
+            par.threads,
+            DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA
+        );
+        seqDbrCA->open(DBReader<unsigned int>::NOSORT);
+    }
+
+    IndexReader headerDB(par.db1, par.threads, IndexReader::HEADERS, touch ? IndexReader::PRELOAD_INDEX : 0);
     
+    // Read in MSA, mapping headers to database indices
+    int alnLength = 0;
+    std::vector<std::string> headers;
+    std::vector<size_t> indices;
+    std::vector<std::vector<Instruction> > cigars_aa;
+    std::vector<std::vector<Instruction> > cigars_ss;
+    readMSA(par.db2, &seqDbrAA, &seqDbr3Di, headers, indices, cigars_aa, cigars_ss, alnLength, par.threads);
+    
+    std::string tree;
+    if (par.guideTree != "") {
+        std::string line;
+        std::ifstream newick(par.guideTree);
+        if (newick.is_open()) {
+            while (std::getline(newick, line))
+                tree += line;
+            newick.close();
+        }
+    }
+    msa2lddtReport(par, makeReport, par.db3, par.db2, tree, headers, indices, cigars_aa, cigars_ss, alnLength, seqDbrCA);
+
     seqDbrAA.close();
     seqDbr3Di.close();
     if (caExist) {
@@ -4,8 +4,10 @@
 #include <vector>
 #include <iostream>
 #include "DBReader.h"
+#include "FoldmasonParameters.h"
 #include "KSeqWrapper.h"
 #include "MSA.h"
+#include "LDDT.h"
 // #include "structuremsa.h"
 
 void parseFasta(
@@ -19,6 +21,44 @@ void parseFasta(
     int &alnLength
 );
 
+void parseFastaFile(
+    const std::string &fileName,
+    DBReader<unsigned int> * seqDbrAA,
+    DBReader<unsigned int> * seqDbr3Di,
+    std::vector<std::string> &headers,
+    std::vector<size_t>      &indices,
+    std::vector<std::vector<Instruction> > &cigars_aa,
+    std::vector<std::vector<Instruction> > &cigars_ss,
+    int &alnLength,
+    int threads
+);
+
+// Read a FASTA (plain, gzip or zstd) or binary MSA file (see MSAFile) like parseFasta
+void readMSA(
+    const std::string &fileName,
+    DBReader<unsigned int> * seqDbrAA,
+    DBReader<unsigned int> * seqDbr3Di,
+    std::vector<std::string> &headers,
+    std::vector<size_t>      &indices,
+    std::vector<std::vector<Instruction> > &cigars_aa,
+    std::vector<std::vector<Instruction> > &cigars_ss,
+    int &alnLength,
+    int threads
+);
+
+struct LDDTEstimate {
+    std::vector<float> perColumnScore;
+    std::vector<float> perColumnLow;   // 95% CI lower bound per column
+    std::vector<float> perColumnHigh;  // 95% CI upper bound per column
+    std::vector<int>   perColumnCount;
+    float lddtScore;
+    float lddtLow;
+    float lddtHigh;
+    int numCols;
+    size_t numPairs;                   // number of pairs scored
+    bool exact;
+};
+
 std::tuple<std::vector<float>, std::vector<int>, float, int> calculate_lddt(
     std::vector<std::vector<Instruction> > &cigars,
     std::vector<size_t> &subset,
@@ -27,6 +67,98 @@ std::tuple<std::vector<float>, std::vector<int>, float, int> calculate_lddt(
     float pairThreshold
 );
 
+LDDTEstimate calculate_lddt_sampled(
+    std::vector<std::vector<Instruction> > &cigars,
+    std::vector<size_t> &subset,
+    std::vector<size_t> &keys,
+    DBReader<unsigned int> * seqDbrCA,
+    float pairThreshold,
+    float targetPrecision,
+    size_t maxPairs,
+    unsigned int seed
+);
+
+LDDTEstimate estimateLDDT(
+    std::vector<std::vector<Instruction> > &cigars,
+    std::vector<size_t> &subset,
+    std::vector<size_t> &keys,
+    DBReader<unsigned int> * seqDbrCA,
+    float pairThreshold,
+    float targetPrecision,
+    size_t maxPairs,
+    unsigned int seed
+);
+
+/**
+ * @brief Per-pair LDDT contributions of an MSA, for rescoring refinement candidates
+ *
+ * Re-aligning two groups of rows leaves every within-group residue correspondence,
+ * and so its LDDT, unchanged. Each row pair's per-residue scores are cached on the
+ * query row (lower key) so that a candidate only needs its cross-group pairs rescored.
+ * Per-column sums of the current MSA are kept as running state: a candidate subtracts
+ * the old cross-group contributions, adds the new ones and moves only the rows it rewrote.
+ * Rows are identified by their index in the cigar vectors.
+ */
+class LDDTPairCache {
+public:
+    struct Contribution {
+        unsigned int residue;
+        float score;
+    };
+
+    // Re-aligned bipartition, its rescored group1 x group2 pairs and the column sums of its MSA
+    struct Candidate {
+        std::vector<size_t> group1;
+        std::vector<size_t> group2;
+        std::vector<std::vector<Contribution> > contributions;
+        std::vector<size_t> rows;
+        std::vector<std::vector<int> > residueToColumn;
+        std::vector<double> columnScore;
+        std::vector<int> columnPairs;
+        std::vector<int> columnResidues;
+    };
+
+    LDDTPairCache(std::vector<size_t> &keys, DBReader<unsigned int> *seqDbrCA, float pairThreshold);
+
+    // Score all pairs of the current MSA; false if the cache would exceed maxBytes
+    bool init(std::vector<std::vector<Instruction> > &cigars, size_t maxBytes);
+
+    // MSA LDDT of the current MSA
+    float score();
+
+    // Rescore the candidate's cross-group pairs and return its MSA LDDT; the cache is not modified.
+    // cigars is the candidate MSA, in which only the given rows differ from the current one.
+    float scoreCandidate(std::vector<std::vector<Instruction> > &cigars, const std::vector<size_t> &rows, Candidate &candidate);
+
+    // Make an accepted candidate the current MSA
+    void accept(Candidate &candidate);
+
+private:
+    size_t pairIndex(size_t a, size_t b) const;
+    size_t queryRow(size_t a, size_t b) const { return (keys[a] < keys[b]) ? a : b; }
+    void scorePairs(
+        std::vector<std::vector<Instruction> > &cigars,
+        std::vector<std::pair<size_t, size_t> > &pairs,
+        std::vector<std::vector<Contribution> > &out
+    );
+    float average(const std::vector<double> &score, const std::vector<int> &pairs, const std::vector<int> &residues);
+
+    std::vector<size_t> &keys;
+    DBReader<unsigned int> *seqDbrCA;
+    float pairThreshold;
+    size_t numRows;
+    std::vector<std::vector<Contribution> > pairContributions;
+
+    // Current MSA: residue -> column of each row, contributions summed per query row residue,
+    // and per column the summed scores, number of contributions and number of residues
+    std::vector<std::vector<int> > residueToColumn;
+    std::vector<std::vector<double> > residueScore;
+    std::vector<std::vector<int> > residuePairs;
+    std::vector<double> columnScore;
+    std::vector<int> columnPairs;
+    std::vector<int> columnResidues;
+};
+
 double calculate_lddt_pair(
     std::vector<Instruction> &q_cigar,
     std::vector<Instruction> &t_cigar,
@@ -44,6 +176,36 @@ double calculate_lddt_pair(
     int thread_idx
 );
 
+void calculate_lddt_pair(
+    LDDTCalculator &lddtcalculator,
+    float *queryCaData,
+    unsigned int qLen,
+    float *targetCaData,
+    unsigned int tLen,
+    Matcher::result_t &result1,
+    Matcher::result_t &result2,
+    double &lddt1,
+    double &lddt2
+);
+
+// Compute the LDDT of an in-memory MSA and write its HTML (makeReport 1) or JSON (makeReport 2) report
+void msa2lddtReport(
+    FoldmasonParameters &par,
+    int makeReport,
+    const std::string &reportFile,
+    const std::string &msaFile,
+    const std::string &tree,
+    std::vector<std::string> &headers,
+    std::vector<size_t> &indices,
+    std::vector<std::vector<Instruction> > &cigars_aa,
+    std::vector<std::vector<Instruction> > &cigars_ss,
+    int alnLength,
+    DBReader<unsigned int> *seqDbrCA
+);
+
+// Vendor JS of the HTML report, decompressed on first use and kept for the process
+const std::string &reportVendorJS();
+
 float getLDDTScore(
     DBReader<unsigned int> &seqDbrAA,
     DBReader<unsigned int> &seqDbr3Di,
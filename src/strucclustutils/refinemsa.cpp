@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <vector>
 #include <set>
+#include <map>
 #include "DBReader.h"
 #include "Sequence.h"
 #include "kseq.h"
@@ -15,18 +16,30 @@
 #include "FoldmasonParameters.h"
 #include "IndexReader.h"
 #include "DBWriter.h"
+#include "MSAFile.h"
+#include "newick.h"
+#include "refinemsa.h"
 #include "assert.h"
 
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
+// Upper bound on memory for cached pairwise LDDT contributions during refinement
+const size_t MAX_LDDT_CACHE_BYTES = 2ULL * 1024 * 1024 * 1024;
+
 /**
  * @brief Find and delete all-gap columns from a sub-collection of CIGAR vectors
  * 
  * @param indices 
  * @param cigars 
+ * @param undoLog if given, rows are saved here before they are modified
  */
 void deleteGapCols(
     std::vector<size_t> &indices,
     std::vector<std::vector<Instruction> > &cigars_aa,
-    std::vector<std::vector<Instruction> > &cigars_ss
+    std::vector<std::vector<Instruction> > &cigars_ss,
+    CigarUndoLog *undoLog = NULL
 ) {
     int length = cigarLength(cigars_aa[indices[0]], true); 
     
@@ -45,8 +58,15 @@ void deleteGapCols(
         }
     }
    
+    if (std::find(isGap.begin(), isGap.end(), true) == isGap.end()) {
+        return;
+    }
+
     // adjust gap counts for deleted columns
     for (size_t cigIndex : indices) {
+        if (undoLog != NULL) {
+            undoLog->save(cigIndex, cigars_aa, cigars_ss);
+        }
         int seqIndex = 0;
         std::vector<int> toPop;  // instructions to remove if count = 0
         for (size_t i = 0; i < cigars_aa[cigIndex].size(); i++) {
@@ -96,36 +116,16 @@ std::pair<unsigned long long, unsigned long long> vectorBoolToULL(const std::vec
     return std::make_pair(longOne, longTwo);
 }
 
+/**
+ * @brief Draw a random bipartition of the MSA rows
+ */
 template<typename RNG>
-void refineOne(
-    int8_t * tinySubMatAA,
-    int8_t * tinySubMat3Di,
-    std::vector<std::vector<Instruction> > &cigars_aa,
-    std::vector<std::vector<Instruction> > &cigars_ss,
-    PSSMCalculator &calculator_aa,
-    MsaFilter &filter_aa,
-    SubstitutionMatrix &subMat_aa,
-    PSSMCalculator &calculator_3di,
-    MsaFilter &filter_3di,
-    SubstitutionMatrix &subMat_3di,
-    StructureSmithWaterman &structureSmithWaterman,
-    bool filterMsa,
-    bool compBiasCorrection,
-    std::string & qid,
-    float filterMaxSeqId,
-    float Ndiff,
-    float covMSAThr,
-    float qsc,
-    int filterMinEnable,
-    bool wg,
-    int gapExtend,
-    int gapOpen,
-    std::vector<Sequence*> &sequences_aa,
-    std::vector<Sequence*> &sequences_ss,
+void drawBipartition(
+    size_t sequenceCnt,
+    std::vector<size_t> &group1,
+    std::vector<size_t> &group2,
     RNG &rng
 ) {
-    int sequenceCnt = cigars_aa.size();
-
     // Choose random size of group 1 in distribution from 1 to (N-1)
     std::uniform_int_distribution<> dist(1, sequenceCnt - 1);
     size_t groupOneSize = dist(rng); 
@@ -136,8 +136,8 @@ void refineOne(
     std::shuffle(bitmask.begin(), bitmask.end(), rng);
 
     // Build groups of subMSA indices based on this combination
-    std::vector<size_t> group1;
-    std::vector<size_t> group2;
+    group1.clear();
+    group2.clear();
     group1.reserve(groupOneSize);
     group2.reserve(sequenceCnt - groupOneSize);
     for (std::size_t i = 0; i < bitmask.size(); i++) {
@@ -154,11 +154,224 @@ void refineOne(
     // std::shuffle(numbers.begin(), numbers.end(), rng);
     // std::vector<size_t> group1(numbers.begin(), numbers.begin() + groupOneSize);
     // std::vector<size_t> group2(numbers.begin() + groupOneSize, numbers.end());
-    
+}
+
+std::vector<size_t> complementGroup(const std::vector<size_t> &group, size_t sequenceCnt) {
+    std::vector<bool> inGroup(sequenceCnt, false);
+    for (size_t row : group) {
+        inGroup[row] = true;
+    }
+    std::vector<size_t> complement;
+    complement.reserve(sequenceCnt - group.size());
+    for (size_t i = 0; i < sequenceCnt; i++) {
+        if (inGroup[i] == false) {
+            complement.push_back(i);
+        }
+    }
+    return complement;
+}
+
+/**
+ * @brief Alignment objects used by one thread during refinement
+ */
+struct RefineWorker {
+    RefineWorker(
+        FoldmasonParameters &par,
+        SubstitutionMatrix &subMat_aa,
+        SubstitutionMatrix &subMat_3di,
+        int maxSeqLength,
+        int sequenceCnt
+    ) : structureSmithWaterman(par.maxSeqLen, subMat_3di.alphabetSize, par.compBiasCorrection, par.compBiasCorrectionScale, &subMat_aa, &subMat_3di),
+        filter_aa(maxSeqLength + 1, sequenceCnt + 1, &subMat_aa, par.gapOpen.values.aminoacid(), par.gapExtend.values.aminoacid()),
+        filter_3di(maxSeqLength + 1, sequenceCnt + 1, &subMat_3di, par.gapOpen.values.aminoacid(), par.gapExtend.values.aminoacid()),
+        calculator_aa(&subMat_aa, maxSeqLength + 1, sequenceCnt + 1, par.pcmode, par.pcaAa, par.pcbAa
+#ifdef GAP_POS_SCORING
+            , par.gapOpen.values.aminoacid(), par.gapPseudoCount
+#endif
+        ),
+        calculator_3di(&subMat_3di, maxSeqLength + 1, sequenceCnt + 1, par.pcmode, par.pca3di, par.pcb3di
+#ifdef GAP_POS_SCORING
+            , par.gapOpen.values.aminoacid(), par.gapPseudoCount
+#endif
+        ),
+        sequences_aa(2),
+        sequences_ss(2),
+        undoLog(sequenceCnt)
+    {
+        for (size_t i = 0; i < 2; i++) {
+            sequences_aa[i] = new Sequence(par.maxSeqLen, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_aa,  0, false, par.compBiasCorrection);
+            sequences_ss[i] = new Sequence(par.maxSeqLen, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_3di, 0, false, par.compBiasCorrection);
+        }
+    }
+    ~RefineWorker() {
+        for (size_t i = 0; i < sequences_aa.size(); i++) {
+            delete sequences_aa[i];
+            delete sequences_ss[i];
+        }
+    }
+
+    StructureSmithWaterman structureSmithWaterman;
+    MsaFilter filter_aa;
+    MsaFilter filter_3di;
+    PSSMCalculator calculator_aa;
+    PSSMCalculator calculator_3di;
+    std::vector<Sequence*> sequences_aa;
+    std::vector<Sequence*> sequences_ss;
+
+    // Working copy of the MSA that candidates are built in; the first worker edits the MSA itself
+    std::vector<std::vector<Instruction> > cigars_aa;
+    std::vector<std::vector<Instruction> > cigars_ss;
+    CigarUndoLog undoLog;
+};
+
+/**
+ * @brief Profiles of row groups built during refinement, reused while their sub-alignment is unchanged
+ *
+ * A group's profile only depends on its own rows with all-gap columns removed. Accepting a
+ * bipartition inserts columns that are all-gap within either side, so cached groups lying
+ * entirely on one side stay valid and only groups spanning both sides are dropped.
+ */
+class RefineProfileCache {
+public:
+    RefineProfileCache() : hits(0), misses(0) {}
+
+    bool get(const std::vector<size_t> &group, std::string &profile_aa, std::string &profile_ss) {
+        bool found = false;
+#pragma omp critical(refineProfileCache)
+        {
+            std::map<std::vector<size_t>, std::pair<std::string, std::string> >::iterator it = profiles.find(group);
+            if (it != profiles.end()) {
+                profile_aa = it->second.first;
+                profile_ss = it->second.second;
+                found = true;
+                hits++;
+            } else {
+                misses++;
+            }
+        }
+        return found;
+    }
+
+    void put(const std::vector<size_t> &group, const std::string &profile_aa, const std::string &profile_ss) {
+#pragma omp critical(refineProfileCache)
+        {
+            profiles[group] = std::make_pair(profile_aa, profile_ss);
+        }
+    }
+
+    void invalidate(const std::vector<size_t> &group1, size_t sequenceCnt) {
+        std::vector<bool> side(sequenceCnt, false);
+        for (size_t row : group1) {
+            side[row] = true;
+        }
+        std::map<std::vector<size_t>, std::pair<std::string, std::string> >::iterator it = profiles.begin();
+        while (it != profiles.end()) {
+            bool first = side[it->first[0]];
+            bool spans = false;
+            for (size_t row : it->first) {
+                if (side[row] != first) {
+                    spans = true;
+                    break;
+                }
+            }
+            it = spans ? profiles.erase(it) : std::next(it);
+        }
+    }
+
+    size_t hits;
+    size_t misses;
+
+private:
+    std::map<std::vector<size_t>, std::pair<std::string, std::string> > profiles;
+};
+
+std::vector<std::vector<size_t> > subtreeGroups(std::vector<AlnSimple> &hits, size_t sequenceCnt) {
+    std::vector<std::vector<size_t> > members(sequenceCnt);
+    std::vector<size_t> rowToCluster(sequenceCnt);
+    std::vector<bool> inTree(sequenceCnt, false);
+    for (size_t i = 0; i < sequenceCnt; i++) {
+        members[i].push_back(i);
+        rowToCluster[i] = i;
+    }
+
+    // Every merge creates the subtree of its two clusters; leaves are subtrees too
+    std::vector<std::vector<size_t> > subtrees;
+    for (AlnSimple &hit : hits) {
+        size_t a = rowToCluster[hit.queryId];
+        size_t b = rowToCluster[hit.targetId];
+        if (a == b) {
+            continue;
+        }
+        inTree[hit.queryId] = true;
+        inTree[hit.targetId] = true;
+        for (size_t row : members[b]) {
+            rowToCluster[row] = a;
+        }
+        members[a].insert(members[a].end(), members[b].begin(), members[b].end());
+        std::sort(members[a].begin(), members[a].end());
+        members[b].clear();
+        subtrees.push_back(members[a]);
+    }
+    std::reverse(subtrees.begin(), subtrees.end());
+    for (size_t i = 0; i < sequenceCnt; i++) {
+        if (inTree[i]) {
+            subtrees.push_back(std::vector<size_t>(1, i));
+        }
+    }
+
+    // Skip the root and bipartitions already seen from the other side (root's two children)
+    std::vector<std::vector<size_t> > groups;
+    std::set<std::vector<size_t> > seen;
+    for (std::vector<size_t> &subtree : subtrees) {
+        if (subtree.size() == sequenceCnt) {
+            continue;
+        }
+        std::vector<size_t> complement = complementGroup(subtree, sequenceCnt);
+        const std::vector<size_t> &canonical = (subtree[0] == 0) ? complement : subtree;
+        if (seen.insert(canonical).second) {
+            groups.push_back(subtree);
+        }
+    }
+    return groups;
+}
+
+/**
+ * @brief Re-align two groups of MSA rows against each other, updating the CIGARs in place
+ */
+void refineOne(
+    int8_t * tinySubMatAA,
+    int8_t * tinySubMat3Di,
+    std::vector<std::vector<Instruction> > &cigars_aa,
+    std::vector<std::vector<Instruction> > &cigars_ss,
+    PSSMCalculator &calculator_aa,
+    MsaFilter &filter_aa,
+    SubstitutionMatrix &subMat_aa,
+    PSSMCalculator &calculator_3di,
+    MsaFilter &filter_3di,
+    SubstitutionMatrix &subMat_3di,
+    StructureSmithWaterman &structureSmithWaterman,
+    bool filterMsa,
+    bool compBiasCorrection,
+    std::string & qid,
+    float filterMaxSeqId,
+    float Ndiff,
+    float covMSAThr,
+    float qsc,
+    int filterMinEnable,
+    bool wg,
+    int gapExtend,
+    int gapOpen,
+    std::vector<Sequence*> &sequences_aa,
+    std::vector<Sequence*> &sequences_ss,
+    std::vector<size_t> group1,
+    std::vector<size_t> group2,
+    CigarUndoLog &undoLog,
+    RefineProfileCache *profileCache
+) {
     // delete all-gap columns, if any, from cigars
     // TODO probably not necessary, all-gap columns are ignored in profile anyway
-    deleteGapCols(group1, cigars_aa, cigars_ss);
-    deleteGapCols(group2, cigars_aa, cigars_ss);
+    deleteGapCols(group1, cigars_aa, cigars_ss, &undoLog);
+    deleteGapCols(group2, cigars_aa, cigars_ss, &undoLog);
     
     // generate masks for each sub MSA
     std::string mask1 = computeProfileMask(group1, cigars_aa, subMat_aa, 1.0);
@@ -168,27 +381,34 @@ void refineOne(
     maskToMapping(mask1, map1);
     maskToMapping(mask2, map2);
 
-    // msa2profile
-    std::string profile1_aa = msa2profile(
-        group1, cigars_aa, mask1, calculator_aa, filter_aa,
-        subMat_aa, filterMsa, compBiasCorrection, qid, filterMaxSeqId,
-        Ndiff, covMSAThr, qsc, filterMinEnable, wg
-    );
-    std::string profile1_ss = msa2profile(
-        group1, cigars_ss, mask1, calculator_3di, filter_3di,
-        subMat_3di, filterMsa, compBiasCorrection, qid, filterMaxSeqId,
-        Ndiff, covMSAThr, qsc, filterMinEnable, wg
-    );
-    std::string profile2_aa = msa2profile(
-        group2, cigars_aa, mask2, calculator_aa, filter_aa,
-        subMat_aa, filterMsa, compBiasCorrection, qid, filterMaxSeqId,
-        Ndiff, covMSAThr, qsc, filterMinEnable, wg
-    );
-    std::string profile2_ss = msa2profile(
-        group2, cigars_ss, mask2, calculator_3di, filter_3di,
-        subMat_3di, filterMsa, compBiasCorrection, qid, filterMaxSeqId,
-        Ndiff, covMSAThr, qsc, filterMinEnable, wg
-    );
+    // msa2profile, reusing cached profiles of unchanged groups
+    auto groupProfiles = [&](std::vector<size_t> &group, std::string &mask, std::string &profile_aa, std::string &profile_ss) {
+        if (profileCache != NULL) {
+            size_t profileLength = std::count(mask.begin(), mask.end(), '0') * Sequence::PROFILE_READIN_SIZE;
+            if (profileCache->get(group, profile_aa, profile_ss) && profile_aa.length() == profileLength) {
+                return;
+            }
+        }
+        profile_aa = msa2profile(
+            group, cigars_aa, mask, calculator_aa, filter_aa,
+            subMat_aa, filterMsa, compBiasCorrection, qid, filterMaxSeqId,
+            Ndiff, covMSAThr, qsc, filterMinEnable, wg
+        );
+        profile_ss = msa2profile(
+            group, cigars_ss, mask, calculator_3di, filter_3di,
+            subMat_3di, filterMsa, compBiasCorrection, qid, filterMaxSeqId,
+            Ndiff, covMSAThr, qsc, filterMinEnable, wg
+        );
+        if (profileCache != NULL) {
+            profileCache->put(group, profile_aa, profile_ss);
+        }
+    };
+    std::string profile1_aa;
+    std::string profile1_ss;
+    std::string profile2_aa;
+    std::string profile2_ss;
+    groupProfiles(group1, mask1, profile1_aa, profile1_ss);
+    groupProfiles(group2, mask2, profile2_aa, profile2_ss);
     assert(profile1_aa.length() == profile1_ss.length());
     assert(profile2_aa.length() == profile2_ss.length());
 
@@ -205,9 +425,10 @@ void refineOne(
     for (int i = 0; i < sequences_aa[qId]->L; i++)
         q_neff_sum += sequences_aa[qId]->neffM[i];
     for (int i = 0; i < sequences_aa[tId]->L; i++)
-        q_neff_sum += sequences_aa[tId]->neffM[i];
+        t_neff_sum += sequences_aa[tId]->neffM[i];
     if (q_neff_sum <= t_neff_sum) {
         std::swap(mask1, mask2);
+        std::swap(map1, map2);
         std::swap(group1, group2);
         std::swap(qId, tId);
     }
@@ -228,39 +449,36 @@ void refineOne(
     std::vector<Instruction> qBt;
     std::vector<Instruction> tBt;
     getMergeInstructions(result, map1, map2, qBt, tBt);
-    updateCIGARs(result, map1, map2, cigars_aa, cigars_ss, group1, group2, qBt, tBt);
+    updateCIGARs(result, map1, map2, cigars_aa, cigars_ss, group1, group2, qBt, tBt, &undoLog);
 }
 
+/**
+ * @brief Iteratively refine an MSA by re-aligning bipartitions
+ *
+ * Each step takes par.refineCandidates bipartitions, re-aligns them in parallel and keeps
+ * the best candidate if it improves the MSA LDDT. With --refine-mode 0 bipartitions are
+ * drawn serially from the seeded RNG, so results depend only on the seed and not on the
+ * thread count. With --refine-mode 1 they cycle through the guide tree edges given as
+ * subtree row groups in treeGroups, and group profiles are cached between iterations.
+ */
 void refineMany(
     int8_t * tinySubMatAA,
     int8_t * tinySubMat3Di,
     DBReader<unsigned int> *seqDbrCA,
     std::vector<std::vector<Instruction> > &cigars_aa,
     std::vector<std::vector<Instruction> > &cigars_ss,
-    PSSMCalculator &calculator_aa,
-    MsaFilter &filter_aa,
     SubstitutionMatrix &subMat_aa,
-    PSSMCalculator &calculator_3di,
-    MsaFilter &filter_3di,
     SubstitutionMatrix &subMat_3di,
-    StructureSmithWaterman & structureSmithWaterman,
-    int iterations,
-    bool compBiasCorrection,
-    bool wg,
-    float filterMaxSeqId,
-    float qsc,
-    int Ndiff,
-    float covMSAThr,
-    int filterMinEnable,
-    int filterMsa,
-    int gapExtend,
-    int gapOpen,
-    int maxSeqLen,
-    std::string qid,
-    float pairThreshold,
+    FoldmasonParameters &par,
+    int maxSeqLength,
     std::vector<size_t> indices,
-    int seed
+    std::vector<std::vector<size_t> > &treeGroups
 ) {
+    int iterations = par.refineIters;
+    int seed = par.refinementSeed;
+    size_t numCandidates = std::max(1, par.refineCandidates);
+    int gapOpen = par.gapOpen.values.aminoacid();
+    int gapExtend = par.gapExtend.values.aminoacid();
     std::cout << "Running " << iterations << " refinement iterations\n";
 
     std::vector<size_t> subset(cigars_aa.size());
@@ -268,19 +486,15 @@ void refineMany(
         subset[i] = i;
     }
 
-    float prevLDDT = std::get<2>(calculate_lddt(cigars_aa, subset, indices, seqDbrCA, pairThreshold));
-    float initLDDT = prevLDDT;
-    std::cout << "Initial LDDT: " << prevLDDT << '\n';
-
-    std::vector<std::vector<Instruction> > cigars_new_aa;
-    std::vector<std::vector<Instruction> > cigars_new_ss;
-
-    std::vector<Sequence*> sequences_aa(2);
-    std::vector<Sequence*> sequences_ss(2);
-    sequences_aa[0] = new Sequence(maxSeqLen, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_aa,  0, false, compBiasCorrection);
-    sequences_ss[0] = new Sequence(maxSeqLen, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_3di, 0, false, compBiasCorrection);
-    sequences_aa[1] = new Sequence(maxSeqLen, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_aa,  0, false, compBiasCorrection);
-    sequences_ss[1] = new Sequence(maxSeqLen, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_3di, 0, false, compBiasCorrection);
+    int numWorkers = std::max(1, std::min(par.threads, static_cast<int>(numCandidates)));
+    std::vector<RefineWorker*> workers(numWorkers);
+    for (int i = 0; i < numWorkers; i++) {
+        workers[i] = new RefineWorker(par, subMat_aa, subMat_3di, maxSeqLength, cigars_aa.size());
+        if (i > 0) {
+            copyInstructionVectors(cigars_aa, workers[i]->cigars_aa);
+            copyInstructionVectors(cigars_ss, workers[i]->cigars_ss);
+        }
+    }
 
     if (seed == -1) {
         std::random_device rd;
@@ -288,33 +502,146 @@ void refineMany(
     }
     std::mt19937 rng(seed);
     std::cout << "Using seed: " << std::to_string(seed) << '\n';
+    if (numCandidates > 1) {
+        std::cout << "Evaluating " << numCandidates << " candidates per iteration\n";
+    }
+    RefineProfileCache *profileCache = NULL;
+    if (par.refineMode == FoldmasonParameters::REFINE_MODE_GUIDE_TREE) {
+        if (treeGroups.empty()) {
+            Debug(Debug::WARNING) << "No guide tree available, refining random bipartitions\n";
+        } else {
+            std::cout << "Cycling through " << treeGroups.size() << " guide tree bipartitions\n";
+            profileCache = new RefineProfileCache();
+        }
+    }
+
+    // Sampled LDDT reuses the same seed every iteration, so candidates are compared on the same pairs
+    if (par.lddtPrecision > 0.0) {
+        std::cout << "Using sampled LDDT objective (precision " << par.lddtPrecision << ")\n";
+    }
 
+    // Exact LDDT is scored incrementally: a candidate only changes pairs across its two groups
+    LDDTPairCache *pairCache = NULL;
+    if (par.lddtPrecision == 0.0) {
+        pairCache = new LDDTPairCache(indices, seqDbrCA, par.pairThreshold);
+        if (pairCache->init(cigars_aa, MAX_LDDT_CACHE_BYTES) == false) {
+            std::cout << "Too many pairs to cache LDDT contributions, rescoring all pairs per iteration\n";
+            delete pairCache;
+            pairCache = NULL;
+        }
+    }
+    float prevLDDT = (pairCache != NULL)
+        ? pairCache->score()
+        : estimateLDDT(cigars_aa, subset, indices, seqDbrCA, par.pairThreshold, par.lddtPrecision, par.lddtMaxPairs, seed).lddtScore;
+    float initLDDT = prevLDDT;
+    std::cout << "Initial LDDT: " << prevLDDT << '\n';
+
+    // Candidate rows are swapped out of the working copies, which are then rolled back,
+    // so a candidate costs only the rows it rewrote and accepting one moves no data
+    std::vector<std::vector<std::vector<Instruction> > > candidates_aa(numCandidates, std::vector<std::vector<Instruction> >(cigars_aa.size()));
+    std::vector<std::vector<std::vector<Instruction> > > candidates_ss(numCandidates, std::vector<std::vector<Instruction> >(cigars_aa.size()));
+    std::vector<std::vector<size_t> > candidateRows(numCandidates);
+    std::vector<LDDTPairCache::Candidate> candidates(numCandidates);
+    std::vector<float> candidateScores(numCandidates);
+
+    // Tree edges are deterministic, so a full cycle without improvement has converged
+    size_t sinceImprovement = 0;
     int i = 0;
     while (i < iterations) {
-        copyInstructionVectors(cigars_aa, cigars_new_aa);
-        copyInstructionVectors(cigars_ss, cigars_new_ss);
-        refineOne(
-            tinySubMatAA, tinySubMat3Di,
-            cigars_new_aa, cigars_new_ss,
-            calculator_aa, filter_aa, subMat_aa,
-            calculator_3di, filter_3di, subMat_3di,
-            structureSmithWaterman, filterMsa, compBiasCorrection,
-            qid, filterMaxSeqId, Ndiff, covMSAThr, qsc, filterMinEnable,
-            wg, gapExtend, gapOpen,
-            sequences_aa, sequences_ss,
-            rng
-        );
-        float lddtScore = std::get<2>(calculate_lddt(cigars_new_aa, subset, indices, seqDbrCA, pairThreshold));
+        if (profileCache != NULL && sinceImprovement >= treeGroups.size()) {
+            std::cout << "No guide tree bipartition improved the MSA, stopping after " << i << " iterations\n";
+            break;
+        }
+        for (size_t c = 0; c < numCandidates; c++) {
+            if (profileCache != NULL) {
+                candidates[c].group1 = treeGroups[(static_cast<size_t>(i) * numCandidates + c) % treeGroups.size()];
+                candidates[c].group2 = complementGroup(candidates[c].group1, cigars_aa.size());
+            } else {
+                drawBipartition(cigars_aa.size(), candidates[c].group1, candidates[c].group2, rng);
+            }
+        }
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(numWorkers) if(numWorkers > 1)
+        for (size_t c = 0; c < numCandidates; c++) {
+            unsigned int thread_idx = 0;
+#ifdef OPENMP
+            thread_idx = static_cast<unsigned int>(omp_get_thread_num());
+#endif
+            RefineWorker &worker = *workers[thread_idx];
+            std::vector<std::vector<Instruction> > &working_aa = (thread_idx == 0) ? cigars_aa : worker.cigars_aa;
+            std::vector<std::vector<Instruction> > &working_ss = (thread_idx == 0) ? cigars_ss : worker.cigars_ss;
+            refineOne(
+                tinySubMatAA, tinySubMat3Di,
+                working_aa, working_ss,
+                worker.calculator_aa, worker.filter_aa, subMat_aa,
+                worker.calculator_3di, worker.filter_3di, subMat_3di,
+                worker.structureSmithWaterman, par.filterMsa, par.compBiasCorrection,
+                par.qid, par.filterMaxSeqId, par.Ndiff, par.covMSAThr, par.qsc, par.filterMinEnable,
+                par.wg, gapExtend, gapOpen,
+                worker.sequences_aa, worker.sequences_ss,
+                candidates[c].group1, candidates[c].group2,
+                worker.undoLog, profileCache
+            );
+            candidateRows[c] = worker.undoLog.modifiedRows();
+            for (size_t row : candidateRows[c]) {
+                candidates_aa[c][row].swap(working_aa[row]);
+                candidates_ss[c][row].swap(working_ss[row]);
+            }
+            worker.undoLog.rollback(working_aa, working_ss);
+        }
+
+        // Untouched rows are unchanged from the MSA, swap them in for scoring
+        std::vector<bool> modified(cigars_aa.size());
+        size_t best = 0;
+        for (size_t c = 0; c < numCandidates; c++) {
+            std::fill(modified.begin(), modified.end(), false);
+            for (size_t row : candidateRows[c]) {
+                modified[row] = true;
+            }
+            for (size_t row = 0; row < modified.size(); row++) {
+                if (modified[row] == false) {
+                    candidates_aa[c][row].swap(cigars_aa[row]);
+                }
+            }
+            // LDDT scoring is parallel over pairs, so candidates are scored one after another
+            candidateScores[c] = (pairCache != NULL)
+                ? pairCache->scoreCandidate(candidates_aa[c], candidateRows[c], candidates[c])
+                : estimateLDDT(candidates_aa[c], subset, indices, seqDbrCA, par.pairThreshold, par.lddtPrecision, par.lddtMaxPairs, seed).lddtScore;
+            for (size_t row = 0; row < modified.size(); row++) {
+                if (modified[row] == false) {
+                    candidates_aa[c][row].swap(cigars_aa[row]);
+                }
+            }
+            if (candidateScores[c] > candidateScores[best]) {
+                best = c;
+            }
+        }
+        float lddtScore = candidateScores[best];
         // std::cout << std::fixed << std::setprecision(4) << "New LDDT: " << lddtScore << '\t' << "(" << i + 1 << ")\n";
-        // for (std::vector<Instruction> &ins : cigars_new_aa) {
-        //     std::cout << expand(ins) << '\n';
-        // }
         // std::cout << std::fixed << std::setprecision(4) << prevLDDT << " -> " << lddtScore << " (+" << (lddtScore - prevLDDT) << ") #" << i + 1 << '\n';
         if (lddtScore > prevLDDT) {
             std::cout << std::fixed << std::setprecision(4) << prevLDDT << " -> " << lddtScore << " (+" << (lddtScore - prevLDDT) << ") #" << i + 1 << '\n';
             prevLDDT = lddtScore;
-            std::swap(cigars_aa, cigars_new_aa);
-            std::swap(cigars_ss, cigars_new_ss);
+            for (size_t row : candidateRows[best]) {
+                cigars_aa[row].swap(candidates_aa[best][row]);
+                cigars_ss[row].swap(candidates_ss[best][row]);
+            }
+            // Other workers' copies only need the accepted rows
+            for (size_t w = 1; w < workers.size(); w++) {
+                for (size_t row : candidateRows[best]) {
+                    workers[w]->cigars_aa[row].assign(cigars_aa[row].begin(), cigars_aa[row].end());
+                    workers[w]->cigars_ss[row].assign(cigars_ss[row].begin(), cigars_ss[row].end());
+                }
+            }
+            if (pairCache != NULL) {
+                pairCache->accept(candidates[best]);
+            }
+            if (profileCache != NULL) {
+                profileCache->invalidate(candidates[best].group1, cigars_aa.size());
+            }
+            sinceImprovement = 0;
+        } else {
+            sinceImprovement += numCandidates;
         }
         i++;
     }
@@ -324,9 +651,13 @@ void refineMany(
     } else {
         std::cout << "Did not improve MSA\n";
     }
-    for (size_t i = 0; i < sequences_aa.size(); i++) {
-        delete sequences_aa[i];
-        delete sequences_ss[i];
+    if (profileCache != NULL) {
+        std::cout << "Reused " << profileCache->hits << " of " << (profileCache->hits + profileCache->misses) << " group profiles\n";
+        delete profileCache;
+    }
+    delete pairCache;
+    for (size_t i = 0; i < workers.size(); i++) {
+        delete workers[i];
     }
 }
 
@@ -356,89 +687,74 @@ int refinemsa(int argc, const char **argv, const Command& command) {
     std::vector<std::string> headers;
     int alnLength = 0;
 
-    KSeqWrapper* kseq = KSeqFactory(par.db2.c_str());
-    parseFasta(kseq, &seqDbrAA, &seqDbr3Di, headers, indices, cigars_aa, cigars_ss, alnLength);
-    std::cout << "Parsed FASTA\n";
+    readMSA(par.db2, &seqDbrAA, &seqDbr3Di, headers, indices, cigars_aa, cigars_ss, alnLength, par.threads);
+    std::cout << "Parsed MSA\n";
 
     int sequenceCnt = cigars_aa.size();
+
+    // Guide tree bipartitions, with leaves named like the FASTA entries
+    std::vector<std::vector<size_t> > treeGroups;
+    if (par.refineMode == FoldmasonParameters::REFINE_MODE_GUIDE_TREE && par.guideTree != "") {
+        std::string tree;
+        std::string line;
+        std::ifstream newick(par.guideTree);
+        if (newick.is_open()) {
+            while (std::getline(newick, line))
+                tree += line;
+            newick.close();
+        }
+        std::unordered_map<std::string, size_t> nameToRow;
+        for (size_t i = 0; i < headers.size(); i++) {
+            nameToRow[headers[i]] = i;
+        }
+        std::vector<AlnSimple> hits;
+        if (tree != "") {
+            NewickParser::Node* root = NewickParser::parse(tree);
+            std::vector<std::string> linkage;
+            NewickParser::postOrder(root, &linkage);
+            delete root;
+            for (size_t i = 0; i + 1 < linkage.size(); i += 2) {
+                std::unordered_map<std::string, size_t>::iterator query = nameToRow.find(linkage[i]);
+                std::unordered_map<std::string, size_t>::iterator target = nameToRow.find(linkage[i + 1]);
+                if (query == nameToRow.end() || target == nameToRow.end()) {
+                    Debug(Debug::ERROR) << "Could not find name " << (query == nameToRow.end() ? linkage[i] : linkage[i + 1]) << " in MSA\n";
+                    EXIT(EXIT_FAILURE);
+                }
+                AlnSimple hit;
+                hit.queryId = query->second;
+                hit.targetId = target->second;
+                hit.score = 0;
+                hits.push_back(hit);
+            }
+        }
+        treeGroups = subtreeGroups(hits, sequenceCnt);
+    }
     
-    SubstitutionMatrix subMat_3di(par.scoringMatrixFile.values.aminoacid().c_str(), par.bitFactor3Di, par.scoreBias3di);
-    std::string blosum;
-    for (size_t i = 0; i < par.substitutionMatrices.size(); i++) {
-        if (par.substitutionMatrices[i].name == "blosum62.out") {
-            std::string matrixData((const char *)par.substitutionMatrices[i].subMatData, par.substitutionMatrices[i].subMatDataLen);
-            std::string matrixName = par.substitutionMatrices[i].name;
-            char * serializedMatrix = BaseMatrix::serialize(matrixName, matrixData);
-            blosum.assign(serializedMatrix);
-            free(serializedMatrix);
-        }
-    }
-    SubstitutionMatrix subMat_aa(blosum.c_str(), par.bitFactorAa, par.scoreBiasAa);
-
-    // Substitution matrices needed for query profile
-    int8_t *tinySubMatAA  = (int8_t*) mem_align(ALIGN_INT, subMat_aa.alphabetSize * 32);
-    int8_t *tinySubMat3Di = (int8_t*) mem_align(ALIGN_INT, subMat_3di.alphabetSize * 32);
-
-    for (int i = 0; i < subMat_aa.alphabetSize; i++)
-        for (int j = 0; j < subMat_aa.alphabetSize; j++)
-            tinySubMatAA[i * subMat_aa.alphabetSize + j] = subMat_aa.subMatrix[i][j];
-    for (int i = 0; i < subMat_3di.alphabetSize; i++)
-        for (int j = 0; j < subMat_3di.alphabetSize; j++)
-            tinySubMat3Di[i * subMat_3di.alphabetSize + j] = subMat_3di.subMatrix[i][j]; // for farrar profile
-
-    StructureSmithWaterman structureSmithWaterman(par.maxSeqLen, subMat_3di.alphabetSize, par.compBiasCorrection, par.compBiasCorrectionScale, &subMat_aa, &subMat_3di);
-    MsaFilter filter_aa(par.maxSeqLen + 1, sequenceCnt + 1, &subMat_aa, par.gapOpen.values.aminoacid(), par.gapExtend.values.aminoacid());
-    MsaFilter filter_3di(par.maxSeqLen + 1, sequenceCnt + 1, &subMat_3di, par.gapOpen.values.aminoacid(), par.gapExtend.values.aminoacid()); 
-    PSSMCalculator calculator_aa(&subMat_aa, par.maxSeqLen + 1, sequenceCnt + 1, par.pcmode, par.pcaAa, par.pcbAa
-#ifdef GAP_POS_SCORING
-            , par.gapOpen.values.aminoacid(), par.gapPseudoCount
-#endif
-            );
-    PSSMCalculator calculator_3di(&subMat_3di, par.maxSeqLen + 1, sequenceCnt + 1, par.pcmode, par.pca3di, par.pcb3di
-#ifdef GAP_POS_SCORING
-            , par.gapOpen.values.aminoacid(), par.gapPseudoCount
-#endif
-            );
-    
+    AlignmentMatrices matrices(par);
+    SubstitutionMatrix &subMat_3di = matrices.subMat_3di;
+    SubstitutionMatrix &subMat_aa = matrices.subMat_aa;
+    int8_t *tinySubMatAA = matrices.tinySubMatAA;
+    int8_t *tinySubMat3Di = matrices.tinySubMat3Di;
+
     // Refine for N iterations
     refineMany(
         tinySubMatAA, tinySubMat3Di, &seqDbrCA, cigars_aa, cigars_ss,
-        calculator_aa, filter_aa, subMat_aa, calculator_3di, filter_3di, subMat_3di,
-        structureSmithWaterman, par.refineIters, par.compBiasCorrection, par.wg, par.filterMaxSeqId,
-        par.qsc, par.Ndiff, par.covMSAThr,
-        par.filterMinEnable, par.filterMsa, par.gapExtend.values.aminoacid(), par.gapOpen.values.aminoacid(),
-        par.maxSeqLen, par.qid, par.pairThreshold, indices, par.refinementSeed
+        subMat_aa, subMat_3di, par, par.maxSeqLen, indices, treeGroups
     );
     
     // Write final MSA to file
-    DBWriter resultWriter(
-        par.db3.c_str(),
-        (par.db3 + ".index").c_str(),
-        static_cast<unsigned int>(par.threads),
-        par.compressed,
-        Parameters::DBTYPE_OMIT_FILE
-    );
-    resultWriter.open();
-    std::string buffer;
-    for (int i = 0; i < sequenceCnt; i++) {
-        buffer.append(1, '>');
-        buffer.append(headers[i]);
-        buffer.append(1, '\n');
-        // TODO format mode for 3di alignments ?
-        buffer.append(expand(cigars_aa[i]));
-        buffer.append(1, '\n');
-        resultWriter.writeAdd(buffer.c_str(), buffer.size(), 0);
-        buffer.clear();
-    } 
-    resultWriter.writeEnd(0, 0, false, 0);
-    resultWriter.close(true);
-    FileUtil::remove((par.db3 + ".index").c_str());
+    // TODO format mode for 3di alignments ?
+    std::vector<size_t> rows(sequenceCnt);
+    std::iota(rows.begin(), rows.end(), 0);
+    if (Util::endsWith(".fmsa", par.db3)) {
+        MSAFile::write(par.db3, headers, indices, cigars_aa, rows);
+    } else {
+        writeMSAFasta(par.db3, headers, cigars_aa, rows, par.threads, par.compressed);
+    }
 
     // Cleanup
     seqDbrAA.close();
     seqDbr3Di.close();
-    delete [] tinySubMatAA;
-    delete [] tinySubMat3Di;
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -13,6 +13,7 @@
 #include "Parameters.h"
 #include "Sequence.h"
 #include "StructureSmithWaterman.h"
+#include "SimdDispatch.h"
 // #include "affineneedlemanwunsch.h"
 #include "StructureUtil.h"
 #include "Util.h"
@@ -24,6 +25,10 @@
 #include <iostream>
 #include <regex>
 #include <stack>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zstd.h>
 
 #include "kseq.h"
 #include "KSeqBufferReader.h"
@@ -36,6 +41,8 @@
 #include "refinemsa.h"
 #include "structuremsa.h"
 #include "newick.h"
+#include "MSACheckpoint.h"
+#include "MSAFile.h"
 #include "MSA.h"
 
 #ifdef OPENMP
@@ -211,9 +218,50 @@ inline size_t get1dIndex(size_t i, size_t j, size_t N) {
     return j + i * (2 * N - i - 1) / 2 - i - 1;
 }
 
+EncodedSequences::EncodedSequences(DBReader<unsigned int> &seqDbrAA, DBReader<unsigned int> &seqDbr3Di, BaseMatrix &subMat_aa, BaseMatrix &subMat_3di) {
+    size_t sequenceCnt = seqDbrAA.getSize();
+    offsets.resize(sequenceCnt + 1);
+    lengths.resize(sequenceCnt);
+    offsets[0] = 0;
+    for (size_t i = 0; i < sequenceCnt; i++) {
+        lengths[i] = seqDbrAA.getSeqLen(i);
+        // keep every record aligned for vector loads
+        size_t recordSize = 2 * static_cast<size_t>(lengths[i]);
+        offsets[i + 1] = offsets[i] + (recordSize + ALIGN_INT - 1) / ALIGN_INT * ALIGN_INT;
+    }
+    arena = (unsigned char *) mem_align(ALIGN_INT, std::max(offsets[sequenceCnt], (size_t) ALIGN_INT));
+
+#pragma omp parallel
+{
+    unsigned int thread_idx = 0;
+#ifdef OPENMP
+    thread_idx = static_cast<unsigned int>(omp_get_thread_num());
+#endif
+#pragma omp for schedule(dynamic, 100)
+    for (size_t i = 0; i < sequenceCnt; i++) {
+        const char *seqAA = seqDbrAA.getData(i, thread_idx);
+        const char *seq3Di = seqDbr3Di.getData(seqDbr3Di.getId(seqDbrAA.getDbKey(i)), thread_idx);
+        unsigned char *outAA = arena + offsets[i];
+        unsigned char *out3Di = outAA + lengths[i];
+        // same translation as Sequence::mapSequence
+        unsigned int l = 0;
+        while (l < lengths[i] && seqAA[l] != '\0' && seqAA[l] != '\n') {
+            outAA[l] = subMat_aa.aa2num[static_cast<int>(seqAA[l])];
+            out3Di[l] = subMat_3di.aa2num[static_cast<int>(seq3Di[l])];
+            l++;
+        }
+        lengths[i] = l;
+    }
+}
+}
+
+EncodedSequences::~EncodedSequences() {
+    free(arena);
+}
+
 std::vector<AlnSimple> updateAllScores(
     DBReader<unsigned int> &seqDbrAA,
-    DBReader<unsigned int> &seqDbr3Di,
+    EncodedSequences &encoded,
     int8_t * tinySubMatAA,
     int8_t * tinySubMat3Di,
     SubstitutionMatrix * subMat_aa,
@@ -229,16 +277,8 @@ std::vector<AlnSimple> updateAllScores(
 
 #pragma omp parallel
 {
-
-    unsigned int thread_idx = 0;
-#ifdef OPENMP
-    thread_idx = static_cast<unsigned int>(omp_get_thread_num());
-#endif
-
     Sequence seqMergedAa(maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) subMat_aa,  0, false, compBiasCorrection);
     Sequence seqMergedSs(maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) subMat_3di, 0, false, compBiasCorrection);
-    Sequence seqTargetAa(maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) subMat_aa,  0, false, compBiasCorrection);
-    Sequence seqTargetSs(maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) subMat_3di, 0, false, compBiasCorrection);
 
     StructureSmithWaterman structureSmithWaterman(
         maxSeqLen,
@@ -248,6 +288,7 @@ std::vector<AlnSimple> updateAllScores(
         subMat_aa,
         subMat_3di
     );
+    SimdDispatch::UngappedProfile ungappedProfile(maxSeqLen, alphabetSize);
     std::vector<AlnSimple> threadHits;
 
 #pragma omp for schedule(dynamic, 10)
@@ -257,9 +298,8 @@ std::vector<AlnSimple> updateAllScores(
 
         unsigned int mergedKey = seqDbrAA.getDbKey(i);
         size_t mergedId  = seqDbrAA.getId(mergedKey);
-        seqMergedAa.mapSequence(mergedId, mergedKey, seqDbrAA.getData(mergedId, thread_idx), seqDbrAA.getSeqLen(mergedId));
-        mergedId = seqDbr3Di.getId(mergedKey);
-        seqMergedSs.mapSequence(mergedId, mergedKey, seqDbr3Di.getData(mergedId, thread_idx), seqDbr3Di.getSeqLen(mergedId));
+        seqMergedAa.mapSequence(mergedId, mergedKey, encoded.aaData(mergedId));
+        seqMergedSs.mapSequence(mergedId, mergedKey, encoded.ssData(mergedId));
 
         structureSmithWaterman.ssw_init(
             &seqMergedAa,
@@ -268,6 +308,7 @@ std::vector<AlnSimple> updateAllScores(
             tinySubMat3Di,
             subMat_aa
         );
+        structureSmithWaterman.createUngappedProfile(ungappedProfile);
 
         for (size_t j = i + 1; j < sequenceCnt; j++) {
             if (alreadyMerged[j] || i == j)
@@ -275,13 +316,11 @@ std::vector<AlnSimple> updateAllScores(
 
             size_t targetKey = seqDbrAA.getDbKey(j);
             size_t targetId  = seqDbrAA.getId(targetKey);
-            seqTargetAa.mapSequence(targetId, targetKey, seqDbrAA.getData(targetId, i), seqDbrAA.getSeqLen(targetId));
-            seqTargetSs.mapSequence(targetId, targetKey, seqDbr3Di.getData(targetId, i), seqDbr3Di.getSeqLen(targetId));
 
             AlnSimple aln;
             aln.queryId = mergedId;
             aln.targetId = targetId;
-            aln.score = structureSmithWaterman.ungapped_alignment(seqTargetAa.numSequence, seqTargetSs.numSequence, seqTargetAa.L);
+            aln.score = structureSmithWaterman.ungapped_alignment(encoded.aa(targetId), encoded.ss(targetId), encoded.length(targetId), &ungappedProfile);
             threadHits.push_back(aln); 
         }
     }
@@ -294,6 +333,210 @@ std::vector<AlnSimple> updateAllScores(
     return newHits;
 }
 
+static const int COLLAPSE_KMER_SIZE = 6;
+static const int COLLAPSE_SKETCH_SIZE = 8;
+
+/**
+ * @brief Find structures whose AA and 3Di sequences (nearly) duplicate a longer one.
+ *
+ * Structures are visited longest first. Exact duplicates are found by hashing. Otherwise
+ * candidate representatives share one of COLLAPSE_SKETCH_SIZE minhashes over combined
+ * AA/3Di k-mers, and the k-mer positions give the diagonal of an ungapped comparison.
+ * A structure is collapsed if it lies on that diagonal within the representative and at
+ * least minSeqId of the representative's positions are identical in both AA and 3Di
+ * (1.0: exact duplicates only).
+ *
+ * @param offset position of each collapsed structure's first residue in its representative
+ * @return number of collapsed structures; representative[i] == i for representatives
+ */
+size_t collapseDuplicates(EncodedSequences &encoded, size_t sequenceCnt, float minSeqId, std::vector<size_t> &representative, std::vector<unsigned int> &offset) {
+    representative.resize(sequenceCnt);
+    offset.assign(sequenceCnt, 0);
+    std::vector<size_t> order(sequenceCnt);
+    for (size_t i = 0; i < sequenceCnt; i++) {
+        representative[i] = i;
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&encoded](size_t a, size_t b) {
+        return encoded.length(a) > encoded.length(b);
+    });
+
+    std::unordered_map<size_t, std::vector<size_t> > repsByHash;
+    // minhash of sketch slot -> representatives with their k-mer position
+    std::unordered_map<size_t, std::vector<std::pair<size_t, unsigned int> > > repsBySketch;
+    size_t sketch[COLLAPSE_SKETCH_SIZE];
+    unsigned int sketchPos[COLLAPSE_SKETCH_SIZE];
+    std::vector<std::pair<size_t, unsigned int> > tried;
+    size_t collapsed = 0;
+    for (size_t i : order) {
+        unsigned int length = encoded.length(i);
+        const unsigned char *aa = encoded.aa(i);
+        const unsigned char *ss = encoded.ss(i);
+        // AA and 3Di codes are adjacent in the arena
+        size_t hash = Util::hash(reinterpret_cast<const char *>(aa), 2 * length);
+        std::vector<size_t> &sameHash = repsByHash[hash];
+        for (size_t rep : sameHash) {
+            if (encoded.length(rep) == length && memcmp(encoded.aa(rep), aa, 2 * length) == 0) {
+                representative[i] = rep;
+                break;
+            }
+        }
+        bool sketched = (minSeqId < 1.0 && length >= (unsigned int) COLLAPSE_KMER_SIZE);
+        if (representative[i] == i && sketched) {
+            for (int h = 0; h < COLLAPSE_SKETCH_SIZE; h++) {
+                sketch[h] = SIZE_MAX;
+                sketchPos[h] = 0;
+            }
+            uint64_t kmer = 0;
+            for (unsigned int k = 0; k < length; k++) {
+                kmer = ((kmer << 10) | (static_cast<uint64_t>(aa[k]) << 5) | ss[k]) & ((1ULL << (10 * COLLAPSE_KMER_SIZE)) - 1);
+                if (k + 1 < (unsigned int) COLLAPSE_KMER_SIZE) {
+                    continue;
+                }
+                for (int h = 0; h < COLLAPSE_SKETCH_SIZE; h++) {
+                    uint64_t seeded = kmer ^ (0x9E3779B97F4A7C15ULL * (h + 1));
+                    size_t value = Util::hash(reinterpret_cast<const char *>(&seeded), sizeof(seeded));
+                    if (value < sketch[h]) {
+                        sketch[h] = value;
+                        sketchPos[h] = k + 1 - COLLAPSE_KMER_SIZE;
+                    }
+                }
+            }
+            float bestSeqId = 0.0;
+            tried.clear();
+            for (int h = 0; h < COLLAPSE_SKETCH_SIZE; h++) {
+                std::unordered_map<size_t, std::vector<std::pair<size_t, unsigned int> > >::const_iterator it = repsBySketch.find(sketch[h] ^ h);
+                if (it == repsBySketch.end()) {
+                    continue;
+                }
+                for (const std::pair<size_t, unsigned int> &hit : it->second) {
+                    size_t rep = hit.first;
+                    unsigned int repLength = encoded.length(rep);
+                    if (hit.second < sketchPos[h] || hit.second - sketchPos[h] + length > repLength) {
+                        continue;
+                    }
+                    std::pair<size_t, unsigned int> diagonal(rep, hit.second - sketchPos[h]);
+                    if (std::find(tried.begin(), tried.end(), diagonal) != tried.end()) {
+                        continue;
+                    }
+                    tried.push_back(diagonal);
+                    const unsigned char *repAa = encoded.aa(rep) + diagonal.second;
+                    const unsigned char *repSs = encoded.ss(rep) + diagonal.second;
+                    unsigned int identical = 0;
+                    for (unsigned int k = 0; k < length; k++) {
+                        identical += (repAa[k] == aa[k] && repSs[k] == ss[k]);
+                    }
+                    float seqId = static_cast<float>(identical) / repLength;
+                    if (seqId >= minSeqId && seqId > bestSeqId) {
+                        bestSeqId = seqId;
+                        representative[i] = rep;
+                        offset[i] = diagonal.second;
+                    }
+                }
+            }
+        }
+        if (representative[i] == i) {
+            sameHash.push_back(i);
+            if (sketched) {
+                for (int h = 0; h < COLLAPSE_SKETCH_SIZE; h++) {
+                    repsBySketch[sketch[h] ^ h].emplace_back(i, sketchPos[h]);
+                }
+            }
+        } else {
+            collapsed++;
+        }
+    }
+    return collapsed;
+}
+
+/**
+ * @brief Add collapsed structures back to the final MSA.
+ * Each duplicate is placed after its representative and takes over its gapping with its own
+ * residues; representative residues outside the duplicate become gaps.
+ */
+void expandDuplicates(MSAContainer &msa, std::vector<size_t> &representative, std::vector<unsigned int> &offset) {
+    size_t sequenceCnt = representative.size();
+    std::vector<std::vector<size_t> > duplicates(sequenceCnt);
+    size_t firstRep = 0;
+    for (size_t i = sequenceCnt; i-- > 0;) {
+        if (representative[i] != i) {
+            duplicates[representative[i]].push_back(i);
+        } else {
+            firstRep = i;
+        }
+    }
+    for (size_t i = 0; i < sequenceCnt; i++) {
+        std::reverse(duplicates[i].begin(), duplicates[i].end());
+    }
+    if (msa.size() == 0) {
+        // every structure collapsed onto a single representative
+        msa.add(firstRep);
+    }
+    SubMSA &finalMSA = msa[0];
+    std::vector<size_t> members;
+    members.reserve(sequenceCnt);
+    std::vector<Instruction> rowAa;
+    std::vector<Instruction> rowSs;
+    for (size_t member : finalMSA.members) {
+        members.push_back(member);
+        const std::vector<Instruction> &repAa = msa.cigars_aa[member];
+        for (size_t duplicate : duplicates[member]) {
+            const std::vector<Instruction> &residuesAa = msa.cigars_aa[duplicate];
+            const std::vector<Instruction> &residuesSs = msa.cigars_ss[duplicate];
+            size_t first = offset[duplicate];
+            size_t last = first + residuesAa.size();
+            rowAa.clear();
+            rowSs.clear();
+            size_t repResidue = 0;
+            for (const Instruction &ins : repAa) {
+                size_t gaps = ins.isSeq() ? 0 : ins.bits.count;
+                if (ins.isSeq()) {
+                    if (repResidue >= first && repResidue < last) {
+                        rowAa.push_back(residuesAa[repResidue - first]);
+                        rowSs.push_back(residuesSs[repResidue - first]);
+                    } else {
+                        gaps = 1;
+                    }
+                    repResidue++;
+                }
+                while (gaps > 0) {
+                    if (rowAa.empty() || rowAa.back().isSeq() || rowAa.back().isFull()) {
+                        rowAa.emplace_back(0);
+                        rowSs.emplace_back(0);
+                    }
+                    size_t add = std::min(gaps, (size_t) (127 - rowAa.back().bits.count));
+                    rowAa.back().bits.count += add;
+                    rowSs.back().bits.count += add;
+                    gaps -= add;
+                }
+            }
+            msa.cigars_aa[duplicate].swap(rowAa);
+            msa.cigars_ss[duplicate].swap(rowSs);
+            msa.dbIdToSubMSAVec[duplicate] = 0;
+            members.push_back(duplicate);
+        }
+    }
+    finalMSA.members.swap(members);
+}
+
+/**
+ * @brief Linkage joining each collapsed structure to its representative.
+ * Placed before the guide tree linkage so duplicates become siblings of their representative.
+ */
+std::vector<AlnSimple> duplicateLinkage(const std::vector<size_t> &representative) {
+    std::vector<AlnSimple> linkage;
+    for (size_t i = 0; i < representative.size(); i++) {
+        if (representative[i] != i) {
+            AlnSimple hit;
+            hit.queryId = representative[i];
+            hit.targetId = i;
+            hit.score = 0;
+            linkage.push_back(hit);
+        }
+    }
+    return linkage;
+}
+
 int findRoot(int vertex, std::vector<int>& parent) {
     while (parent[vertex] != vertex) {
         parent[vertex] = parent[parent[vertex]];
@@ -622,7 +865,7 @@ void maskToMapping(const std::string &mask, std::vector<size_t> &mapping) {
 
 std::vector<AlnSimple> parseAndScoreExternalHits(
     DBReader<unsigned int> &seqDbrAA,
-    DBReader<unsigned int> &seqDbr3Di,
+    EncodedSequences &encoded,
     DBReader<unsigned int> *cluDbr,
     int8_t * tinySubMatAA,
     int8_t * tinySubMat3Di,
@@ -645,8 +888,6 @@ std::vector<AlnSimple> parseAndScoreExternalHits(
 
     Sequence seqQueryAa(maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) subMat_aa,  0, false, compBiasCorrection);
     Sequence seqQuerySs(maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) subMat_3di, 0, false, compBiasCorrection);
-    Sequence seqDbAa(maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) subMat_aa,  0, false, compBiasCorrection);
-    Sequence seqDbSs(maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) subMat_3di, 0, false, compBiasCorrection);
 
     StructureSmithWaterman structureSmithWaterman(
         maxSeqLen,
@@ -656,6 +897,7 @@ std::vector<AlnSimple> parseAndScoreExternalHits(
         subMat_aa,
         subMat_3di
     );
+    SimdDispatch::UngappedProfile ungappedProfile(maxSeqLen, alphabetSize);
     std::vector<AlnSimple> threadAlnResults;
     char buffer[255 + 1];
 
@@ -665,9 +907,8 @@ std::vector<AlnSimple> parseAndScoreExternalHits(
         unsigned int queryKey = cluDbr->getDbKey(i);
         
         size_t queryId = seqDbrAA.getId(queryKey);
-        seqQueryAa.mapSequence(queryId, queryKey, seqDbrAA.getData(queryId, thread_idx), seqDbrAA.getSeqLen(queryId));
-        queryId = seqDbr3Di.getId(queryKey);
-        seqQuerySs.mapSequence(queryId, queryKey, seqDbr3Di.getData(queryId, thread_idx), seqDbr3Di.getSeqLen(queryId));
+        seqQueryAa.mapSequence(queryId, queryKey, encoded.aaData(queryId));
+        seqQuerySs.mapSequence(queryId, queryKey, encoded.ssData(queryId));
         
         structureSmithWaterman.ssw_init(
             &seqQueryAa,
@@ -676,6 +917,7 @@ std::vector<AlnSimple> parseAndScoreExternalHits(
             tinySubMat3Di,
             subMat_aa
         );
+        structureSmithWaterman.createUngappedProfile(ungappedProfile);
        
         while (*data != '\0') {
             Util::parseKey(data, buffer);
@@ -685,16 +927,14 @@ std::vector<AlnSimple> parseAndScoreExternalHits(
                 continue;
             }
             size_t dbId = seqDbrAA.getId(dbKey);
-            seqDbAa.mapSequence(dbId, dbKey, seqDbrAA.getData(dbId, thread_idx), seqDbrAA.getSeqLen(dbId));
-            dbId = seqDbr3Di.getId(dbKey);
-            seqDbSs.mapSequence(dbId, dbKey, seqDbr3Di.getData(dbId, thread_idx), seqDbr3Di.getSeqLen(dbId));
             AlnSimple aln;
             aln.queryId = queryKey;
             aln.targetId = dbKey;
             aln.score = structureSmithWaterman.ungapped_alignment(
-                seqDbAa.numSequence,
-                seqDbSs.numSequence,
-                seqDbAa.L
+                encoded.aa(dbId),
+                encoded.ss(dbId),
+                encoded.length(dbId),
+                &ungappedProfile
             );
             threadAlnResults.push_back(aln);
             data = Util::skipLine(data);
@@ -708,405 +948,1843 @@ std::vector<AlnSimple> parseAndScoreExternalHits(
     return allAlnResults;
 }
 
-void addCigarStates(std::vector<Instruction> &cigar, int state, int count) {
-    while (count > 0) {
-        if (cigar.empty() || cigar.back().bits.state != state || cigar.back().isFull()) {
-            cigar.emplace_back(state, 0); 
-        }
-        int spaceLeft = 127 - static_cast<int>(cigar.back().bits.count);
-        if (count > spaceLeft) {
-            cigar.back().bits.count = 127;
-            count -= spaceLeft;
-        } else {
-            cigar.back().bits.count += count;
-            count = 0;
+// Pairwise alignments read from an alignment DB, keyed by (query id << 32 | target id)
+typedef std::unordered_map<uint64_t, Matcher::result_t> StoredAlignments;
+
+inline uint64_t storedAlignmentKey(size_t queryId, size_t targetId) {
+    return (static_cast<uint64_t>(queryId) << 32) | static_cast<uint64_t>(targetId);
+}
+
+/**
+ * @brief Look up a stored alignment of two structures in either direction.
+ * Alignments stored target-to-query are returned with query and target swapped.
+ */
+bool findStoredAlignment(const StoredAlignments &stored, size_t queryId, size_t targetId, Matcher::result_t &res) {
+    StoredAlignments::const_iterator it = stored.find(storedAlignmentKey(queryId, targetId));
+    if (it != stored.end()) {
+        res = it->second;
+        return true;
+    }
+    it = stored.find(storedAlignmentKey(targetId, queryId));
+    if (it == stored.end()) {
+        return false;
+    }
+    res = it->second;
+    std::swap(res.qStartPos, res.dbStartPos);
+    std::swap(res.qEndPos, res.dbEndPos);
+    std::swap(res.qLen, res.dbLen);
+    for (size_t i = 0; i < res.backtrace.size(); i++) {
+        if (res.backtrace[i] == 'I') {
+            res.backtrace[i] = 'D';
+        } else if (res.backtrace[i] == 'D') {
+            res.backtrace[i] = 'I';
         }
     }
+    return true;
 }
 
-
 /**
- * @brief Get merge instructions for two MSAs
- * 
- * @param res  - alignment result
- * @param map1 - ungapped->gapped mapping for msa1
- * @param map2 - ungapped->gapped mapping for msa2
- * @param qBt  - vector to store query merge instructions
- * @param tBt  - vector to store target merge instructions
+ * @brief Read representative-member scores of a clustering from the alignment DB it was built from.
+ *
+ * Each pair is looked up in the representative's entry first, then in the member's.
+ * Alignments with a backtrace over the full structures in this database are kept in
+ * storedAlignments, so leaf merges can use them instead of aligning again.
+ *
+ * @return hits with the stored alignment scores; pairs absent from the alignment DB are
+ * returned in missing as {representative, member}
  */
-void getMergeInstructions(
-    Matcher::result_t &res,
-    std::vector<size_t> &map1,
-    std::vector<size_t> &map2,
-    std::vector<Instruction> &qBt,
-    std::vector<Instruction> &tBt
+std::vector<AlnSimple> parseExternalAlignments(
+    DBReader<unsigned int> &seqDbrAA,
+    EncodedSequences &encoded,
+    DBReader<unsigned int> *cluDbr,
+    DBReader<unsigned int> *alnDbr,
+    StoredAlignments &storedAlignments,
+    std::vector<std::vector<size_t> > &missing
 ) {
-    qBt.emplace_back(SEQ, 1);  // first match
-    tBt.emplace_back(SEQ, 1);
-    int new_q, dq;
-    int new_t, dt;
-    int old_q = map1[res.qStartPos];
-    int old_t = map2[res.dbStartPos];
-    int q = res.qStartPos + 1;  // indices in non-gappy sequence
-    int t = res.dbStartPos + 1;
- 
-    // Generate instructions for query/target sequences from backtrace
-    for (size_t i = 1; i < res.backtrace.length(); ++i) {
-        switch (res.backtrace[i]) {
-            case 'M': {
-                new_q = map1[q];
-                new_t = map2[t];
-                dq = new_q - old_q;
-                dt = new_t - old_t; 
-                if (dq == 0) {
-                    // No matches in query
-                    addCigarStates(qBt, GAP, dt);
-                    addCigarStates(tBt, SEQ, dt);
-                } else if (dq == 1) {
-                    // One match in query
-                    if ((dt - 1) > 0)
-                        addCigarStates(qBt, GAP, dt - 1);
-                    addCigarStates(qBt, SEQ, 1);
-                    addCigarStates(tBt, SEQ, dt);
-                } else if (dq >= dt) {
-                    // More query matches than target
-                    addCigarStates(qBt, SEQ, dq);
-                    addCigarStates(tBt, GAP, dq - dt);
-                    addCigarStates(tBt, SEQ, dt);
-                } else if (dt > dq) {
-                    // More target than query
-                    addCigarStates(qBt, GAP, dt - dq);
-                    addCigarStates(qBt, SEQ, dq);
-                    addCigarStates(tBt, SEQ, dt);
+    std::vector<AlnSimple> allAlnResults;
+
+#pragma omp parallel
+{
+    unsigned int thread_idx = 0;
+#ifdef OPENMP
+    thread_idx = static_cast<unsigned int>(omp_get_thread_num());
+#endif
+    std::vector<AlnSimple> threadAlnResults;
+    std::vector<std::vector<size_t> > threadMissing;
+    StoredAlignments threadStored;
+    std::vector<Matcher::result_t> repResults;
+    std::vector<Matcher::result_t> memberResults;
+    char buffer[255 + 1];
+
+#pragma omp for schedule(dynamic, 10)
+    for (size_t i = 0; i < cluDbr->getSize(); ++i) {
+        char *data = cluDbr->getData(i, thread_idx);
+        unsigned int queryKey = cluDbr->getDbKey(i);
+        size_t queryId = seqDbrAA.getId(queryKey);
+
+        repResults.clear();
+        size_t alnId = alnDbr->getId(queryKey);
+        if (alnId != UINT_MAX) {
+            Matcher::readAlignmentResults(repResults, alnDbr->getData(alnId, thread_idx));
+        }
+
+        while (*data != '\0') {
+            Util::parseKey(data, buffer);
+            data = Util::skipLine(data);
+            const unsigned int dbKey = (unsigned int) strtoul(buffer, NULL, 10);
+            if (queryKey == dbKey) {
+                continue;
+            }
+            size_t dbId = seqDbrAA.getId(dbKey);
+            bool found = false;
+            Matcher::result_t res;
+            for (size_t j = 0; j < repResults.size(); j++) {
+                if (repResults[j].dbKey == dbKey) {
+                    res = repResults[j];
+                    found = true;
+                    break;
                 }
-                old_q = new_q;
-                old_t = new_t;
-                ++q;
-                ++t;
-                break;
             }
-            case 'I': {
-                ++q;
-                break;
+            size_t resQuery = queryId;
+            size_t resTarget = dbId;
+            if (found == false) {
+                memberResults.clear();
+                size_t memberAlnId = alnDbr->getId(dbKey);
+                if (memberAlnId != UINT_MAX) {
+                    Matcher::readAlignmentResults(memberResults, alnDbr->getData(memberAlnId, thread_idx));
+                }
+                for (size_t j = 0; j < memberResults.size(); j++) {
+                    if (memberResults[j].dbKey == queryKey) {
+                        res = memberResults[j];
+                        found = true;
+                        std::swap(resQuery, resTarget);
+                        break;
+                    }
+                }
             }
-            case 'D': {
-                ++t;
-                break;
+            if (found == false) {
+                threadMissing.push_back({ queryId, dbId });
+                continue;
+            }
+            AlnSimple aln;
+            aln.queryId = queryId;
+            aln.targetId = dbId;
+            aln.score = res.score;
+            threadAlnResults.push_back(aln);
+            bool fullLength = static_cast<unsigned int>(res.qLen) == encoded.length(resQuery)
+                && static_cast<unsigned int>(res.dbLen) == encoded.length(resTarget);
+            if (res.backtrace.empty() == false && fullLength) {
+                threadStored.emplace(storedAlignmentKey(resQuery, resTarget), res);
             }
         }
     }
+#pragma omp critical
+    {
+        allAlnResults.insert(allAlnResults.end(), threadAlnResults.begin(), threadAlnResults.end());
+        missing.insert(missing.end(), threadMissing.begin(), threadMissing.end());
+        storedAlignments.insert(threadStored.begin(), threadStored.end());
+    }
 }
-
-inline bool needNewInstruction(std::vector<Instruction> &instructions) {
-    return (
-        instructions.empty()
-        || instructions.back().isSeq()
-        || instructions.back().isFull()
-    );
+    return allAlnResults;
 }
 
 /**
- * @brief Expands a sequence based on CIGAR
- * 
- * @param instructions Vector of Instructions
- * @return std::string Expanded alignment string
+ * @brief Score all pairs of structures within each cluster
+ *
+ * Clusters hold db ids. Work is split by query structure rather than by cluster, so
+ * a few large clusters are spread over all threads as well as many small ones.
  */
-std::string expand(const std::vector<Instruction> &instructions) {
-    std::string result = "";
-    for (const Instruction &ins : instructions) {
-        if (ins.isSeq()) {
-            result.append(1, ins.getCharacter());
-        } else {
-            result.append(static_cast<int>(ins.bits.count), '-');
+std::vector<AlnSimple> scoreClusterPairs(
+    const std::vector<std::vector<size_t> > &clusters,
+    EncodedSequences &encoded,
+    int8_t * tinySubMatAA,
+    int8_t * tinySubMat3Di,
+    SubstitutionMatrix * subMat_aa,
+    SubstitutionMatrix * subMat_3di,
+    int maxSeqLen,
+    int alphabetSize,
+    int compBiasCorrection,
+    int compBiasCorrectionScale
+) {
+    std::vector<std::pair<size_t, size_t> > queries;
+    for (size_t c = 0; c < clusters.size(); c++) {
+        for (size_t i = 0; i + 1 < clusters[c].size(); i++) {
+            queries.emplace_back(c, i);
         }
     }
-    return result;
-}
+    std::vector<AlnSimple> allHits;
 
-/**
- * @brief Convert sequence string to vector of Instructions
- * 
- * e.g. --AB-C
- *      state 1, count 2
- *      state 0, A
- *      state 0, B
- *      state 1, count 1
- *      state 0, C
- *
- * @param sequence 
- * @return std::vector<Instruction> 
- */
-std::vector<Instruction> contract(const std::string& sequence) {
-    std::vector<Instruction> instructions;
-    for (const char& letter : sequence) {
-        if (letter == '\0') {
-            break;
-        }
-        if (letter == '-') {
-            if (needNewInstruction(instructions)) {
-                instructions.emplace_back(static_cast<int>(1));
+#pragma omp parallel
+{
+    Sequence seqQueryAa(maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) subMat_aa,  0, false, compBiasCorrection);
+    Sequence seqQuerySs(maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) subMat_3di, 0, false, compBiasCorrection);
+    StructureSmithWaterman structureSmithWaterman(
+        maxSeqLen,
+        alphabetSize,
+        compBiasCorrection,
+        compBiasCorrectionScale,
+        subMat_aa,
+        subMat_3di
+    );
+    SimdDispatch::UngappedProfile ungappedProfile(maxSeqLen, alphabetSize);
+    std::vector<AlnSimple> threadHits;
+
+#pragma omp for schedule(dynamic, 10)
+    for (size_t q = 0; q < queries.size(); q++) {
+        const std::vector<size_t> &members = clusters[queries[q].first];
+        size_t queryId = members[queries[q].second];
+        seqQueryAa.mapSequence(queryId, queryId, encoded.aaData(queryId));
+        seqQuerySs.mapSequence(queryId, queryId, encoded.ssData(queryId));
+        structureSmithWaterman.ssw_init(&seqQueryAa, &seqQuerySs, tinySubMatAA, tinySubMat3Di, subMat_aa);
+        structureSmithWaterman.createUngappedProfile(ungappedProfile);
+        for (size_t j = queries[q].second + 1; j < members.size(); j++) {
+            size_t targetId = members[j];
+            AlnSimple aln;
+            aln.queryId = queryId;
+            aln.targetId = targetId;
+            aln.score = structureSmithWaterman.ungapped_alignment(encoded.aa(targetId), encoded.ss(targetId), encoded.length(targetId), &ungappedProfile);
+            threadHits.push_back(aln);
+        }
+    }
+
+#pragma omp critical
+    {
+        allHits.insert(allHits.end(), threadHits.begin(), threadHits.end());
+    }
+}
+    return allHits;
+}
+
+/**
+ * @brief Put ungapped scores of pairs missing from the alignment DB on the DB's score scale
+ *
+ * The stored pairs are scored ungapped as well; a missing pair gets the stored score found
+ * at the rank its ungapped score has among the stored pairs' ungapped scores (quantile mapping),
+ * interpolated between neighbouring ranks and clamped to the stored range.
+ */
+void mapToStoredScores(
+    std::vector<AlnSimple> &missingHits,
+    const std::vector<AlnSimple> &storedHits,
+    const std::vector<AlnSimple> &storedUngappedHits
+) {
+    if (storedHits.empty() || storedUngappedHits.size() != storedHits.size()) {
+        return;
+    }
+    std::vector<int> stored(storedHits.size());
+    std::vector<int> ungapped(storedUngappedHits.size());
+    for (size_t i = 0; i < storedHits.size(); i++) {
+        stored[i] = storedHits[i].score;
+        ungapped[i] = storedUngappedHits[i].score;
+    }
+    std::sort(stored.begin(), stored.end());
+    std::sort(ungapped.begin(), ungapped.end());
+    for (size_t i = 0; i < missingHits.size(); i++) {
+        int score = missingHits[i].score;
+        size_t rank = std::upper_bound(ungapped.begin(), ungapped.end(), score) - ungapped.begin();
+        if (rank == 0) {
+            missingHits[i].score = stored.front();
+        } else if (rank == ungapped.size()) {
+            missingHits[i].score = stored.back();
+        } else {
+            // interpolate between neighbouring quantiles so missing pairs keep their order
+            float fraction = static_cast<float>(score - ungapped[rank - 1]) / (ungapped[rank] - ungapped[rank - 1]);
+            missingHits[i].score = stored[rank - 1] + static_cast<int>(fraction * (stored[rank] - stored[rank - 1]) + 0.5f);
+        }
+    }
+}
+
+// 3Di k-mers sampled per structure for preclustering, as foldseek cluster uses for linclust
+static const int PRECLUSTER_KMER_SIZE = 10;
+static const size_t PRECLUSTER_KMERS_PER_SEQUENCE = 300;
+
+struct PreclusterKmer {
+    uint64_t kmer;
+    unsigned int length;
+    unsigned int id;
+};
+
+/**
+ * @brief Pre-cluster structures in memory by shared 3Di k-mers
+ *
+ * Every structure contributes its PRECLUSTER_KMERS_PER_SEQUENCE k-mers with the lowest hash.
+ * The longest structure sharing a k-mer is paired with all others sharing it, and each pair is
+ * kept if its ungapped score reaches minScoreRatio of the larger self score of the two.
+ * Representatives are then picked greedily by number of kept pairs (set cover).
+ * Members are marked in alreadyMerged.
+ *
+ * @return representative-member edges with their ungapped scores
+ */
+std::vector<AlnSimple> preclusterStructures(
+    EncodedSequences &encoded,
+    size_t sequenceCnt,
+    bool * alreadyMerged,
+    int8_t * tinySubMatAA,
+    int8_t * tinySubMat3Di,
+    SubstitutionMatrix * subMat_aa,
+    SubstitutionMatrix * subMat_3di,
+    int maxSeqLen,
+    int alphabetSize,
+    int compBiasCorrection,
+    int compBiasCorrectionScale,
+    float minScoreRatio
+) {
+    const unsigned char unknown3Di = subMat_3di->aa2num[static_cast<int>('X')];
+    const uint64_t highestPosition = MathUtil::ipow<uint64_t>(alphabetSize, PRECLUSTER_KMER_SIZE - 1);
+    std::vector<PreclusterKmer> kmers;
+    std::vector<int> selfScores(sequenceCnt, 0);
+
+#pragma omp parallel
+{
+    Sequence seqQueryAa(maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) subMat_aa,  0, false, compBiasCorrection);
+    Sequence seqQuerySs(maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) subMat_3di, 0, false, compBiasCorrection);
+    StructureSmithWaterman structureSmithWaterman(
+        maxSeqLen,
+        alphabetSize,
+        compBiasCorrection,
+        compBiasCorrectionScale,
+        subMat_aa,
+        subMat_3di
+    );
+    SimdDispatch::UngappedProfile ungappedProfile(maxSeqLen, alphabetSize);
+    std::vector<std::pair<uint64_t, uint64_t> > sequenceKmers;
+    std::vector<PreclusterKmer> threadKmers;
+#pragma omp for schedule(dynamic, 100)
+    for (size_t i = 0; i < sequenceCnt; i++) {
+        if (alreadyMerged[i]) {
+            continue;
+        }
+        const unsigned char *ss = encoded.ss(i);
+        unsigned int length = encoded.length(i);
+        // self score with the same composition bias as the pair scores
+        seqQueryAa.mapSequence(i, i, encoded.aaData(i));
+        seqQuerySs.mapSequence(i, i, encoded.ssData(i));
+        structureSmithWaterman.ssw_init(&seqQueryAa, &seqQuerySs, tinySubMatAA, tinySubMat3Di, subMat_aa);
+        structureSmithWaterman.createUngappedProfile(ungappedProfile);
+        selfScores[i] = structureSmithWaterman.ungapped_alignment(encoded.aa(i), ss, length, &ungappedProfile);
+
+        sequenceKmers.clear();
+        uint64_t kmer = 0;
+        int valid = 0;
+        for (unsigned int k = 0; k < length; k++) {
+            if (ss[k] == unknown3Di) {
+                valid = 0;
+                continue;
+            }
+            kmer = (valid == 0 ? 0 : kmer) * alphabetSize + ss[k];
+            if (valid < PRECLUSTER_KMER_SIZE) {
+                valid++;
+            }
+            if (valid == PRECLUSTER_KMER_SIZE) {
+                sequenceKmers.emplace_back(Util::hash(reinterpret_cast<const char *>(&kmer), sizeof(kmer)), kmer);
+                // drop the first residue of the window
+                kmer %= highestPosition;
+            }
+        }
+        std::sort(sequenceKmers.begin(), sequenceKmers.end());
+        sequenceKmers.erase(std::unique(sequenceKmers.begin(), sequenceKmers.end()), sequenceKmers.end());
+        size_t selected = std::min(sequenceKmers.size(), PRECLUSTER_KMERS_PER_SEQUENCE);
+        for (size_t k = 0; k < selected; k++) {
+            PreclusterKmer entry;
+            entry.kmer = sequenceKmers[k].second;
+            entry.length = length;
+            entry.id = static_cast<unsigned int>(i);
+            threadKmers.push_back(entry);
+        }
+    }
+#pragma omp critical
+    {
+        kmers.insert(kmers.end(), threadKmers.begin(), threadKmers.end());
+    }
+}
+
+    // Group by k-mer, longest structure first
+    std::sort(kmers.begin(), kmers.end(), [](const PreclusterKmer &a, const PreclusterKmer &b) {
+        if (a.kmer != b.kmer) return a.kmer < b.kmer;
+        if (a.length != b.length) return a.length > b.length;
+        return a.id < b.id;
+    });
+    std::vector<std::pair<unsigned int, unsigned int> > candidates;
+    for (size_t start = 0, end = 0; start < kmers.size(); start = end) {
+        for (end = start + 1; end < kmers.size() && kmers[end].kmer == kmers[start].kmer; end++) {
+            candidates.emplace_back(kmers[start].id, kmers[end].id);
+        }
+    }
+    std::vector<PreclusterKmer>().swap(kmers);
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    // Candidates are sorted by center, so each profile is built once per thread and center
+    std::vector<AlnSimple> accepted;
+#pragma omp parallel
+{
+    Sequence seqQueryAa(maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) subMat_aa,  0, false, compBiasCorrection);
+    Sequence seqQuerySs(maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) subMat_3di, 0, false, compBiasCorrection);
+    StructureSmithWaterman structureSmithWaterman(
+        maxSeqLen,
+        alphabetSize,
+        compBiasCorrection,
+        compBiasCorrectionScale,
+        subMat_aa,
+        subMat_3di
+    );
+    SimdDispatch::UngappedProfile ungappedProfile(maxSeqLen, alphabetSize);
+    std::vector<AlnSimple> threadHits;
+    size_t lastQuery = SIZE_MAX;
+#pragma omp for schedule(dynamic, 100)
+    for (size_t i = 0; i < candidates.size(); i++) {
+        size_t queryId = candidates[i].first;
+        size_t targetId = candidates[i].second;
+        if (queryId != lastQuery) {
+            seqQueryAa.mapSequence(queryId, queryId, encoded.aaData(queryId));
+            seqQuerySs.mapSequence(queryId, queryId, encoded.ssData(queryId));
+            structureSmithWaterman.ssw_init(&seqQueryAa, &seqQuerySs, tinySubMatAA, tinySubMat3Di, subMat_aa);
+            structureSmithWaterman.createUngappedProfile(ungappedProfile);
+            lastQuery = queryId;
+        }
+        AlnSimple aln;
+        aln.queryId = queryId;
+        aln.targetId = targetId;
+        aln.score = structureSmithWaterman.ungapped_alignment(encoded.aa(targetId), encoded.ss(targetId), encoded.length(targetId), &ungappedProfile);
+        if (aln.score >= minScoreRatio * std::max(selfScores[queryId], selfScores[targetId])) {
+            threadHits.push_back(aln);
+        }
+    }
+#pragma omp critical
+    {
+        accepted.insert(accepted.end(), threadHits.begin(), threadHits.end());
+    }
+}
+
+    // Greedy set cover: structures with the most kept pairs become representatives first
+    std::vector<std::vector<size_t> > neighbours(sequenceCnt);
+    for (size_t i = 0; i < accepted.size(); i++) {
+        neighbours[accepted[i].queryId].push_back(i);
+        neighbours[accepted[i].targetId].push_back(i);
+    }
+    std::vector<size_t> order;
+    for (size_t i = 0; i < sequenceCnt; i++) {
+        if (alreadyMerged[i] == false) {
+            order.push_back(i);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (neighbours[a].size() != neighbours[b].size()) return neighbours[a].size() > neighbours[b].size();
+        return encoded.length(a) > encoded.length(b);
+    });
+    std::vector<bool> assigned(sequenceCnt, false);
+    std::vector<AlnSimple> edges;
+    for (size_t rep : order) {
+        if (assigned[rep]) {
+            continue;
+        }
+        assigned[rep] = true;
+        for (size_t hit : neighbours[rep]) {
+            size_t member = (accepted[hit].queryId == rep) ? accepted[hit].targetId : accepted[hit].queryId;
+            if (assigned[member]) {
+                continue;
+            }
+            assigned[member] = true;
+            alreadyMerged[member] = true;
+            AlnSimple edge;
+            edge.queryId = rep;
+            edge.targetId = member;
+            edge.score = accepted[hit].score;
+            edges.push_back(edge);
+        }
+    }
+    return edges;
+}
+
+void addCigarStates(std::vector<Instruction> &cigar, int state, int count) {
+    while (count > 0) {
+        if (cigar.empty() || cigar.back().bits.state != state || cigar.back().isFull()) {
+            cigar.emplace_back(state, 0); 
+        }
+        int spaceLeft = 127 - static_cast<int>(cigar.back().bits.count);
+        if (count > spaceLeft) {
+            cigar.back().bits.count = 127;
+            count -= spaceLeft;
+        } else {
+            cigar.back().bits.count += count;
+            count = 0;
+        }
+    }
+}
+
+
+/**
+ * @brief Get merge instructions for two MSAs
+ * 
+ * @param res  - alignment result
+ * @param map1 - ungapped->gapped mapping for msa1
+ * @param map2 - ungapped->gapped mapping for msa2
+ * @param qBt  - vector to store query merge instructions
+ * @param tBt  - vector to store target merge instructions
+ */
+void getMergeInstructions(
+    Matcher::result_t &res,
+    std::vector<size_t> &map1,
+    std::vector<size_t> &map2,
+    std::vector<Instruction> &qBt,
+    std::vector<Instruction> &tBt
+) {
+    qBt.emplace_back(SEQ, 1);  // first match
+    tBt.emplace_back(SEQ, 1);
+    int new_q, dq;
+    int new_t, dt;
+    int old_q = map1[res.qStartPos];
+    int old_t = map2[res.dbStartPos];
+    int q = res.qStartPos + 1;  // indices in non-gappy sequence
+    int t = res.dbStartPos + 1;
+ 
+    // Generate instructions for query/target sequences from backtrace
+    for (size_t i = 1; i < res.backtrace.length(); ++i) {
+        switch (res.backtrace[i]) {
+            case 'M': {
+                new_q = map1[q];
+                new_t = map2[t];
+                dq = new_q - old_q;
+                dt = new_t - old_t; 
+                if (dq == 0) {
+                    // No matches in query
+                    addCigarStates(qBt, GAP, dt);
+                    addCigarStates(tBt, SEQ, dt);
+                } else if (dq == 1) {
+                    // One match in query
+                    if ((dt - 1) > 0)
+                        addCigarStates(qBt, GAP, dt - 1);
+                    addCigarStates(qBt, SEQ, 1);
+                    addCigarStates(tBt, SEQ, dt);
+                } else if (dq >= dt) {
+                    // More query matches than target
+                    addCigarStates(qBt, SEQ, dq);
+                    addCigarStates(tBt, GAP, dq - dt);
+                    addCigarStates(tBt, SEQ, dt);
+                } else if (dt > dq) {
+                    // More target than query
+                    addCigarStates(qBt, GAP, dt - dq);
+                    addCigarStates(qBt, SEQ, dq);
+                    addCigarStates(tBt, SEQ, dt);
+                }
+                old_q = new_q;
+                old_t = new_t;
+                ++q;
+                ++t;
+                break;
+            }
+            case 'I': {
+                ++q;
+                break;
+            }
+            case 'D': {
+                ++t;
+                break;
+            }
+        }
+    }
+}
+
+inline bool needNewInstruction(std::vector<Instruction> &instructions) {
+    return (
+        instructions.empty()
+        || instructions.back().isSeq()
+        || instructions.back().isFull()
+    );
+}
+
+/**
+ * @brief Expands a sequence based on CIGAR
+ * 
+ * @param instructions Vector of Instructions
+ * @return std::string Expanded alignment string
+ */
+std::string expand(const std::vector<Instruction> &instructions) {
+    std::string result;
+    appendExpanded(result, instructions);
+    return result;
+}
+
+/**
+ * @brief Append the expanded alignment row of a CIGAR to buffer
+ *
+ * The row is sized once up front and gap runs are filled with memset.
+ */
+void appendExpanded(std::string &buffer, const std::vector<Instruction> &instructions) {
+    size_t offset = buffer.size();
+    buffer.resize(offset + cigarLength(instructions, true));
+    char *out = &buffer[offset];
+    for (const Instruction &ins : instructions) {
+        if (ins.isSeq()) {
+            *out++ = ins.getCharacter();
+        } else {
+            memset(out, '-', ins.bits.count);
+            out += ins.bits.count;
+        }
+    }
+}
+
+/**
+ * @brief Write MSA rows in the given order as a FASTA file
+ *
+ * Rows are rendered in parallel in chunks of consecutive rows. Plain output is written with
+ * pwrite at offsets precomputed from the row lengths; compressed output stores every chunk
+ * as an independent zstd frame, appended in row order, which decompresses as one stream.
+ *
+ * @param headers FASTA headers indexed like cigars
+ * @param rows indices into cigars in output order
+ */
+void writeMSAFasta(
+    const std::string &fileName,
+    const std::vector<std::string> &headers,
+    const std::vector<std::vector<Instruction> > &cigars,
+    const std::vector<size_t> &rows,
+    int threads,
+    bool compressed
+) {
+    const size_t chunkBytes = 4 * 1024 * 1024;
+
+    // '>' header '\n' row '\n'
+    std::vector<size_t> offsets(rows.size() + 1, 0);
+    for (size_t i = 0; i < rows.size(); i++) {
+        offsets[i + 1] = offsets[i] + headers[rows[i]].size() + cigarLength(cigars[rows[i]], true) + 3;
+    }
+    std::vector<size_t> chunkStart(1, 0);
+    for (size_t i = 1; i < rows.size(); i++) {
+        if (offsets[i] - offsets[chunkStart.back()] >= chunkBytes) {
+            chunkStart.push_back(i);
+        }
+    }
+    chunkStart.push_back(rows.size());
+    const size_t chunkCnt = chunkStart.size() - 1;
+
+    int fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        Debug(Debug::ERROR) << "Could not open " << fileName << " for writing\n";
+        EXIT(EXIT_FAILURE);
+    }
+    if (compressed == false && ftruncate(fd, offsets.back()) != 0) {
+        Debug(Debug::ERROR) << "Could not allocate " << offsets.back() << " bytes for " << fileName << "\n";
+        EXIT(EXIT_FAILURE);
+    }
+    size_t compressedOffset = 0;
+    bool failed = false;
+
+#pragma omp parallel num_threads(threads)
+{
+    std::string buffer;
+    std::string frame;
+
+#pragma omp for ordered schedule(dynamic, 1)
+    for (size_t c = 0; c < chunkCnt; c++) {
+        buffer.clear();
+        for (size_t i = chunkStart[c]; i < chunkStart[c + 1]; i++) {
+            buffer.append(1, '>');
+            buffer.append(headers[rows[i]]);
+            buffer.append(1, '\n');
+            appendExpanded(buffer, cigars[rows[i]]);
+            buffer.append(1, '\n');
+        }
+        const char *data = buffer.data();
+        size_t size = buffer.size();
+        if (compressed) {
+            frame.resize(ZSTD_compressBound(size));
+            size = ZSTD_compress(&frame[0], frame.size(), buffer.data(), buffer.size(), ZSTD_CLEVEL_DEFAULT);
+            if (ZSTD_isError(size)) {
+#pragma omp critical
+                failed = true;
+                size = 0;
+            }
+            data = frame.data();
+        }
+        size_t offset = offsets[chunkStart[c]];
+#pragma omp ordered
+        {
+            // compressed frames only know their position once all previous frames are done
+            if (compressed) {
+                offset = compressedOffset;
+                compressedOffset += size;
+            }
+        }
+        while (size > 0) {
+            ssize_t written = pwrite(fd, data, size, offset);
+            if (written <= 0) {
+#pragma omp critical
+                failed = true;
+                break;
+            }
+            data += written;
+            offset += written;
+            size -= written;
+        }
+    }
+}
+    if (close(fd) != 0 || failed) {
+        Debug(Debug::ERROR) << "Could not write " << fileName << "\n";
+        EXIT(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Convert sequence string to vector of Instructions
+ * 
+ * e.g. --AB-C
+ *      state 1, count 2
+ *      state 0, A
+ *      state 0, B
+ *      state 1, count 1
+ *      state 0, C
+ *
+ * @param sequence 
+ * @return std::vector<Instruction> 
+ */
+std::vector<Instruction> contract(const std::string& sequence) {
+    std::vector<Instruction> instructions;
+    for (const char& letter : sequence) {
+        if (letter == '\0') {
+            break;
+        }
+        if (letter == '-') {
+            if (needNewInstruction(instructions)) {
+                instructions.emplace_back(static_cast<int>(1));
+            } else {
+                instructions.back().bits.count++;
+            }
+        } else {
+            instructions.emplace_back(letter);
+        }
+    };
+    // std::string rex = expand(instructions);
+    // assert(rex == sequence);
+    return instructions;
+}
+
+void printInstructions(std::vector<Instruction> &instructions) {
+    for (Instruction ins : instructions) {
+        if (ins.bits.state == 0) { 
+            std::cout << ins.getCharacter();
+        } else {
+            for (int i = 0; i < ins.bits.count; i++) {
+                std::cout << '-';
+            }
+        }
+    }
+    std::cout << '\n';
+}
+
+/**
+ * @brief Add gaps to a vector of instructions
+ * 
+ * @param toAdd number of gaps to add to end of instructions
+ * @param instructions vector of instructions
+ */
+void addCigarGaps(
+    int toAdd,
+    std::vector<Instruction> &instructionsAA,
+    std::vector<Instruction> &instructionsSS
+) {
+    while (toAdd > 0) {
+        if (needNewInstruction(instructionsAA)) {
+            instructionsAA.emplace_back(0);
+            instructionsSS.emplace_back(0);
+        }
+        int spaceLeft = 127 - static_cast<int>(instructionsAA.back().bits.count);
+        if (toAdd > spaceLeft) {
+            instructionsAA.back().bits.count = 127;
+            instructionsSS.back().bits.count = 127;
+            toAdd -= spaceLeft;
+        } else {
+            instructionsAA.back().bits.count += toAdd;
+            instructionsSS.back().bits.count += toAdd;
+            toAdd = 0;
+        }
+    }
+}
+
+/**
+ * @brief Generate new instructions for gaps/sequence before start of alignment
+ * 
+ * The old instructions are not modified; oldOffset tracks how much of the current
+ * old gap instruction has already been consumed.
+ *
+ * @param toAdd number of sequence positions to add
+ * @param oldIndex index of current old instruction
+ * @param oldOffset number of gaps already used from the current old instruction
+ * @param newInstructionsAA 
+ * @param newInstructionsSS 
+ * @param oldInstructionsAA 
+ * @param oldInstructionsSS 
+ */
+void addCigarIndices(
+    int toAdd,
+    int &oldIndex,
+    int &oldOffset,
+    std::vector<Instruction> &newInstructionsAA,
+    std::vector<Instruction> &newInstructionsSS,
+    const std::vector<Instruction> &oldInstructionsAA,
+    const std::vector<Instruction> &oldInstructionsSS
+) {
+    while (toAdd > 0) {
+        if (oldInstructionsAA[oldIndex].isSeq()) {
+            newInstructionsAA.emplace_back(oldInstructionsAA[oldIndex].getCharacter());
+            newInstructionsSS.emplace_back(oldInstructionsSS[oldIndex].getCharacter());
+            oldIndex++;
+            toAdd--;
+        } else {
+            if (needNewInstruction(newInstructionsAA)) {
+                newInstructionsAA.emplace_back(0);
+                newInstructionsSS.emplace_back(0);
+            }
+            // take as many gaps as are left in the old instruction and fit in the new one
+            int spaceLeft = 127 - newInstructionsAA.back().bits.count;
+            int oldLeft = oldInstructionsAA[oldIndex].bits.count - oldOffset;
+            int toTake = std::min(toAdd, std::min(spaceLeft, oldLeft));
+            newInstructionsAA.back().bits.count += toTake;
+            newInstructionsSS.back().bits.count += toTake;
+            oldOffset += toTake;
+            toAdd -= toTake;
+            if (oldOffset == oldInstructionsAA[oldIndex].bits.count) {
+                oldIndex++;
+                oldOffset = 0;
+            }
+        }
+    }
+}
+
+void updateQueryCIGAR(
+    const std::vector<Instruction> &cigar_aa,
+    const std::vector<Instruction> &cigar_ss,
+    std::vector<Instruction> &instructions,
+    int preGap,
+    int preSequence,
+    int endGap,
+    int endSequence,
+    std::vector<Instruction> &aa,
+    std::vector<Instruction> &ss
+) {
+    int cigarIndex = 0;
+    int cigarOffset = 0;
+    aa.clear();
+    ss.clear();
+    addCigarGaps(preGap, aa, ss);
+    addCigarIndices(preSequence, cigarIndex, cigarOffset, aa, ss, cigar_aa, cigar_ss);
+    for (Instruction ins : instructions) {
+        if (ins.isSeq()) {
+            addCigarIndices(ins.bits.count, cigarIndex, cigarOffset, aa, ss, cigar_aa, cigar_ss);
+        } else {
+            addCigarGaps(ins.bits.count, aa, ss);
+        }
+    }
+    addCigarIndices(endSequence, cigarIndex, cigarOffset, aa, ss, cigar_aa, cigar_ss);
+    addCigarGaps(endGap, aa, ss);
+}
+
+void updateTargetCIGAR(
+    const std::vector<Instruction> &cigar_aa,
+    const std::vector<Instruction> &cigar_ss,
+    std::vector<Instruction> &instructions,
+    int preGap,
+    int preSequence,
+    int endGap,
+    int endSequence,
+    std::vector<Instruction> &aa,
+    std::vector<Instruction> &ss
+) {
+    int cigarIndex = 0;
+    int cigarOffset = 0;
+    aa.clear();
+    ss.clear();
+    addCigarIndices(preSequence, cigarIndex, cigarOffset, aa, ss, cigar_aa, cigar_ss);
+    addCigarGaps(preGap, aa, ss);
+    for (Instruction ins : instructions) {
+        if (ins.isSeq()) {
+            addCigarIndices(ins.bits.count, cigarIndex, cigarOffset, aa, ss, cigar_aa, cigar_ss);
+        } else {
+            addCigarGaps(ins.bits.count, aa, ss);
+        }
+    }
+    addCigarGaps(endGap, aa, ss);
+    addCigarIndices(endSequence, cigarIndex, cigarOffset, aa, ss, cigar_aa, cigar_ss);
+}
+
+/**
+ * @brief Check whether merge instructions leave a group's rows unchanged
+ *
+ * True if no gaps are inserted and the instructions cover exactly the current row length.
+ */
+bool mergeKeepsRows(const std::vector<Instruction> &instructions, int gaps, int sequence, int rowLength) {
+    if (gaps > 0) {
+        return false;
+    }
+    int columns = sequence;
+    for (const Instruction &ins : instructions) {
+        if (ins.isSeq() == false) {
+            return false;
+        }
+        columns++;
+    }
+    return columns == rowLength;
+}
+
+/**
+ * @brief Rewrite the CIGARs of both merged groups according to their pairwise alignment
+ *
+ * New rows are swapped into place rather than copied. A group whose merge instructions
+ * insert no gaps keeps its rows as they are, so only rows that actually change are
+ * rebuilt and, if undoLog is given, kept there so the merge can be rolled back.
+ */
+void updateCIGARs(
+    Matcher::result_t& result,
+    std::vector<size_t>& map1,
+    std::vector<size_t>& map2,
+    std::vector<std::vector<Instruction> >& cigars_aa,
+    std::vector<std::vector<Instruction> >& cigars_ss,
+    std::vector<size_t>& q_members,
+    std::vector<size_t>& t_members,
+    std::vector<Instruction>& q_ins,
+    std::vector<Instruction>& t_ins,
+    CigarUndoLog *undoLog
+) {
+    GapData g = getGapData(result, map1, map2); 
+    std::vector<Instruction> aa;
+    std::vector<Instruction> ss;
+    bool keepQuery = q_members.empty() || mergeKeepsRows(q_ins, g.preGaps + g.endGaps, g.preSequence + g.endSequence, cigarLength(cigars_aa[q_members[0]], true));
+    bool keepTarget = t_members.empty() || mergeKeepsRows(t_ins, g.preSequence + g.endSequence, g.preGaps + g.endGaps, cigarLength(cigars_aa[t_members[0]], true));
+    for (size_t i = 0; keepQuery == false && i < q_members.size(); i++) {
+        size_t m = q_members[i];
+        updateQueryCIGAR(cigars_aa[m], cigars_ss[m], q_ins, g.preGaps, g.preSequence, g.endGaps, g.endSequence, aa, ss);
+        if (undoLog != NULL) {
+            undoLog->replace(m, cigars_aa, cigars_ss, aa, ss);
+        } else {
+            cigars_aa[m].swap(aa);
+            cigars_ss[m].swap(ss);
+        }
+    }
+    for (size_t i = 0; keepTarget == false && i < t_members.size(); i++) {
+        size_t m = t_members[i];
+        updateTargetCIGAR(cigars_aa[m], cigars_ss[m], t_ins, g.preSequence, g.preGaps, g.endSequence, g.endGaps, aa, ss);
+        if (undoLog != NULL) {
+            undoLog->replace(m, cigars_aa, cigars_ss, aa, ss);
+        } else {
+            cigars_aa[m].swap(aa);
+            cigars_ss[m].swap(ss);
+        }
+    }
+}
+
+void testSeqLens(std::vector<size_t> &MAYBE_UNUSED(indices), std::vector<std::vector<Instruction> > &MAYBE_UNUSED(cigars), std::vector<int> &MAYBE_UNUSED(lengths)) {
+    for (int MAYBE_UNUSED(index) : indices) {
+        assert(lengths[index] == cigarLength(cigars[index], false));
+    }
+}
+
+/**
+ * @brief Per-thread TM-align and LDDT buffers for leaf-leaf merges
+ *
+ * Both aligners are only reallocated when a longer structure comes along.
+ */
+struct LeafAlignmentWorkspace {
+    LeafAlignmentWorkspace() : tmaligner(NULL), tmCapacity(0), lddtcalculator(NULL), lddtCapacity(0) {}
+    ~LeafAlignmentWorkspace() {
+        delete tmaligner;
+        delete lddtcalculator;
+    }
+    TMaligner &getTMaligner(unsigned int length) {
+        if (length > tmCapacity) {
+            delete tmaligner;
+            tmCapacity = length;
+            tmaligner = new TMaligner(tmCapacity, 1, 0, false);
+        }
+        return *tmaligner;
+    }
+    LDDTCalculator &getLDDTCalculator(unsigned int length) {
+        if (length > lddtCapacity) {
+            delete lddtcalculator;
+            lddtCapacity = length;
+            lddtcalculator = new LDDTCalculator(lddtCapacity, lddtCapacity);
+        }
+        return *lddtcalculator;
+    }
+
+    TMaligner *tmaligner;
+    unsigned int tmCapacity;
+    LDDTCalculator *lddtcalculator;
+    unsigned int lddtCapacity;
+    Coordinate16 qcoords;
+    Coordinate16 tcoords;
+};
+
+Matcher::result_t pairwiseTMAlign(
+    LeafAlignmentWorkspace &workspace,
+    int mergedId,
+    int targetId,
+    DBReader<unsigned int> &seqDbrAA,
+    float *qCaData,
+    float *tCaData,
+    unsigned int thread_idx
+) {
+    int qLen = seqDbrAA.getSeqLen(mergedId);
+    int tLen = seqDbrAA.getSeqLen(targetId);
+    char *merged_aa_seq = seqDbrAA.getData(mergedId, thread_idx);
+    char *target_aa_seq = seqDbrAA.getData(targetId, thread_idx);
+
+    float TMscore = 0.0;
+    TMaligner &tmaln = workspace.getTMaligner(std::max(qLen, tLen) + VECSIZE_FLOAT);
+    tmaln.initQuery(qCaData, &qCaData[qLen], &qCaData[qLen * 2], merged_aa_seq, qLen);
+    Matcher::result_t res = tmaln.align(targetId, tCaData, &tCaData[tLen], &tCaData[tLen * 2], target_aa_seq, tLen, TMscore);
+    res.backtrace = Matcher::uncompressAlignment(res.backtrace);
+    res.score /= 100;
+
+    return res;
+}
+
+// copy from one to two
+void copyInstructions(std::vector<Instruction> &one, std::vector<Instruction> &two) {
+    for (Instruction ins : one) {
+        two.emplace_back(static_cast<int>(ins.bits.state), static_cast<int>(ins.bits.count));
+    }
+}
+
+// copy from one to two
+void copyInstructionVectors(std::vector<std::vector<Instruction> > &one, std::vector<std::vector<Instruction> > &two) {
+    two.clear();
+    two.resize(one.size());
+    // for (std::vector<Instruction> vec : one) {
+    for (size_t i = 0; i < one.size(); i++) {
+        // std::vector<Instruction> tmp;
+        copyInstructions(one[i], two[i]);
+        // two[i] = tmp;
+    }
+}
+
+/**
+ * @brief Merge order for --recompute-scores, chosen round by round from updated scores
+ *
+ * Scores between all active nodes (structures or merged sub-MSAs, named by one member) are
+ * kept in a dense matrix. Every round merges all pairs of nodes that are each other's best
+ * partner, so the best scoring pair is always among them. Only the nodes created by a round
+ * are rescored against the remaining ones, with a score-only ungapped pass of their profile;
+ * all other scores are kept from earlier rounds.
+ */
+class DynamicMergeOrder {
+public:
+    DynamicMergeOrder(std::vector<AlnSimple> &hits, size_t sequenceCnt) : nodeIndex(sequenceCnt, SIZE_MAX), rescored(0) {
+        for (AlnSimple &hit : hits) {
+            addNode(hit.queryId);
+            addNode(hit.targetId);
+        }
+        size_t n = ids.size();
+        scores.assign(n * n, INT_MIN);
+        for (AlnSimple &hit : hits) {
+            size_t a = nodeIndex[hit.queryId];
+            size_t b = nodeIndex[hit.targetId];
+            scores[a * n + b] = hit.score;
+            scores[b * n + a] = hit.score;
+        }
+        active.assign(n, true);
+        best.assign(n, SIZE_MAX);
+        consensusAa.resize(n);
+        consensusSs.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            findBest(i);
+        }
+    }
+
+    /**
+     * @brief Append the next round of merges to hits and merges; nothing is added once one node is left
+     */
+    void nextRound(std::vector<AlnSimple> &hits, std::vector<size_t> &merges) {
+        size_t n = ids.size();
+        if (!merged.empty()) {
+            std::vector<bool> isNew(n, false);
+            for (size_t r : merged) {
+                isNew[r] = true;
+            }
+            for (size_t i = 0; i < n; i++) {
+                if (!active[i]) {
+                    continue;
+                }
+                if (isNew[i] || best[i] == SIZE_MAX || !active[best[i]] || isNew[best[i]]) {
+                    findBest(i);
+                    continue;
+                }
+                for (size_t r : merged) {
+                    if (r != i && better(i, r, best[i])) {
+                        best[i] = r;
+                    }
+                }
+            }
+        }
+
+        // Reciprocal best pairs are disjoint and can be merged in the same round
+        std::vector<AlnSimple> round;
+        for (size_t i = 0; i < n; i++) {
+            if (active[i] && best[i] != SIZE_MAX && i < best[i] && best[best[i]] == i) {
+                AlnSimple hit;
+                hit.queryId = ids[i];
+                hit.targetId = ids[best[i]];
+                hit.score = scores[i * n + best[i]];
+                round.push_back(hit);
+            }
+        }
+        sortHitsByScore(round);
+        merged.clear();
+        work.clear();
+        if (round.empty()) {
+            return;
+        }
+        for (AlnSimple &hit : round) {
+            merged.push_back(nodeIndex[hit.queryId]);
+            active[nodeIndex[hit.targetId]] = false;
+        }
+        hits.insert(hits.end(), round.begin(), round.end());
+        merges.push_back(round.size());
+
+        // Pairs to rescore once the round is merged, new-new pairs only once
+        std::vector<bool> isNew(n, false);
+        for (size_t r : merged) {
+            isNew[r] = true;
+        }
+        for (size_t r : merged) {
+            for (size_t c = 0; c < n; c++) {
+                if (active[c] && c != r && !(isNew[c] && c < r)) {
+                    work.emplace_back(r, c);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Score the nodes merged in the last round against all active nodes
+     *
+     * Must be called by every thread of the enclosing parallel region, after the round was merged.
+     */
+    void rescore(
+        MSAContainer &msa,
+        EncodedSequences &encoded,
+        StructureSmithWaterman &structureSmithWaterman,
+        SimdDispatch::UngappedProfile &ungappedProfile,
+        Sequence &profileAa,
+        Sequence &profileSs,
+        int8_t *tinySubMatAA,
+        int8_t *tinySubMat3Di,
+        SubstitutionMatrix &subMat_aa
+    ) {
+        size_t n = ids.size();
+#pragma omp for schedule(dynamic, 1)
+        for (size_t i = 0; i < merged.size(); i++) {
+            size_t r = merged[i];
+            SubMSA &sub = msa[msa.dbIdToSubMSAVec[ids[r]]];
+            profileAa.mapSequence(0, 0, sub.profile_aa.c_str(), sub.profile_aa.length() / Sequence::PROFILE_READIN_SIZE);
+            profileSs.mapSequence(0, 0, sub.profile_ss.c_str(), sub.profile_ss.length() / Sequence::PROFILE_READIN_SIZE);
+            consensusAa[r].assign((const char *) profileAa.numConsensusSequence, profileAa.L);
+            consensusSs[r].assign((const char *) profileSs.numConsensusSequence, profileSs.L);
+        }
+
+        // Contiguous blocks per thread, so the query profile is mostly initialised once per node
+        size_t current = SIZE_MAX;
+#pragma omp for schedule(static)
+        for (size_t i = 0; i < work.size(); i++) {
+            size_t r = work[i].first;
+            size_t c = work[i].second;
+            if (r != current) {
+                SubMSA &sub = msa[msa.dbIdToSubMSAVec[ids[r]]];
+                profileAa.mapSequence(0, 0, sub.profile_aa.c_str(), sub.profile_aa.length() / Sequence::PROFILE_READIN_SIZE);
+                profileSs.mapSequence(0, 0, sub.profile_ss.c_str(), sub.profile_ss.length() / Sequence::PROFILE_READIN_SIZE);
+                structureSmithWaterman.ssw_init(&profileAa, &profileSs, tinySubMatAA, tinySubMat3Di, &subMat_aa);
+                structureSmithWaterman.createUngappedProfile(ungappedProfile);
+                current = r;
+            }
+            int score;
+            if (msa.isProfile(ids[c])) {
+                score = structureSmithWaterman.ungapped_alignment(
+                    (const unsigned char *) consensusAa[c].c_str(), (const unsigned char *) consensusSs[c].c_str(), consensusAa[c].length(), &ungappedProfile
+                );
             } else {
-                instructions.back().bits.count++;
+                score = structureSmithWaterman.ungapped_alignment(encoded.aa(ids[c]), encoded.ss(ids[c]), encoded.length(ids[c]), &ungappedProfile);
+            }
+            scores[r * n + c] = score;
+            scores[c * n + r] = score;
+        }
+#pragma omp master
+        {
+            rescored += work.size();
+        }
+    }
+
+    size_t rescoredPairs() const { return rescored; }
+
+private:
+    std::vector<size_t> ids;
+    std::vector<size_t> nodeIndex;
+    std::vector<int> scores;
+    std::vector<bool> active;
+    std::vector<size_t> best;
+    std::vector<size_t> merged;
+    std::vector<std::pair<size_t, size_t> > work;
+    std::vector<std::string> consensusAa;
+    std::vector<std::string> consensusSs;
+    size_t rescored;
+
+    void addNode(size_t id) {
+        if (nodeIndex[id] == SIZE_MAX) {
+            nodeIndex[id] = ids.size();
+            ids.push_back(id);
+        }
+    }
+
+    // Higher score wins, ties go to the lower database id
+    bool better(size_t i, size_t a, size_t b) {
+        if (b == SIZE_MAX) {
+            return true;
+        }
+        size_t n = ids.size();
+        int sa = scores[i * n + a];
+        int sb = scores[i * n + b];
+        return (sa == sb) ? (ids[a] < ids[b]) : (sa > sb);
+    }
+
+    void findBest(size_t i) {
+        best[i] = SIZE_MAX;
+        for (size_t j = 0; j < ids.size(); j++) {
+            if (j != i && active[j] && scores[i * ids.size() + j] != INT_MIN && better(i, j, best[i])) {
+                best[i] = j;
+            }
+        }
+    }
+};
+
+/**
+ * @brief Progressively merge structures and sub-MSAs of msa along a linkage
+ *
+ * hits holds the linkage in merge rounds as produced by reorderLinkage, merges the number of
+ * independent merges per round. Merges within a round run in parallel.
+ * With dynamicOrder, hits and merges are extended round by round after rescoring.
+ * Alignment starts at round startRound; with a checkpoint, the rows merged since the previous save are appended every
+ * par.checkpointRounds rounds and after the last round.
+ */
+void progressiveAlignment(
+    MSAContainer &msa,
+    std::vector<AlnSimple> &hits,
+    std::vector<size_t> &merges,
+    FoldmasonParameters &par,
+    DBReader<unsigned int> &seqDbrAA,
+    EncodedSequences &encoded,
+    DBReader<unsigned int> *seqDbrCA,
+    int8_t *tinySubMatAA,
+    int8_t *tinySubMat3Di,
+    SubstitutionMatrix &subMat_aa,
+    SubstitutionMatrix &subMat_3di,
+    int maxSeqLength,
+    size_t sequenceCnt,
+    DynamicMergeOrder *dynamicOrder = NULL,
+    size_t startRound = 0,
+    MSACheckpoint *checkpoint = NULL,
+    const StoredAlignments *storedAlignments = NULL
+) {
+    if (startRound >= merges.size()) {
+        return;
+    }
+    bool caExist = (seqDbrCA != NULL);
+
+    // global reduction vectors
+    std::vector<SubMSA> globalSubMSAs;
+    std::vector<size_t> globalToRemove;
+    int index = std::accumulate(merges.begin(), merges.begin() + startRound, 0); // in hit list
+    size_t maxMerges = *std::max_element(merges.begin() + startRound, merges.end());
+    int maxThreads = (dynamicOrder != NULL) ? par.threads : std::min(par.threads, static_cast<int>(maxMerges));
+
+#pragma omp parallel num_threads(maxThreads)
+{
+    unsigned int thread_idx = 0;
+#ifdef OPENMP
+    thread_idx = static_cast<unsigned int>(omp_get_thread_num());
+#endif
+
+    // Initialise alignment objects per thread
+    StructureSmithWaterman structureSmithWaterman(par.maxSeqLen, subMat_3di.alphabetSize, par.compBiasCorrection, par.compBiasCorrectionScale, &subMat_aa, &subMat_3di);
+    SimdDispatch::UngappedProfile *ungappedProfile = (dynamicOrder != NULL) ? new SimdDispatch::UngappedProfile(par.maxSeqLen, subMat_3di.alphabetSize) : NULL;
+    MsaFilter filter_aa(maxSeqLength + 1, sequenceCnt + 1, &subMat_aa, par.gapOpen.values.aminoacid(), par.gapExtend.values.aminoacid());
+    MsaFilter filter_3di(maxSeqLength + 1, sequenceCnt + 1, &subMat_3di, par.gapOpen.values.aminoacid(), par.gapExtend.values.aminoacid()); 
+    PSSMCalculator calculator_aa(&subMat_aa, maxSeqLength + 1, sequenceCnt + 1, par.pcmode, par.pcaAa, par.pcbAa
+#ifdef GAP_POS_SCORING
+    , par.gapOpen.values.aminoacid(), par.gapPseudoCount
+#endif
+    );
+    PSSMCalculator calculator_3di(&subMat_3di, maxSeqLength + 1, sequenceCnt + 1, par.pcmode, par.pca3di, par.pcb3di
+#ifdef GAP_POS_SCORING
+    , par.gapOpen.values.aminoacid(), par.gapPseudoCount
+#endif
+    );
+
+    // Add four seq objects per alignee per thread
+    // Amino acid profile/sequence, 3Di profile/sequence
+    Sequence seqMergedAaAa(par.maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) &subMat_aa,  0, false, par.compBiasCorrection);
+    Sequence seqMergedAaPr(par.maxSeqLen, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_aa,  0, false, par.compBiasCorrection);
+    Sequence seqMergedSsAa(par.maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) &subMat_3di, 0, false, par.compBiasCorrection);
+    Sequence seqMergedSsPr(par.maxSeqLen, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_3di, 0, false, par.compBiasCorrection);
+    Sequence seqTargetAaAa(par.maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) &subMat_aa,  0, false, par.compBiasCorrection);
+    Sequence seqTargetAaPr(par.maxSeqLen, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_aa,  0, false, par.compBiasCorrection);
+    Sequence seqTargetSsAa(par.maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) &subMat_3di, 0, false, par.compBiasCorrection);
+    Sequence seqTargetSsPr(par.maxSeqLen, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_3di, 0, false, par.compBiasCorrection);
+    
+    // Pointers to whichever Sequence we need to use per-alignment
+    Sequence *seqMergedAa;
+    Sequence *seqMergedSs;
+    Sequence *seqTargetAa;
+    Sequence *seqTargetSs;
+
+    // TM-align/LDDT buffers for leaf-leaf merges
+    LeafAlignmentWorkspace leafWorkspace;
+
+    // thread-local vectors
+    std::vector<SubMSA> subMSAs;
+    std::vector<size_t> toRemove;
+
+    for (size_t i = startRound; i < merges.size(); i++) {
+        subMSAs.reserve(merges[i]);
+
+
+#pragma omp for schedule(static, 1)
+        for (size_t j = 0; j < merges[i]; j++) {
+
+            size_t mergedId = hits[index + j].queryId;
+            size_t targetId = hits[index + j].targetId;
+            if (mergedId == targetId) {
+                continue;
+            }
+
+            size_t querySubMSA = msa.dbIdToSubMSAVec[mergedId];
+            bool queryIsProfile = msa.isProfile(mergedId);
+            size_t targetSubMSA = msa.dbIdToSubMSAVec[targetId];
+            bool targetIsProfile = msa.isProfile(targetId);
+
+            // mask e.g. 010101 <=> [ 0, 2, 4 ] index
+            std::vector<size_t> map1;
+            std::vector<size_t> map2;
+
+            // ids of members for each group
+            std::vector<size_t> qMembers;
+            std::vector<size_t> tMembers;
+
+            if (queryIsProfile) {
+                SubMSA& q = msa[querySubMSA];
+                qMembers.assign(q.members.begin(), q.members.end());
+                seqMergedAaPr.mapSequence(mergedId, mergedId, q.profile_aa.c_str(), q.profile_aa.length() / Sequence::PROFILE_READIN_SIZE);
+                seqMergedSsPr.mapSequence(mergedId, mergedId, q.profile_ss.c_str(), q.profile_ss.length() / Sequence::PROFILE_READIN_SIZE);
+                seqMergedAa = &seqMergedAaPr;
+                seqMergedSs = &seqMergedSsPr;
+                maskToMapping(q.mask, map1);
+            } else {
+                size_t length = seqDbrAA.getSeqLen(mergedId);
+                qMembers = { mergedId };
+                seqMergedAaAa.mapSequence(mergedId, mergedId, encoded.aaData(mergedId));
+                seqMergedSsAa.mapSequence(mergedId, mergedId, encoded.ssData(mergedId));
+                seqMergedAa = &seqMergedAaAa;
+                seqMergedSs = &seqMergedSsAa;
+                map1.resize(length);
+                std::iota(map1.begin(), map1.end(), 0);
+            }
+
+            if (targetIsProfile) {
+                SubMSA& t = msa[targetSubMSA];
+                tMembers.assign(t.members.begin(), t.members.end());
+                seqTargetAaPr.mapSequence(targetId, targetId, t.profile_aa.c_str(), t.profile_aa.length() / Sequence::PROFILE_READIN_SIZE);
+                seqTargetSsPr.mapSequence(targetId, targetId, t.profile_ss.c_str(), t.profile_ss.length() / Sequence::PROFILE_READIN_SIZE);
+                seqTargetAa = &seqTargetAaPr;
+                seqTargetSs = &seqTargetSsPr;
+                maskToMapping(t.mask, map2);
+            } else {
+                size_t length = seqDbrAA.getSeqLen(targetId);
+                tMembers = { targetId };
+                seqTargetAaAa.mapSequence(targetId, targetId, encoded.aaData(targetId));
+                seqTargetSsAa.mapSequence(targetId, targetId, encoded.ssData(targetId));
+                seqTargetAa = &seqTargetAaAa;
+                seqTargetSs = &seqTargetSsAa;
+                map2.resize(length);
+                std::iota(map2.begin(), map2.end(), 0);
+            }
+
+            // Use most informative profile as query
+            if (queryIsProfile && targetIsProfile) {
+                float q_neff_sum = 0.0;
+                float t_neff_sum = 0.0;
+                for (int i = 0; i < seqMergedSs->L; i++) {
+                    q_neff_sum += seqMergedSs->neffM[i];
+                }
+                for (int i = 0; i < seqTargetSs->L; i++) {
+                    t_neff_sum += seqTargetSs->neffM[i];
+                }
+                if (q_neff_sum <= t_neff_sum) {
+                    std::swap(mergedId, targetId);
+                    std::swap(seqMergedAa, seqTargetAa);
+                    std::swap(seqMergedSs, seqTargetSs);
+                    std::swap(queryIsProfile, targetIsProfile);
+                    std::swap(querySubMSA, targetSubMSA);
+                    std::swap(qMembers, tMembers);
+                    std::swap(map1, map2);
+                }
+            } else if (targetIsProfile && !queryIsProfile) {
+                std::swap(mergedId, targetId);
+                std::swap(seqMergedAa, seqTargetAa);
+                std::swap(seqMergedSs, seqTargetSs);
+                std::swap(queryIsProfile, targetIsProfile);
+                std::swap(querySubMSA, targetSubMSA);
+                std::swap(qMembers, tMembers);
+                std::swap(map1, map2);
+            }
+
+            // Since we will update the query subMSA, need to remove the target one 
+            if (targetIsProfile) {
+                toRemove.push_back(targetSubMSA);
+            }
+
+            // Do alignment, leaf merges reuse an alignment from the alignment DB if there is one
+            Matcher::result_t res;
+            bool storedLeafAlignment = storedAlignments != NULL && !queryIsProfile && !targetIsProfile
+                && findStoredAlignment(*storedAlignments, mergedId, targetId, res);
+            if (storedLeafAlignment == false) {
+                structureSmithWaterman.ssw_init(seqMergedAa, seqMergedSs, tinySubMatAA, tinySubMat3Di, &subMat_aa);
+                res = pairwiseAlignment(
+                    structureSmithWaterman,
+                    seqMergedAa->L,
+                    seqMergedAa,
+                    seqMergedSs, 
+                    seqTargetAa,
+                    seqTargetSs,
+                    par.gapOpen.values.aminoacid(),
+                    par.gapExtend.values.aminoacid(),
+                    &subMat_aa,
+                    &subMat_3di,
+                    par.compBiasCorrection
+                );
+            }
+            std::vector<Instruction> qBt;
+            std::vector<Instruction> tBt;
+            getMergeInstructions(res, map1, map2, qBt, tBt);
+
+            // If neither are profiles, do TM-align as well and take the best alignment
+            if (caExist && !queryIsProfile && !targetIsProfile) {
+                // Decode coordinates once for TM-align and both LDDT scores
+                int qLen = seqDbrAA.getSeqLen(mergedId);
+                int tLen = seqDbrAA.getSeqLen(targetId);
+                size_t qCaId = seqDbrCA->getId(msa.dbKeys[mergedId]);
+                size_t tCaId = seqDbrCA->getId(msa.dbKeys[targetId]);
+                float *qCaData = leafWorkspace.qcoords.read(seqDbrCA->getData(qCaId, thread_idx), qLen, seqDbrCA->getEntryLen(qCaId));
+                float *tCaData = leafWorkspace.tcoords.read(seqDbrCA->getData(tCaId, thread_idx), tLen, seqDbrCA->getEntryLen(tCaId));
+
+                Matcher::result_t tmRes = pairwiseTMAlign(leafWorkspace, mergedId, targetId, seqDbrAA, qCaData, tCaData, thread_idx);
+                double lddtTM = 0.0;
+                double lddt3Di = 0.0;
+                calculate_lddt_pair(
+                    leafWorkspace.getLDDTCalculator(std::max(qLen, tLen)),
+                    qCaData, qLen, tCaData, tLen, tmRes, res, lddtTM, lddt3Di
+                );
+                if (lddtTM > lddt3Di) {
+                    qBt.clear();
+                    tBt.clear();
+                    getMergeInstructions(tmRes, map1, map2, qBt, tBt);
+                    std::swap(res, tmRes);
+                }
+            }
+
+            updateCIGARs(res, map1, map2, msa.cigars_aa, msa.cigars_ss, qMembers, tMembers, qBt, tBt);
+
+            SubMSA *newSubMSA;
+            if (queryIsProfile) {
+                size_t idx = msa.mergeInto(mergedId, targetId);
+                newSubMSA = &msa[idx];
+            } else {
+                subMSAs.emplace_back();
+                newSubMSA = &subMSAs.back();
+                newSubMSA->id = mergedId;
+                newSubMSA->concat(qMembers);
+                newSubMSA->concat(tMembers);
+            }
+
+            // Don't need to make profiles on final alignment, unless they are rescored
+            if (dynamicOrder != NULL || !(i == merges.size() - 1 && j == merges[i] - 1)) {
+                newSubMSA->mask = computeProfileMask(
+                    newSubMSA->members,
+                    msa.cigars_aa,
+                    subMat_aa,
+                    par.matchRatio
+                );
+                newSubMSA->profile_aa = msa2profile(
+                    newSubMSA->members,
+                    msa.cigars_aa,
+                    newSubMSA->mask,
+                    calculator_aa,
+                    filter_aa,
+                    subMat_aa,
+                    par.filterMsa,
+                    par.compBiasCorrection,
+                    par.qid,
+                    par.filterMaxSeqId,
+                    par.Ndiff,
+                    par.covMSAThr,
+                    par.qsc,
+                    par.filterMinEnable,
+                    par.wg
+                );
+                newSubMSA->profile_ss = msa2profile(
+                    newSubMSA->members,
+                    msa.cigars_ss,
+                    newSubMSA->mask,
+                    calculator_3di,
+                    filter_3di,
+                    subMat_3di,
+                    par.filterMsa,
+                    par.compBiasCorrection,
+                    par.qid,
+                    par.filterMaxSeqId,
+                    par.Ndiff,
+                    par.covMSAThr,
+                    par.qsc,
+                    par.filterMinEnable,
+                    par.wg
+                );
             }
-        } else {
-            instructions.emplace_back(letter);
         }
-    };
-    // std::string rex = expand(instructions);
-    // assert(rex == sequence);
-    return instructions;
-}
 
-void printInstructions(std::vector<Instruction> &instructions) {
-    for (Instruction ins : instructions) {
-        if (ins.bits.state == 0) { 
-            std::cout << ins.getCharacter();
-        } else {
-            for (int i = 0; i < ins.bits.count; i++) {
-                std::cout << '-';
+#pragma omp critical
+        {
+            globalSubMSAs.insert(globalSubMSAs.end(), subMSAs.begin(), subMSAs.end());
+            globalToRemove.insert(globalToRemove.end(), toRemove.begin(), toRemove.end());
+            subMSAs.clear();
+            toRemove.clear();
+        }
+#pragma omp barrier
+#pragma omp master
+        {
+            msa.update(globalSubMSAs, globalToRemove);
+            globalSubMSAs.clear();
+            globalToRemove.clear();
+            index += merges[i];
+            if (checkpoint != NULL && (i + 1) < merges.size() && (i + 1) % par.checkpointRounds == 0) {
+                checkpoint->save(msa, hits, merges, i + 1);
+            }
+        }
+#pragma omp barrier
+        if (dynamicOrder != NULL) {
+            dynamicOrder->rescore(msa, encoded, structureSmithWaterman, *ungappedProfile, seqMergedAaPr, seqMergedSsPr, tinySubMatAA, tinySubMat3Di, subMat_aa);
+#pragma omp barrier
+#pragma omp master
+            {
+                dynamicOrder->nextRound(hits, merges);
             }
+#pragma omp barrier
         }
     }
-    std::cout << '\n';
+    delete ungappedProfile;
+}
+    if (checkpoint != NULL) {
+        checkpoint->save(msa, hits, merges, merges.size());
+        checkpoint->wait();
+    }
 }
 
 /**
- * @brief Add gaps to a vector of instructions
- * 
- * @param toAdd number of gaps to add to end of instructions
- * @param instructions vector of instructions
+ * @brief Split a guide tree into clades of at most maxCladeSize structures
+ *
+ * Tree edges are taken strongest first and join two clades unless the result would be too
+ * large. Skipped edges are returned in interClade and connect the clades as a tree.
+ *
+ * @return clade index of every structure, SIZE_MAX for structures not in the tree
  */
-void addCigarGaps(
-    int toAdd,
-    std::vector<Instruction> &instructionsAA,
-    std::vector<Instruction> &instructionsSS
+std::vector<size_t> splitIntoClades(
+    std::vector<AlnSimple> linkage,
+    size_t sequenceCnt,
+    size_t maxCladeSize,
+    std::vector<AlnSimple> &intraClade,
+    std::vector<AlnSimple> &interClade,
+    size_t &cladeCnt
 ) {
-    while (toAdd > 0) {
-        if (needNewInstruction(instructionsAA)) {
-            instructionsAA.emplace_back(0);
-            instructionsSS.emplace_back(0);
-        }
-        int spaceLeft = 127 - static_cast<int>(instructionsAA.back().bits.count);
-        if (toAdd > spaceLeft) {
-            instructionsAA.back().bits.count = 127;
-            instructionsSS.back().bits.count = 127;
-            toAdd -= spaceLeft;
+    sortHitsByScore(linkage);
+    std::vector<int> parent(sequenceCnt);
+    std::vector<size_t> size(sequenceCnt, 1);
+    std::vector<bool> inTree(sequenceCnt, false);
+    std::iota(parent.begin(), parent.end(), 0);
+    for (AlnSimple &aln : linkage) {
+        inTree[aln.queryId] = true;
+        inTree[aln.targetId] = true;
+        int u = findRoot(aln.queryId, parent);
+        int v = findRoot(aln.targetId, parent);
+        if (size[u] + size[v] <= maxCladeSize) {
+            parent[u] = v;
+            size[v] += size[u];
+            intraClade.push_back(aln);
         } else {
-            instructionsAA.back().bits.count += toAdd;
-            instructionsSS.back().bits.count += toAdd;
-            toAdd = 0;
+            interClade.push_back(aln);
+        }
+    }
+    std::vector<size_t> clade(sequenceCnt, SIZE_MAX);
+    std::vector<size_t> rootToClade(sequenceCnt, SIZE_MAX);
+    cladeCnt = 0;
+    for (size_t i = 0; i < sequenceCnt; i++) {
+        if (!inTree[i]) {
+            continue;
         }
+        int root = findRoot(i, parent);
+        if (rootToClade[root] == SIZE_MAX) {
+            rootToClade[root] = cladeCnt++;
+        }
+        clade[i] = rootToClade[root];
     }
+    return clade;
 }
 
 /**
- * @brief Generate new instructions for gaps/sequence before start of alignment
- * 
- * @param toAdd number of sequence positions to add
- * @param oldIndex index of current old instruction
- * @param newInstructionsAA 
- * @param newInstructionsSS 
- * @param oldInstructionsAA 
- * @param oldInstructionsSS 
+ * @brief Regressive alignment along a guide tree, as in T-Coffee regressive
+ *
+ * The tree is cut into clades of at most par.regressiveCladeSize structures and the longest
+ * structure of each clade is picked as its seed. Clades are aligned independently (in
+ * parallel) with the progressive engine, and so are the seeds along the edges joining the
+ * clades. Clade MSAs are then stitched into the seed MSA through their seed rows; columns
+ * where a seed has a gap in its clade MSA become insertion columns of that clade only.
  */
-void addCigarIndices(
-    int toAdd,
-    int &oldIndex,
-    std::vector<Instruction> &newInstructionsAA,
-    std::vector<Instruction> &newInstructionsSS,
-    std::vector<Instruction> &oldInstructionsAA,
-    std::vector<Instruction> &oldInstructionsSS
+void regressiveAlignment(
+    MSAContainer &msa,
+    std::vector<AlnSimple> &hits,
+    FoldmasonParameters &par,
+    DBReader<unsigned int> &seqDbrAA,
+    EncodedSequences &encoded,
+    DBReader<unsigned int> *seqDbrCA,
+    int8_t *tinySubMatAA,
+    int8_t *tinySubMat3Di,
+    SubstitutionMatrix &subMat_aa,
+    SubstitutionMatrix &subMat_3di,
+    int maxSeqLength,
+    size_t sequenceCnt
 ) {
-    while (toAdd > 0) {
-        if (oldInstructionsAA[oldIndex].isSeq()) {
-            newInstructionsAA.emplace_back(oldInstructionsAA[oldIndex].getCharacter());
-            newInstructionsSS.emplace_back(oldInstructionsSS[oldIndex].getCharacter());
-            oldIndex++;
-            toAdd--;
-        } else {
-            if (needNewInstruction(newInstructionsAA)) {
-                newInstructionsAA.emplace_back(0);
-                newInstructionsSS.emplace_back(0);
-            }
-            int spaceLeft = 127 - newInstructionsAA.back().bits.count;
-            if (toAdd > oldInstructionsAA[oldIndex].bits.count) {
-                // use ALL of this instructions count
-                // just have to check space in the new count
-
-                if (oldInstructionsAA[oldIndex].bits.count > spaceLeft) {
-                    // make new instruction/s until we exhaust the old instruction
-                    newInstructionsAA.back().bits.count = 127;
-                    newInstructionsSS.back().bits.count = 127;
-                    oldInstructionsAA[oldIndex].bits.count -= spaceLeft;
-                    oldInstructionsSS[oldIndex].bits.count -= spaceLeft;
-                    toAdd -= spaceLeft;
-                } else {
-                    newInstructionsAA.back().bits.count += oldInstructionsAA[oldIndex].bits.count;
-                    newInstructionsSS.back().bits.count += oldInstructionsSS[oldIndex].bits.count;
-                    toAdd -= oldInstructionsAA[oldIndex].bits.count;
-                    oldIndex++;
-                }
-            } else {
-                if (toAdd > spaceLeft) {
-                    newInstructionsAA.back().bits.count = 127;
-                    newInstructionsSS.back().bits.count = 127;
-                    oldInstructionsAA[oldIndex].bits.count -= spaceLeft;
-                    oldInstructionsSS[oldIndex].bits.count -= spaceLeft;
-                    toAdd -= spaceLeft;
-                } else {
-                    newInstructionsAA.back().bits.count += toAdd;
-                    newInstructionsSS.back().bits.count += toAdd;
-                    oldInstructionsAA[oldIndex].bits.count -= toAdd;
-                    oldInstructionsSS[oldIndex].bits.count -= toAdd;
-                    toAdd = 0;
-                }
+    std::vector<AlnSimple> intraClade;
+    std::vector<AlnSimple> interClade;
+    size_t cladeCnt = 0;
+    std::vector<size_t> clade = splitIntoClades(hits, sequenceCnt, par.regressiveCladeSize, intraClade, interClade, cladeCnt);
+
+    std::vector<size_t> seeds(cladeCnt, SIZE_MAX);
+    for (size_t i = 0; i < sequenceCnt; i++) {
+        if (clade[i] == SIZE_MAX) {
+            continue;
+        }
+        size_t &seed = seeds[clade[i]];
+        if (seed == SIZE_MAX || seqDbrAA.getSeqLen(i) > seqDbrAA.getSeqLen(seed)) {
+            seed = i;
+        }
+    }
+    Debug(Debug::INFO) << "Regressive alignment of " << cladeCnt << " clades of at most " << par.regressiveCladeSize << " structures\n";
+
+    Debug(Debug::INFO) << "Aligning clades\n";
+    std::vector<size_t> cladeMerges;
+    intraClade = reorderLinkage(intraClade, cladeMerges, sequenceCnt);
+    progressiveAlignment(
+        msa, intraClade, cladeMerges, par, seqDbrAA, encoded, seqDbrCA,
+        tinySubMatAA, tinySubMat3Di, subMat_aa, subMat_3di, maxSeqLength, sequenceCnt
+    );
+    if (cladeCnt < 2) {
+        return;
+    }
+
+    Debug(Debug::INFO) << "Aligning " << cladeCnt << " clade seeds\n";
+    MSAContainer seedMsa(sequenceCnt);
+    for (size_t seed : seeds) {
+        for (size_t j = 0; j < msa.cigars_aa[seed].size(); j++) {
+            if (msa.cigars_aa[seed][j].isSeq()) {
+                seedMsa.cigars_aa[seed].push_back(msa.cigars_aa[seed][j]);
+                seedMsa.cigars_ss[seed].push_back(msa.cigars_ss[seed][j]);
             }
         }
+        seedMsa.dbKeys[seed] = msa.dbKeys[seed];
     }
-}
+    std::vector<AlnSimple> seedLinkage;
+    for (AlnSimple aln : interClade) {
+        aln.queryId = seeds[clade[aln.queryId]];
+        aln.targetId = seeds[clade[aln.targetId]];
+        seedLinkage.push_back(aln);
+    }
+    std::vector<size_t> seedMerges;
+    seedLinkage = reorderLinkage(seedLinkage, seedMerges, sequenceCnt);
+    progressiveAlignment(
+        seedMsa, seedLinkage, seedMerges, par, seqDbrAA, encoded, seqDbrCA,
+        tinySubMatAA, tinySubMat3Di, subMat_aa, subMat_3di, maxSeqLength, sequenceCnt
+    );
 
-void updateQueryCIGAR(
-    std::vector<Instruction> &cigar_aa,
-    std::vector<Instruction> &cigar_ss,
-    std::vector<Instruction> &instructions,
-    int preGap,
-    int preSequence,
-    int endGap,
-    int endSequence
-) {
-    int cigarIndex = 0;
-    std::vector<Instruction> aa;
-    std::vector<Instruction> ss;
-    addCigarGaps(preGap, aa, ss);
-    addCigarIndices(preSequence, cigarIndex, aa, ss, cigar_aa, cigar_ss);
-    for (Instruction ins : instructions) {
-        if (ins.isSeq()) {
-            addCigarIndices(ins.bits.count, cigarIndex, aa, ss, cigar_aa, cigar_ss);
-        } else {
-            addCigarGaps(ins.bits.count, aa, ss);
+    Debug(Debug::INFO) << "Joining clades through their seeds\n";
+    // seedColumn[r]: column of seed residue r in the seed MSA
+    std::vector<std::vector<size_t> > seedColumn(cladeCnt);
+    // Insertion blocks of each clade: slot k sits after seed MSA column k - 1
+    struct InsertBlock {
+        size_t slot;
+        size_t clade;
+        size_t width;
+        size_t start;
+    };
+    std::vector<std::vector<InsertBlock> > cladeBlocks(cladeCnt);
+    size_t seedWidth = cigarLength(seedMsa.cigars_aa[seeds[0]], true);
+#pragma omp parallel for schedule(dynamic, 1) num_threads(par.threads)
+    for (size_t c = 0; c < cladeCnt; c++) {
+        std::string seedRow = expand(seedMsa.cigars_aa[seeds[c]]);
+        for (size_t j = 0; j < seedRow.length(); j++) {
+            if (seedRow[j] != '-') {
+                seedColumn[c].push_back(j);
+            }
+        }
+        std::string cladeRow = expand(msa.cigars_aa[seeds[c]]);
+        size_t residue = 0;
+        for (size_t j = 0; j < cladeRow.length(); j++) {
+            if (cladeRow[j] != '-') {
+                residue++;
+                continue;
+            }
+            size_t slot = (residue == 0) ? 0 : seedColumn[c][residue - 1] + 1;
+            if (cladeBlocks[c].empty() || cladeBlocks[c].back().slot != slot) {
+                InsertBlock block = { slot, c, 0, 0 };
+                cladeBlocks[c].push_back(block);
+            }
+            cladeBlocks[c].back().width++;
         }
     }
-    addCigarIndices(endSequence, cigarIndex, aa, ss, cigar_aa, cigar_ss);
-    addCigarGaps(endGap, aa, ss);
-    cigar_aa.assign(aa.begin(), aa.end());
-    cigar_ss.assign(ss.begin(), ss.end());
-}
 
-void updateTargetCIGAR(
-    std::vector<Instruction> &cigar_aa,
-    std::vector<Instruction> &cigar_ss,
-    std::vector<Instruction> &instructions,
-    int preGap,
-    int preSequence,
-    int endGap,
-    int endSequence
-) {
-    int cigarIndex = 0;
-    std::vector<Instruction> aa;
-    std::vector<Instruction> ss;
-    addCigarIndices(preSequence, cigarIndex, aa, ss, cigar_aa, cigar_ss);
-    addCigarGaps(preGap, aa, ss);
-    for (Instruction ins : instructions) {
-        if (ins.isSeq()) {
-            addCigarIndices(ins.bits.count, cigarIndex, aa, ss, cigar_aa, cigar_ss);
-        } else {
-            addCigarGaps(ins.bits.count, aa, ss);
+    // Lay out insertion blocks between seed MSA columns, in clade order within a slot
+    std::vector<InsertBlock *> blocks;
+    for (size_t c = 0; c < cladeCnt; c++) {
+        for (InsertBlock &block : cladeBlocks[c]) {
+            blocks.push_back(&block);
         }
     }
-    addCigarGaps(endGap, aa, ss);
-    addCigarIndices(endSequence, cigarIndex, aa, ss, cigar_aa, cigar_ss);
-    cigar_aa.assign(aa.begin(), aa.end());
-    cigar_ss.assign(ss.begin(), ss.end());
-}
+    std::sort(blocks.begin(), blocks.end(), [](const InsertBlock *a, const InsertBlock *b) {
+        return (a->slot == b->slot) ? (a->clade < b->clade) : (a->slot < b->slot);
+    });
+    std::vector<size_t> seedColumnPos(seedWidth);
+    size_t offset = 0;
+    size_t blockIdx = 0;
+    for (size_t k = 0; k <= seedWidth; k++) {
+        while (blockIdx < blocks.size() && blocks[blockIdx]->slot == k) {
+            blocks[blockIdx]->start = k + offset;
+            offset += blocks[blockIdx]->width;
+            blockIdx++;
+        }
+        if (k < seedWidth) {
+            seedColumnPos[k] = k + offset;
+        }
+    }
+    size_t width = seedWidth + offset;
+    Debug(Debug::INFO) << "Joined MSA has " << width << " columns, " << offset << " from clade insertions\n";
 
-void updateCIGARs(
-    Matcher::result_t& result,
-    std::vector<size_t>& map1,
-    std::vector<size_t>& map2,
-    std::vector<std::vector<Instruction> >& cigars_aa,
-    std::vector<std::vector<Instruction> >& cigars_ss,
-    std::vector<size_t>& q_members,
-    std::vector<size_t>& t_members,
-    std::vector<Instruction>& q_ins,
-    std::vector<Instruction>& t_ins
-) {
-    GapData g = getGapData(result, map1, map2); 
-    for (size_t m : q_members) {
-        updateQueryCIGAR(cigars_aa[m], cigars_ss[m], q_ins, g.preGaps, g.preSequence, g.endGaps, g.endSequence);
+    std::vector<std::vector<size_t> > cladeMembers(cladeCnt);
+    for (size_t c = 0; c < cladeCnt; c++) {
+        if (msa.isProfile(seeds[c])) {
+            cladeMembers[c] = msa[msa.dbIdToSubMSAVec[seeds[c]]].members;
+        } else {
+            cladeMembers[c].push_back(seeds[c]);
+        }
     }
-    for (size_t m : t_members) {
-        updateTargetCIGAR(cigars_aa[m], cigars_ss[m], t_ins, g.preSequence, g.preGaps, g.endSequence, g.endGaps);
+#pragma omp parallel for schedule(dynamic, 1) num_threads(par.threads)
+    for (size_t c = 0; c < cladeCnt; c++) {
+        // Clade MSA column -> joined MSA column
+        std::string cladeRow = expand(msa.cigars_aa[seeds[c]]);
+        std::vector<size_t> columnMap(cladeRow.length());
+        size_t residue = 0;
+        size_t block = 0;
+        size_t inBlock = 0;
+        for (size_t j = 0; j < cladeRow.length(); j++) {
+            if (cladeRow[j] != '-') {
+                columnMap[j] = seedColumnPos[seedColumn[c][residue]];
+                residue++;
+                continue;
+            }
+            size_t slot = (residue == 0) ? 0 : seedColumn[c][residue - 1] + 1;
+            if (cladeBlocks[c][block].slot != slot) {
+                block++;
+                inBlock = 0;
+            }
+            columnMap[j] = cladeBlocks[c][block].start + inBlock;
+            inBlock++;
+        }
+        for (size_t member : cladeMembers[c]) {
+            std::string oldAa = expand(msa.cigars_aa[member]);
+            std::string oldSs = expand(msa.cigars_ss[member]);
+            std::string rowAa(width, '-');
+            std::string rowSs(width, '-');
+            for (size_t j = 0; j < oldAa.length(); j++) {
+                rowAa[columnMap[j]] = oldAa[j];
+                rowSs[columnMap[j]] = oldSs[j];
+            }
+            msa.cigars_aa[member] = contract(rowAa);
+            msa.cigars_ss[member] = contract(rowSs);
+        }
     }
-}
 
-void testSeqLens(std::vector<size_t> &MAYBE_UNUSED(indices), std::vector<std::vector<Instruction> > &MAYBE_UNUSED(cigars), std::vector<int> &MAYBE_UNUSED(lengths)) {
-    for (int MAYBE_UNUSED(index) : indices) {
-        assert(lengths[index] == cigarLength(cigars[index], false));
+    // One sub-MSA holding every row, in seed MSA order
+    SubMSA joined;
+    for (size_t seed : seedMsa[0].members) {
+        std::vector<size_t> &members = cladeMembers[clade[seed]];
+        joined.members.insert(joined.members.end(), members.begin(), members.end());
     }
+    joined.id = joined.members[0];
+    std::vector<size_t> toRemove(msa.size());
+    std::iota(toRemove.begin(), toRemove.end(), 0);
+    std::vector<SubMSA> newMSAs(1, joined);
+    msa.update(newMSAs, toRemove);
 }
 
-Matcher::result_t pairwiseTMAlign(
-    int mergedId,
-    int targetId,
-    DBReader<unsigned int> &seqDbrAA,
-    DBReader<unsigned int> *seqDbrCA
-) {
-    int qLen = seqDbrAA.getSeqLen(mergedId);
-    int tLen = seqDbrAA.getSeqLen(targetId);
-    
-    unsigned int qKey = seqDbrAA.getDbKey(mergedId);
-    size_t qCaId = seqDbrCA->getId(qKey);
-
-    unsigned int tKey = seqDbrAA.getDbKey(targetId);
-    size_t tCaId = seqDbrCA->getId(tKey);
-    
-    Coordinate16 qcoords;
-    char *qcadata = seqDbrCA->getData(qCaId, 0);
-    size_t qCaLength = seqDbrCA->getEntryLen(qCaId);
-    float *qCaData = qcoords.read(qcadata, qLen, qCaLength);
-    char *merged_aa_seq = seqDbrAA.getData(qCaId, 0);
-    
-    Coordinate16 tcoords;
-    char *tcadata = seqDbrCA->getData(tCaId, 0);
-    size_t tCaLength = seqDbrCA->getEntryLen(tCaId);
-    float *tCaData = tcoords.read(tcadata, tLen, tCaLength);
-    char *target_aa_seq = seqDbrAA.getData(tCaId, 0);
-
-    float TMscore = 0.0;
-    TMaligner tmaln(std::max(qLen, tLen)+VECSIZE_FLOAT, 1, 0, false);
-    tmaln.initQuery(qCaData, &qCaData[qLen], &qCaData[qLen * 2], merged_aa_seq, qLen);
-    Matcher::result_t res = tmaln.align(targetId, tCaData, &tCaData[tLen], &tCaData[tLen * 2], target_aa_seq, tLen, TMscore);
-    res.backtrace = Matcher::uncompressAlignment(res.backtrace);
-    res.score /= 100;
-
-    return res;
+std::string writeGuideTree(std::vector<AlnSimple> &hits, const std::vector<size_t> &representative, IndexReader &qdbrH, const std::string &treeFile) {
+    std::vector<AlnSimple> treeHits = duplicateLinkage(representative);
+    treeHits.insert(treeHits.end(), hits.begin(), hits.end());
+    NewickParser::Node* root = NewickParser::buildTree(treeHits); 
+    NewickParser::addNames(root, &qdbrH);
+    std::string nw = NewickParser::toNewick(root);
+    Debug(Debug::INFO) << "Writing guide tree to: " << treeFile << '\n';
+    std::ofstream guideTree(treeFile, std::ofstream::out);
+    guideTree << nw;
+    guideTree.close();
+    delete root;
+    return nw;
 }
 
-// copy from one to two
-void copyInstructions(std::vector<Instruction> &one, std::vector<Instruction> &two) {
-    for (Instruction ins : one) {
-        two.emplace_back(static_cast<int>(ins.bits.state), static_cast<int>(ins.bits.count));
+std::string serializedBlosum62(FoldmasonParameters &par) {
+    std::string blosum;
+    for (size_t i = 0; i < par.substitutionMatrices.size(); i++) {
+        if (par.substitutionMatrices[i].name == "blosum62.out") {
+            std::string matrixData((const char *)par.substitutionMatrices[i].subMatData, par.substitutionMatrices[i].subMatDataLen);
+            std::string matrixName = par.substitutionMatrices[i].name;
+            char * serializedMatrix = BaseMatrix::serialize(matrixName, matrixData);
+            blosum.assign(serializedMatrix);
+            free(serializedMatrix);
+        }
     }
+    return blosum;
 }
 
-// copy from one to two
-void copyInstructionVectors(std::vector<std::vector<Instruction> > &one, std::vector<std::vector<Instruction> > &two) {
-    two.clear();
-    two.resize(one.size());
-    // for (std::vector<Instruction> vec : one) {
-    for (size_t i = 0; i < one.size(); i++) {
-        // std::vector<Instruction> tmp;
-        copyInstructions(one[i], two[i]);
-        // two[i] = tmp;
-    }
+AlignmentMatrices::AlignmentMatrices(FoldmasonParameters &par) :
+    subMat_3di(par.scoringMatrixFile.values.aminoacid().c_str(), par.bitFactor3Di, par.scoreBias3di),
+    subMat_aa(serializedBlosum62(par).c_str(), par.bitFactorAa, par.scoreBiasAa) {
+    tinySubMat3Di = (int8_t*) mem_align(ALIGN_INT, subMat_3di.alphabetSize * 32);
+    tinySubMatAA  = (int8_t*) mem_align(ALIGN_INT, subMat_aa.alphabetSize * 32);
+    for (int i = 0; i < subMat_3di.alphabetSize; i++)
+        for (int j = 0; j < subMat_3di.alphabetSize; j++)
+            tinySubMat3Di[i * subMat_3di.alphabetSize + j] = subMat_3di.subMatrix[i][j]; // for farrar profile
+    for (int i = 0; i < subMat_aa.alphabetSize; i++)
+        for (int j = 0; j < subMat_aa.alphabetSize; j++)
+            tinySubMatAA[i * subMat_aa.alphabetSize + j] = subMat_aa.subMatrix[i][j];
 }
 
-int structuremsa(int argc, const char **argv, const Command& command, bool preCluster) {
-    FoldmasonParameters &par = FoldmasonParameters::getFoldmasonInstance();
+AlignmentMatrices::~AlignmentMatrices() {
+    free(tinySubMat3Di);
+    free(tinySubMatAA);
+}
+
+static AlignmentMatrices *sharedMatrices = NULL;
+
+void shareAlignmentMatrices(FoldmasonParameters &par) {
+    if (sharedMatrices == NULL) {
+        sharedMatrices = new AlignmentMatrices(par);
+    }
+}
 
+int structureMSA(FoldmasonParameters &par, const std::string &outputPrefix, bool preCluster, int makeReport) {
     // Databases
     const bool touch = (par.preloadMode != Parameters::PRELOAD_MODE_MMAP);
-    par.parseParameters(argc, argv, command, true, 0, MMseqsParameter::COMMAND_ALIGN);
+    Debug(Debug::INFO) << "Using " << SimdDispatch::name(SimdDispatch::select(par.simdLevel)) << " alignment kernels\n";
 
     DBReader<unsigned int> seqDbrAA(par.db1.c_str(), par.db1Index.c_str(), par.threads, DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA|DBReader<unsigned int>::USE_LOOKUP_REV);
     seqDbrAA.open(DBReader<unsigned int>::NOSORT);
@@ -1132,19 +2810,12 @@ int structuremsa(int argc, const char **argv, const Command& command, bool preCl
     
     Debug(Debug::INFO) << "Got databases\n";
     
-    SubstitutionMatrix subMat_3di(par.scoringMatrixFile.values.aminoacid().c_str(), par.bitFactor3Di, par.scoreBias3di);
-    std::string blosum;
-    for (size_t i = 0; i < par.substitutionMatrices.size(); i++) {
-        if (par.substitutionMatrices[i].name == "blosum62.out") {
-            std::string matrixData((const char *)par.substitutionMatrices[i].subMatData, par.substitutionMatrices[i].subMatDataLen);
-            std::string matrixName = par.substitutionMatrices[i].name;
-            char * serializedMatrix = BaseMatrix::serialize(matrixName, matrixData);
-            blosum.assign(serializedMatrix);
-            free(serializedMatrix);
-        }
-    }
-
-    SubstitutionMatrix subMat_aa(blosum.c_str(), par.bitFactorAa, par.scoreBiasAa);
+    AlignmentMatrices *ownMatrices = (sharedMatrices == NULL) ? new AlignmentMatrices(par) : NULL;
+    AlignmentMatrices &matrices = (sharedMatrices != NULL) ? *sharedMatrices : *ownMatrices;
+    SubstitutionMatrix &subMat_3di = matrices.subMat_3di;
+    SubstitutionMatrix &subMat_aa = matrices.subMat_aa;
+    int8_t *tinySubMatAA = matrices.tinySubMatAA;
+    int8_t *tinySubMat3Di = matrices.tinySubMat3Di;
 
     Debug(Debug::INFO) << "Got substitution matrices\n";
 
@@ -1164,22 +2835,14 @@ int structuremsa(int argc, const char **argv, const Command& command, bool preCl
    
     Debug(Debug::INFO) << "Initialised MSAs, Sequence objects\n";
 
-    // Substitution matrices needed for query profile
-    int8_t *tinySubMatAA  = (int8_t*) mem_align(ALIGN_INT, subMat_aa.alphabetSize * 32);
-    int8_t *tinySubMat3Di = (int8_t*) mem_align(ALIGN_INT, subMat_3di.alphabetSize * 32);
-
-    for (int i = 0; i < subMat_3di.alphabetSize; i++)
-        for (int j = 0; j < subMat_3di.alphabetSize; j++)
-            tinySubMat3Di[i * subMat_3di.alphabetSize + j] = subMat_3di.subMatrix[i][j]; // for farrar profile
-    for (int i = 0; i < subMat_aa.alphabetSize; i++)
-        for (int j = 0; j < subMat_aa.alphabetSize; j++)
-            tinySubMatAA[i * subMat_aa.alphabetSize + j] = subMat_aa.subMatrix[i][j];
-
-    Debug(Debug::INFO) << "Set up tiny substitution matrices\n";
+    // Numeric AA/3Di codes for all structures, translated once for scoring and leaf merges
+    EncodedSequences encoded(seqDbrAA, seqDbr3Di, subMat_aa, subMat_3di);
 
     bool * alreadyMerged = new bool[sequenceCnt];
    
     DBReader<unsigned int> * cluDbr = NULL;
+    DBReader<unsigned int> * alnDbr = NULL;
+    StoredAlignments storedAlignments;
 
     if (preCluster) {
         // consider everything merged and unmerge the ones that are not
@@ -1196,15 +2859,72 @@ int structuremsa(int argc, const char **argv, const Command& command, bool preCl
             unsigned int dbKey = cluDbr->getDbKey(i);
             alreadyMerged[dbKey] = 0;
         }
+        // structuremsacluster queryDB clusterDB [alignmentDB] alignmentFile
+        if (par.filenames.size() > 3) {
+            alnDbr = new DBReader<unsigned int>(
+                par.db3.c_str(),
+                par.db3Index.c_str(),
+                par.threads,
+                DBReader<unsigned int>::USE_INDEX | DBReader<unsigned int>::USE_DATA
+            );
+            alnDbr->open(DBReader<unsigned int>::NOSORT);
+        }
     } else {
         memset(alreadyMerged, 0, sizeof(bool) * sequenceCnt);
     }       
+
+    // Duplicates are left out of scoring and merging and copied back into the final MSA
+    std::vector<size_t> representative;
+    std::vector<unsigned int> collapsedOffset;
+    size_t collapsedCnt = 0;
+    if (par.collapseSeqId > 0.0) {
+        if (preCluster || par.precluster || par.guideTree != "") {
+            Debug(Debug::WARNING) << "Duplicate collapsing is not used with a guide tree or pre-clustering\n";
+        } else {
+            collapsedCnt = collapseDuplicates(encoded, sequenceCnt, par.collapseSeqId, representative, collapsedOffset);
+            for (size_t i = 0; i < sequenceCnt; i++) {
+                alreadyMerged[i] = (representative[i] != i);
+            }
+            Debug(Debug::INFO) << "Collapsed " << collapsedCnt << " duplicate structures, aligning " << (sequenceCnt - collapsedCnt) << " representatives\n";
+        }
+    }
     
     // Check if guide tree argument given
     // Try parse --> read if non-empty, otherwise generate one and write
     std::string tree;
     std::vector<AlnSimple> hits;
     std::vector<size_t> merges;
+    DynamicMergeOrder *dynamicOrder = NULL;
+    bool recomputeScores = par.recomputeScores;
+    if (recomputeScores && (preCluster || par.precluster || par.guideTree != "" || par.regressive)) {
+        Debug(Debug::WARNING) << "--recompute-scores is not used with a guide tree, pre-clustering or --regressive\n";
+        recomputeScores = false;
+    }
+
+    // Resume needs the same database and a checkpoint of the static merge order
+    MSACheckpoint *checkpoint = NULL;
+    std::string checkpointFile = outputPrefix + ".ckpt";
+    size_t startRound = 0;
+    bool resumed = false;
+    if (par.checkpointRounds > 0 || par.resume) {
+        if (recomputeScores || par.regressive) {
+            Debug(Debug::WARNING) << "Checkpoints are not used with --recompute-scores or --regressive\n";
+        } else {
+            checkpoint = new MSACheckpoint(checkpointFile);
+            if (par.resume && FileUtil::fileExists(checkpointFile.c_str())) {
+                if (checkpoint->load(msa, hits, merges, startRound) == false) {
+                    Debug(Debug::ERROR) << "Could not resume from checkpoint " << checkpointFile << ", it is incomplete or was written for a different database\n";
+                    EXIT(EXIT_FAILURE);
+                }
+                resumed = true;
+                Debug(Debug::INFO) << "Resuming from checkpoint " << checkpointFile << " after " << startRound << " of " << merges.size() << " merge rounds\n";
+            }
+            if (par.checkpointRounds == 0) {
+                delete checkpoint;
+                checkpoint = NULL;
+            }
+        }
+    }
 
     if (par.guideTree != "") {
         std::string line;
@@ -1216,6 +2936,11 @@ int structuremsa(int argc, const char **argv, const Command& command, bool preCl
         }
     }
 
+    // On resume the linkage comes from the checkpoint, the tree is only kept for the report
+    std::string newick = tree;
+    if (resumed) {
+        tree = "";
+    }
     if (tree != "") {
         Debug(Debug::INFO) << "Parsing tree: " << tree << '\n';
         NewickParser::Node* root = NewickParser::parse(tree);
@@ -1240,354 +2965,173 @@ int structuremsa(int argc, const char **argv, const Command& command, bool preCl
             
             size_t targetLookupId = seqDbrAA.getLookupIdByAccession(linkage[i + 1]);
             if (targetLookupId == SIZE_MAX) {
-                Debug(Debug::ERROR) << "Could not find name " << linkage[i + 1] << " in lookup\n";
-                exit(1);
-            }
-            
-            unsigned int targetKey = seqDbrAA.getLookupKey(targetLookupId);
-            size_t targetId = seqDbrAA.getId(targetKey);
-            hit.targetId = targetId;
-            
-            if (queryId == targetId) {
-                continue;
-            }
-
-            hit.score = 0;
-            hits.push_back(hit);
-        }
-        
-        Debug(Debug::INFO) << "Optimising merge order\n";
-        hits = reorderLinkage(hits, merges, sequenceCnt);
-    } else {
-        hits = updateAllScores(
-            seqDbrAA,
-            seqDbr3Di,
-            tinySubMatAA,
-            tinySubMat3Di,
-            &subMat_aa,
-            &subMat_3di,
-            alreadyMerged,
-            par.maxSeqLen,
-            subMat_3di.alphabetSize,
-            par.compBiasCorrection,
-            par.compBiasCorrectionScale
-        );
-        if (cluDbr != NULL) {
-            // add external hits to the list
-            std::vector<AlnSimple> externalHits = parseAndScoreExternalHits(
-                seqDbrAA,
-                seqDbr3Di,
-                cluDbr,
-                tinySubMatAA,
-                tinySubMat3Di,
-                &subMat_aa,
-                &subMat_3di,
-                par.maxSeqLen,
-                subMat_3di.alphabetSize,
-                par.compBiasCorrection,
-                par.compBiasCorrectionScale
-            );
-            // maybe a bit dangerous because memory of hits might be doubled
-            for (size_t i = 0; i < externalHits.size(); i++)
-                hits.push_back(externalHits[i]);
-        }
-        Debug(Debug::INFO) << "Performing initial all vs all alignments\n";
-        sortHitsByScore(hits);
-        
-        Debug(Debug::INFO) << "Generating guide tree\n";
-        hits = mst(hits, sequenceCnt);
-
-        Debug(Debug::INFO) << "Optimising merge order\n";
-        hits = reorderLinkage(hits, merges, sequenceCnt);
-
-        NewickParser::Node* root = NewickParser::buildTree(hits); 
-        NewickParser::addNames(root, &qdbrH);
-        std::string nw = NewickParser::toNewick(root);
-        std::string treeFile = par.filenames[par.filenames.size()-1] + ".nw";
-        Debug(Debug::INFO) << "Writing guide tree to: " << treeFile << '\n';
-        std::ofstream guideTree(treeFile, std::ofstream::out);
-        guideTree << nw;
-        guideTree.close();
-        delete root;
-    }
-   
-    if (par.verbosity > Debug::INFO) {
-        int idx = 0;
-        size_t qHeaderId, tHeaderId;
-        unsigned int qKey, tKey;
-        std::string qHeader, tHeader;
-        for (size_t i = 0; i < merges.size(); i++) {
-            Debug(Debug::INFO) << "Merging " << merges[i] << " sequences\n";
-            for (size_t j = 0; j < merges[i]; j++) {
-                qKey = seqDbrAA.getDbKey(hits[idx + j].queryId);
-                qHeaderId = qdbrH.sequenceReader->getId(qKey);
-                qHeader = Util::parseFastaHeader(qdbrH.sequenceReader->getData(qHeaderId, 0));
-                tKey = seqDbrAA.getDbKey(hits[idx + j].targetId);
-                tHeaderId = qdbrH.sequenceReader->getId(tKey);
-                tHeader = Util::parseFastaHeader(qdbrH.sequenceReader->getData(tHeaderId, 0));
-                Debug(Debug::INFO) << "  " << qHeader << "\t" << tHeader << '\t' << hits[idx + j].score << '\n';
-            }
-            idx += merges[i];
-        }
-    }
-
-    Debug(Debug::INFO) << "Begin progressive alignment\n";
-    
-    // global reduction vectors
-    std::vector<SubMSA> globalSubMSAs;
-    std::vector<size_t> globalToRemove;
-    int index = 0; // in hit list
-    size_t maxMerges = *std::max_element(merges.begin(), merges.end());
-    int maxThreads = std::min(par.threads, static_cast<int>(maxMerges));
-
-#pragma omp parallel num_threads(maxThreads)
-{
-    unsigned int thread_idx = 0;
-#ifdef OPENMP
-    thread_idx = static_cast<unsigned int>(omp_get_thread_num());
-#endif
-
-    // Initialise alignment objects per thread
-    StructureSmithWaterman structureSmithWaterman(par.maxSeqLen, subMat_3di.alphabetSize, par.compBiasCorrection, par.compBiasCorrectionScale, &subMat_aa, &subMat_3di);
-    MsaFilter filter_aa(maxSeqLength + 1, sequenceCnt + 1, &subMat_aa, par.gapOpen.values.aminoacid(), par.gapExtend.values.aminoacid());
-    MsaFilter filter_3di(maxSeqLength + 1, sequenceCnt + 1, &subMat_3di, par.gapOpen.values.aminoacid(), par.gapExtend.values.aminoacid()); 
-    PSSMCalculator calculator_aa(&subMat_aa, maxSeqLength + 1, sequenceCnt + 1, par.pcmode, par.pcaAa, par.pcbAa
-#ifdef GAP_POS_SCORING
-    , par.gapOpen.values.aminoacid(), par.gapPseudoCount
-#endif
-    );
-    PSSMCalculator calculator_3di(&subMat_3di, maxSeqLength + 1, sequenceCnt + 1, par.pcmode, par.pca3di, par.pcb3di
-#ifdef GAP_POS_SCORING
-    , par.gapOpen.values.aminoacid(), par.gapPseudoCount
-#endif
-    );
-
-    // Add four seq objects per alignee per thread
-    // Amino acid profile/sequence, 3Di profile/sequence
-    Sequence seqMergedAaAa(par.maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) &subMat_aa,  0, false, par.compBiasCorrection);
-    Sequence seqMergedAaPr(par.maxSeqLen, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_aa,  0, false, par.compBiasCorrection);
-    Sequence seqMergedSsAa(par.maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) &subMat_3di, 0, false, par.compBiasCorrection);
-    Sequence seqMergedSsPr(par.maxSeqLen, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_3di, 0, false, par.compBiasCorrection);
-    Sequence seqTargetAaAa(par.maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) &subMat_aa,  0, false, par.compBiasCorrection);
-    Sequence seqTargetAaPr(par.maxSeqLen, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_aa,  0, false, par.compBiasCorrection);
-    Sequence seqTargetSsAa(par.maxSeqLen, Parameters::DBTYPE_AMINO_ACIDS, (const BaseMatrix *) &subMat_3di, 0, false, par.compBiasCorrection);
-    Sequence seqTargetSsPr(par.maxSeqLen, Parameters::DBTYPE_HMM_PROFILE, (const BaseMatrix *) &subMat_3di, 0, false, par.compBiasCorrection);
-    
-    // Pointers to whichever Sequence we need to use per-alignment
-    Sequence *seqMergedAa;
-    Sequence *seqMergedSs;
-    Sequence *seqTargetAa;
-    Sequence *seqTargetSs;
-
-    // thread-local vectors
-    std::vector<SubMSA> subMSAs;
-    std::vector<size_t> toRemove;
-
-    for (size_t i = 0; i < merges.size(); i++) {
-        subMSAs.reserve(merges[i]);
-
-
-#pragma omp for schedule(static, 1)
-        for (size_t j = 0; j < merges[i]; j++) {
-
-            size_t mergedId = hits[index + j].queryId;
-            size_t targetId = hits[index + j].targetId;
-            if (mergedId == targetId) {
-                continue;
-            }
-
-            size_t querySubMSA = msa.dbIdToSubMSAVec[mergedId];
-            bool queryIsProfile = msa.isProfile(mergedId);
-            size_t targetSubMSA = msa.dbIdToSubMSAVec[targetId];
-            bool targetIsProfile = msa.isProfile(targetId);
-
-            // mask e.g. 010101 <=> [ 0, 2, 4 ] index
-            std::vector<size_t> map1;
-            std::vector<size_t> map2;
-
-            // ids of members for each group
-            std::vector<size_t> qMembers;
-            std::vector<size_t> tMembers;
-
-            if (queryIsProfile) {
-                SubMSA& q = msa[querySubMSA];
-                qMembers.assign(q.members.begin(), q.members.end());
-                seqMergedAaPr.mapSequence(mergedId, mergedId, q.profile_aa.c_str(), q.profile_aa.length() / Sequence::PROFILE_READIN_SIZE);
-                seqMergedSsPr.mapSequence(mergedId, mergedId, q.profile_ss.c_str(), q.profile_ss.length() / Sequence::PROFILE_READIN_SIZE);
-                seqMergedAa = &seqMergedAaPr;
-                seqMergedSs = &seqMergedSsPr;
-                maskToMapping(q.mask, map1);
-            } else {
-                size_t length = seqDbrAA.getSeqLen(mergedId);
-                qMembers = { mergedId };
-                seqMergedAaAa.mapSequence(mergedId, mergedId, seqDbrAA.getData(mergedId, thread_idx), length);
-                seqMergedSsAa.mapSequence(mergedId, mergedId, seqDbr3Di.getData(mergedId, thread_idx), length);
-                seqMergedAa = &seqMergedAaAa;
-                seqMergedSs = &seqMergedSsAa;
-                map1.resize(length);
-                std::iota(map1.begin(), map1.end(), 0);
-            }
-
-            if (targetIsProfile) {
-                SubMSA& t = msa[targetSubMSA];
-                tMembers.assign(t.members.begin(), t.members.end());
-                seqTargetAaPr.mapSequence(targetId, targetId, t.profile_aa.c_str(), t.profile_aa.length() / Sequence::PROFILE_READIN_SIZE);
-                seqTargetSsPr.mapSequence(targetId, targetId, t.profile_ss.c_str(), t.profile_ss.length() / Sequence::PROFILE_READIN_SIZE);
-                seqTargetAa = &seqTargetAaPr;
-                seqTargetSs = &seqTargetSsPr;
-                maskToMapping(t.mask, map2);
-            } else {
-                size_t length = seqDbrAA.getSeqLen(targetId);
-                tMembers = { targetId };
-                seqTargetAaAa.mapSequence(targetId, targetId, seqDbrAA.getData(targetId, thread_idx), length);
-                seqTargetSsAa.mapSequence(targetId, targetId, seqDbr3Di.getData(targetId, thread_idx), length);
-                seqTargetAa = &seqTargetAaAa;
-                seqTargetSs = &seqTargetSsAa;
-                map2.resize(length);
-                std::iota(map2.begin(), map2.end(), 0);
-            }
-
-            // Use most informative profile as query
-            if (queryIsProfile && targetIsProfile) {
-                float q_neff_sum = 0.0;
-                float t_neff_sum = 0.0;
-                for (int i = 0; i < seqMergedSs->L; i++) {
-                    q_neff_sum += seqMergedSs->neffM[i];
-                }
-                for (int i = 0; i < seqTargetSs->L; i++) {
-                    t_neff_sum += seqTargetSs->neffM[i];
-                }
-                if (q_neff_sum <= t_neff_sum) {
-                    std::swap(mergedId, targetId);
-                    std::swap(seqMergedAa, seqTargetAa);
-                    std::swap(seqMergedSs, seqTargetSs);
-                    std::swap(queryIsProfile, targetIsProfile);
-                    std::swap(querySubMSA, targetSubMSA);
-                    std::swap(qMembers, tMembers);
-                    std::swap(map1, map2);
-                }
-            } else if (targetIsProfile && !queryIsProfile) {
-                std::swap(mergedId, targetId);
-                std::swap(seqMergedAa, seqTargetAa);
-                std::swap(seqMergedSs, seqTargetSs);
-                std::swap(queryIsProfile, targetIsProfile);
-                std::swap(querySubMSA, targetSubMSA);
-                std::swap(qMembers, tMembers);
-                std::swap(map1, map2);
+                Debug(Debug::ERROR) << "Could not find name " << linkage[i + 1] << " in lookup\n";
+                exit(1);
             }
-
-            // Since we will update the query subMSA, need to remove the target one 
-            if (targetIsProfile) {
-                toRemove.push_back(targetSubMSA);
+            
+            unsigned int targetKey = seqDbrAA.getLookupKey(targetLookupId);
+            size_t targetId = seqDbrAA.getId(targetKey);
+            hit.targetId = targetId;
+            
+            if (queryId == targetId) {
+                continue;
             }
 
-            // Do alignment
-            structureSmithWaterman.ssw_init(seqMergedAa, seqMergedSs, tinySubMatAA, tinySubMat3Di, &subMat_aa);
-            Matcher::result_t res = pairwiseAlignment(
-                structureSmithWaterman,
-                seqMergedAa->L,
-                seqMergedAa,
-                seqMergedSs, 
-                seqTargetAa,
-                seqTargetSs,
-                par.gapOpen.values.aminoacid(),
-                par.gapExtend.values.aminoacid(),
+            hit.score = 0;
+            hits.push_back(hit);
+        }
+        
+        Debug(Debug::INFO) << "Optimising merge order\n";
+        hits = reorderLinkage(hits, merges, sequenceCnt);
+    } else if (resumed) {
+        if (par.guideTree == "") {
+            newick = writeGuideTree(hits, representative, qdbrH, outputPrefix + ".nw");
+        }
+    } else {
+        // Cluster edges keep their scores from preclustering, only representatives are scored all-vs-all
+        std::vector<AlnSimple> clusterHits;
+        if (par.precluster && preCluster == false) {
+            clusterHits = preclusterStructures(
+                encoded,
+                sequenceCnt,
+                alreadyMerged,
+                tinySubMatAA,
+                tinySubMat3Di,
                 &subMat_aa,
                 &subMat_3di,
-                par.compBiasCorrection
+                par.maxSeqLen,
+                subMat_3di.alphabetSize,
+                par.compBiasCorrection,
+                par.compBiasCorrectionScale,
+                par.preclusterMinScore
             );
-            std::vector<Instruction> qBt;
-            std::vector<Instruction> tBt;
-            getMergeInstructions(res, map1, map2, qBt, tBt);
-
-            // If neither are profiles, do TM-align as well and take the best alignment
-            if (caExist && !queryIsProfile && !targetIsProfile) {
-                Matcher::result_t tmRes = pairwiseTMAlign(mergedId, targetId, seqDbrAA, seqDbrCA);
-                double lddtTM = calculate_lddt_pair(msa.dbKeys[mergedId], msa.dbKeys[targetId], tmRes, seqDbrCA, thread_idx);
-                double lddt3Di = calculate_lddt_pair(msa.dbKeys[mergedId], msa.dbKeys[targetId], res, seqDbrCA, thread_idx);
-                if (lddtTM > lddt3Di) {
-                    qBt.clear();
-                    tBt.clear();
-                    getMergeInstructions(tmRes, map1, map2, qBt, tBt);
-                    std::swap(res, tmRes);
+            Debug(Debug::INFO) << "Pre-clustered " << sequenceCnt << " structures into " << (sequenceCnt - clusterHits.size()) << " clusters\n";
+        }
+        hits = updateAllScores(
+            seqDbrAA,
+            encoded,
+            tinySubMatAA,
+            tinySubMat3Di,
+            &subMat_aa,
+            &subMat_3di,
+            alreadyMerged,
+            par.maxSeqLen,
+            subMat_3di.alphabetSize,
+            par.compBiasCorrection,
+            par.compBiasCorrectionScale
+        );
+        if (alnDbr != NULL) {
+            // scores and backtraces of the clustering alignments, only pairs missing from them are scored
+            std::vector<std::vector<size_t> > missing;
+            std::vector<AlnSimple> externalHits = parseExternalAlignments(
+                seqDbrAA, encoded, cluDbr, alnDbr, storedAlignments, missing
+            );
+            Debug(Debug::INFO) << "Read " << externalHits.size() << " cluster alignments (" << storedAlignments.size() << " with backtrace), scoring " << missing.size() << " missing pairs\n";
+            if (missing.empty() == false) {
+                std::vector<AlnSimple> missingHits = scoreClusterPairs(
+                    missing, encoded, tinySubMatAA, tinySubMat3Di, &subMat_aa, &subMat_3di,
+                    par.maxSeqLen, subMat_3di.alphabetSize, par.compBiasCorrection, par.compBiasCorrectionScale
+                );
+                std::vector<std::vector<size_t> > storedPairs;
+                storedPairs.reserve(externalHits.size());
+                for (size_t i = 0; i < externalHits.size(); i++) {
+                    storedPairs.push_back({ externalHits[i].queryId, externalHits[i].targetId });
                 }
+                std::vector<AlnSimple> storedUngappedHits = scoreClusterPairs(
+                    storedPairs, encoded, tinySubMatAA, tinySubMat3Di, &subMat_aa, &subMat_3di,
+                    par.maxSeqLen, subMat_3di.alphabetSize, par.compBiasCorrection, par.compBiasCorrectionScale
+                );
+                mapToStoredScores(missingHits, externalHits, storedUngappedHits);
+                externalHits.insert(externalHits.end(), missingHits.begin(), missingHits.end());
             }
-
-            updateCIGARs(res, map1, map2, msa.cigars_aa, msa.cigars_ss, qMembers, tMembers, qBt, tBt);
-
-            SubMSA *newSubMSA;
-            if (queryIsProfile) {
-                size_t idx = msa.mergeInto(mergedId, targetId);
-                newSubMSA = &msa[idx];
-            } else {
-                subMSAs.emplace_back();
-                newSubMSA = &subMSAs.back();
-                newSubMSA->id = mergedId;
-                newSubMSA->concat(qMembers);
-                newSubMSA->concat(tMembers);
+            // Cluster edges are now all on the alignment DB scale, not the ungapped scale of the
+            // representative scores; shift them above it so members join their representative
+            // before clusters are joined
+            int maxScore = 0;
+            for (size_t i = 0; i < hits.size(); i++) {
+                maxScore = std::max(maxScore, hits[i].score);
             }
-
-            // Don't need to make profiles on final alignment
-            if (!(i == merges.size() - 1 && j == merges[i] - 1)) {
-                newSubMSA->mask = computeProfileMask(
-                    newSubMSA->members,
-                    msa.cigars_aa,
-                    subMat_aa,
-                    par.matchRatio
-                );
-                newSubMSA->profile_aa = msa2profile(
-                    newSubMSA->members,
-                    msa.cigars_aa,
-                    newSubMSA->mask,
-                    calculator_aa,
-                    filter_aa,
-                    subMat_aa,
-                    par.filterMsa,
-                    par.compBiasCorrection,
-                    par.qid,
-                    par.filterMaxSeqId,
-                    par.Ndiff,
-                    par.covMSAThr,
-                    par.qsc,
-                    par.filterMinEnable,
-                    par.wg
-                );
-                newSubMSA->profile_ss = msa2profile(
-                    newSubMSA->members,
-                    msa.cigars_ss,
-                    newSubMSA->mask,
-                    calculator_3di,
-                    filter_3di,
-                    subMat_3di,
-                    par.filterMsa,
-                    par.compBiasCorrection,
-                    par.qid,
-                    par.filterMaxSeqId,
-                    par.Ndiff,
-                    par.covMSAThr,
-                    par.qsc,
-                    par.filterMinEnable,
-                    par.wg
-                );
+            for (size_t i = 0; i < externalHits.size(); i++) {
+                externalHits[i].score += maxScore;
             }
+            hits.insert(hits.end(), externalHits.begin(), externalHits.end());
+        } else if (cluDbr != NULL) {
+            // add external hits to the list
+            std::vector<AlnSimple> externalHits = parseAndScoreExternalHits(
+                seqDbrAA,
+                encoded,
+                cluDbr,
+                tinySubMatAA,
+                tinySubMat3Di,
+                &subMat_aa,
+                &subMat_3di,
+                par.maxSeqLen,
+                subMat_3di.alphabetSize,
+                par.compBiasCorrection,
+                par.compBiasCorrectionScale
+            );
+            // maybe a bit dangerous because memory of hits might be doubled
+            for (size_t i = 0; i < externalHits.size(); i++)
+                hits.push_back(externalHits[i]);
         }
+        hits.insert(hits.end(), clusterHits.begin(), clusterHits.end());
+        Debug(Debug::INFO) << "Performing initial all vs all alignments\n";
+        if (recomputeScores) {
+            // Merge order is chosen during alignment, the guide tree is written afterwards
+            Debug(Debug::INFO) << "Recomputing scores of merged profiles after every round\n";
+            dynamicOrder = new DynamicMergeOrder(hits, sequenceCnt);
+            hits.clear();
+            dynamicOrder->nextRound(hits, merges);
+        } else {
+            sortHitsByScore(hits);
 
-#pragma omp critical
-        {
-            globalSubMSAs.insert(globalSubMSAs.end(), subMSAs.begin(), subMSAs.end());
-            globalToRemove.insert(globalToRemove.end(), toRemove.begin(), toRemove.end());
-            subMSAs.clear();
-            toRemove.clear();
+            Debug(Debug::INFO) << "Generating guide tree\n";
+            hits = mst(hits, sequenceCnt);
+
+            Debug(Debug::INFO) << "Optimising merge order\n";
+            hits = reorderLinkage(hits, merges, sequenceCnt);
+
+            newick = writeGuideTree(hits, representative, qdbrH, outputPrefix + ".nw");
         }
-#pragma omp barrier
-#pragma omp master
-        {
-            msa.update(globalSubMSAs, globalToRemove);
-            globalSubMSAs.clear();
-            globalToRemove.clear();
-            index += merges[i];
+    }
+   
+    if (par.verbosity > Debug::INFO) {
+        int idx = 0;
+        size_t qHeaderId, tHeaderId;
+        unsigned int qKey, tKey;
+        std::string qHeader, tHeader;
+        for (size_t i = 0; i < merges.size(); i++) {
+            Debug(Debug::INFO) << "Merging " << merges[i] << " sequences\n";
+            for (size_t j = 0; j < merges[i]; j++) {
+                qKey = seqDbrAA.getDbKey(hits[idx + j].queryId);
+                qHeaderId = qdbrH.sequenceReader->getId(qKey);
+                qHeader = Util::parseFastaHeader(qdbrH.sequenceReader->getData(qHeaderId, 0));
+                tKey = seqDbrAA.getDbKey(hits[idx + j].targetId);
+                tHeaderId = qdbrH.sequenceReader->getId(tKey);
+                tHeader = Util::parseFastaHeader(qdbrH.sequenceReader->getData(tHeaderId, 0));
+                Debug(Debug::INFO) << "  " << qHeader << "\t" << tHeader << '\t' << hits[idx + j].score << '\n';
+            }
+            idx += merges[i];
         }
-#pragma omp barrier
+    }
+
+    if (par.regressive && !hits.empty()) {
+        regressiveAlignment(
+            msa, hits, par, seqDbrAA, encoded, seqDbrCA,
+            tinySubMatAA, tinySubMat3Di, subMat_aa, subMat_3di, maxSeqLength, sequenceCnt
+        );
+    } else {
+        Debug(Debug::INFO) << "Begin progressive alignment\n";
+        progressiveAlignment(
+            msa, hits, merges, par, seqDbrAA, encoded, seqDbrCA,
+            tinySubMatAA, tinySubMat3Di, subMat_aa, subMat_3di, maxSeqLength, sequenceCnt,
+            dynamicOrder, startRound, checkpoint, storedAlignments.empty() ? NULL : &storedAlignments
+        );
+    }
+    if (dynamicOrder != NULL) {
+        Debug(Debug::INFO) << "Rescored " << dynamicOrder->rescoredPairs() << " pairs in " << merges.size() << " merge rounds\n";
+        newick = writeGuideTree(hits, representative, qdbrH, outputPrefix + ".nw");
+        delete dynamicOrder;
     }
 
     // Refine alignment -- MUSCLE5 style
@@ -1597,86 +3141,89 @@ int structuremsa(int argc, const char **argv, const Command& command, bool preCl
     // 4. Save profiles -> Sequence objects
     // 5. Pairwise alignment
     // 6. Repeat x100
-    // Only run with master thread
-#pragma omp master
-{
+    // Candidates and LDDT scoring are parallelised inside refineMany
+    if (collapsedCnt > 0) {
+        expandDuplicates(msa, representative, collapsedOffset);
+    }
+
     if (par.refineIters > 0) {
+        std::vector<std::vector<size_t> > treeGroups;
+        if (par.refineMode == FoldmasonParameters::REFINE_MODE_GUIDE_TREE) {
+            std::vector<AlnSimple> treeHits = duplicateLinkage(representative);
+            treeHits.insert(treeHits.end(), hits.begin(), hits.end());
+            treeGroups = subtreeGroups(treeHits, sequenceCnt);
+        }
         refineMany(
-            tinySubMatAA, tinySubMat3Di, seqDbrCA, msa.cigars_aa, msa.cigars_ss, calculator_aa,
-            filter_aa, subMat_aa, calculator_3di, filter_3di, subMat_3di, structureSmithWaterman,
-            par.refineIters, par.compBiasCorrection, par.wg, par.filterMaxSeqId, par.qsc,
-            par.Ndiff, par.covMSAThr, par.filterMinEnable, par.filterMsa, par.gapExtend.values.aminoacid(),
-            par.gapOpen.values.aminoacid(), par.maxSeqLen, par.qid, par.pairThreshold, msa.dbKeys,
-            par.refinementSeed
+            tinySubMatAA, tinySubMat3Di, seqDbrCA, msa.cigars_aa, msa.cigars_ss,
+            subMat_aa, subMat_3di, par, maxSeqLength, msa.dbKeys, treeGroups
         );
     }
-}
 
-}
     // Write final MSA to file with correct headers
-    DBWriter resultWriterAa(
-        (par.filenames[par.filenames.size()-1] + "_aa.fa").c_str(),
-        (par.filenames[par.filenames.size()-1] + "_aa.index").c_str(),
-        static_cast<unsigned int>(par.threads), par.compressed, Parameters::DBTYPE_OMIT_FILE
-    );
-    DBWriter resultWriter3Di(
-        (par.filenames[par.filenames.size()-1] + "_3di.fa").c_str(),
-        (par.filenames[par.filenames.size()-1] + "_3di.index").c_str(),
-        static_cast<unsigned int>(par.threads), par.compressed, Parameters::DBTYPE_OMIT_FILE
-    );
-    resultWriterAa.open();
-    resultWriterAa.writeStart(0);
-    resultWriter3Di.open();
-    resultWriter3Di.writeStart(0);
-    std::string buffer;
-    buffer.reserve(10 * 1024);
-
-
     assert(msa.size() == 1);
     SubMSA &finalMSA = msa[0];
-
-    for (size_t member : finalMSA.members) {
+    std::vector<std::string> headers(sequenceCnt);
+#pragma omp parallel for schedule(static) num_threads(par.threads)
+    for (size_t i = 0; i < finalMSA.members.size(); i++) {
+        size_t member = finalMSA.members[i];
         unsigned int key = seqDbrAA.getDbKey(member);
         size_t headerId = qdbrH.sequenceReader->getId(key);
-        std::string header = Util::parseFastaHeader(qdbrH.sequenceReader->getData(headerId, 0));
-
-        buffer.append(1, '>');
-        buffer.append(header);
-        buffer.append(1, '\n');
-        buffer.append(expand(msa.cigars_aa[member]));
-        buffer.append(1, '\n');
-        resultWriterAa.writeAdd(buffer.c_str(), buffer.size(), 0);
-        buffer.clear();
-        
-        buffer.append(1, '>');
-        buffer.append(header);
-        buffer.append(1, '\n');
-        buffer.append(expand(msa.cigars_ss[member]));
-        buffer.append(1, '\n');
-        resultWriter3Di.writeAdd(buffer.c_str(), buffer.size(), 0);
-        buffer.clear();
+        headers[member] = Util::parseFastaHeader(qdbrH.sequenceReader->getData(headerId, 0));
+    }
+    writeMSAFasta(outputPrefix + "_aa.fa", headers, msa.cigars_aa, finalMSA.members, par.threads, par.compressed);
+    writeMSAFasta(outputPrefix + "_3di.fa", headers, msa.cigars_ss, finalMSA.members, par.threads, par.compressed);
+    if (par.writeFmsa) {
+        MSAFile::write(outputPrefix + ".fmsa", headers, msa.dbKeys, msa.cigars_aa, finalMSA.members);
+    }
+
+    // The alignment is complete, a later --resume must not pick up its checkpoint
+    if ((checkpoint != NULL || resumed) && FileUtil::fileExists(checkpointFile.c_str())) {
+        FileUtil::remove(checkpointFile.c_str());
+    }
+
+    // LDDT and report straight from the alignment in memory, rows in output order
+    if (makeReport > 0) {
+        std::vector<std::string> rowHeaders;
+        std::vector<size_t> rowKeys;
+        std::vector<std::vector<Instruction> > rows_aa;
+        std::vector<std::vector<Instruction> > rows_ss;
+        for (size_t member : finalMSA.members) {
+            rowHeaders.push_back(std::move(headers[member]));
+            rowKeys.push_back(msa.dbKeys[member]);
+            rows_aa.push_back(std::move(msa.cigars_aa[member]));
+            rows_ss.push_back(std::move(msa.cigars_ss[member]));
+        }
+        int alnLength = rows_aa.empty() ? 0 : cigarLength(rows_aa[0], true);
+        msa2lddtReport(
+            par, makeReport, outputPrefix + (makeReport == 1 ? ".html" : ".json"), outputPrefix + "_aa.fa", newick,
+            rowHeaders, rowKeys, rows_aa, rows_ss, alnLength, seqDbrCA
+        );
     }
-    resultWriterAa.writeEnd(0, 0, false, 0);
-    resultWriterAa.close(true);
-    resultWriter3Di.writeEnd(0, 0, false, 0);
-    resultWriter3Di.close(true);
-    FileUtil::remove((par.filenames[par.filenames.size()-1] + "_aa.index").c_str());
-    FileUtil::remove((par.filenames[par.filenames.size()-1] + "_3di.index").c_str());
 
     // Cleanup
+    delete checkpoint;
     delete[] alreadyMerged;
-    free(tinySubMatAA);
-    free(tinySubMat3Di);
     seqDbrAA.close();
     seqDbr3Di.close();
     if (caExist) {
         seqDbrCA->close();
     }
     delete seqDbrCA;
+    if (alnDbr != NULL) {
+        alnDbr->close();
+        delete alnDbr;
+    }
+    delete ownMatrices;
   
     return EXIT_SUCCESS;
 }
 
+int structuremsa(int argc, const char **argv, const Command& command, bool preCluster) {
+    FoldmasonParameters &par = FoldmasonParameters::getFoldmasonInstance();
+    par.parseParameters(argc, argv, command, true, 0, MMseqsParameter::COMMAND_ALIGN);
+    return structureMSA(par, par.filenames[par.filenames.size()-1], preCluster, 0);
+}
+
 int structuremsa(int argc, const char **argv, const Command& command) {
     return structuremsa(argc, argv, command, false);
 }
@@ -1684,3 +3231,148 @@ int structuremsa(int argc, const char **argv, const Command& command) {
 int structuremsacluster(int argc, const char **argv, const Command& command) {
     return structuremsa(argc, argv, command, true);
 }
+
+/**
+ * @brief Build one MSA per cluster of a clustering DB and write them to an MSA DB
+ *
+ * All clusters share the loaded databases and are aligned together: their guide trees form
+ * one forest, so every merge round runs the independent merges of all clusters in parallel.
+ * Output entries are keyed by the cluster representative and hold the AA FASTA MSA
+ * (3Di in <msaDB>_ss), rows in merge order.
+ */
+int structuremsabatch(int argc, const char **argv, const Command& command) {
+    FoldmasonParameters &par = FoldmasonParameters::getFoldmasonInstance();
+    const bool touch = (par.preloadMode != Parameters::PRELOAD_MODE_MMAP);
+    par.parseParameters(argc, argv, command, true, 0, MMseqsParameter::COMMAND_ALIGN);
+    Debug(Debug::INFO) << "Using " << SimdDispatch::name(SimdDispatch::select(par.simdLevel)) << " alignment kernels\n";
+    if (par.refineIters > 0 || par.regressive || par.recomputeScores || par.guideTree != "" || par.collapseSeqId > 0.0 || par.checkpointRounds > 0) {
+        Debug(Debug::WARNING) << "Refinement, --regressive, --recompute-scores, --guide-tree, --collapse-seq-id and checkpoints are not used in batch mode\n";
+    }
+
+    DBReader<unsigned int> seqDbrAA(par.db1.c_str(), par.db1Index.c_str(), par.threads, DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA);
+    seqDbrAA.open(DBReader<unsigned int>::NOSORT);
+    DBReader<unsigned int> seqDbr3Di((par.db1+"_ss").c_str(), (par.db1+"_ss.index").c_str(), par.threads, DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA);
+    seqDbr3Di.open(DBReader<unsigned int>::NOSORT);
+    DBReader<unsigned int> *seqDbrCA = NULL;
+    if (FileUtil::fileExists((par.db1 + "_ca.dbtype").c_str())) {
+        seqDbrCA = new DBReader<unsigned int>((par.db1 + "_ca").c_str(), (par.db1 + "_ca.index").c_str(), par.threads, DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA);
+        seqDbrCA->open(DBReader<unsigned int>::NOSORT);
+    }
+    IndexReader qdbrH(par.db1, par.threads, IndexReader::HEADERS, touch ? IndexReader::PRELOAD_INDEX : 0);
+
+    AlignmentMatrices *ownMatrices = (sharedMatrices == NULL) ? new AlignmentMatrices(par) : NULL;
+    AlignmentMatrices &matrices = (sharedMatrices != NULL) ? *sharedMatrices : *ownMatrices;
+    SubstitutionMatrix &subMat_3di = matrices.subMat_3di;
+    SubstitutionMatrix &subMat_aa = matrices.subMat_aa;
+    int8_t *tinySubMatAA = matrices.tinySubMatAA;
+    int8_t *tinySubMat3Di = matrices.tinySubMat3Di;
+
+    size_t sequenceCnt = seqDbrAA.getSize();
+    int maxSeqLength = par.maxSeqLen;
+    MSAContainer msa(sequenceCnt);
+    for (size_t i = 0; i < sequenceCnt; i++) {
+        unsigned int seqKeyAA = seqDbrAA.getDbKey(i);
+        size_t seqId3Di = seqDbr3Di.getId(seqKeyAA);
+        size_t length = seqDbrAA.getSeqLen(i);
+        msa.addStructure(i, seqKeyAA, length, seqDbrAA.getData(i, 0), seqDbr3Di.getData(seqId3Di, 0));
+        maxSeqLength = std::max(maxSeqLength, static_cast<int>(length));
+    }
+    EncodedSequences encoded(seqDbrAA, seqDbr3Di, subMat_aa, subMat_3di);
+
+    // Cluster members as db ids, representative first
+    DBReader<unsigned int> cluDbr(par.db2.c_str(), par.db2Index.c_str(), par.threads, DBReader<unsigned int>::USE_INDEX|DBReader<unsigned int>::USE_DATA);
+    cluDbr.open(DBReader<unsigned int>::LINEAR_ACCCESS);
+    std::vector<std::vector<size_t> > clusters;
+    std::vector<unsigned int> clusterKeys;
+    std::vector<bool> assigned(sequenceCnt, false);
+    char buffer[255 + 1];
+    for (size_t i = 0; i < cluDbr.getSize(); i++) {
+        unsigned int repKey = cluDbr.getDbKey(i);
+        size_t repId = seqDbrAA.getId(repKey);
+        if (repId == UINT_MAX) {
+            Debug(Debug::WARNING) << "Skipping cluster " << repKey << ", its representative is not in the structure database\n";
+            continue;
+        }
+        std::vector<size_t> members(1, repId);
+        assigned[repId] = true;
+        char *data = cluDbr.getData(i, 0);
+        while (*data != '\0') {
+            Util::parseKey(data, buffer);
+            data = Util::skipLine(data);
+            size_t id = seqDbrAA.getId((unsigned int) strtoul(buffer, NULL, 10));
+            if (id == repId) {
+                continue;
+            }
+            if (id == UINT_MAX || assigned[id]) {
+                Debug(Debug::ERROR) << "Member " << buffer << " of cluster " << repKey << " is missing from the structure database or part of another cluster\n";
+                EXIT(EXIT_FAILURE);
+            }
+            assigned[id] = true;
+            members.push_back(id);
+        }
+        clusters.push_back(members);
+        clusterKeys.push_back(repKey);
+    }
+    cluDbr.close();
+    Debug(Debug::INFO) << "Aligning " << clusters.size() << " clusters\n";
+
+    std::vector<AlnSimple> hits = scoreClusterPairs(
+        clusters, encoded, tinySubMatAA, tinySubMat3Di, &subMat_aa, &subMat_3di,
+        par.maxSeqLen, subMat_3di.alphabetSize, par.compBiasCorrection, par.compBiasCorrectionScale
+    );
+    sortHitsByScore(hits);
+    hits = mst(hits, sequenceCnt);
+    std::vector<size_t> merges;
+    hits = reorderLinkage(hits, merges, sequenceCnt);
+    if (hits.empty() == false) {
+        Debug(Debug::INFO) << "Begin progressive alignment of " << hits.size() << " merges in " << merges.size() << " rounds\n";
+        progressiveAlignment(
+            msa, hits, merges, par, seqDbrAA, encoded, seqDbrCA,
+            tinySubMatAA, tinySubMat3Di, subMat_aa, subMat_3di, maxSeqLength, sequenceCnt
+        );
+    }
+
+    DBWriter writerAA(par.db3.c_str(), (par.db3 + ".index").c_str(), static_cast<unsigned int>(par.threads), par.compressed, Parameters::DBTYPE_MSA_DB);
+    writerAA.open();
+    DBWriter writer3Di((par.db3 + "_ss").c_str(), (par.db3 + "_ss.index").c_str(), static_cast<unsigned int>(par.threads), par.compressed, Parameters::DBTYPE_MSA_DB);
+    writer3Di.open();
+#pragma omp parallel num_threads(par.threads)
+{
+    unsigned int thread_idx = 0;
+#ifdef OPENMP
+    thread_idx = static_cast<unsigned int>(omp_get_thread_num());
+#endif
+    std::string fastaAA;
+    std::string fasta3Di;
+#pragma omp for schedule(dynamic, 10)
+    for (size_t c = 0; c < clusters.size(); c++) {
+        size_t repId = clusters[c][0];
+        const std::vector<size_t> &rows = msa.isProfile(repId) ? msa[msa.dbIdToSubMSAVec[repId]].members : clusters[c];
+        fastaAA.clear();
+        fasta3Di.clear();
+        for (size_t member : rows) {
+            size_t headerId = qdbrH.sequenceReader->getId(msa.dbKeys[member]);
+            std::string header = Util::parseFastaHeader(qdbrH.sequenceReader->getData(headerId, thread_idx));
+            fastaAA.append(">" + header + "\n");
+            appendExpanded(fastaAA, msa.cigars_aa[member]);
+            fastaAA.push_back('\n');
+            fasta3Di.append(">" + header + "\n");
+            appendExpanded(fasta3Di, msa.cigars_ss[member]);
+            fasta3Di.push_back('\n');
+        }
+        writerAA.writeData(fastaAA.c_str(), fastaAA.length(), clusterKeys[c], thread_idx);
+        writer3Di.writeData(fasta3Di.c_str(), fasta3Di.length(), clusterKeys[c], thread_idx);
+    }
+}
+    writerAA.close(true);
+    writer3Di.close(true);
+
+    seqDbrAA.close();
+    seqDbr3Di.close();
+    if (seqDbrCA != NULL) {
+        seqDbrCA->close();
+        delete seqDbrCA;
+    }
+    delete ownMatrices;
+    return EXIT_SUCCESS;
+}
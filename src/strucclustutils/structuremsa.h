@@ -9,6 +9,9 @@
 #include "SubstitutionMatrix.h"
 #include "StructureSmithWaterman.h"
 #include "Sequence.h"
+#include "DBReader.h"
+#include "FoldmasonParameters.h"
+#include "newick.h"
 
 enum State {
     SEQ = 0,
@@ -23,6 +26,57 @@ struct GapData {
     size_t endGaps;
 };
 
+/**
+ * @brief AA and 3Di sequences of every structure, translated to numeric codes once.
+ * Both encodings of a structure sit next to each other in one aligned arena, in db id order.
+ */
+class EncodedSequences {
+public:
+    EncodedSequences(DBReader<unsigned int> &seqDbrAA, DBReader<unsigned int> &seqDbr3Di, BaseMatrix &subMat_aa, BaseMatrix &subMat_3di);
+    ~EncodedSequences();
+
+    const unsigned char *aa(size_t id) const { return arena + offsets[id]; }
+    const unsigned char *ss(size_t id) const { return arena + offsets[id] + lengths[id]; }
+    unsigned int length(size_t id) const { return lengths[id]; }
+    std::pair<const unsigned char *, const unsigned int> aaData(size_t id) const {
+        return std::pair<const unsigned char *, const unsigned int>(aa(id), lengths[id]);
+    }
+    std::pair<const unsigned char *, const unsigned int> ssData(size_t id) const {
+        return std::pair<const unsigned char *, const unsigned int>(ss(id), lengths[id]);
+    }
+
+private:
+    unsigned char *arena;
+    std::vector<size_t> offsets;
+    std::vector<unsigned int> lengths;
+};
+
+/**
+ * @brief 3Di and BLOSUM62 substitution matrices with the int8 copies used for query profiles
+ */
+struct AlignmentMatrices {
+    AlignmentMatrices(FoldmasonParameters &par);
+    ~AlignmentMatrices();
+
+    SubstitutionMatrix subMat_3di;
+    SubstitutionMatrix subMat_aa;
+    int8_t *tinySubMat3Di;
+    int8_t *tinySubMatAA;
+
+private:
+    AlignmentMatrices(const AlignmentMatrices &);
+    AlignmentMatrices &operator=(const AlignmentMatrices &);
+};
+
+std::string serializedBlosum62(FoldmasonParameters &par);
+
+/**
+ * @brief Build the matrices once and use them in all later structureMSA calls of this process
+ *
+ * serve calls this before forking, so request children share the parent's copy.
+ */
+void shareAlignmentMatrices(FoldmasonParameters &par);
+
 GapData getGapData(const Matcher::result_t &res, const std::vector<size_t>& qMap, const std::vector<size_t>& tMap);
 
 void updateCIGARs(
@@ -34,7 +88,8 @@ void updateCIGARs(
     std::vector<size_t>& q_members,
     std::vector<size_t>& t_members,
     std::vector<Instruction>& q_ins,
-    std::vector<Instruction>& t_ins
+    std::vector<Instruction>& t_ins,
+    CigarUndoLog *undoLog = NULL
 );
 
 void getMergeInstructions(
@@ -59,6 +114,10 @@ Matcher::result_t pairwiseAlignment(
 );
 
 void maskToMapping(const std::string &mask, std::vector<size_t> &mapping);
+void sortHitsByScore(std::vector<AlnSimple> &hits);
+int findRoot(int vertex, std::vector<int>& parent);
+std::vector<AlnSimple> mst(std::vector<AlnSimple> hits, int n);
+std::vector<AlnSimple> reorderLinkage(std::vector<AlnSimple> linkage, std::vector<size_t> &merges, int n);
 int cigarLength(const std::vector<Instruction> &cigar, bool withGaps);
 
 std::string computeProfileMask(
@@ -88,6 +147,24 @@ std::string msa2profile(
 
 std::vector<Instruction> contract(const std::string& sequence);
 std::string expand(const std::vector<Instruction> &instructions);
+void appendExpanded(std::string &buffer, const std::vector<Instruction> &instructions);
+void writeMSAFasta(
+    const std::string &fileName,
+    const std::vector<std::string> &headers,
+    const std::vector<std::vector<Instruction> > &cigars,
+    const std::vector<size_t> &rows,
+    int threads,
+    bool compressed
+);
+
+/**
+ * @brief Align the structures of par.db1 (clustered by par.db2 if preCluster) and write
+ * <outputPrefix>_aa.fa, _3di.fa and .nw (and .fmsa with --write-fmsa)
+ *
+ * With makeReport 1 or 2 the LDDT and HTML/JSON report (<outputPrefix>.html/.json) are computed
+ * from the alignment in memory, without reading the written files back.
+ */
+int structureMSA(FoldmasonParameters &par, const std::string &outputPrefix, bool preCluster, int makeReport);
 
 void copyInstructions(std::vector<Instruction> &one, std::vector<Instruction> &two);
 void copyInstructionVectors(std::vector<std::vector<Instruction> > &one, std::vector<std::vector<Instruction> > &two);
@@ -1,12 +1,15 @@
-#include <cassert>
 #include <FoldmasonParameters.h>
 #include "LinsearchIndexReader.h"
 #include "PrefilteringIndexReader.h"
-#include "CommandCaller.h"
 #include "Util.h"
 #include "Debug.h"
 #include "Parameters.h"
-#include "easymsa.sh.h"
+#include "FileUtil.h"
+#include "DBReader.h"
+
+extern const Command* getCommandByName(const char *s);
+extern int structcreatedb(int argc, const char **argv, const Command& command);
+extern int structureMSA(FoldmasonParameters &par, const std::string &outputPrefix, bool preCluster, int makeReport);
 
 void setEasyMSADefaults(Parameters *p) {
     p->sensitivity = 9.5;
@@ -16,6 +19,50 @@ void setEasyMSADefaults(Parameters *p) {
     p->alignmentMode = Parameters::ALIGNMENT_MODE_SCORE_COV_SEQID;
 }
 
+// Force the alignment parameters into the command string shown in the report
+void setReportCommand(FoldmasonParameters &par) {
+    par.PARAM_GAP_OPEN.wasSet = true;
+    par.PARAM_GAP_EXTEND.wasSet = true;
+    par.PARAM_MATCH_RATIO.wasSet = true;
+    par.PARAM_FILTER_MSA.wasSet = true;
+    par.reportCommand = par.createParameterString(par.easymsaworkflow, true);
+}
+
+/**
+ * @brief Run createdb, structuremsa and the LDDT report in this process
+ *
+ * The structure database is the only file written to tmpDir; the MSA, guide tree and DB readers
+ * are handed from the alignment to the report directly instead of being read back from disk.
+ */
+int easymsaInProcess(FoldmasonParameters &par, const std::vector<std::string> &inputs, const std::string &results, const std::string &tmpDir) {
+    std::string structureDb = tmpDir + "/structures";
+    if (FileUtil::fileExists((structureDb + ".dbtype").c_str()) == false) {
+        // createdb re-parses only the file names, all other parameters keep their easy-msa values
+        std::vector<const char *> args;
+        for (size_t i = 0; i < inputs.size(); i++) {
+            args.push_back(inputs[i].c_str());
+        }
+        args.push_back(structureDb.c_str());
+        int status = structcreatedb(static_cast<int>(args.size()), args.data(), *getCommandByName("createdb"));
+        if (status != EXIT_SUCCESS) {
+            return status;
+        }
+    }
+
+    par.db1 = structureDb;
+    par.db1Index = structureDb + ".index";
+    setReportCommand(par);
+    int status = structureMSA(par, results, false, par.reportMode);
+
+    if (par.removeTmpFiles) {
+        const char *suffixes[] = { "", "_h", "_ss", "_ca" };
+        for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+            DBReader<unsigned int>::removeDb(structureDb + suffixes[i]);
+        }
+    }
+    return status;
+}
+
 int easymsa(int argc, const char **argv, const Command &command) {
     FoldmasonParameters &par = FoldmasonParameters::getFoldmasonInstance();
 
@@ -37,30 +84,6 @@ int easymsa(int argc, const char **argv, const Command &command) {
     setEasyMSADefaults(&par);
     par.parseParameters(argc, argv, command, true, Parameters::PARSE_VARIADIC, 0);
 
-    bool needBacktrace = false;
-    bool needTaxonomy = false;
-    bool needTaxonomyMapping = false;
-    bool needLookup = false;
-    {
-        bool needSequenceDB = false;
-        bool needFullHeaders = false;
-        bool needSource = false;
-        Parameters::getOutputFormat(par.formatAlignmentMode, par.outfmt, needSequenceDB, needBacktrace, needFullHeaders,
-                                    needLookup, needSource, needTaxonomyMapping, needTaxonomy);
-    }
-
-    if (par.formatAlignmentMode == Parameters::FORMAT_ALIGNMENT_SAM || par.greedyBestHits) {
-        needBacktrace = true;
-    }
-    if (needBacktrace) {
-        Debug(Debug::INFO) << "Alignment backtraces will be computed, since they were requested by output format.\n";
-        par.addBacktrace = true;
-        par.PARAM_ADD_BACKTRACE.wasSet = true;
-    }
-    if(needLookup){
-        par.writeLookup = true;
-    }
-
     std::string tmpDir = par.filenames.back();
     std::string hash = SSTR(par.hashParameter(command.databases, par.filenames, *command.params));
     if (par.reuseLatest) {
@@ -69,51 +92,8 @@ int easymsa(int argc, const char **argv, const Command &command) {
     tmpDir = FileUtil::createTemporaryDirectory(tmpDir, hash);
     par.filenames.pop_back();
 
-    CommandCaller cmd;
-    cmd.addVariable("STRUCTUREMSA_PAR", par.createParameterString(par.structuremsa).c_str());
-    cmd.addVariable("TMP_PATH", tmpDir.c_str());
-    cmd.addVariable("RESULTS", par.filenames.back().c_str());
+    std::string results = par.filenames.back();
     par.filenames.pop_back();
-    cmd.addVariable("LEAVE_INPUT", par.dbOut ? "TRUE" : NULL);
-
-    par.spacedKmer = true;
-    par.covThr = 0.95;
-    par.evalThr = 0.01;
-    par.sortByStructureBits = 0;
-    par.kmersPerSequence = 300;
-    par.maskMode = 0;
-    par.compBiasCorrection = 0;
-    cmd.addVariable("KMERMATCHER_PAR", par.createParameterString(par.kmermatcher).c_str());
-    cmd.addVariable("ALIGN_PAR", par.createParameterString(par.structurealign).c_str());
-    cmd.addVariable("CLUST_PAR", par.createParameterString(par.clust).c_str());
-    cmd.addVariable("REMOVE_TMP", par.removeTmpFiles ? "TRUE" : NULL);
-
-    cmd.addVariable("RUNNER", par.runner.c_str());
-    cmd.addVariable("THREADS_PAR", par.createParameterString(par.onlythreads).c_str());
-    cmd.addVariable("VERBOSITY", par.createParameterString(par.onlyverbosity).c_str());
-    cmd.addVariable("PRECLUSTER", par.precluster ? "TRUE" : NULL); 
-    cmd.addVariable("MAKE_REPORT", std::to_string(par.reportMode).c_str());
-    cmd.addVariable("CREATEDB_PAR", par.createParameterString(par.structurecreatedb).c_str());
-
-    // needs to be last
-    std::vector<MMseqsParameter *> msa2lddtWithoutTree;
-    par.PARAM_GAP_OPEN.wasSet = true;
-    par.PARAM_GAP_EXTEND.wasSet = true;
-    par.PARAM_MATCH_RATIO.wasSet = true;
-    par.PARAM_FILTER_MSA.wasSet = true;
-    par.reportCommand = par.createParameterString(par.easymsaworkflow, true);
-    for (size_t i = 0; i < par.msa2lddt.size(); i++) {
-        if (par.msa2lddt[i]->uniqid != par.PARAM_GUIDE_TREE.uniqid) {
-            msa2lddtWithoutTree.push_back(par.msa2lddt[i]);
-        }
-    }
-    cmd.addVariable("MSA2LDDT_PAR", par.createParameterString(msa2lddtWithoutTree).c_str());
-
-    std::string program = tmpDir + "/easymsa.sh";
-    FileUtil::writeFile(program, easymsa_sh, easymsa_sh_len);
-    cmd.execProgram(program.c_str(), par.filenames);
-
-    // Should never get here
-    assert(false);
-    return EXIT_FAILURE;
+    std::vector<std::string> inputs(par.filenames);
+    return easymsaInProcess(par, inputs, results, tmpDir);
 }
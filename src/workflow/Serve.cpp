@@ -0,0 +1,580 @@
+#include <FoldmasonParameters.h>
+#include "Util.h"
+#include "Debug.h"
+#include "Parameters.h"
+#include "FileUtil.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
+extern void setEasyMSADefaults(Parameters *p);
+extern void shareAlignmentMatrices(FoldmasonParameters &par);
+extern const std::string &reportVendorJS();
+extern int easymsaInProcess(FoldmasonParameters &par, const std::vector<std::string> &inputs, const std::string &results, const std::string &tmpDir);
+
+/**
+ * @brief Minimal JSON value for serve requests
+ *
+ * Objects keep their keys in `keys` and the corresponding values in `items`.
+ */
+struct JsonValue {
+    enum Type { JSON_NULL, JSON_BOOL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT };
+    Type type = JSON_NULL;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<std::string> keys;
+    std::vector<JsonValue> items;
+
+    const JsonValue *find(const std::string &key) const {
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (keys[i] == key) {
+                return &items[i];
+            }
+        }
+        return NULL;
+    }
+};
+
+class JsonParser {
+public:
+    JsonParser(const std::string &text) : text(text), pos(0) {}
+
+    bool parse(JsonValue &value) {
+        return parseValue(value) && (skipSpace(), pos == text.size());
+    }
+
+private:
+    const std::string &text;
+    size_t pos;
+
+    void skipSpace() {
+        while (pos < text.size() && isspace(static_cast<unsigned char>(text[pos]))) {
+            pos++;
+        }
+    }
+
+    bool consume(const char *literal) {
+        size_t length = strlen(literal);
+        if (text.compare(pos, length, literal) != 0) {
+            return false;
+        }
+        pos += length;
+        return true;
+    }
+
+    static void appendUtf8(std::string &out, unsigned int codepoint) {
+        if (codepoint < 0x80) {
+            out.push_back(static_cast<char>(codepoint));
+        } else if (codepoint < 0x800) {
+            out.push_back(static_cast<char>(0xC0 | (codepoint >> 6)));
+            out.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+        } else if (codepoint < 0x10000) {
+            out.push_back(static_cast<char>(0xE0 | (codepoint >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+        } else {
+            out.push_back(static_cast<char>(0xF0 | (codepoint >> 18)));
+            out.push_back(static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+        }
+    }
+
+    bool parseHex(unsigned int &codepoint) {
+        if (pos + 4 > text.size()) {
+            return false;
+        }
+        char *end;
+        std::string hex = text.substr(pos, 4);
+        codepoint = static_cast<unsigned int>(strtoul(hex.c_str(), &end, 16));
+        pos += 4;
+        return end == hex.c_str() + 4;
+    }
+
+    bool parseString(std::string &out) {
+        if (pos >= text.size() || text[pos] != '"') {
+            return false;
+        }
+        pos++;
+        while (pos < text.size() && text[pos] != '"') {
+            char c = text[pos++];
+            if (c != '\\') {
+                out.push_back(c);
+                continue;
+            }
+            if (pos >= text.size()) {
+                return false;
+            }
+            c = text[pos++];
+            switch (c) {
+                case '"': case '\\': case '/': out.push_back(c); break;
+                case 'b': out.push_back('\b'); break;
+                case 'f': out.push_back('\f'); break;
+                case 'n': out.push_back('\n'); break;
+                case 'r': out.push_back('\r'); break;
+                case 't': out.push_back('\t'); break;
+                case 'u': {
+                    unsigned int codepoint;
+                    if (parseHex(codepoint) == false) {
+                        return false;
+                    }
+                    if (codepoint >= 0xD800 && codepoint < 0xDC00) {
+                        unsigned int low;
+                        if (consume("\\u") == false || parseHex(low) == false || low < 0xDC00 || low > 0xDFFF) {
+                            return false;
+                        }
+                        codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    appendUtf8(out, codepoint);
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        if (pos >= text.size()) {
+            return false;
+        }
+        pos++;
+        return true;
+    }
+
+    bool parseValue(JsonValue &value) {
+        skipSpace();
+        if (pos >= text.size()) {
+            return false;
+        }
+        char c = text[pos];
+        if (c == '"') {
+            value.type = JsonValue::JSON_STRING;
+            return parseString(value.string);
+        }
+        if (c == '{' || c == '[') {
+            const bool isObject = (c == '{');
+            const char close = isObject ? '}' : ']';
+            value.type = isObject ? JsonValue::JSON_OBJECT : JsonValue::JSON_ARRAY;
+            pos++;
+            skipSpace();
+            if (pos < text.size() && text[pos] == close) {
+                pos++;
+                return true;
+            }
+            while (true) {
+                if (isObject) {
+                    skipSpace();
+                    value.keys.emplace_back();
+                    if (parseString(value.keys.back()) == false) {
+                        return false;
+                    }
+                    skipSpace();
+                    if (consume(":") == false) {
+                        return false;
+                    }
+                }
+                value.items.emplace_back();
+                if (parseValue(value.items.back()) == false) {
+                    return false;
+                }
+                skipSpace();
+                if (pos < text.size() && text[pos] == ',') {
+                    pos++;
+                } else if (pos < text.size() && text[pos] == close) {
+                    pos++;
+                    return true;
+                } else {
+                    return false;
+                }
+            }
+        }
+        if (consume("true")) {
+            value.type = JsonValue::JSON_BOOL;
+            value.boolean = true;
+            return true;
+        }
+        if (consume("false")) {
+            value.type = JsonValue::JSON_BOOL;
+            return true;
+        }
+        if (consume("null")) {
+            return true;
+        }
+        char *end;
+        value.number = strtod(text.c_str() + pos, &end);
+        if (end == text.c_str() + pos) {
+            return false;
+        }
+        value.type = JsonValue::JSON_NUMBER;
+        pos = end - text.c_str();
+        return true;
+    }
+};
+
+static void appendJsonString(std::string &out, const std::string &value) {
+    out.push_back('"');
+    for (size_t i = 0; i < value.size(); i++) {
+        unsigned char c = static_cast<unsigned char>(value[i]);
+        switch (c) {
+            case '"': out.append("\\\""); break;
+            case '\\': out.append("\\\\"); break;
+            case '\n': out.append("\\n"); break;
+            case '\r': out.append("\\r"); break;
+            case '\t': out.append("\\t"); break;
+            default:
+                if (c < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out.append(escaped);
+                } else {
+                    out.push_back(static_cast<char>(c));
+                }
+        }
+    }
+    out.push_back('"');
+}
+
+static std::string readWholeFile(const std::string &fileName) {
+    std::ifstream file(fileName, std::ios::binary);
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+static std::string errorResponse(const std::string &id, const std::string &message) {
+    std::string response = "{\"id\":";
+    appendJsonString(response, id);
+    response.append(",\"status\":\"error\",\"message\":");
+    appendJsonString(response, message);
+    response.append("}");
+    return response;
+}
+
+/**
+ * @brief Check a parsed request before any work is started
+ *
+ * Request:  {"id": "...", "structures": {"name.pdb": "<file content>", ...}, "files": ["path", ...], "report": 0|1|2}
+ * @return an empty string if the request can be aligned, otherwise the error response
+ */
+static std::string checkRequest(const JsonValue &request, int defaultReportMode, std::string &id, int &reportMode) {
+    const JsonValue *value = request.find("id");
+    if (value != NULL && value->type == JsonValue::JSON_STRING) {
+        id = value->string;
+    } else if (value != NULL && value->type == JsonValue::JSON_NUMBER) {
+        id = SSTR(static_cast<long long>(value->number));
+    }
+    reportMode = defaultReportMode;
+    value = request.find("report");
+    if (value != NULL && value->type == JsonValue::JSON_NUMBER) {
+        reportMode = static_cast<int>(value->number);
+        if (reportMode < 0 || reportMode > 2) {
+            return errorResponse(id, "report must be 0, 1 or 2");
+        }
+    }
+    size_t inputCnt = 0;
+    value = request.find("structures");
+    if (value != NULL && value->type == JsonValue::JSON_OBJECT) {
+        for (size_t i = 0; i < value->keys.size(); i++) {
+            if (value->items[i].type != JsonValue::JSON_STRING) {
+                return errorResponse(id, "Structure " + value->keys[i] + " is not a string");
+            }
+            if (value->items[i].string.find_first_not_of(" \t\r\n") == std::string::npos) {
+                return errorResponse(id, "Structure " + value->keys[i] + " is empty");
+            }
+            inputCnt++;
+        }
+    }
+    value = request.find("files");
+    if (value != NULL && value->type == JsonValue::JSON_ARRAY) {
+        for (size_t i = 0; i < value->items.size(); i++) {
+            if (value->items[i].type != JsonValue::JSON_STRING || FileUtil::fileExists(value->items[i].string.c_str()) == false) {
+                return errorResponse(id, "Could not find structure file " + value->items[i].string);
+            }
+            inputCnt++;
+        }
+    }
+    if (inputCnt == 0) {
+        return errorResponse(id, "Request has no structures or files");
+    }
+    return "";
+}
+
+/**
+ * @brief Run one checked request through createdb, structuremsa and the LDDT report
+ *
+ * Response: {"id": "...", "status": "ok", "aa": "<FASTA>", "3di": "<FASTA>", "tree": "<Newick>", "report": "<HTML/JSON>"}
+ * Inline structures are written to workDir, an empty directory created for this request.
+ */
+static std::string alignRequest(FoldmasonParameters &par, const JsonValue &request, const std::string &id, int reportMode, const std::string &workDir) {
+    std::vector<std::string> inputs;
+    const JsonValue *value = request.find("structures");
+    if (value != NULL && value->type == JsonValue::JSON_OBJECT) {
+        for (size_t i = 0; i < value->keys.size(); i++) {
+            std::string fileName = workDir + "/" + FileUtil::sanitizeFilename(value->keys[i]);
+            std::ofstream file(fileName, std::ios::binary);
+            file << value->items[i].string;
+            file.close();
+            inputs.push_back(fileName);
+        }
+    }
+    value = request.find("files");
+    if (value != NULL && value->type == JsonValue::JSON_ARRAY) {
+        for (size_t i = 0; i < value->items.size(); i++) {
+            inputs.push_back(value->items[i].string);
+        }
+    }
+
+    const std::string results = workDir + "/result";
+    par.reportMode = reportMode;
+    par.guideTree = "";
+    if (easymsaInProcess(par, inputs, results, workDir) != EXIT_SUCCESS) {
+        return errorResponse(id, "Alignment failed");
+    }
+
+    std::string response = "{\"id\":";
+    appendJsonString(response, id);
+    response.append(",\"status\":\"ok\",\"aa\":");
+    appendJsonString(response, readWholeFile(results + "_aa.fa"));
+    response.append(",\"3di\":");
+    appendJsonString(response, readWholeFile(results + "_3di.fa"));
+    response.append(",\"tree\":");
+    appendJsonString(response, readWholeFile(results + ".nw"));
+    if (reportMode > 0) {
+        response.append(",\"report\":");
+        appendJsonString(response, readWholeFile(results + (reportMode == 1 ? ".html" : ".json")));
+    }
+    response.append("}");
+    return response;
+}
+
+static void removeWorkDir(const std::string &workDir) {
+    DIR *dir = opendir(workDir.c_str());
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            unlink((workDir + "/" + entry->d_name).c_str());
+        }
+    }
+    closedir(dir);
+    rmdir(workDir.c_str());
+}
+
+/**
+ * @brief A request aligned in a forked child, which sends its response through fd
+ */
+struct ServeJob {
+    pid_t pid;
+    int fd;
+    int threads;
+    std::string id;
+    std::string workDir;
+    std::string response;
+};
+
+static void writeResponse(FILE *responses, const std::string &response) {
+    fwrite(response.data(), 1, response.size(), responses);
+    fputc('\n', responses);
+    fflush(responses);
+}
+
+static void writeAll(int fd, const std::string &data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        written += static_cast<size_t>(n);
+    }
+}
+
+int serve(int argc, const char **argv, const Command &command) {
+    // Responses go to the original stdout, all log output is moved to stderr
+    fflush(stdout);
+    int responseFd = dup(fileno(stdout));
+    dup2(fileno(stderr), fileno(stdout));
+    FILE *responses = fdopen(responseFd, "w");
+    if (responses == NULL) {
+        Debug(Debug::ERROR) << "Could not open response stream\n";
+        EXIT(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    FoldmasonParameters &par = FoldmasonParameters::getFoldmasonInstance();
+    setEasyMSADefaults(&par);
+    par.parseParameters(argc, argv, command, true, 0, 0);
+    const std::string tmpDir = par.filenames.back();
+    const int defaultReportMode = par.reportMode;
+    const int totalThreads = std::max(1, par.threads);
+    // Work directories are never reused, also not by an earlier server on the same tmpDir
+    const std::string workPrefix = tmpDir + "/request_" + SSTR(getpid()) + "_";
+
+    // Built once here, forked children share the matrices and report JS with the server
+    shareAlignmentMatrices(par);
+    reportVendorJS();
+
+    // Each request is aligned in a forked child, so a failing request (createdb and structuremsa
+    // exit on bad input) is answered with an error instead of ending the server.
+    // Queued requests split the free threads evenly, so up to --threads requests run at once.
+    Debug(Debug::INFO) << "Waiting for requests on stdin\n";
+    std::deque<std::string> pending;
+    std::vector<ServeJob> jobs;
+    std::string input;
+    bool inputOpen = true;
+    int usedThreads = 0;
+    size_t requestCnt = 0;
+    char buffer[65536];
+    while (inputOpen || pending.empty() == false || jobs.empty() == false) {
+        while (pending.empty() == false && usedThreads < totalThreads) {
+            std::string line = pending.front();
+            pending.pop_front();
+
+            JsonValue request;
+            std::string id;
+            int reportMode;
+            if (JsonParser(line).parse(request) == false || request.type != JsonValue::JSON_OBJECT) {
+                writeResponse(responses, errorResponse("", "Request is not a JSON object"));
+                continue;
+            }
+            std::string error = checkRequest(request, defaultReportMode, id, reportMode);
+            if (error.empty() == false) {
+                writeResponse(responses, error);
+                continue;
+            }
+            std::string workDir;
+            do {
+                workDir = workPrefix + SSTR(requestCnt++);
+            } while (FileUtil::directoryExists(workDir.c_str()));
+            int pipeFds[2];
+            if (FileUtil::makeDir(workDir.c_str()) == false || pipe(pipeFds) != 0) {
+                writeResponse(responses, errorResponse(id, "Could not create " + workDir));
+                continue;
+            }
+
+            ServeJob job;
+            job.threads = std::max(1, (totalThreads - usedThreads) / static_cast<int>(pending.size() + 1));
+            job.id = id;
+            job.workDir = workDir;
+            fflush(stdout);
+            fflush(stderr);
+            job.pid = fork();
+            if (job.pid == 0) {
+                close(pipeFds[0]);
+                par.threads = job.threads;
+#ifdef OPENMP
+                omp_set_num_threads(par.threads);
+#endif
+                writeAll(pipeFds[1], alignRequest(par, request, id, reportMode, workDir));
+                close(pipeFds[1]);
+                fflush(stdout);
+                _exit(EXIT_SUCCESS);
+            }
+            close(pipeFds[1]);
+            if (job.pid < 0) {
+                close(pipeFds[0]);
+                removeWorkDir(workDir);
+                writeResponse(responses, errorResponse(id, "Could not start alignment"));
+                continue;
+            }
+            job.fd = pipeFds[0];
+            usedThreads += job.threads;
+            jobs.push_back(job);
+        }
+
+        std::vector<struct pollfd> fds;
+        // stop reading requests while all threads are busy, they wait in the pipe instead
+        const bool readInput = inputOpen && usedThreads < totalThreads;
+        if (readInput) {
+            struct pollfd fd = { STDIN_FILENO, POLLIN, 0 };
+            fds.push_back(fd);
+        }
+        for (size_t i = 0; i < jobs.size(); i++) {
+            struct pollfd fd = { jobs[i].fd, POLLIN, 0 };
+            fds.push_back(fd);
+        }
+        if (fds.empty()) {
+            break;
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Debug(Debug::ERROR) << "Could not wait for requests\n";
+            EXIT(EXIT_FAILURE);
+        }
+
+        size_t fdIdx = 0;
+        if (readInput) {
+            if (fds[fdIdx].revents != 0) {
+                ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+                if (n > 0) {
+                    input.append(buffer, static_cast<size_t>(n));
+                } else if (n == 0 || errno != EINTR) {
+                    inputOpen = false;
+                    input.push_back('\n');
+                }
+                size_t lineStart = 0;
+                size_t lineEnd;
+                while ((lineEnd = input.find('\n', lineStart)) != std::string::npos) {
+                    std::string line = input.substr(lineStart, lineEnd - lineStart);
+                    if (line.find_first_not_of(" \t\r") != std::string::npos) {
+                        pending.push_back(line);
+                    }
+                    lineStart = lineEnd + 1;
+                }
+                input.erase(0, lineStart);
+            }
+            fdIdx++;
+        }
+
+        for (size_t i = 0; i < jobs.size(); fdIdx++) {
+            ServeJob &job = jobs[i];
+            if (fds[fdIdx].revents == 0) {
+                i++;
+                continue;
+            }
+            ssize_t n = read(job.fd, buffer, sizeof(buffer));
+            if (n > 0 || (n < 0 && errno == EINTR)) {
+                if (n > 0) {
+                    job.response.append(buffer, static_cast<size_t>(n));
+                }
+                i++;
+                continue;
+            }
+            close(job.fd);
+            int status = 0;
+            while (waitpid(job.pid, &status, 0) < 0 && errno == EINTR) {}
+            if (WIFEXITED(status) == false || WEXITSTATUS(status) != EXIT_SUCCESS || job.response.empty()) {
+                job.response = errorResponse(job.id, "Alignment failed");
+            }
+            writeResponse(responses, job.response);
+            if (par.removeTmpFiles) {
+                removeWorkDir(job.workDir);
+            }
+            usedThreads -= job.threads;
+            jobs.erase(jobs.begin() + i);
+        }
+    }
+    fclose(responses);
+    return EXIT_SUCCESS;
+}